@@ -53,6 +53,7 @@ struct chime_file_writer : public wi_transform {
 	this->nt_chunk = nt_chunk_;
 	this->nt_prepad = 0;
 	this->nt_postpad = 0;
+	this->is_read_only = true;
     }
     
     virtual ~chime_file_writer() { }
@@ -73,6 +73,7 @@ chime_packetizer::chime_packetizer(const string &dstname, int nfreq_coarse_per_p
     // Initialize base class members
     this->nt_chunk = nt_per_chunk;
     this->name = "chime_packetizer";
+    this->is_read_only = true;
 }
 
 
@@ -0,0 +1,100 @@
+// chunk_mask_info: per-chunk metadata which records the fully masked rows of the current chunk.
+// See the comment above 'struct chunk_mask_info' in rf_pipelines_internals.hpp for an overview.
+
+#include "rf_pipelines_internals.hpp"
+
+using namespace std;
+
+namespace rf_pipelines {
+#if 0
+}; // pacify emacs c-mode
+#endif
+
+
+// Returns true if every weight in the row is zero.  The row is processed in blocks of 64 samples,
+// so that the inner loop (which has no early exit) can be vectorized by the compiler, and the scan
+// of an unmasked row usually stops after the first block.
+inline bool _row_is_masked(const float *wrow, ssize_t nt)
+{
+    for (ssize_t i0 = 0; i0 < nt; i0 += 64) {
+	ssize_t i1 = min(i0 + 64, nt);
+	int nonzero = 0;
+
+	for (ssize_t i = i0; i < i1; i++)
+	    nonzero |= (wrow[i] != 0.0f);
+
+	if (nonzero)
+	    return false;
+    }
+
+    return true;
+}
+
+
+void chunk_mask_info::set_chunk(ssize_t nfreq_, ssize_t it0_, ssize_t nt_, const float *weights_, ssize_t stride_)
+{
+    // The metadata for the previous chunk is also valid for any chunk which it contains.
+    bool contained = (nfreq_ == nfreq) && (it0_ >= it0) && (it0_ + nt_ <= it0 + nt);
+
+    if (!contained) {
+	this->row_bits.assign((nfreq_ + 63) / 64, 0);
+	this->nrows_masked = 0;
+	this->scanned = false;
+    }
+    else if ((it0_ != it0) || (nt_ != nt))
+	this->scanned = false;
+
+    this->nfreq = nfreq_;
+    this->it0 = it0_;
+    this->nt = nt_;
+    this->weights = weights_;
+    this->stride = stride_;
+
+    if ((it0 >= it_padding) && !all_masked()) {
+	for (ssize_t ifreq = 0; ifreq < nfreq; ifreq++)
+	    this->mask_row(ifreq);
+	this->scanned = true;
+    }
+}
+
+
+void chunk_mask_info::invalidate()
+{
+    this->nt = 0;
+    this->nrows_masked = 0;
+    this->scanned = false;
+    this->it_padding = numeric_limits<ssize_t>::max();
+}
+
+
+void chunk_mask_info::update()
+{
+    if (scanned)
+	return;
+
+    if (_unlikely(!weights))
+	throw runtime_error("rf_pipelines: chunk_mask_info::update() was called before set_chunk()");
+
+    for (ssize_t ifreq = 0; ifreq < nfreq; ifreq++)
+	if (!is_row_masked(ifreq) && _row_is_masked(weights + ifreq * stride, nt))
+	    this->mask_row(ifreq);
+
+    this->scanned = true;
+}
+
+
+void chunk_mask_info::mask_row(ssize_t ifreq)
+{
+    rf_assert((ifreq >= 0) && (ifreq < nfreq));
+
+    uint64_t bit = uint64_t(1) << (ifreq & 63);
+
+    if (row_bits[ifreq >> 6] & bit)
+	return;
+
+    row_bits[ifreq >> 6] |= bit;
+    this->nrows_masked++;
+}
+
+
+}  // namespace rf_pipelines
@@ -0,0 +1,110 @@
+// clipper_workspace: temporary buffers for apply_intensity_clipper() and apply_std_dev_clipper().
+// The assignment of buffers to clippers is in 'enum clipper_workspace_buffer' (rf_pipelines_internals.hpp).
+
+#include "rf_pipelines_internals.hpp"
+#include "kernels/kernel_tables.hpp"
+
+using namespace std;
+
+namespace rf_pipelines {
+#if 0
+}; // pacify emacs c-mode
+#endif
+
+
+clipper_workspace::clipper_workspace(int nfreq, int nt, int Df, int Dt)
+{
+    this->reserve(nfreq, nt, Df, Dt);
+}
+
+
+clipper_workspace::~clipper_workspace()
+{
+    this->deallocate();
+}
+
+
+void clipper_workspace::deallocate()
+{
+    for (int i = 0; i < nbuf; i++) {
+	free(buf[i]);
+	buf[i] = nullptr;
+	nbytes[i] = 0;
+    }
+}
+
+
+ssize_t clipper_workspace::get_nbytes_allocated() const
+{
+    ssize_t ret = 0;
+    for (int i = 0; i < nbuf; i++)
+	ret += nbytes[i];
+    return ret;
+}
+
+
+void *clipper_workspace::_get(int ibuf, ssize_t nbytes_needed)
+{
+    rf_assert((ibuf >= 0) && (ibuf < nbuf));
+    rf_assert(nbytes_needed >= 0);
+
+    if (nbytes[ibuf] < nbytes_needed) {
+	free(buf[ibuf]);
+	buf[ibuf] = aligned_alloc<char> (nbytes_needed);
+	nbytes[ibuf] = nbytes_needed;
+    }
+
+    return buf[ibuf];
+}
+
+
+// The sizes below are upper bounds on what any clipper (intensity_clipper or std_dev_clipper,
+// any axis, robust or not) will request for the given (nfreq, nt, Df, Dt).
+void clipper_workspace::reserve(int nfreq, int nt, int Df, int Dt)
+{
+    if (_unlikely((nfreq <= 0) || (nt <= 0)))
+	throw runtime_error("rf_pipelines: clipper_workspace::reserve(): expected nfreq, nt > 0");
+    if (_unlikely((Df <= 0) || (Dt <= 0)))
+	throw runtime_error("rf_pipelines: clipper_workspace::reserve(): expected Df, Dt > 0");
+    if (_unlikely((nfreq % Df) || (nt % Dt)))
+	throw runtime_error("rf_pipelines: clipper_workspace::reserve(): expected nfreq, nt to be divisible by Df, Dt");
+
+    static constexpr int S = max_dispatch_simd_length;
+
+    ssize_t nf = nfreq / Df;
+    ssize_t nt_ds = nt / Dt;
+    ssize_t nds = nf * nt_ds;
+    ssize_t nsd = max(nf, nt_ds);
+
+    // Staged downsampling (or robust clipper downsampling).
+    int Df1 = Df / staged_downsampler::kernel_Df(Df);
+    int Dt1 = Dt / staged_downsampler::kernel_Dt(Dt);
+    ssize_t nstage = ((Df1 > 1) || (Dt1 > 1)) ? (ssize_t(nfreq/Df1) * ssize_t(nt/Dt1)) : 0;
+
+    if ((Df > 1) || (Dt > 1)) {
+	nstage = max(nstage, nds);
+	_get(WS_KERNEL_INTENSITY, max(nds, nf*S) * sizeof(float));
+	_get(WS_KERNEL_WEIGHTS, max(nds, nf*S) * sizeof(float));
+    }
+
+    _get(WS_STAGE_INTENSITY, nstage * sizeof(float));
+    _get(WS_STAGE_WEIGHTS, nstage * sizeof(float));
+    _get(WS_SD, max(nsd * sizeof(float), nds * sizeof(pair<float,float>)));
+    _get(WS_SD_VALID, nsd * max(sizeof(float), sizeof(smask_t<float,1>)));
+
+    // Intermediate arrays in wi_downsample(), called by the staged downsampler (with factors (Df1,Dt1)),
+    // or by the robust clippers (with factors (Df,Dt)).
+    ssize_t nscratch = max(wi_downsample_scratch_size(nfreq, nt, Df1, Dt1), wi_downsample_scratch_size(nfreq, nt, Df, Dt));
+    _get(WS_DOWNSAMPLE, nscratch * sizeof(float));
+}
+
+
+// static member function
+clipper_workspace &clipper_workspace::thread_local_default()
+{
+    static thread_local clipper_workspace ws;
+    return ws;
+}
+
+
+}  // namespace rf_pipelines
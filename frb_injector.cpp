@@ -0,0 +1,424 @@
+#include <algorithm>
+#include <climits>
+#include "rf_pipelines_internals.hpp"
+#include "kernels/frb_injector.hpp"
+
+using namespace std;
+
+namespace rf_pipelines {
+#if 0
+}; // pacify emacs c-mode
+#endif
+
+
+// -------------------------------------------------------------------------------------------------
+//
+// Pulse model.
+//
+// In each frequency channel, the arrival time of the pulse is modeled as a random variable
+//
+//    T = t_a + U w + N(0,sigma) + Exp(tau)
+//
+// where t_a is the dispersion delay at the top of the channel, U is uniform in [0,1] and w is the
+// dispersion delay across the channel, sigma is the intrinsic width, and tau is the scattering time
+// in the channel.  The contribution of the pulse to a time sample [s0,s1] is proportional to the
+// probability that T is in [s0,s1], i.e. to C(s1) - C(s0) where C is the CDF of T.
+//
+// Everything can be done analytically.  Let F(x) be the CDF of N(0,sigma) + Exp(tau), i.e. the
+// "exponentially modified Gaussian", and let H(x) be its antiderivative, which turns out to be
+//
+//    H(x) = x Phi(x/sigma) + sigma phi(x/sigma) - tau F(x)
+//
+// Then C(t) = (H(t-t_a) - H(t-t_a-w)) / w.  Limiting cases (sigma=0, tau=0, w=0) are handled
+// separately below.
+
+
+static constexpr double dispersion_delay_constant = 4.148808e3;   // seconds, for DM in pc/cm^3 and frequency in MHz
+static constexpr double width_cutoff = 6.0;                        // pulse is truncated at 6 sigma
+static constexpr double scattering_cutoff = 12.0;                  // ... and at 12 scattering times
+
+
+// Gaussian CDF Phi(x/sigma), with the sigma=0 case treated as a step function.
+inline double _gaussian_cdf(double x, double sigma)
+{
+    if (sigma <= 0.0)
+	return (x >= 0.0) ? 1.0 : 0.0;
+    return 0.5 * erfc(-x / (M_SQRT2 * sigma));
+}
+
+
+// CDF of N(0,sigma) + Exp(tau).
+inline double _exgaussian_cdf(double x, double sigma, double tau)
+{
+    if (tau <= 0.0)
+	return _gaussian_cdf(x, sigma);
+
+    if (sigma <= 0.0)
+	return (x > 0.0) ? (1.0 - exp(-x/tau)) : 0.0;
+
+    // Far from the pulse, we skip the (expensive) special function evaluations.
+    if (x < -width_cutoff * sigma)
+	return 0.0;
+    if (x > width_cutoff * sigma + scattering_cutoff * tau)
+	return 1.0;
+
+    // F(x) = Phi(x/sigma) - exp(-x/tau + sigma^2/(2 tau^2)) Phi(x/sigma - sigma/tau).
+    // When z is large, the second term is computed with an asymptotic expansion, to avoid overflow.
+    // (Note that the exponents combine as exp(-x^2 / 2 sigma^2).)
+
+    double u = x/sigma - sigma/tau;
+    double z = -u / M_SQRT2;
+
+    // In the exponential tail, both Phi's are equal to 1 (to double precision).
+    if (u > width_cutoff)
+	return 1.0 - exp(-x/tau + 0.5*sigma*sigma/(tau*tau));
+
+    if (z < 10.0)
+	return _gaussian_cdf(x, sigma) - exp(-x/tau + 0.5*sigma*sigma/(tau*tau)) * 0.5 * erfc(z);
+
+    double e = 0.5 * exp(-0.5*x*x / (sigma*sigma)) / (z * sqrt(M_PI)) * (1.0 - 0.5/(z*z));
+    return _gaussian_cdf(x, sigma) - e;
+}
+
+
+// Antiderivative of _exgaussian_cdf(), normalized so that H(x) -> 0 as x -> -infinity.
+inline double _exgaussian_integrated_cdf(double x, double sigma, double tau)
+{
+    // Far from the pulse, H(x) is either 0, or linear in x.  This is the common case for
+    // samples in the "interior" of a dispersion-smeared pulse.
+    if (x < -width_cutoff * sigma)
+	return 0.0;
+    if (x > width_cutoff * sigma + scattering_cutoff * tau)
+	return x - tau;
+
+    // In the exponential tail, H(x) = x - tau F(x).
+    if ((sigma <= 0.0) || (x > width_cutoff * sigma))
+	return ((x > 0.0) ? x : 0.0) - tau * _exgaussian_cdf(x, sigma, tau);
+
+    return x * _gaussian_cdf(x, sigma) + sigma * exp(-0.5*x*x / (sigma*sigma)) / sqrt(2*M_PI) - tau * _exgaussian_cdf(x, sigma, tau);
+}
+
+
+// CDF C(t) of the arrival time T, where t is measured relative to the arrival time t_a at the top of the channel.
+inline double _pulse_cdf(double t, double w, double sigma, double tau)
+{
+    if (w <= 0.0)
+	return _exgaussian_cdf(t, sigma, tau);
+
+    return (_exgaussian_integrated_cdf(t, sigma, tau) - _exgaussian_integrated_cdf(t-w, sigma, tau)) / w;
+}
+
+
+// -------------------------------------------------------------------------------------------------
+
+
+struct frb_injector : public wi_transform
+{
+    static constexpr int S = constants::single_precision_simd_length;
+
+    struct pulse_state {
+	frb_pulse params;
+	double t_start = 0.0;       // time range spanned by pulse (all channels), initialized in set_stream()
+	double t_end = 0.0;
+	double amplitude = 0.0;     // initialized when pulse first overlaps a chunk
+	bool is_normalized = false;
+
+	pulse_state(const frb_pulse &p) : params(p) { }
+    };
+
+    const double sample_rms;
+
+    vector<pulse_state> pulses;   // sorted by t_start in set_stream()
+
+    // Per-channel quantities which don't depend on the pulse, initialized in set_stream().
+    double dt_sample = 0.0;
+    vector<double> delay_hi;      // dispersion delay per unit DM, at top of channel
+    vector<double> delay_lo;      // dispersion delay per unit DM, at bottom of channel
+    vector<double> scattering;    // scattering time per unit SM (in seconds, since SM is defined in milliseconds at 1 GHz)
+    vector<double> log_freq;      // log(channel center / band center), for spectral index
+
+    // Scratch row of length nt_chunk, which accumulates all pulses in a channel.
+    // Invariant: the scratch row is all zeros between calls to process_chunk().
+    float *scratch = nullptr;
+
+    // Per-substream state.
+    // The "interval index" is a sweep over 'pulses' in order of t_start: pulses [0:ipulse_next] have started,
+    // and the 'active' list contains the indices of started pulses which haven't ended yet.
+    double substream_t0 = 0.0;
+    double substream_t1 = 0.0;
+    ssize_t ipulse_next = 0;
+    vector<ssize_t> active;
+    ssize_t npulses_injected = 0;
+    ssize_t npulses_partial = 0;
+
+    // Noncopyable
+    frb_injector(const frb_injector &) = delete;
+    frb_injector &operator=(const frb_injector &) = delete;
+
+
+    frb_injector(const vector<frb_pulse> &pulses_, double sample_rms_, int nt_chunk_) :
+	sample_rms(sample_rms_)
+    {
+	stringstream ss;
+	ss << "frb_injector(npulses=" << pulses_.size() << ", sample_rms=" << sample_rms << ", nt_chunk=" << nt_chunk_ << ")";
+
+	this->name = ss.str();
+	this->nt_chunk = nt_chunk_;
+	this->nt_prepad = 0;
+	this->nt_postpad = 0;
+	this->preserves_mask = true;   // only the intensity is modified
+
+	// No need to make these asserts "verbose", since they should have been checked in make_frb_injector().
+	rf_assert(sample_rms > 0.0);
+	rf_assert(nt_chunk > 0);
+	rf_assert(nt_chunk % S == 0);
+
+	for (const frb_pulse &p: pulses_)
+	    this->pulses.push_back(pulse_state(p));
+    }
+
+    virtual ~frb_injector()
+    {
+	free(scratch);
+	scratch = nullptr;
+    }
+
+    virtual void set_stream(const wi_stream &stream) override
+    {
+	this->nfreq = stream.nfreq;
+	this->dt_sample = stream.dt_sample;
+
+	double freq_lo = stream.freq_lo_MHz;
+	double freq_hi = stream.freq_hi_MHz;
+	double freq_mid = 0.5 * (freq_lo + freq_hi);
+
+	delay_hi.resize(nfreq);
+	delay_lo.resize(nfreq);
+	scattering.resize(nfreq);
+	log_freq.resize(nfreq);
+
+	// Note: frequency channels are ordered from highest frequency to lowest.
+	for (int ifreq = 0; ifreq < nfreq; ifreq++) {
+	    double f_hi = freq_hi - ifreq * (freq_hi - freq_lo) / nfreq;
+	    double f_lo = freq_hi - (ifreq+1) * (freq_hi - freq_lo) / nfreq;
+	    double f_mid = 0.5 * (f_lo + f_hi);
+
+	    delay_hi[ifreq] = dispersion_delay_constant / (f_hi * f_hi);
+	    delay_lo[ifreq] = dispersion_delay_constant / (f_lo * f_lo);
+	    scattering[ifreq] = 1.0e-3 * pow(f_mid / 1000.0, -4.4);
+	    log_freq[ifreq] = log(f_mid / freq_mid);
+	}
+
+	// The scattering time is largest in the lowest channel.
+	for (pulse_state &p: pulses) {
+	    double sigma = p.params.intrinsic_width;
+	    double tau = p.params.sm * scattering[nfreq-1];
+
+	    p.t_start = p.params.undispersed_arrival_time + p.params.dm * delay_hi[0] - width_cutoff * sigma;
+	    p.t_end = p.params.undispersed_arrival_time + p.params.dm * delay_lo[nfreq-1] + width_cutoff * sigma + scattering_cutoff * tau;
+	}
+
+	std::stable_sort(pulses.begin(), pulses.end(), [](const pulse_state &a, const pulse_state &b) { return a.t_start < b.t_start; });
+
+	free(scratch);
+	this->scratch = aligned_alloc<float> (nt_chunk);
+    }
+
+    virtual void start_substream(int isubstream, double t0) override
+    {
+	this->substream_t0 = t0;
+	this->substream_t1 = t0;
+	this->ipulse_next = 0;
+	this->active.clear();
+	this->npulses_injected = 0;
+	this->npulses_partial = 0;
+
+	// The normalization depends on the alignment of the pulse relative to the sample grid,
+	// which may be different in each substream.
+	for (pulse_state &p: pulses)
+	    p.is_normalized = false;
+    }
+
+    virtual void process_chunk(double t0, double t1, float *intensity, float *weights, ssize_t stride, float *pp_intensity, float *pp_weights, ssize_t pp_stride) override
+    {
+	t1 = t0 + nt_chunk * dt_sample;
+	this->substream_t1 = t1;
+
+	// Update the interval index.
+
+	while ((ipulse_next < ssize_t(pulses.size())) && (pulses[ipulse_next].t_start < t1)) {
+	    pulse_state &p = pulses[ipulse_next];
+
+	    if (p.t_end > t0) {
+		this->_normalize(p);
+		this->active.push_back(ipulse_next);
+		this->npulses_injected++;
+
+		if (p.t_start < substream_t0)
+		    this->npulses_partial++;
+	    }
+
+	    this->ipulse_next++;
+	}
+
+	if (active.size() == 0)
+	    return;
+
+	// Add pulses, one channel at a time.
+
+	for (int ifreq = 0; ifreq < nfreq; ifreq++) {
+	    int it_min = nt_chunk;
+	    int it_max = 0;
+
+	    for (ssize_t ipulse: active) {
+		int it0, it1;
+		this->_add_pulse(pulses[ipulse], ifreq, t0, scratch, it0, it1);
+
+		it_min = min(it_min, it0);
+		it_max = max(it_max, it1);
+	    }
+
+	    if (it_min >= it_max)
+		continue;
+
+	    // Round to a multiple of S (note that nt_chunk is a multiple of S).
+	    it_min = (it_min / S) * S;
+	    it_max = min(round_up(it_max, S), ssize_t(nt_chunk));
+
+	    _kernel_accumulate_and_zero<float,S> (intensity + ifreq*stride + it_min, scratch + it_min, it_max - it_min);
+	}
+
+	// Remove pulses which have ended.
+	auto it = std::remove_if(active.begin(), active.end(), [this,t1](ssize_t i) { return this->pulses[i].t_end <= t1; });
+	active.erase(it, active.end());
+    }
+
+    virtual void end_substream() override
+    {
+	// Pulses which are still active at the end of the substream were only partially injected.
+	// (Pulses which started before the substream have already been counted in process_chunk().)
+	for (ssize_t ipulse: active)
+	    if (pulses[ipulse].t_start >= substream_t0)
+		this->npulses_partial++;
+
+	this->json_per_substream["npulses_injected"] = Json::Int64(npulses_injected);
+	this->json_per_substream["npulses_partial"] = Json::Int64(npulses_partial);
+
+	// We print a warning if some pulses aren't entirely contained in the substream, since this is probably unintentional.
+	if (npulses_partial > 0)
+	    cerr << "frb_injector: warning: " << npulses_partial << " pulse(s) were only partially contained in the stream\n";
+    }
+
+
+    // Computes the per-channel time range of the pulse, relative to the chunk starting at time t0,
+    // as a sample index range [it0, it1), clamped to [0, nt).  Returns the "local" pulse parameters
+    // (arrival time at top of channel, dispersion smearing, scattering time).
+    inline void _channel_range(const pulse_state &p, int ifreq, double t0, int nt, double &ta, double &w, double &tau, int &it0, int &it1) const
+    {
+	const frb_pulse &q = p.params;
+	double sigma = q.intrinsic_width;
+
+	ta = q.undispersed_arrival_time + q.dm * delay_hi[ifreq];
+	w = q.dm * (delay_lo[ifreq] - delay_hi[ifreq]);
+	tau = q.sm * scattering[ifreq];
+
+	double s0 = (ta - width_cutoff * sigma - t0) / dt_sample;
+	double s1 = (ta + w + width_cutoff * sigma + scattering_cutoff * tau - t0) / dt_sample;
+
+	// The range is padded by one sample on each side, to be robust to roundoff when a pulse
+	// endpoint falls on a sample boundary.
+	it0 = int(max(floor(s0) - 1.0, 0.0));
+	it1 = int(min(floor(s1) + 2.0, double(nt)));
+    }
+
+    // Adds the pulse (in one channel) to the scratch row, and returns the sample range [it0,it1) which was modified.
+    inline void _add_pulse(const pulse_state &p, int ifreq, double t0, float *out, int &it0, int &it1) const
+    {
+	double ta, w, tau;
+	_channel_range(p, ifreq, t0, nt_chunk, ta, w, tau, it0, it1);
+
+	if (it0 >= it1)
+	    return;
+
+	double sigma = p.params.intrinsic_width;
+	double a = p.amplitude * exp(p.params.spectral_index * log_freq[ifreq]);
+	double c0 = _pulse_cdf(t0 + it0*dt_sample - ta, w, sigma, tau);
+
+	for (int it = it0; it < it1; it++) {
+	    double c1 = _pulse_cdf(t0 + (it+1)*dt_sample - ta, w, sigma, tau);
+	    out[it] += a * (c1 - c0);
+	    c0 = c1;
+	}
+    }
+
+    // Sets the amplitude, so that the signal-to-noise (with uniform channel weighting and
+    // noise rms 'sample_rms') is equal to the 'snr' parameter.  As in the python frb_injector_transform,
+    // the sum is taken on the sample grid of the current substream.
+    void _normalize(pulse_state &p)
+    {
+	if (p.is_normalized)
+	    return;
+
+	double sigma = p.params.intrinsic_width;
+	double acc = 0.0;
+
+	for (int ifreq = 0; ifreq < nfreq; ifreq++) {
+	    // Sample indices here are relative to 'substream_t0', and are not clamped.
+	    double ta, w, tau;
+	    int it0, it1;
+	    _channel_range(p, ifreq, substream_t0, INT_MAX, ta, w, tau, it0, it1);
+
+	    double s0 = (ta - width_cutoff * sigma - substream_t0) / dt_sample;
+	    it0 = int(floor(s0) - 1.0);
+
+	    double a = exp(p.params.spectral_index * log_freq[ifreq]);
+	    double c0 = _pulse_cdf(substream_t0 + it0*dt_sample - ta, w, sigma, tau);
+
+	    for (int it = it0; it < it1; it++) {
+		double c1 = _pulse_cdf(substream_t0 + (it+1)*dt_sample - ta, w, sigma, tau);
+		acc += square(a * (c1 - c0));
+		c0 = c1;
+	    }
+	}
+
+	double snr0 = sqrt(acc) / sample_rms;
+	p.amplitude = (snr0 > 0.0) ? (p.params.snr / snr0) : 0.0;
+	p.is_normalized = true;
+    }
+};
+
+
+// -------------------------------------------------------------------------------------------------
+
+
+static void check_params(const vector<frb_pulse> &pulses, double sample_rms, int nt_chunk)
+{
+    static constexpr int S = constants::single_precision_simd_length;
+
+    if (_unlikely(sample_rms <= 0.0))
+	throw runtime_error("rf_pipelines: make_frb_injector(): sample_rms=" + to_string(sample_rms) + ", positive value was expected");
+
+    if (_unlikely((nt_chunk <= 0) || (nt_chunk % S)))
+	throw runtime_error("rf_pipelines: make_frb_injector(): nt_chunk=" + to_string(nt_chunk)
+			    + " must be positive, and a multiple of constants::single_precision_simd_length=" + to_string(S));
+
+    for (const frb_pulse &p: pulses) {
+	if (_unlikely(p.dm < 0.0))
+	    throw runtime_error("rf_pipelines: make_frb_injector(): dm=" + to_string(p.dm) + ", non-negative value was expected");
+	if (_unlikely(p.intrinsic_width < 0.0))
+	    throw runtime_error("rf_pipelines: make_frb_injector(): intrinsic_width=" + to_string(p.intrinsic_width) + ", non-negative value was expected");
+	if (_unlikely(p.sm < 0.0))
+	    throw runtime_error("rf_pipelines: make_frb_injector(): sm=" + to_string(p.sm) + ", non-negative value was expected");
+    }
+}
+
+
+// externally visible
+shared_ptr<wi_transform> make_frb_injector(const vector<frb_pulse> &pulses, double sample_rms, int nt_chunk)
+{
+    check_params(pulses, sample_rms, nt_chunk);
+    return make_shared<frb_injector> (pulses, sample_rms, nt_chunk);
+}
+
+
+}  // namespace rf_pipelines
@@ -1,10 +1,10 @@
-// FIXME: currently we need to compile a new kernel for every (Df,Dt) pair, where
-// Df,Dt are the frequency/time downsampling factors.  Eventually I'd like to 
-// improve this by having special kernels to handle the large-Df and large-Dt cases.
+// We compile a specialized kernel for every (Df,Dt) pair up to constants::max_specialized_frequency_downsampling
+// and constants::max_specialized_time_downsampling, where Df,Dt are the frequency/time downsampling factors.
+// Larger factors are handled by downsampling in stages (see 'struct staged_downsampler').
 
 #include <array>
 #include "rf_pipelines_internals.hpp"
-#include "kernels/intensity_clippers.hpp"
+#include "kernels/kernel_tables.hpp"
 
 using namespace std;
 
@@ -26,7 +26,9 @@ namespace rf_pipelines {
 
 inline int get_nds(int nfreq, int nt, int axis, int Df, int Dt)
 {
-    static constexpr int S = constants::single_precision_simd_length;
+    // Note: we use the largest simd length which can be selected by simd_dispatch_length(),
+    // so that the buffers are large enough for either kernel table.
+    static constexpr int S = max_dispatch_simd_length;
 
     if (axis == AXIS_FREQ)
 	return (nfreq/Df) * S;
@@ -39,114 +41,69 @@ inline int get_nds(int nfreq, int nt, int axis, int Df, int Dt)
 }
 
 
-inline float *alloc_ds_intensity(int nfreq, int nt, axis_type axis, int niter, int Df, int Dt, bool two_pass)
+// The ds_*_size() functions return 0 if the kernel expects a NULL pointer.
+
+inline int ds_intensity_size(int nfreq, int nt, axis_type axis, int niter, int Df, int Dt, bool two_pass)
 {
     if ((Df==1) && (Dt==1))
-	return nullptr;
+	return 0;
 
-    int nds = get_nds(nfreq, nt, axis, Df, Dt);
-    return aligned_alloc<float> (nds);
+    return get_nds(nfreq, nt, axis, Df, Dt);
 }
 
 
-inline float *alloc_ds_weights(int nfreq, int nt, axis_type axis, int niter, int Df, int Dt, bool two_pass)
+inline int ds_weights_size(int nfreq, int nt, axis_type axis, int niter, int Df, int Dt, bool two_pass)
 {
     if ((Df==1) && (Dt==1))
-	return nullptr;
+	return 0;
 
     if ((niter == 1) && !two_pass)
-	return nullptr;
+	return 0;
 
-    int nds = get_nds(nfreq, nt, axis, Df, Dt);
-    return aligned_alloc<float> (nds);
+    return get_nds(nfreq, nt, axis, Df, Dt);
 }
 
 
-// -------------------------------------------------------------------------------------------------
-//
-// intensity_clipper_kernel_table
-
-
-// kernel(intensity, weights, nfreq, nt_chunk, stride, niter, sigma, iter_sigma, ds_intensity, ds_weights)
-using intensity_clipper_kernel_t = void (*)(const float *, float *, int, int, int, int, double, double, float *, float *);
-
-
-// Fills shape-(3,2) array indexed by (axis, two_pass)
-template<unsigned int S, unsigned int Df, unsigned int Dt>
-inline void fill_2d_intensity_clipper_kernel_table(intensity_clipper_kernel_t *out)
+inline float *alloc_ds_intensity(int nfreq, int nt, axis_type axis, int niter, int Df, int Dt, bool two_pass)
 {
-    static_assert(AXIS_FREQ == 0, "expected AXIS_FREQ==0");
-    static_assert(AXIS_TIME == 1, "expected AXIS_TIME==1");
-    static_assert(AXIS_NONE == 2, "expected AXIS_NONE==2");
-
-    out[2*AXIS_FREQ] = _kernel_clip_1d_f<float,S,Df,Dt,false>;
-    out[2*AXIS_FREQ + 1] = _kernel_clip_1d_f<float,S,Df,Dt,true>;
-
-    out[2*AXIS_TIME] = _kernel_clip_1d_t<float,S,Df,Dt,false>;
-    out[2*AXIS_TIME + 1] = _kernel_clip_1d_t<float,S,Df,Dt,true>;
-
-    out[2*AXIS_NONE] = _kernel_clip_2d<float,S,Df,Dt,false>;
-    out[2*AXIS_NONE + 1] = _kernel_clip_2d<float,S,Df,Dt,true>;
-}
-
-
-// Fills shape-(NDt,3,2) array indexed by (Dt, axis, two_pass)
-template<unsigned int S, unsigned int Df, unsigned int NDt, typename enable_if<(NDt==0),int>::type = 0>
-inline void fill_3d_intensity_clipper_kernel_table(intensity_clipper_kernel_t *out) { }
-
-template<unsigned int S, unsigned int Df, unsigned int NDt, typename enable_if<(NDt>0),int>::type = 0>
-inline void fill_3d_intensity_clipper_kernel_table(intensity_clipper_kernel_t *out) 
-{ 
-    fill_3d_intensity_clipper_kernel_table<S,Df,(NDt-1)> (out);
-    fill_2d_intensity_clipper_kernel_table<S,Df,(1<<(NDt-1))> (out + 6*(NDt-1));
+    int nds = ds_intensity_size(nfreq, nt, axis, niter, Df, Dt, two_pass);
+    return nds ? aligned_alloc<float> (nds) : nullptr;
 }
 
 
-// Fills shape-(NDf,NDt,3,2) array indexed by (Df, Dt, axis, two_pass)
-template<unsigned int S, unsigned int NDf, unsigned int NDt, typename enable_if<(NDf==0),int>::type = 0>
-inline void fill_4d_intensity_clipper_kernel_table(intensity_clipper_kernel_t *out) { }
-
-template<unsigned int S, unsigned int NDf, unsigned int NDt, typename enable_if<(NDf>0),int>::type = 0>
-inline void fill_4d_intensity_clipper_kernel_table(intensity_clipper_kernel_t *out)
+inline float *alloc_ds_weights(int nfreq, int nt, axis_type axis, int niter, int Df, int Dt, bool two_pass)
 {
-    fill_4d_intensity_clipper_kernel_table<S,(NDf-1),NDt> (out);
-    fill_3d_intensity_clipper_kernel_table<S,(1<<(NDf-1)),NDt> (out + 6*(NDf-1)*NDt);
+    int nds = ds_weights_size(nfreq, nt, axis, niter, Df, Dt, two_pass);
+    return nds ? aligned_alloc<float> (nds) : nullptr;
 }
 
 
-struct intensity_clipper_kernel_table {
-    static constexpr int S = constants::single_precision_simd_length;
-    static constexpr int MaxDf = constants::max_frequency_downsampling;
-    static constexpr int MaxDt = constants::max_time_downsampling;
-    static constexpr int NDf = IntegerLog2<MaxDf>() + 1;
-    static constexpr int NDt = IntegerLog2<MaxDt>() + 1;
-
-    // Weird: for some reason using std::max() here gives a clang linker (not compiler) error.
-    static constexpr int MaxD = (MaxDf > MaxDt) ? MaxDf : MaxDt;
+// -------------------------------------------------------------------------------------------------
+//
+// Kernel dispatch (the kernel tables themselves are in kernels/kernel_tables.hpp)
 
-    vector<intensity_clipper_kernel_t> kernels;
 
-    integer_log2_lookup_table ilog2_lookup;
+static intensity_clipper_kernel_table<constants::single_precision_simd_length> global_intensity_clipper_kernel_table;
 
-    intensity_clipper_kernel_table() :
-	kernels(6*NDf*NDt, nullptr), 
-	ilog2_lookup(MaxD)
-    {
-	fill_4d_intensity_clipper_kernel_table<S,NDf,NDt> (&kernels[0]);
-    }
 
-    // Caller must call check_params()!
-    inline intensity_clipper_kernel_t get_kernel(axis_type axis, int Df, int Dt, bool two_pass)
-    {
-	int idf = ilog2_lookup(Df);
-	int idt = ilog2_lookup(Dt);
+// Caller must call check_params()!
+//
+// If (Df,Dt) exceeds the largest specialized kernel, then the returned kernel is for the
+// factors (staged_downsampler::kernel_Df(Df), staged_downsampler::kernel_Dt(Dt)).
 
-	return kernels[6*(idf*NDt+idt) + 2*axis + (two_pass ? 1 : 0)];
-    }
-};
+static intensity_clipper_kernel_t get_intensity_clipper_kernel(axis_type axis, int nt, int Df, int Dt, bool two_pass)
+{
+    int Dk_f = staged_downsampler::kernel_Df(Df);
+    int Dk_t = staged_downsampler::kernel_Dt(Dt);
 
+#ifdef HAVE_AVX512
+    // The kernel runs on an array of length nt/(Dt/Dk_t), so this is equivalent to checking (nt/(Dt/Dk_t)) % (16*Dk_t).
+    if ((simd_dispatch_length() == 16) && (nt % (16*Dt) == 0))
+	return get_avx512_intensity_clipper_kernel(axis, Dk_f, Dk_t, two_pass);
+#endif
 
-static intensity_clipper_kernel_table global_intensity_clipper_kernel_table;
+    return global_intensity_clipper_kernel_table.get_kernel(axis, Dk_f, Dk_t, two_pass);
+}
 
 
 // -------------------------------------------------------------------------------------------------
@@ -161,6 +118,7 @@ struct clipper_transform : public wi_transform
     const int nds_t;
     const axis_type axis;
     const bool two_pass;
+    const bool robust;
     
     // Clipping thresholds.
     const int niter;
@@ -171,20 +129,30 @@ struct clipper_transform : public wi_transform
     float *ds_intensity = nullptr;
     float *ds_weights = nullptr;
 
+    // Only used if (Df,Dt) exceeds the largest specialized kernel.
+    staged_downsampler stage;
+
+    // Only used in robust mode.
+    clipper_workspace ws;
+
     // Kernels
     intensity_clipper_kernel_t kernel;
 
+    // Iteration counts, for reporting in the json output (iterated clipping can terminate early).
+    double iter_sum = 0.0;
+    ssize_t iter_nchunks = 0;
+
     // Noncopyable
     clipper_transform(const clipper_transform &) = delete;
     clipper_transform &operator=(const clipper_transform &) = delete;
 
-    clipper_transform(int nds_f_, int nds_t_, axis_type axis_, int nt_chunk_, double sigma_, int niter_, double iter_sigma_, bool two_pass_, intensity_clipper_kernel_t kernel_)
-	: nds_f(nds_f_), nds_t(nds_t_), axis(axis_), two_pass(two_pass_), niter(niter_), sigma(sigma_), iter_sigma(iter_sigma_ ? iter_sigma_ : sigma_), kernel(kernel_)
+    clipper_transform(int nds_f_, int nds_t_, axis_type axis_, int nt_chunk_, double sigma_, int niter_, double iter_sigma_, bool two_pass_, bool robust_, intensity_clipper_kernel_t kernel_)
+	: nds_f(nds_f_), nds_t(nds_t_), axis(axis_), two_pass(two_pass_), robust(robust_), niter(niter_), sigma(sigma_), iter_sigma(iter_sigma_ ? iter_sigma_ : sigma_), kernel(kernel_)
     {
 	stringstream ss;
         ss << "intensity_clipper_cpp(nt_chunk=" << nt_chunk_ << ", axis=" << axis 
 	   << ", sigma=" << sigma << ", niter=" << niter << ", iter_sigma=" << iter_sigma 
-	   << ", Df=" << nds_f << ", Dt=" << nds_t << ", two_pass=" << two_pass << ")";
+	   << ", Df=" << nds_f << ", Dt=" << nds_t << ", two_pass=" << two_pass << ", robust=" << robust << ")";
 
 	this->name = ss.str();
 	this->nt_chunk = nt_chunk_;
@@ -196,6 +164,8 @@ struct clipper_transform : public wi_transform
 	rf_assert(iter_sigma >= 1.0);
 	rf_assert(nt_chunk > 0);
 	rf_assert(nt_chunk % nds_t == 0);
+
+	this->preserves_mask = true;
     }
 
     virtual ~clipper_transform()
@@ -212,34 +182,98 @@ struct clipper_transform : public wi_transform
 				+ ") is not divisible by frequency downsampling factor Df=" + to_string(nds_f));
 
 	this->nfreq = stream.nfreq;
-	this->ds_intensity = alloc_ds_intensity(nfreq, nt_chunk, axis, niter, nds_f, nds_t, two_pass);
-	this->ds_weights = alloc_ds_weights(nfreq, nt_chunk, axis, niter, nds_f, nds_t, two_pass);
+	this->stage.init(nfreq, nt_chunk, nds_f, nds_t);
+	this->ds_intensity = alloc_ds_intensity(stage.nfreq_ds, stage.nt_ds, axis, niter, stage.Df_kernel, stage.Dt_kernel, two_pass);
+	this->ds_weights = alloc_ds_weights(stage.nfreq_ds, stage.nt_ds, axis, niter, stage.Df_kernel, stage.Dt_kernel, two_pass);
+    }
+
+    // Number of iterations for a fully masked clipping group: the second iteration leaves (mean, rms)
+    // unchanged, so iterated clipping always terminates there.
+    inline int masked_niter() const { return min(niter, 2); }
+
+    // Applies the (axis=AXIS_TIME) kernel to the rows which are not fully masked, and returns the
+    // number of iterations averaged over all clipping groups, as the kernel would.
+    double clip_unmasked_rows(const float *intensity, float *weights, ssize_t stride)
+    {
+	double n = 0.0;
+
+	mask_info->foreach_block_range(nds_f, [&](ssize_t ifreq0, ssize_t ifreq1, bool masked) {
+	    double ngroups = (ifreq1 - ifreq0) / nds_f;
+
+	    if (masked)
+		n += ngroups * masked_niter();
+	    else
+		n += ngroups * this->kernel(intensity + ifreq0 * stride, weights + ifreq0 * stride, ifreq1 - ifreq0, nt_chunk, stride, niter, sigma, iter_sigma, ds_intensity, ds_weights);
+	});
+
+	return n / double(nfreq / nds_f);
     }
 
     virtual void process_chunk(double t0, double t1, float *intensity, float *weights, ssize_t stride, float *pp_intensity, float *pp_weights, ssize_t pp_stride) override
     {
-	this->kernel(intensity, weights, nfreq, nt_chunk, stride, niter, sigma, iter_sigma, ds_intensity, ds_weights);
+	// Clipping doesn't change a fully masked chunk (see 'struct chunk_mask_info').
+	if (mask_info) {
+	    mask_info->update();
+
+	    if (mask_info->all_masked()) {
+		if (!robust) {
+		    this->iter_nchunks++;
+		    this->iter_sum += masked_niter();
+		}
+		return;
+	    }
+	}
+
+	if (robust) {
+	    robust_intensity_clip(intensity, weights, nfreq, nt_chunk, stride, axis, sigma, nds_f, nds_t, ws);
+	    return;
+	}
+
+	this->iter_nchunks++;
+
+	if (!stage.is_active() && mask_info && (mask_info->nrows_masked > 0) && (axis == AXIS_TIME)) {
+	    this->iter_sum += this->clip_unmasked_rows(intensity, weights, stride);
+	    return;
+	}
+
+	if (!stage.is_active()) {
+	    this->iter_sum += this->kernel(intensity, weights, nfreq, nt_chunk, stride, niter, sigma, iter_sigma, ds_intensity, ds_weights);
+	    return;
+	}
+
+	stage.downsample(intensity, weights, stride, this->ds_cache, this->mask_info);
+	this->iter_sum += this->kernel(stage.intensity_ds, stage.weights_ds, stage.nfreq_ds, stage.nt_ds, stage.nt_ds, niter, sigma, iter_sigma, ds_intensity, ds_weights);
+	stage.upsample_mask(weights, stride);
+    }
+
+    virtual void start_substream(int isubstream, double t0) override
+    {
+	this->iter_sum = 0.0;
+	this->iter_nchunks = 0;
     }
 
-    virtual void start_substream(int isubstream, double t0) override { }
-    virtual void end_substream() override { }
+    virtual void end_substream() override
+    {
+	// Average number of iterations per clipping group (row, column, or chunk), including the
+	// initial non-iterative pass.  This is only interesting if niter > 1.
+	if ((niter > 1) && (iter_nchunks > 0))
+	    this->json_per_substream["mean_iterations"] = iter_sum / double(iter_nchunks);
+    }
 };
 
 
 // -------------------------------------------------------------------------------------------------
 
 
-static void check_params(const char *name, int Df, int Dt, axis_type axis, int nfreq, int nt, int stride, double sigma, int niter, double iter_sigma)
+static void check_params(const char *name, int Df, int Dt, axis_type axis, int nfreq, int nt, int stride, double sigma, int niter, double iter_sigma, bool two_pass, bool robust)
 {
     static constexpr int S = constants::single_precision_simd_length;
-    static constexpr int MaxDf = constants::max_frequency_downsampling;
-    static constexpr int MaxDt = constants::max_time_downsampling;
 
-    if (_unlikely((Df <= 0) || !is_power_of_two(Df)))
-	throw runtime_error(string(name) + ": Df=" + to_string(Df) + " must be a power of two");
+    if (_unlikely(Df <= 0))
+	throw runtime_error(string(name) + ": Df=" + to_string(Df) + ", positive value was expected");
 
-    if (_unlikely((Dt <= 0) || !is_power_of_two(Dt)))
-	throw runtime_error(string(name) + ": Dt=" + to_string(Dt) + " must be a power of two");
+    if (_unlikely(Dt <= 0))
+	throw runtime_error(string(name) + ": Dt=" + to_string(Dt) + ", positive value was expected");
 
     if (_unlikely((axis != AXIS_FREQ) && (axis != AXIS_TIME) && (axis != AXIS_NONE)))
 	throw runtime_error(string(name) + ": axis=" + stringify(axis) + " is not defined for this transform");
@@ -259,6 +293,12 @@ static void check_params(const char *name, int Df, int Dt, axis_type axis, int n
     if (_unlikely(niter < 1))
 	throw runtime_error(string(name) + ": niter=" + to_string(niter) + " must be >= 1");
 
+    if (_unlikely(robust && (niter != 1)))
+	throw runtime_error(string(name) + ": niter=" + to_string(niter) + " was specified, but niter=1 is required in robust mode");
+
+    if (_unlikely(robust && two_pass))
+	throw runtime_error(string(name) + ": two_pass=true is not supported in robust mode");
+
     if (_unlikely((nfreq % Df) != 0))
 	throw runtime_error(string(name) + ": nfreq=" + to_string(nfreq)
 			    + " must be a multiple of the downsampling factor Df=" + to_string(Df));
@@ -267,90 +307,233 @@ static void check_params(const char *name, int Df, int Dt, axis_type axis, int n
 	throw runtime_error(string(name) + ": nt=" + to_string(nt)
 			    + " must be a multiple of the downsampling factor Dt=" + to_string(Dt)
 			    + " multiplied by constants::single_precision_simd_length=" + to_string(S));
-
-    if (_unlikely((Df > MaxDf) || (Dt > MaxDt)))
-	throw runtime_error(string(name) + ": (Df,Dt)=(" + to_string(Df) + "," + to_string(Dt) + ")"
-			    + " exceeds compile time limits; to fix this see 'constants' in rf_pipelines.hpp");
 }
 
 
 // externally visible
-shared_ptr<wi_transform> make_intensity_clipper(int nt_chunk, axis_type axis, double sigma, int niter, double iter_sigma, int Df, int Dt, bool two_pass)
+shared_ptr<wi_transform> make_intensity_clipper(int nt_chunk, axis_type axis, double sigma, int niter, double iter_sigma, int Df, int Dt, bool two_pass, bool robust)
 {
     int dummy_nfreq = Df;         // arbitrary
     int dummy_stride = nt_chunk;  // arbitrary
 
-    check_params("rf_pipelines: make_intensity_clipper()", Df, Dt, axis, dummy_nfreq, nt_chunk, dummy_stride, sigma, niter, iter_sigma);
+    check_params("rf_pipelines: make_intensity_clipper()", Df, Dt, axis, dummy_nfreq, nt_chunk, dummy_stride, sigma, niter, iter_sigma, two_pass, robust);
     
-    auto kernel = global_intensity_clipper_kernel_table.get_kernel(axis, Df, Dt, two_pass);
-    return make_shared<clipper_transform> (Df, Dt, axis, nt_chunk, sigma, niter, iter_sigma, two_pass, kernel);
+    auto kernel = get_intensity_clipper_kernel(axis, nt_chunk, Df, Dt, two_pass);
+    return make_shared<clipper_transform> (Df, Dt, axis, nt_chunk, sigma, niter, iter_sigma, two_pass, robust, kernel);
 }
 
 
 // externally visible
-void apply_intensity_clipper(const float *intensity, float *weights, int nfreq, int nt, int stride, axis_type axis, double sigma, int niter, double iter_sigma, int Df, int Dt, bool two_pass)
+void apply_intensity_clipper(const float *intensity, float *weights, int nfreq, int nt, int stride, axis_type axis, double sigma, int niter, double iter_sigma, int Df, int Dt, bool two_pass, bool robust, clipper_workspace *ws)
 {
-    check_params("rf_pipeliens: apply_intensity_clipper()", Df, Dt, axis, nfreq, nt, stride, sigma, niter, iter_sigma);
+    check_params("rf_pipeliens: apply_intensity_clipper()", Df, Dt, axis, nfreq, nt, stride, sigma, niter, iter_sigma, two_pass, robust);
 
     if (_unlikely(!intensity))
 	throw runtime_error("rf_pipelines: apply_intensity_clipper(): NULL intensity pointer");
     if (_unlikely(!weights))
 	throw runtime_error("rf_pipelines: apply_intensity_clipper(): NULL weights pointer");
 
-    float *ds_intensity = alloc_ds_intensity(nfreq, nt, axis, niter, Df, Dt, two_pass);
-    float *ds_weights = alloc_ds_weights(nfreq, nt, axis, niter, Df, Dt, two_pass);
+    clipper_workspace &w = ws ? (*ws) : clipper_workspace::thread_local_default();
+
+    if (robust) {
+	robust_intensity_clip(intensity, weights, nfreq, nt, stride, axis, sigma, Df, Dt, w);
+	return;
+    }
+
+    // Same convention as make_intensity_clipper(): iter_sigma=0 means "same as sigma".
+    if (iter_sigma == 0.0)
+	iter_sigma = sigma;
+
+    staged_downsampler stage;
+    stage.init(nfreq, nt, Df, Dt, &w);
+
+    int nds_i = ds_intensity_size(stage.nfreq_ds, stage.nt_ds, axis, niter, stage.Df_kernel, stage.Dt_kernel, two_pass);
+    int nds_w = ds_weights_size(stage.nfreq_ds, stage.nt_ds, axis, niter, stage.Df_kernel, stage.Dt_kernel, two_pass);
+    float *ds_intensity = nds_i ? w.get<float> (WS_KERNEL_INTENSITY, nds_i) : nullptr;
+    float *ds_weights = nds_w ? w.get<float> (WS_KERNEL_WEIGHTS, nds_w) : nullptr;
+
+    auto kernel = get_intensity_clipper_kernel(axis, nt, Df, Dt, two_pass);
+
+    if (stage.is_active()) {
+	stage.downsample(intensity, weights, stride);
+	kernel(stage.intensity_ds, stage.weights_ds, stage.nfreq_ds, stage.nt_ds, stage.nt_ds, niter, sigma, iter_sigma, ds_intensity, ds_weights);
+	stage.upsample_mask(weights, stride);
+    }
+    else
+	kernel(intensity, weights, nfreq, nt, stride, niter, sigma, iter_sigma, ds_intensity, ds_weights);
+}
+
+
+// -------------------------------------------------------------------------------------------------
+//
+// Multithreaded intensity clipper.
+//
+// For axis=AXIS_TIME and AXIS_FREQ, the clipping groups (rows or columns) are independent, so the
+// array is split into blocks of rows or columns, and apply_intensity_clipper() is called on each
+// block in its own thread.  For axis=AXIS_NONE, the mean/rms are computed by a parallel reduction:
+// each thread runs a visitor (from kernels/mean_variance.hpp) over a block of rows, and the partial
+// sums are combined pairwise in a tree.
+
+
+// Returns a visitor whose accumulators are summed over the whole (nfreq, nt) array.
+template<typename V>
+static V parallel_visit_2d(int nthreads, const V &v0, const float *intensity, const float *weights, int nfreq, int nt, int stride)
+{
+    int n = parallel_nthreads(nthreads, nfreq, 1);
+    vector<V> partial_sums(n, v0);
+
+    parallel_for(nthreads, nfreq, 1, [&](int ithread, int f0, int f1) {
+	_kernel_visit_2d<1,1> (partial_sums[ithread], intensity + f0*stride, weights + f0*stride, f1-f0, nt, stride);
+    });
+
+    for (int d = 1; d < n; d *= 2)
+	for (int i = 0; i+d < n; i += 2*d)
+	    partial_sums[i].merge(partial_sums[i+d]);
+
+    return partial_sums[0];
+}
+
 
-    auto kernel = global_intensity_clipper_kernel_table.get_kernel(axis, Df, Dt, two_pass);
+// Parallel version of _kernel_clip_2d().  The array is downsampled first (if Df > 1 or Dt > 1), and the
+// iteration logic (including early termination) is the same as _kernel_wrms_iterate_2d().
+template<bool TwoPass>
+static void parallel_clip_2d(int nthreads, const float *intensity, float *weights, int nfreq, int nt, int stride, int niter, double sigma, double iter_sigma, int Df, int Dt)
+{
+    static constexpr int S = constants::single_precision_simd_length;
+
+    parallel_downsampler ds(nthreads, intensity, weights, nfreq, nt, stride, Df, Dt);
+
+    simd_t<float,S> mean, rms;
+
+    if (!TwoPass) {
+	auto v = parallel_visit_2d(nthreads, _mean_variance_visitor<float,S,false,false> (nullptr, nullptr), ds.intensity, ds.weights, ds.nfreq_ds, ds.nt_ds, ds.stride);
+	v.get_mean_rms(mean, rms);
+    }
+    else {
+	auto v = parallel_visit_2d(nthreads, _mean_visitor<float,S,false,false> (nullptr, nullptr), ds.intensity, ds.weights, ds.nfreq_ds, ds.nt_ds, ds.stride);
+	mean = v.get_mean();
+
+	auto vv = parallel_visit_2d(nthreads, _variance_visitor<float,S> (mean), ds.intensity, ds.weights, ds.nfreq_ds, ds.nt_ds, ds.stride);
+	rms = vv.get_variance().sqrt();
+    }
 
-    kernel(intensity, weights, nfreq, nt, stride, niter, sigma, iter_sigma, ds_intensity, ds_weights);
+    for (int iter = 1; iter < niter; iter++) {
+	simd_t<float,S> thresh = simd_t<float,S>(iter_sigma) * rms;
+	auto v = parallel_visit_2d(nthreads, _mean_variance_iterator<float,S> (mean, thresh), ds.intensity, ds.weights, ds.nfreq_ds, ds.nt_ds, ds.stride);
 
-    free(ds_intensity);
-    free(ds_weights);
+	simd_t<float,S> prev_mean = mean;
+	simd_t<float,S> prev_rms = rms;
+	v.get_mean_rms(mean, rms);
+
+	if (_wrms_converged(prev_mean, prev_rms, mean, rms))
+	    break;
+    }
+
+    simd_t<float,S> thresh = simd_t<float,S>(sigma) * rms;
+
+    parallel_for(nthreads, ds.nfreq_ds, 1, [&](int ithread, int f0, int f1) {
+	_kernel_intensity_mask_2d<float,S,1,1> (ds.weights + f0*ds.stride, ds.intensity + f0*ds.stride, mean, thresh, f1-f0, ds.nt_ds, ds.stride, ds.stride);
+    });
+
+    ds.upsample_mask(weights, stride);
 }
 
 
-template<typename T, unsigned int S>
-inline void _weighted_mean_and_rms(simd_t<T,S> &mean, simd_t<T,S> &rms, const float *intensity, const float *weights, int nfreq, int nt, int stride, int niter, double sigma, bool two_pass)
+// externally visible
+void apply_intensity_clipper_parallel(int nthreads, const float *intensity, float *weights, int nfreq, int nt, int stride, axis_type axis, double sigma, int niter, double iter_sigma, int Df, int Dt, bool two_pass, bool robust)
 {
-    check_params("rf_pipelines: weighted_mean_and_rms()", 1, 1, AXIS_NONE, nfreq, nt, stride, sigma, niter, sigma);
+    static constexpr int S = constants::single_precision_simd_length;
+
+    check_params("rf_pipelines: apply_intensity_clipper_parallel()", Df, Dt, axis, nfreq, nt, stride, sigma, niter, iter_sigma, two_pass, robust);
+
+    if (_unlikely(!intensity))
+	throw runtime_error("rf_pipelines: apply_intensity_clipper_parallel(): NULL intensity pointer");
+    if (_unlikely(!weights))
+	throw runtime_error("rf_pipelines: apply_intensity_clipper_parallel(): NULL weights pointer");
+
+    if (axis == AXIS_TIME) {
+	parallel_for(nthreads, nfreq, Df, [&](int ithread, int f0, int f1) {
+	    apply_intensity_clipper(intensity + f0*stride, weights + f0*stride, f1-f0, nt, stride, axis, sigma, niter, iter_sigma, Df, Dt, two_pass, robust);
+	});
+	return;
+    }
+
+    if (axis == AXIS_FREQ) {
+	// Column blocks are multiples of the largest simd length, if possible, so that each block gets the same kernel.
+	int g = (nt % (max_dispatch_simd_length * Dt)) ? (S * Dt) : (max_dispatch_simd_length * Dt);
+
+	parallel_for(nthreads, nt, g, [&](int ithread, int t0, int t1) {
+	    apply_intensity_clipper(intensity + t0, weights + t0, nfreq, t1-t0, stride, axis, sigma, niter, iter_sigma, Df, Dt, two_pass, robust);
+	});
+	return;
+    }
+
+    // The robust clipper needs the median of the whole array, so it isn't parallelized.
+    if (robust) {
+	apply_intensity_clipper(intensity, weights, nfreq, nt, stride, axis, sigma, niter, iter_sigma, Df, Dt, two_pass, robust);
+	return;
+    }
+
+    // Same convention as make_intensity_clipper(): iter_sigma=0 means "same as sigma".
+    if (iter_sigma == 0.0)
+	iter_sigma = sigma;
 
     if (two_pass)
-	_kernel_noniterative_wrms_2d<T,S,1,1,false,false,true> (mean, rms, intensity, weights, nfreq, nt, stride, NULL, NULL);
+	parallel_clip_2d<true> (nthreads, intensity, weights, nfreq, nt, stride, niter, sigma, iter_sigma, Df, Dt);
     else
-	_kernel_noniterative_wrms_2d<T,S,1,1,false,false,false> (mean, rms, intensity, weights, nfreq, nt, stride, NULL, NULL);
+	parallel_clip_2d<false> (nthreads, intensity, weights, nfreq, nt, stride, niter, sigma, iter_sigma, Df, Dt);
+}
+
 
-    _kernel_wrms_iterate_2d<T,S> (mean, rms, intensity, weights, nfreq, nt, stride, niter, sigma);
+// The whole-array wrms kernels use the same dispatch rule as the (AXIS_NONE, Df=Dt=1) intensity_clipper
+// kernel in get_intensity_clipper_kernel(), so that weighted_mean_and_rms() agrees with the clipper.
+static inline bool wrms_uses_avx512(int nt)
+{
+#ifdef HAVE_AVX512
+    return (simd_dispatch_length() == 16) && (nt % 16 == 0);
+#else
+    return false;
+#endif
 }
 
 
-void weighted_mean_and_rms(float &mean, float &rms, const float *intensity, const float *weights, int nfreq, int nt, int stride, int niter, double sigma, bool two_pass)
+static void _weighted_mean_and_rms(float &mean, float &rms, float *mean_hint, const float *intensity, const float *weights, int nfreq, int nt, int stride, int niter, double sigma, bool two_pass)
 {
     static constexpr int S = constants::single_precision_simd_length;
 
+    check_params("rf_pipelines: weighted_mean_and_rms()", 1, 1, AXIS_NONE, nfreq, nt, stride, sigma, niter, sigma, two_pass, false);
+
     if (_unlikely(!intensity))
 	throw runtime_error("rf_pipelines: weighted_mean_and_rms(): NULL intensity pointer");
     if (_unlikely(!weights))
 	throw runtime_error("rf_pipelines: weighted_mean_and_rms(): NULL weights pointer");
 
-    simd_t<float,S> mean_x, rms_x;
-    _weighted_mean_and_rms(mean_x, rms_x, intensity, weights, nfreq, nt, stride, niter, sigma, two_pass);
+#ifdef HAVE_AVX512
+    if (wrms_uses_avx512(nt)) {
+	avx512_wrms_kernel(mean, rms, mean_hint, intensity, weights, nfreq, nt, stride, niter, sigma, two_pass);
+	return;
+    }
+#endif
 
-    mean = mean_x.template extract<0> ();
-    rms = rms_x.template extract<0> ();
+    _wrms_kernel<S> (mean, rms, mean_hint, intensity, weights, nfreq, nt, stride, niter, sigma, two_pass);
 }
 
 
-// The "wrms_hack_for_testing" is explained in test-cpp-python-equivalence.py
+void weighted_mean_and_rms(float &mean, float &rms, const float *intensity, const float *weights, int nfreq, int nt, int stride, int niter, double sigma, bool two_pass)
+{
+    _weighted_mean_and_rms(mean, rms, NULL, intensity, weights, nfreq, nt, stride, niter, sigma, two_pass);
+}
+
+
+// The "wrms_hack_for_testing" is explained in test-cpp-python-equivalence.py.
+// The length of the mean_hint is the simd length of the kernel which was used (8 or 16).
 
 void _wrms_hack_for_testing1(vector<float> &mean_hint, const float *intensity, const float *weights, int nfreq, int nt, int stride, int niter, double sigma, bool two_pass)
 {
-    static constexpr int S = constants::single_precision_simd_length;
-
-    simd_t<float,S> mean_x, rms_x;
-    _weighted_mean_and_rms(mean_x, rms_x, intensity, weights, nfreq, nt, stride, niter, sigma, two_pass);
+    float mean, rms;
 
-    mean_hint.resize(S);
-    mean_x.storeu(&mean_hint[0]);
+    mean_hint.resize(wrms_uses_avx512(nt) ? 16 : constants::single_precision_simd_length);
+    _weighted_mean_and_rms(mean, rms, &mean_hint[0], intensity, weights, nfreq, nt, stride, niter, sigma, two_pass);
 }
 
 
@@ -358,17 +541,17 @@ void _wrms_hack_for_testing2(float &mean, float &rms, const float *intensity, co
 {
     static constexpr int S = constants::single_precision_simd_length;
 
-    if (mean_hint.size() != S)
+    if (mean_hint.size() != (wrms_uses_avx512(nt) ? 16 : S))
 	throw runtime_error("rf_pipelines: wrong mean_hint size in _wrms_hack_for_testing2()");
 
-    _mean_variance_iterator<float,S> v(simd_t<float,S>::loadu(&mean_hint[0]), simd_t<float,S>(1.0e10));
-    _kernel_visit_2d<1,1> (v, intensity, weights, nfreq, nt, stride);
-
-    simd_t<float,S> mean_x, rms_x;
-    v.get_mean_rms(mean_x, rms_x);
+#ifdef HAVE_AVX512
+    if (wrms_uses_avx512(nt)) {
+	avx512_wrms_kernel_with_hint(mean, rms, &mean_hint[0], intensity, weights, nfreq, nt, stride);
+	return;
+    }
+#endif
 
-    mean = mean_x.template extract<0> ();
-    rms = rms_x.template extract<0> ();
+    _wrms_kernel_with_hint<S> (mean, rms, &mean_hint[0], intensity, weights, nfreq, nt, stride);
 }
 
 
@@ -0,0 +1,127 @@
+// S=16 kernel tables, for CPUs with AVX-512.
+//
+// This file is only compiled if HAVE_AVX512=y in Makefile.local, and is compiled with the extra
+// flags $(CPP_AVX512).  Everything in this file must only be called if simd_dispatch_length()
+// returns 16.  In particular, the tables are function-local statics, so that they aren't
+// constructed (which would execute AVX-512 code) when the library is loaded on an older CPU.
+//
+// Note that simd_helpers must provide simd_t<float,16> for this file to compile.
+//
+// One-definition rule: the kernel headers (and simd_helpers) contain inline functions and templates
+// which are also emitted by the S=8 source files.  If this file emitted them under the same names,
+// the linker could keep the AVX-512 copy, and S=8 code would crash with SIGILL on older CPUs.  To
+// prevent this, the kernel headers are included inside the private namespace 'rf_pipelines_avx512',
+// so that every symbol which they emit here has a distinct mangled name.  The system headers (and
+// rf_pipelines_internals.hpp) are included beforehand in the usual way; the kernels only use them
+// through their declarations.  Only symbols from the private namespace (and the getters
+// below) should appear in kernel_tables_avx512.o; this can be checked with 'nm -C'.
+
+#include <immintrin.h>
+#include <algorithm>
+#include <cmath>
+#include <cstdint>
+#include <cstring>
+#include <iostream>
+#include <limits>
+#include <random>
+#include <sstream>
+#include <stdexcept>
+#include <string>
+#include <type_traits>
+#include <vector>
+
+#include "rf_pipelines_internals.hpp"
+
+namespace rf_pipelines_avx512 {
+    namespace rf_pipelines { using namespace ::rf_pipelines; }
+
+#include "kernels/kernel_tables.hpp"
+}
+
+
+// The kernels call clip_1d() (defined in std_dev_clippers.cpp) by its unqualified name, so a private
+// version is defined here which forwards to the public one.  Note that smask_t<float,1> is an alias
+// for a builtin integer type, so the two declarations below have the same signature.
+
+namespace rf_pipelines {
+    extern void clip_1d(int n, float *tmp_sd, rf_pipelines_avx512::rf_pipelines::smask_t<float,1> *tmp_valid, double sigma, int niter, double iter_sigma);
+}
+
+void rf_pipelines_avx512::rf_pipelines::clip_1d(int n, float *tmp_sd, smask_t<float,1> *tmp_valid, double sigma, int niter, double iter_sigma)
+{
+    ::rf_pipelines::clip_1d(n, tmp_sd, tmp_valid, sigma, niter, iter_sigma);
+}
+
+using namespace std;
+
+namespace rf_pipelines {
+#if 0
+};  // pacify emacs c-mode!
+#endif
+
+
+// Shorthand for the private namespace.
+namespace avx512 = rf_pipelines_avx512::rf_pipelines;
+
+
+// The getters below are declared in kernels/kernel_tables.hpp, which is only included in the private
+// namespace here, so the kernel types are spelled with the avx512:: prefix.  These are the same types
+// as the public ones, except that the std_dev_clipper (and std_dev) kernels take the private (but identical)
+// definition of std_dev_clipper_buffers<float> by reference.
+
+
+// externally visible (declared in kernels/kernel_tables.hpp)
+avx512::intensity_clipper_kernel_t get_avx512_intensity_clipper_kernel(axis_type axis, int Df, int Dt, bool two_pass)
+{
+    static const avx512::intensity_clipper_kernel_table<16> table;
+    return table.get_kernel(axis, Df, Dt, two_pass);
+}
+
+
+// externally visible (declared in kernels/kernel_tables.hpp)
+avx512::std_dev_clipper_kernel_t get_avx512_std_dev_clipper_kernel(axis_type axis, int Df, int Dt, bool two_pass)
+{
+    static const avx512::std_dev_clipper_kernel_table<16> table;
+    return table.get_kernel(axis, Df, Dt, two_pass);
+}
+
+
+// externally visible (declared in kernels/kernel_tables.hpp)
+avx512::std_dev_kernel_t get_avx512_std_dev_kernel(axis_type axis, int Df, int Dt, bool two_pass)
+{
+    static const avx512::std_dev_clipper_kernel_table<16> table;
+    return table.get_sd_kernel(axis, Df, Dt, two_pass);
+}
+
+
+// externally visible (declared in kernels/kernel_tables.hpp)
+avx512::detrending_kernel_t get_avx512_detrending_kernel(int axis, int polydeg, detrender_precision precision)
+{
+    static const avx512::detrending_kernel_table<16> table;
+    return table.get_kernel(axis, polydeg, precision);
+}
+
+
+// externally visible (declared in kernels/kernel_tables.hpp)
+avx512::downsampling_kernel_t get_avx512_downsampling_kernel(int Df, int Dt)
+{
+    static const avx512::downsampling_kernel_table<16> table;
+    return table.get_kernel(Df, Dt);
+}
+
+
+// externally visible (declared in kernels/kernel_tables.hpp)
+void avx512_wrms_kernel(float &mean, float &rms, float *mean_hint, const float *intensity, const float *weights, int nfreq, int nt, int stride, int niter, double sigma, bool two_pass)
+{
+    avx512::_wrms_kernel<16> (mean, rms, mean_hint, intensity, weights, nfreq, nt, stride, niter, sigma, two_pass);
+}
+
+
+// externally visible (declared in kernels/kernel_tables.hpp)
+void avx512_wrms_kernel_with_hint(float &mean, float &rms, const float *mean_hint, const float *intensity, const float *weights, int nfreq, int nt, int stride)
+{
+    avx512::_wrms_kernel_with_hint<16> (mean, rms, mean_hint, intensity, weights, nfreq, nt, stride);
+}
+
+
+}  // namespace rf_pipelines
@@ -4,6 +4,7 @@
 #include <simd_helpers/simd_float32.hpp>
 #include <simd_helpers/simd_ntuple.hpp>
 #include <simd_helpers/udsample.hpp>
+#include <cstring>
 
 
 namespace rf_pipelines {
@@ -12,6 +13,7 @@ namespace rf_pipelines {
 #endif
 
 template<typename T, unsigned int S> using simd_t = simd_helpers::simd_t<T,S>;
+template<typename T, unsigned int S> using smask_t = simd_helpers::smask_t<T,S>;
 template<typename T, unsigned int S, unsigned int D> using simd_ntuple = simd_helpers::simd_ntuple<T,S,D>;
 
 
@@ -148,7 +150,10 @@ inline void _kernel_downsample_2d(T *out_intensity, T *out_weights, int out_stri
 	    simd_t<T,S> ds_wival, ds_wval;
 	    _kernel_downsample<T,S,Df,Dt> (ds_wival, ds_wval, in_irow + it*Dt, in_wrow + it*Dt, in_stride);
 
-	    simd_t<T,S> ds_ival = ds_wival / blendv(ds_wval.compare_gt(zero), ds_wval, one);
+	    // Zero-weight samples get intensity +0, independent of the sign of the (zero-weighted) input
+	    // intensities.  Thus skipping fully masked rows doesn't change the output (see chunk_mask_info).
+	    smask_t<T,S> valid = ds_wval.compare_gt(zero);
+	    simd_t<T,S> ds_ival = (ds_wival / blendv(valid, ds_wval, one)).apply_mask(valid);
 	    ds_ival.storeu(out_irow + it);
 	    ds_wval.storeu(out_wrow + it);
 	}
@@ -156,6 +161,143 @@ inline void _kernel_downsample_2d(T *out_intensity, T *out_weights, int out_stri
 }
 
 
+// -------------------------------------------------------------------------------------------------
+//
+// _kernel_downsample_generic<T,S> (out_intensity, out_weights, out_stride, in_intensity, in_weights, in_nfreq, in_nt, in_stride, Df, Dt)
+//
+// Handles downsampling factors (Df,Dt) which need not be powers of two, in a single pass over the input.
+// Caller must check that nfreq is divisible by Df, and nt is divisible by (Dt*S).
+//
+// There are two cases, depending on whether Dt is smaller than the simd length:
+//
+//   - If Dt < S, then a block of S output samples corresponds to Dt simd words of input, which are
+//     summed over the Df input rows with simd arithmetic.  The sums are then split into S segments of
+//     length Dt (the only scalar part of the kernel, which is a factor Df smaller than the input).
+//
+//   - If Dt >= S, then each output sample is a sum over Df rows and Dt consecutive input samples.
+//     The sum is done with (unaligned) simd loads, a scalar loop over the last (Dt % S) samples,
+//     and a horizontal_sum().
+//
+// In both cases, the intensity is normalized in the same way as _kernel_downsample_2d().
+
+
+template<typename T, unsigned int S>
+inline void _kernel_downsample_generic_short(T *out_irow, T *out_wrow, const T *in_irow, const T *in_wrow, int in_stride, int out_nt, int Df, int Dt)
+{
+    const simd_t<T,S> zero = simd_t<T,S>::zero();
+    const simd_t<T,S> one = simd_t<T,S> (1.0);
+
+    simd_t<T,S> acc_wi[S];
+    simd_t<T,S> acc_w[S];
+    T buf_wi[S*S];
+    T buf_w[S*S];
+
+    for (int it = 0; it < out_nt; it += S) {
+	for (int k = 0; k < Dt; k++) {
+	    acc_wi[k] = zero;
+	    acc_w[k] = zero;
+	}
+
+	for (int r = 0; r < Df; r++) {
+	    const T *ip = in_irow + r*in_stride + it*Dt;
+	    const T *wp = in_wrow + r*in_stride + it*Dt;
+
+	    for (int k = 0; k < Dt; k++) {
+		simd_t<T,S> ival = simd_t<T,S>::loadu(ip + k*S);
+		simd_t<T,S> wval = simd_t<T,S>::loadu(wp + k*S);
+		acc_wi[k] += wval * ival;
+		acc_w[k] += wval;
+	    }
+	}
+
+	for (int k = 0; k < Dt; k++) {
+	    acc_wi[k].storeu(buf_wi + k*S);
+	    acc_w[k].storeu(buf_w + k*S);
+	}
+
+	for (int s = 0; s < int(S); s++) {
+	    T ds_wi = 0;
+	    T ds_w = 0;
+
+	    for (int k = s*Dt; k < (s+1)*Dt; k++) {
+		ds_wi += buf_wi[k];
+		ds_w += buf_w[k];
+	    }
+
+	    buf_wi[s] = ds_wi;
+	    buf_w[s] = ds_w;
+	}
+
+	simd_t<T,S> ds_wival = simd_t<T,S>::loadu(buf_wi);
+	simd_t<T,S> ds_wval = simd_t<T,S>::loadu(buf_w);
+	// As in _kernel_downsample_2d(), zero-weight samples get intensity +0.
+	smask_t<T,S> valid = ds_wval.compare_gt(zero);
+	simd_t<T,S> ds_ival = (ds_wival / blendv(valid, ds_wval, one)).apply_mask(valid);
+
+	ds_ival.storeu(out_irow + it);
+	ds_wval.storeu(out_wrow + it);
+    }
+}
+
+
+template<typename T, unsigned int S>
+inline void _kernel_downsample_generic_long(T *out_irow, T *out_wrow, const T *in_irow, const T *in_wrow, int in_stride, int out_nt, int Df, int Dt)
+{
+    const simd_t<T,S> zero = simd_t<T,S>::zero();
+    const int nv = Dt / S;   // number of full simd words per output sample
+
+    for (int it = 0; it < out_nt; it++) {
+	simd_t<T,S> acc_wi = zero;
+	simd_t<T,S> acc_w = zero;
+	T tail_wi = 0;
+	T tail_w = 0;
+
+	for (int r = 0; r < Df; r++) {
+	    const T *ip = in_irow + r*in_stride + it*Dt;
+	    const T *wp = in_wrow + r*in_stride + it*Dt;
+
+	    for (int k = 0; k < nv; k++) {
+		simd_t<T,S> ival = simd_t<T,S>::loadu(ip + k*S);
+		simd_t<T,S> wval = simd_t<T,S>::loadu(wp + k*S);
+		acc_wi += wval * ival;
+		acc_w += wval;
+	    }
+
+	    for (int k = nv*S; k < Dt; k++) {
+		tail_wi += wp[k] * ip[k];
+		tail_w += wp[k];
+	    }
+	}
+
+	T ds_wi = acc_wi.horizontal_sum().template extract<0> () + tail_wi;
+	T ds_w = acc_w.horizontal_sum().template extract<0> () + tail_w;
+
+	out_irow[it] = (ds_w > 0) ? (ds_wi / ds_w) : ds_wi;
+	out_wrow[it] = ds_w;
+    }
+}
+
+
+template<typename T, unsigned int S>
+inline void _kernel_downsample_generic(T *out_intensity, T *out_weights, int out_stride, const T *in_intensity, const T *in_weights, int in_nfreq, int in_nt, int in_stride, int Df, int Dt)
+{
+    int out_nfreq = in_nfreq / Df;
+    int out_nt = in_nt / Dt;
+
+    for (int ifreq = 0; ifreq < out_nfreq; ifreq++) {
+	T *out_irow = out_intensity + ifreq * out_stride;
+	T *out_wrow = out_weights + ifreq * out_stride;
+	const T *in_irow = in_intensity + (ifreq*Df) * in_stride;
+	const T *in_wrow = in_weights + (ifreq*Df) * in_stride;
+
+	if (Dt < int(S))
+	    _kernel_downsample_generic_short<T,S> (out_irow, out_wrow, in_irow, in_wrow, in_stride, out_nt, Df, Dt);
+	else
+	    _kernel_downsample_generic_long<T,S> (out_irow, out_wrow, in_irow, in_wrow, in_stride, out_nt, Df, Dt);
+    }
+}
+
+
 }  // namespace rf_pipelines
 
 #endif
@@ -0,0 +1,39 @@
+#ifndef _RF_PIPELINES_KERNELS_FRB_INJECTOR_HPP
+#define _RF_PIPELINES_KERNELS_FRB_INJECTOR_HPP
+
+#include <simd_helpers/simd_float32.hpp>
+
+namespace rf_pipelines {
+#if 0
+}; // pacify emacs c-mode
+#endif
+
+template<typename T, unsigned int S> using simd_t = simd_helpers::simd_t<T,S>;
+
+
+// -------------------------------------------------------------------------------------------------
+//
+// _kernel_accumulate_and_zero<T,S> (T *dst, T *src, int n)
+//
+// Adds the length-n array 'src' to 'dst', and sets 'src' to zero.  The frb_injector uses this
+// to add a scratch row (containing all pulses which overlap the chunk) to the intensity array.
+// The caller is responsible for checking that n is a multiple of S.
+
+
+template<typename T, unsigned int S>
+inline void _kernel_accumulate_and_zero(T *dst, T *src, int n)
+{
+    const simd_t<T,S> zero = simd_t<T,S>::zero();
+
+    for (int i = 0; i < n; i += S) {
+	simd_t<T,S> x = simd_t<T,S>::loadu(dst+i);
+	x += simd_t<T,S>::loadu(src+i);
+	x.storeu(dst+i);
+	zero.storeu(src+i);
+    }
+}
+
+
+}  // namespace rf_pipelines
+
+#endif
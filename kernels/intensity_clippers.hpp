@@ -64,35 +64,66 @@ inline void _kernel_noniterative_wrms_1d_t(simd_t<T,S> &mean, simd_t<T,S> &rms,
 // Note: the 'niter' argument to these kernels will be one less than the 'niter' argument
 // to intensity_clipper().  This is because the initial call to _kernel_noniterative_wrms()
 // counts as one iteration.
+//
+// Early termination: if an iteration leaves (mean, rms) exactly unchanged, then the set of
+// unmasked samples in the next iteration will be the same, so every further iteration is a
+// no-op and we can stop.  Since the stopping criterion is exact equality, the result is
+// bitwise identical to running all iterations.  (In the 1d_f case, we stop when all simd
+// lanes have converged.)
+//
+// The return value is the number of iterations performed, including the initial call to
+// _kernel_noniterative_wrms(), i.e. a number between 1 and niter.
 
 
 template<typename T, unsigned int S>
-inline void _kernel_wrms_iterate_2d(simd_t<T,S> &mean, simd_t<T,S> &rms, const T *intensity, const T *weights, int nfreq, int nt, int stride, int niter, double iter_sigma)
+inline bool _wrms_converged(const simd_t<T,S> &mean0, const simd_t<T,S> &rms0, const simd_t<T,S> &mean1, const simd_t<T,S> &rms1)
+{
+    return mean0.compare_eq(mean1).bitwise_and(rms0.compare_eq(rms1)).is_all_ones();
+}
+
+template<typename T, unsigned int S>
+inline int _kernel_wrms_iterate_2d(simd_t<T,S> &mean, simd_t<T,S> &rms, const T *intensity, const T *weights, int nfreq, int nt, int stride, int niter, double iter_sigma)
 {
     for (int iter = 1; iter < niter; iter++) {
 	simd_t<T,S> thresh = simd_t<T,S>(iter_sigma) * rms;
 	_mean_variance_iterator<T,S> v(mean, thresh);
 	_kernel_visit_2d<1,1> (v, intensity, weights, nfreq, nt, stride);
+
+	simd_t<T,S> prev_mean = mean;
+	simd_t<T,S> prev_rms = rms;
 	v.get_mean_rms(mean, rms);
+
+	if (_wrms_converged(prev_mean, prev_rms, mean, rms))
+	    return iter + 1;
     }
+
+    return niter;
 }
 
 // Placeholder for future expansion
 template<typename T, unsigned int S>
-inline void _kernel_wrms_iterate_1d_t(simd_t<T,S> &mean, simd_t<T,S> &rms, const T *intensity, const T *weights, int nt, int niter, double iter_sigma)
+inline int _kernel_wrms_iterate_1d_t(simd_t<T,S> &mean, simd_t<T,S> &rms, const T *intensity, const T *weights, int nt, int niter, double iter_sigma)
 {
-    _kernel_wrms_iterate_2d<T,S> (mean, rms, intensity, weights, 1, nt, 0, niter, iter_sigma);
+    return _kernel_wrms_iterate_2d<T,S> (mean, rms, intensity, weights, 1, nt, 0, niter, iter_sigma);
 }
 
 template<typename T, unsigned int S>
-inline void _kernel_wrms_iterate_1d_f(simd_t<T,S> &mean, simd_t<T,S> &rms, const T *intensity, const T *weights, int nfreq, int stride, int niter, double iter_sigma)
+inline int _kernel_wrms_iterate_1d_f(simd_t<T,S> &mean, simd_t<T,S> &rms, const T *intensity, const T *weights, int nfreq, int stride, int niter, double iter_sigma)
 {
     for (int iter = 1; iter < niter; iter++) {
 	simd_t<T,S> thresh = simd_t<T,S>(iter_sigma) * rms;
 	_mean_variance_iterator<T,S> v(mean, thresh);
 	_kernel_visit_1d_f<1,1> (v, intensity, weights, nfreq, stride);	
+
+	simd_t<T,S> prev_mean = mean;
+	simd_t<T,S> prev_rms = rms;
 	v.get_mean_rms(mean, rms);
+
+	if (_wrms_converged(prev_mean, prev_rms, mean, rms))
+	    return iter + 1;
     }
+
+    return niter;
 }
 
 
@@ -162,35 +193,41 @@ inline void _kernel_intensity_mask_1d_f(T *weights, const T *ds_intensity, simd_
 // -------------------------------------------------------------------------------------------------
 //
 // _kernel_clip_2d(): "Bottom line" routine which is wrapped by intensity_clipper(AXIS_NONE).
+//
+// All _kernel_clip_*() routines return the number of iterations performed, averaged over
+// independent clipping groups (rows, simd-sized column blocks, or the whole array).
 
 
 // Downsampled version: ds_intensity must be non-NULL, ds_weights must be non-NULL if niter > 1.
 template<typename T, unsigned int S, unsigned int Df, unsigned int Dt, bool TwoPass, typename std::enable_if<((Df>1) || (Dt>1)),int>::type = 0>
-inline void _kernel_clip_2d(const T *intensity, T *weights, int nfreq, int nt, int stride, int niter, double sigma, double iter_sigma, T *ds_intensity, T *ds_weights)
+inline double _kernel_clip_2d(const T *intensity, T *weights, int nfreq, int nt, int stride, int niter, double sigma, double iter_sigma, T *ds_intensity, T *ds_weights)
 {
     simd_t<T,S> mean, rms;
+    int n = 1;
 
     if (niter == 1)
 	_kernel_noniterative_wrms_2d<T,S,Df,Dt,true,false,TwoPass> (mean, rms, intensity, weights, nfreq, nt, stride, ds_intensity, ds_weights);
     else {
 	_kernel_noniterative_wrms_2d<T,S,Df,Dt,true,true,TwoPass> (mean, rms, intensity, weights, nfreq, nt, stride, ds_intensity, ds_weights);
-	_kernel_wrms_iterate_2d<T,S> (mean, rms, ds_intensity, ds_weights, nfreq/Df, nt/Dt, nt/Dt, niter, iter_sigma);
+	n = _kernel_wrms_iterate_2d<T,S> (mean, rms, ds_intensity, ds_weights, nfreq/Df, nt/Dt, nt/Dt, niter, iter_sigma);
     }
 
     simd_t<T,S> thresh = simd_t<T,S>(sigma) * rms;
     _kernel_intensity_mask_2d<T,S,Df,Dt> (weights, ds_intensity, mean, thresh, nfreq, nt, stride, nt/Dt);
+    return n;
 }
 
 // Non-downsampled version: ds_intensity, ds_weights can be NULL
 template<typename T, unsigned int S, unsigned int Df, unsigned int Dt, bool TwoPass, typename std::enable_if<((Df==1) && (Dt==1)),int>::type = 0>
-inline void _kernel_clip_2d(const T *intensity, T *weights, int nfreq, int nt, int stride, int niter, double sigma, double iter_sigma, T *ds_intensity, T *ds_weights)
+inline double _kernel_clip_2d(const T *intensity, T *weights, int nfreq, int nt, int stride, int niter, double sigma, double iter_sigma, T *ds_intensity, T *ds_weights)
 {
     simd_t<T,S> mean, rms;
     _kernel_noniterative_wrms_2d<T,S,1,1,false,false,TwoPass> (mean, rms, intensity, weights, nfreq, nt, stride, NULL, NULL);
-    _kernel_wrms_iterate_2d<T,S> (mean, rms, intensity, weights, nfreq, nt, stride, niter, iter_sigma);
+    int n = _kernel_wrms_iterate_2d<T,S> (mean, rms, intensity, weights, nfreq, nt, stride, niter, iter_sigma);
 
     simd_t<T,S> thresh = simd_t<T,S>(sigma) * rms;
     _kernel_intensity_mask_2d<T,S,Df,Dt> (weights, intensity, mean, thresh, nfreq, nt, stride, stride);
+    return n;
 }
 
 
@@ -200,41 +237,48 @@ inline void _kernel_clip_2d(const T *intensity, T *weights, int nfreq, int nt, i
 
 
 template<typename T, unsigned int S, unsigned int Df, unsigned int Dt, bool TwoPass, typename std::enable_if<((Df>1) || (Dt>1)),int>::type = 0>
-inline void _kernel_clip_1d_t(const T *intensity, T *weights, int nfreq, int nt, int stride, int niter, double sigma, double iter_sigma, T *ds_intensity, T *ds_weights)
+inline double _kernel_clip_1d_t(const T *intensity, T *weights, int nfreq, int nt, int stride, int niter, double sigma, double iter_sigma, T *ds_intensity, T *ds_weights)
 {
     simd_t<T,S> mean, rms;
     simd_t<T,S> s = sigma;
 
-    if (niter > 1) {
-	for (int ifreq = 0; ifreq < nfreq; ifreq += Df) {
-	    _kernel_noniterative_wrms_1d_t<T,S,Df,Dt,true,true,TwoPass> (mean, rms, intensity + ifreq*stride, weights + ifreq*stride, nt, stride, ds_intensity, ds_weights);
-	    _kernel_wrms_iterate_1d_t<T,S> (mean, rms, ds_intensity, ds_weights, nt/Dt, niter, iter_sigma);
-	    _kernel_intensity_mask_1d_t<T,S,Df,Dt> (weights + ifreq*stride, ds_intensity, mean, s * rms, nt, stride, nt/Dt);
-	}
-    }
-    else {
+    if (niter == 1) {
 	for (int ifreq = 0; ifreq < nfreq; ifreq += Df) {
 	    _kernel_noniterative_wrms_1d_t<T,S,Df,Dt,true,false,TwoPass> (mean, rms, intensity + ifreq*stride, weights + ifreq*stride, nt, stride, ds_intensity, ds_weights);
 	    _kernel_intensity_mask_1d_t<T,S,Df,Dt> (weights + ifreq*stride, ds_intensity, mean, s * rms, nt, stride, nt/Dt);
 	}
+	return 1.0;
+    }
+
+    int n = 0;
+
+    for (int ifreq = 0; ifreq < nfreq; ifreq += Df) {
+	_kernel_noniterative_wrms_1d_t<T,S,Df,Dt,true,true,TwoPass> (mean, rms, intensity + ifreq*stride, weights + ifreq*stride, nt, stride, ds_intensity, ds_weights);
+	n += _kernel_wrms_iterate_1d_t<T,S> (mean, rms, ds_intensity, ds_weights, nt/Dt, niter, iter_sigma);
+	_kernel_intensity_mask_1d_t<T,S,Df,Dt> (weights + ifreq*stride, ds_intensity, mean, s * rms, nt, stride, nt/Dt);
     }
+
+    return double(n) / double(nfreq/Df);
 }
 
 
 template<typename T, unsigned int S, unsigned int Df, unsigned int Dt, bool TwoPass, typename std::enable_if<((Df==1) && (Dt==1)),int>::type = 0>
-inline void _kernel_clip_1d_t(const T *intensity, T *weights, int nfreq, int nt, int stride, int niter, double sigma, double iter_sigma, T *ds_intensity, T *ds_weights)
+inline double _kernel_clip_1d_t(const T *intensity, T *weights, int nfreq, int nt, int stride, int niter, double sigma, double iter_sigma, T *ds_intensity, T *ds_weights)
 {
     simd_t<T,S> mean, rms;
     simd_t<T,S> s = sigma;
+    int n = 0;
 
     for (int ifreq = 0; ifreq < nfreq; ifreq++) {
 	const T *irow = intensity + ifreq * stride;
 	T *wrow = weights + ifreq * stride;
 
 	_kernel_noniterative_wrms_1d_t<T,S,1,1,false,false,TwoPass> (mean, rms, irow, wrow, nt, stride, NULL, NULL);
-	_kernel_wrms_iterate_1d_t<T,S> (mean, rms, irow, wrow, nt, niter, iter_sigma);
+	n += _kernel_wrms_iterate_1d_t<T,S> (mean, rms, irow, wrow, nt, niter, iter_sigma);
 	_kernel_intensity_mask_1d_t<T,S,1,1> (wrow, irow, mean, s * rms, nt, stride, stride);
     }
+
+    return double(n) / double(nfreq);
 }
 
 
@@ -244,41 +288,48 @@ inline void _kernel_clip_1d_t(const T *intensity, T *weights, int nfreq, int nt,
 
 
 template<typename T, unsigned int S, unsigned int Df, unsigned int Dt, bool TwoPass, typename std::enable_if<((Df > 1) || (Dt > 1)),int>::type = 0>
-inline void _kernel_clip_1d_f(const T *intensity, T *weights, int nfreq, int nt, int stride, int niter, double sigma, double iter_sigma, T *ds_intensity, T *ds_weights)
+inline double _kernel_clip_1d_f(const T *intensity, T *weights, int nfreq, int nt, int stride, int niter, double sigma, double iter_sigma, T *ds_intensity, T *ds_weights)
 {
     simd_t<T,S> mean, rms;	
     simd_t<T,S> s = sigma;
 
-    if (niter > 1) {
-	for (int it = 0; it < nt; it += Dt*S) {
-	    _kernel_noniterative_wrms_1d_f<T,S,Df,Dt,true,true,TwoPass> (mean, rms, intensity + it, weights + it, nfreq, stride, ds_intensity, ds_weights);
-	    _kernel_wrms_iterate_1d_f<T,S> (mean, rms, ds_intensity, ds_weights, nfreq/Df, S, niter, iter_sigma);
-	    _kernel_intensity_mask_1d_f<T,S,Df,Dt> (weights + it, ds_intensity, mean, s * rms, nfreq, stride, S);
-	}
-    }
-    else {
+    if (niter == 1) {
 	for (int it = 0; it < nt; it += Dt*S) {
 	    _kernel_noniterative_wrms_1d_f<T,S,Df,Dt,true,false,TwoPass> (mean, rms, intensity + it, weights + it, nfreq, stride, ds_intensity, ds_weights);
 	    _kernel_intensity_mask_1d_f<T,S,Df,Dt> (weights + it, ds_intensity, mean, s * rms, nfreq, stride, S);
 	}
+	return 1.0;
+    }
+
+    int n = 0;
+
+    for (int it = 0; it < nt; it += Dt*S) {
+	_kernel_noniterative_wrms_1d_f<T,S,Df,Dt,true,true,TwoPass> (mean, rms, intensity + it, weights + it, nfreq, stride, ds_intensity, ds_weights);
+	n += _kernel_wrms_iterate_1d_f<T,S> (mean, rms, ds_intensity, ds_weights, nfreq/Df, S, niter, iter_sigma);
+	_kernel_intensity_mask_1d_f<T,S,Df,Dt> (weights + it, ds_intensity, mean, s * rms, nfreq, stride, S);
     }
+
+    return double(n) / double(nt/(Dt*S));
 }
 
 
 template<typename T, unsigned int S, unsigned int Df, unsigned int Dt, bool TwoPass, typename std::enable_if<((Df == 1) && (Dt == 1)),int>::type = 0>
-inline void _kernel_clip_1d_f(const T *intensity, T *weights, int nfreq, int nt, int stride, int niter, double sigma, double iter_sigma, T *ds_intensity, T *ds_weights)
+inline double _kernel_clip_1d_f(const T *intensity, T *weights, int nfreq, int nt, int stride, int niter, double sigma, double iter_sigma, T *ds_intensity, T *ds_weights)
 {
     simd_t<T,S> mean, rms;	
     simd_t<T,S> s = sigma;
+    int n = 0;
 
     for (int it = 0; it < nt; it += S) {
 	const T *icol = intensity + it;
 	T *wcol = weights + it;
 	
 	_kernel_noniterative_wrms_1d_f<T,S,1,1,false,false,TwoPass> (mean, rms, icol, wcol, nfreq, stride, NULL, NULL);
-	_kernel_wrms_iterate_1d_f<T,S> (mean, rms, icol, wcol, nfreq, stride, niter, iter_sigma);
+	n += _kernel_wrms_iterate_1d_f<T,S> (mean, rms, icol, wcol, nfreq, stride, niter, iter_sigma);
 	_kernel_intensity_mask_1d_f<T,S,1,1> (wcol, icol, mean, s * rms, nfreq, stride, stride);
     }
+
+    return double(n) / double(nt/S);
 }
 
 
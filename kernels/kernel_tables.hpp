@@ -0,0 +1,434 @@
+#ifndef _RF_PIPELINES_KERNELS_KERNEL_TABLES_HPP
+#define _RF_PIPELINES_KERNELS_KERNEL_TABLES_HPP
+
+// Kernel tables for the intensity_clipper, std_dev_clipper, polynomial_detrender, and wi_downsample().
+//
+// The tables are templated on the simd length S, so that they can be instantiated for S=8
+// (in the usual source files) and for S=16 (in kernel_tables_avx512.cpp, which is compiled
+// with AVX-512 flags).  See simd_dispatch.cpp for the runtime logic which chooses between them.
+//
+// Note that the tables are plain arrays which are filled in the constructor.  This is so that
+// the AVX-512 translation unit doesn't instantiate any non-kernel code (e.g. std::vector methods)
+// which could be shared with the rest of the library.
+
+#include "../rf_pipelines_internals.hpp"
+#include "intensity_clippers.hpp"
+#include "std_dev_clippers.hpp"
+#include "polyfit.hpp"
+#include "downsample.hpp"
+
+namespace rf_pipelines {
+#if 0
+}; // pacify emacs c-mode
+#endif
+
+
+// Largest value which can be returned by simd_dispatch_length().
+static constexpr int max_dispatch_simd_length = 16;
+
+
+// Caller must check that n is a power of two.
+inline int _kernel_table_ilog2(int n)
+{
+    int ret = 0;
+    while (n > 1) {
+	n >>= 1;
+	ret++;
+    }
+    return ret;
+}
+
+
+// -------------------------------------------------------------------------------------------------
+//
+// intensity_clipper_kernel_table<S>
+
+
+// kernel(intensity, weights, nfreq, nt_chunk, stride, niter, sigma, iter_sigma, ds_intensity, ds_weights)
+using intensity_clipper_kernel_t = double (*)(const float *, float *, int, int, int, int, double, double, float *, float *);
+
+
+// Fills shape-(3,2) array indexed by (axis, two_pass)
+template<unsigned int S, unsigned int Df, unsigned int Dt>
+inline void fill_2d_intensity_clipper_kernel_table(intensity_clipper_kernel_t *out)
+{
+    static_assert(AXIS_FREQ == 0, "expected AXIS_FREQ==0");
+    static_assert(AXIS_TIME == 1, "expected AXIS_TIME==1");
+    static_assert(AXIS_NONE == 2, "expected AXIS_NONE==2");
+
+    out[2*AXIS_FREQ] = _kernel_clip_1d_f<float,S,Df,Dt,false>;
+    out[2*AXIS_FREQ + 1] = _kernel_clip_1d_f<float,S,Df,Dt,true>;
+
+    out[2*AXIS_TIME] = _kernel_clip_1d_t<float,S,Df,Dt,false>;
+    out[2*AXIS_TIME + 1] = _kernel_clip_1d_t<float,S,Df,Dt,true>;
+
+    out[2*AXIS_NONE] = _kernel_clip_2d<float,S,Df,Dt,false>;
+    out[2*AXIS_NONE + 1] = _kernel_clip_2d<float,S,Df,Dt,true>;
+}
+
+
+// Fills shape-(NDt,3,2) array indexed by (Dt, axis, two_pass)
+template<unsigned int S, unsigned int Df, unsigned int NDt, typename std::enable_if<(NDt==0),int>::type = 0>
+inline void fill_3d_intensity_clipper_kernel_table(intensity_clipper_kernel_t *out) { }
+
+template<unsigned int S, unsigned int Df, unsigned int NDt, typename std::enable_if<(NDt>0),int>::type = 0>
+inline void fill_3d_intensity_clipper_kernel_table(intensity_clipper_kernel_t *out)
+{
+    fill_3d_intensity_clipper_kernel_table<S,Df,(NDt-1)> (out);
+    fill_2d_intensity_clipper_kernel_table<S,Df,(1<<(NDt-1))> (out + 6*(NDt-1));
+}
+
+
+// Fills shape-(NDf,NDt,3,2) array indexed by (Df, Dt, axis, two_pass)
+template<unsigned int S, unsigned int NDf, unsigned int NDt, typename std::enable_if<(NDf==0),int>::type = 0>
+inline void fill_4d_intensity_clipper_kernel_table(intensity_clipper_kernel_t *out) { }
+
+template<unsigned int S, unsigned int NDf, unsigned int NDt, typename std::enable_if<(NDf>0),int>::type = 0>
+inline void fill_4d_intensity_clipper_kernel_table(intensity_clipper_kernel_t *out)
+{
+    fill_4d_intensity_clipper_kernel_table<S,(NDf-1),NDt> (out);
+    fill_3d_intensity_clipper_kernel_table<S,(1<<(NDf-1)),NDt> (out + 6*(NDf-1)*NDt);
+}
+
+
+template<unsigned int S>
+struct intensity_clipper_kernel_table {
+    static constexpr int MaxDf = constants::max_specialized_frequency_downsampling;
+    static constexpr int MaxDt = constants::max_specialized_time_downsampling;
+    static constexpr int NDf = IntegerLog2<MaxDf>() + 1;
+    static constexpr int NDt = IntegerLog2<MaxDt>() + 1;
+
+    intensity_clipper_kernel_t kernels[6*NDf*NDt];
+
+    intensity_clipper_kernel_table()
+    {
+	fill_4d_intensity_clipper_kernel_table<S,NDf,NDt> (kernels);
+    }
+
+    // Caller must call check_params()!
+    inline intensity_clipper_kernel_t get_kernel(axis_type axis, int Df, int Dt, bool two_pass) const
+    {
+	int idf = _kernel_table_ilog2(Df);
+	int idt = _kernel_table_ilog2(Dt);
+
+	return kernels[6*(idf*NDt+idt) + 2*axis + (two_pass ? 1 : 0)];
+    }
+};
+
+
+// -------------------------------------------------------------------------------------------------
+//
+// std_dev_clipper_kernel_table<S>
+
+
+// kernel(buf, intensity, weights, nfreq, nt, stride, niter, sigma, iter_sigma)
+using std_dev_clipper_kernel_t = void (*)(const std_dev_clipper_buffers<float> &, const float *, float *, int, int, int, int, double, double);
+
+// The first step of the std_dev_clipper kernel, which computes buf.sd and buf.sd_valid, but doesn't clip.
+// sd_kernel(buf, intensity, weights, nfreq, nt, stride)
+using std_dev_kernel_t = void (*)(const std_dev_clipper_buffers<float> &, const float *, const float *, int, int, int);
+
+
+// Fills shape-(NDt,2,2) arrays indexed by (Dt,axis,two_pass)
+template<unsigned int S, unsigned int Df, unsigned int NDt, typename std::enable_if<(NDt==0),int>::type = 0>
+inline void fill_3d_std_dev_clipper_kernel_table(std_dev_clipper_kernel_t *out, std_dev_kernel_t *out_sd) { }
+
+template<unsigned int S, unsigned int Df, unsigned int NDt, typename std::enable_if<(NDt>0),int>::type = 0>
+inline void fill_3d_std_dev_clipper_kernel_table(std_dev_clipper_kernel_t *out, std_dev_kernel_t *out_sd)
+{
+    static_assert(AXIS_FREQ == 0, "expected AXIS_FREQ==0");
+    static_assert(AXIS_TIME == 1, "expected AXIS_TIME==1");
+
+    fill_3d_std_dev_clipper_kernel_table<S,Df,NDt-1> (out, out_sd);
+
+    constexpr unsigned int Dt = 1 << (NDt-1);
+    out[4*(NDt-1) + 2*AXIS_FREQ] = _kernel_std_dev_clip_freq_axis<float,S,Df,Dt,false>;
+    out[4*(NDt-1) + 2*AXIS_FREQ+1] = _kernel_std_dev_clip_freq_axis<float,S,Df,Dt,true>;
+    out[4*(NDt-1) + 2*AXIS_TIME] = _kernel_std_dev_clip_time_axis<float,S,Df,Dt,false>;
+    out[4*(NDt-1) + 2*AXIS_TIME+1] = _kernel_std_dev_clip_time_axis<float,S,Df,Dt,true>;
+
+    out_sd[4*(NDt-1) + 2*AXIS_FREQ] = _kernel_std_dev_f<float,S,Df,Dt,false>;
+    out_sd[4*(NDt-1) + 2*AXIS_FREQ+1] = _kernel_std_dev_f<float,S,Df,Dt,true>;
+    out_sd[4*(NDt-1) + 2*AXIS_TIME] = _kernel_std_dev_t<float,S,Df,Dt,false>;
+    out_sd[4*(NDt-1) + 2*AXIS_TIME+1] = _kernel_std_dev_t<float,S,Df,Dt,true>;
+}
+
+// Fills shape-(NDf,NDt,2,2) arrays indexed by (Df,Dt,axis,two_pass)
+template<unsigned int S, unsigned int NDf, unsigned int NDt, typename std::enable_if<(NDf==0),int>::type = 0>
+inline void fill_4d_std_dev_clipper_kernel_table(std_dev_clipper_kernel_t *out, std_dev_kernel_t *out_sd) { }
+
+template<unsigned int S, unsigned int NDf, unsigned int NDt, typename std::enable_if<(NDf>0),int>::type = 0>
+inline void fill_4d_std_dev_clipper_kernel_table(std_dev_clipper_kernel_t *out, std_dev_kernel_t *out_sd)
+{
+    fill_4d_std_dev_clipper_kernel_table<S,NDf-1,NDt> (out, out_sd);
+    fill_3d_std_dev_clipper_kernel_table<S,(1<<(NDf-1)),NDt> (out + 4*(NDf-1)*NDt, out_sd + 4*(NDf-1)*NDt);
+}
+
+
+template<unsigned int S>
+struct std_dev_clipper_kernel_table {
+    static constexpr int MaxDf = constants::max_specialized_frequency_downsampling;
+    static constexpr int MaxDt = constants::max_specialized_time_downsampling;
+    static constexpr int NDf = IntegerLog2<MaxDf>() + 1;
+    static constexpr int NDt = IntegerLog2<MaxDt>() + 1;
+
+    std_dev_clipper_kernel_t kernels[4*NDf*NDt];
+    std_dev_kernel_t sd_kernels[4*NDf*NDt];
+
+    std_dev_clipper_kernel_table()
+    {
+	fill_4d_std_dev_clipper_kernel_table<S,NDf,NDt> (kernels, sd_kernels);
+    }
+
+    // Caller must call check_params()!
+    inline std_dev_clipper_kernel_t get_kernel(axis_type axis, int Df, int Dt, bool two_pass) const
+    {
+	int idf = _kernel_table_ilog2(Df);
+	int idt = _kernel_table_ilog2(Dt);
+
+	return kernels[4*(idf*NDt+idt) + 2*axis + (two_pass ? 1 : 0)];
+    }
+
+    // Caller must call check_params()!
+    inline std_dev_kernel_t get_sd_kernel(axis_type axis, int Df, int Dt, bool two_pass) const
+    {
+	int idf = _kernel_table_ilog2(Df);
+	int idt = _kernel_table_ilog2(Dt);
+
+	return sd_kernels[4*(idf*NDt+idt) + 2*axis + (two_pass ? 1 : 0)];
+    }
+};
+
+
+// -------------------------------------------------------------------------------------------------
+//
+// detrending_kernel_table<S>
+
+
+// Usage: kernel(nfreq, nt, intensity, weights, stride, epsilon)
+using detrending_kernel_t = void (*)(int, int, float *, float *, int, double);
+
+
+// fill_detrending_kernel_table<S,N>(): fills shape (N,2,3) array with kernels.
+// The outer index is a polynomial degree 0 <= polydeg < N, the middle index is the axis,
+// and the inner index is the detrender_precision.  Double-precision kernels use simd length S/2.
+
+template<unsigned int S, unsigned int N, typename std::enable_if<(N==0),int>::type = 0>
+inline void fill_detrending_kernel_table(detrending_kernel_t *out) { }
+
+template<unsigned int S, unsigned int N, typename std::enable_if<(N>0),int>::type = 0>
+inline void fill_detrending_kernel_table(detrending_kernel_t *out)
+{
+    static_assert(AXIS_FREQ == 0, "polynomial_detrenders: current implementation assumes AXIS_FREQ==0");
+    static_assert(AXIS_TIME == 1, "polynomial_detrenders: current implementation assumes AXIS_TIME==1");
+    static_assert(PRECISION_FLOAT == 0, "polynomial_detrenders: current implementation assumes PRECISION_FLOAT==0");
+    static_assert(PRECISION_DOUBLE == 1, "polynomial_detrenders: current implementation assumes PRECISION_DOUBLE==1");
+    static_assert(PRECISION_MIXED == 2, "polynomial_detrenders: current implementation assumes PRECISION_MIXED==2");
+
+    fill_detrending_kernel_table<S,N-1> (out);
+
+    detrending_kernel_t *p = out + 6*(N-1);
+    p[3*AXIS_FREQ + PRECISION_FLOAT] = _kernel_detrend_f<float,S,N>;
+    p[3*AXIS_FREQ + PRECISION_DOUBLE] = _kernel_detrend_f<double,S/2,N>;
+    p[3*AXIS_FREQ + PRECISION_MIXED] = _kernel_detrend_f_mixed<S,N>;
+    p[3*AXIS_TIME + PRECISION_FLOAT] = _kernel_detrend_t<float,S,N>;
+    p[3*AXIS_TIME + PRECISION_DOUBLE] = _kernel_detrend_t<double,S/2,N>;
+    p[3*AXIS_TIME + PRECISION_MIXED] = _kernel_detrend_t_mixed<S,N>;
+}
+
+
+template<unsigned int S>
+struct detrending_kernel_table {
+    static constexpr int MaxDeg = constants::polynomial_detrender_max_degree;
+
+    detrending_kernel_t entries[6*MaxDeg+6];
+
+    detrending_kernel_table()
+    {
+	fill_detrending_kernel_table<S,MaxDeg+1> (entries);
+    }
+
+    // Caller must argument-check by calling check_params()!
+    inline detrending_kernel_t get_kernel(int axis, int polydeg, detrender_precision precision) const
+    {
+	return entries[6*polydeg + 3*axis + precision];
+    }
+};
+
+
+// -------------------------------------------------------------------------------------------------
+//
+// sliding_detrending_kernel_table<S>
+
+
+// Usage: kernel(nfreq, nt, intensity, weights, stride, pp_intensity, pp_weights, pp_stride, nt_step, nt_window, epsilon, scratch)
+using sliding_detrending_kernel_t = void (*)(int, int, float *, float *, int, const float *, const float *, int, int, int, double, float *);
+
+
+// fill_sliding_detrending_kernel_table<S,N>(): fills length-N array with kernels, indexed by polynomial degree.
+// The kernels are always double precision, with simd length S/2.
+
+template<unsigned int S, unsigned int N, typename std::enable_if<(N==0),int>::type = 0>
+inline void fill_sliding_detrending_kernel_table(sliding_detrending_kernel_t *out) { }
+
+template<unsigned int S, unsigned int N, typename std::enable_if<(N>0),int>::type = 0>
+inline void fill_sliding_detrending_kernel_table(sliding_detrending_kernel_t *out)
+{
+    fill_sliding_detrending_kernel_table<S,N-1> (out);
+    out[N-1] = _kernel_detrend_t_sliding<double,S/2,N>;
+}
+
+
+template<unsigned int S>
+struct sliding_detrending_kernel_table {
+    static constexpr int MaxDeg = constants::polynomial_detrender_max_degree;
+
+    sliding_detrending_kernel_t entries[MaxDeg+1];
+
+    sliding_detrending_kernel_table()
+    {
+	fill_sliding_detrending_kernel_table<S,MaxDeg+1> (entries);
+    }
+
+    // Caller must argument-check!
+    inline sliding_detrending_kernel_t get_kernel(int polydeg) const
+    {
+	return entries[polydeg];
+    }
+};
+
+
+// -------------------------------------------------------------------------------------------------
+//
+// downsampling_kernel_table<S>
+
+
+// Note: kernels/downsample.hpp defines
+//   _kernel_downsample_2d<T,S,Df,Dt> (out_intensity, out_weights, out_stride, in_intensity, in_nfreq, in_nt, in_stride)
+
+using downsampling_kernel_t = void (*) (float *, float *, int, const float *, const float *, int, int, int);
+
+
+template<unsigned int S, unsigned int Df, unsigned int MaxDt, typename std::enable_if<(MaxDt==0),int>::type = 0>
+inline void fill_1d_downsampling_kernel_table(downsampling_kernel_t *out) { }
+
+template<unsigned int S, unsigned int Df, unsigned int MaxDt, typename std::enable_if<(MaxDt>0),int>::type = 0>
+inline void fill_1d_downsampling_kernel_table(downsampling_kernel_t *out)
+{
+    constexpr int NDt = IntegerLog2<MaxDt>() + 1;
+
+    fill_1d_downsampling_kernel_table<S,Df,(MaxDt/2)> (out);
+    out[NDt-1] = _kernel_downsample_2d<float,S,Df,MaxDt>;
+}
+
+
+template<unsigned int S, unsigned int MaxDf, unsigned int MaxDt, typename std::enable_if<(MaxDf==0),int>::type = 0>
+inline void fill_2d_downsampling_kernel_table(downsampling_kernel_t *out) { }
+
+template<unsigned int S, unsigned int MaxDf, unsigned int MaxDt, typename std::enable_if<(MaxDf>0),int>::type = 0>
+inline void fill_2d_downsampling_kernel_table(downsampling_kernel_t *out)
+{
+    constexpr int NDf = IntegerLog2<MaxDf>() + 1;
+    constexpr int NDt = IntegerLog2<MaxDt>() + 1;
+
+    fill_2d_downsampling_kernel_table<S,(MaxDf/2),MaxDt> (out);
+    fill_1d_downsampling_kernel_table<S,MaxDf,MaxDt> (out + (NDf-1)*NDt);
+}
+
+
+template<unsigned int S>
+struct downsampling_kernel_table {
+    static constexpr int MaxDf = constants::max_specialized_frequency_downsampling;
+    static constexpr int MaxDt = constants::max_specialized_time_downsampling;
+    static constexpr int NDf = IntegerLog2<MaxDf>() + 1;
+    static constexpr int NDt = IntegerLog2<MaxDt>() + 1;
+
+    downsampling_kernel_t entries[NDf*NDt];
+
+    downsampling_kernel_table()
+    {
+	fill_2d_downsampling_kernel_table<S,MaxDf,MaxDt> (entries);
+    }
+
+    // Before calling get_kernel(), caller must check:
+    //    1 <= Df <= MaxDf
+    //    1 <= Dt <= MaxDt
+    //    both Df,Dt are powers of two
+
+    inline downsampling_kernel_t get_kernel(int Df, int Dt) const
+    {
+	int idf = _kernel_table_ilog2(Df);
+	int idt = _kernel_table_ilog2(Dt);
+
+	return entries[idf*NDt + idt];
+    }
+};
+
+
+// -------------------------------------------------------------------------------------------------
+//
+// Whole-array weighted mean and rms, used by weighted_mean_and_rms() and the "wrms_hack_for_testing"
+// functions in intensity_clippers.cpp.  These follow the code path of the (AXIS_NONE, Df=Dt=1)
+// intensity_clipper kernel, so they must be dispatched on the same simd length as the clipper.
+//
+// If 'mean_hint' is non-NULL, _wrms_kernel() also writes the S-element mean (before extracting
+// a scalar) to it.  This can be passed to _wrms_kernel_with_hint(), which makes one pass over the
+// data, starting from the mean hint, as in the last iteration of _kernel_wrms_iterate_2d().
+
+
+template<unsigned int S>
+inline void _wrms_kernel(float &mean, float &rms, float *mean_hint, const float *intensity, const float *weights, int nfreq, int nt, int stride, int niter, double sigma, bool two_pass)
+{
+    simd_t<float,S> mean_x, rms_x;
+
+    if (two_pass)
+	_kernel_noniterative_wrms_2d<float,S,1,1,false,false,true> (mean_x, rms_x, intensity, weights, nfreq, nt, stride, NULL, NULL);
+    else
+	_kernel_noniterative_wrms_2d<float,S,1,1,false,false,false> (mean_x, rms_x, intensity, weights, nfreq, nt, stride, NULL, NULL);
+
+    _kernel_wrms_iterate_2d<float,S> (mean_x, rms_x, intensity, weights, nfreq, nt, stride, niter, sigma);
+
+    if (mean_hint)
+	mean_x.storeu(mean_hint);
+
+    mean = mean_x.template extract<0> ();
+    rms = rms_x.template extract<0> ();
+}
+
+
+template<unsigned int S>
+inline void _wrms_kernel_with_hint(float &mean, float &rms, const float *mean_hint, const float *intensity, const float *weights, int nfreq, int nt, int stride)
+{
+    _mean_variance_iterator<float,S> v(simd_t<float,S>::loadu(mean_hint), simd_t<float,S>(1.0e10));
+    _kernel_visit_2d<1,1> (v, intensity, weights, nfreq, nt, stride);
+
+    simd_t<float,S> mean_x, rms_x;
+    v.get_mean_rms(mean_x, rms_x);
+
+    mean = mean_x.template extract<0> ();
+    rms = rms_x.template extract<0> ();
+}
+
+
+// -------------------------------------------------------------------------------------------------
+//
+// S=16 kernels, defined in kernel_tables_avx512.cpp.
+//
+// These must only be called if simd_dispatch_length() returns 16, since they contain AVX-512
+// instructions (including the table construction, which happens on the first call).
+
+
+#ifdef HAVE_AVX512
+extern intensity_clipper_kernel_t get_avx512_intensity_clipper_kernel(axis_type axis, int Df, int Dt, bool two_pass);
+extern std_dev_clipper_kernel_t get_avx512_std_dev_clipper_kernel(axis_type axis, int Df, int Dt, bool two_pass);
+extern std_dev_kernel_t get_avx512_std_dev_kernel(axis_type axis, int Df, int Dt, bool two_pass);
+extern detrending_kernel_t get_avx512_detrending_kernel(int axis, int polydeg, detrender_precision precision);
+extern downsampling_kernel_t get_avx512_downsampling_kernel(int Df, int Dt);
+extern void avx512_wrms_kernel(float &mean, float &rms, float *mean_hint, const float *intensity, const float *weights, int nfreq, int nt, int stride, int niter, double sigma, bool two_pass);
+extern void avx512_wrms_kernel_with_hint(float &mean, float &rms, const float *mean_hint, const float *intensity, const float *weights, int nfreq, int nt, int stride);
+#endif
+
+
+}  // namespace rf_pipelines
+
+#endif  // _RF_PIPELINES_KERNELS_KERNEL_TABLES_HPP
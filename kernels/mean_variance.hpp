@@ -31,6 +31,10 @@ template<typename T, unsigned int S> using smask_t = simd_helpers::smask_t<T,S>;
 //    _variance_visitor
 //    _mean_variance_iterator
 //
+// Each of these visitors also defines V::merge(), which adds the (horizontally summed) accumulators
+// of another visitor.  This is used to combine partial sums over disjoint parts of an array, for
+// example in the multithreaded clippers.
+//
 // Note: here and elsewhere in kernels/*.hpp, we define three kernel versions
 // (with suffixes _2d, _1d_t, _1d_f).  This seemed unnecessary and I wanted to clean
 // up by only using the 2d version (with a boolean flag to enable the horizontal_sum()).
@@ -116,9 +120,19 @@ inline void _kernel_visit_1d_f(V &v, const typename V::T *intensity, const typen
 //
 // In this and other visitors, the (Iflag,Wflag) compile-time args control whether the downsampled
 // intensity and weights arrays (computed on-the-fly) are also written out to auxiliary arrays.
+//
+// If the 'Shifted' compile-time arg is true, then the sums are accumulated after subtracting a
+// per-lane "pilot" value, which is the first unmasked intensity seen in each simd lane.  Since
+// the pilot is typically within a few sigma of the mean, this avoids the catastrophic cancellation
+// in (acc2/acc0 - mean^2) when |mean| >> rms, giving accuracy similar to the two-pass kernels in
+// a single pass.  (Compensated summation isn't an option here, since we compile with -ffast-math.)
+//
+// In the shifted case, horizontal_sum() and merge() combine partial sums with different pilot
+// values using the pairwise update formula of Chan, Golub & LeVeque.  Afterwards, the pilot value
+// is the mean, and acc1 is zero.
 
 
-template<typename T_, unsigned int S_, bool Iflag, bool Wflag>
+template<typename T_, unsigned int S_, bool Iflag, bool Wflag, bool Shifted=false>
 struct _mean_variance_visitor {
     using T = T_;
     static constexpr unsigned int S = S_;
@@ -129,6 +143,7 @@ struct _mean_variance_visitor {
     simd_t<T,S> acc0;
     simd_t<T,S> acc1;
     simd_t<T,S> acc2;
+    simd_t<T,S> pilot;   // only used if Shifted=true
 
     T *ds_intensity;
     T *ds_weights;
@@ -139,6 +154,7 @@ struct _mean_variance_visitor {
 	acc0 = simd_t<T,S>::zero();
 	acc1 = simd_t<T,S>::zero();
 	acc2 = simd_t<T,S>::zero();
+	pilot = simd_t<T,S>::zero();
 
 	ds_intensity = ds_intensity_;
 	ds_weights = ds_weights_;
@@ -146,12 +162,6 @@ struct _mean_variance_visitor {
 
     inline void accumulate_i(simd_t<T,S> ival, simd_t<T,S> wval) 
     { 
-	simd_t<T,S> wival = wval * ival;
-
-	acc0 += wval; 
-	acc1 += wival;
-	acc2 += wival * ival;
-
 	// Branches will be optimized out at compile-time
 	if (Iflag) {
 	    ival.storeu(ds_intensity);
@@ -162,16 +172,24 @@ struct _mean_variance_visitor {
 	    wval.storeu(ds_weights);
 	    ds_weights += S;
 	}
+
+	if (Shifted) {
+	    // The pilot value is updated until the first nonzero weight is seen.
+	    pilot = blendv(acc0.compare_gt(zero), pilot, ival);
+	    ival -= pilot;
+	}
+
+	simd_t<T,S> wival = wval * ival;
+
+	acc0 += wval; 
+	acc1 += wival;
+	acc2 += wival * ival;
     }
 
     inline void accumulate_wi(simd_t<T,S> wival, simd_t<T,S> wval)
     {
 	simd_t<T,S> ival = wival / blendv(wval.compare_gt(zero), wval, one);
 
-	acc0 += wval;
-	acc1 += wival;
-	acc2 += wival * ival;
-
 	// Branches will be optimized out at compile-time
 	if (Iflag) {
 	    ival.storeu(ds_intensity);
@@ -182,17 +200,95 @@ struct _mean_variance_visitor {
 	    wval.storeu(ds_weights);
 	    ds_weights += S;
 	}
+
+	if (Shifted) {
+	    pilot = blendv(acc0.compare_gt(zero), pilot, ival);
+	    ival -= pilot;
+	    wival = wval * ival;
+	}
+
+	acc0 += wval;
+	acc1 += wival;
+	acc2 += wival * ival;
+    }
+
+    // Shifted case: returns per-lane (mean, sum of squared deviations from mean).
+    inline void _get_mean_m2(simd_t<T,S> &mean, simd_t<T,S> &m2) const
+    {
+	simd_t<T,S> dmean = acc1 / blendv(acc0.compare_gt(zero), acc0, one);
+	mean = pilot + dmean;
+	m2 = acc2 - acc1 * dmean;
     }
 
     inline void horizontal_sum()
     {
-	acc0 = acc0.horizontal_sum();
-	acc1 = acc1.horizontal_sum();
-	acc2 = acc2.horizontal_sum();
+	if (!Shifted) {
+	    acc0 = acc0.horizontal_sum();
+	    acc1 = acc1.horizontal_sum();
+	    acc2 = acc2.horizontal_sum();
+	    return;
+	}
+
+	simd_t<T,S> mean, m2;
+	_get_mean_m2(mean, m2);
+
+	simd_t<T,S> w = acc0.horizontal_sum();
+	simd_t<T,S> gmean = (acc0 * mean).horizontal_sum() / blendv(w.compare_gt(zero), w, one);
+	simd_t<T,S> dmean = mean - gmean;
+
+	acc2 = (m2 + acc0 * dmean * dmean).horizontal_sum();
+	acc1 = zero;
+	acc0 = w;
+	pilot = gmean;
+    }
+
+    inline void merge(const _mean_variance_visitor &v)
+    {
+	if (!Shifted) {
+	    acc0 += v.acc0;
+	    acc1 += v.acc1;
+	    acc2 += v.acc2;
+	    return;
+	}
+
+	simd_t<T,S> mean_a, m2_a, mean_b, m2_b;
+	this->_get_mean_m2(mean_a, m2_a);
+	v._get_mean_m2(mean_b, m2_b);
+
+	simd_t<T,S> w = acc0 + v.acc0;
+	simd_t<T,S> t = blendv(w.compare_gt(zero), w, one);
+	simd_t<T,S> delta = mean_b - mean_a;
+
+	pilot = mean_a + delta * v.acc0 / t;
+	acc2 = m2_a + m2_b + delta * delta * acc0 * v.acc0 / t;
+	acc1 = zero;
+	acc0 = w;
     }
 
     inline void get_mean_variance(simd_t<T,S> &mean, simd_t<T,S> &var) const
     {
+	if (Shifted) {
+	    // Same roundoff thresholds as _mean_variance_iterator::get_mean_rms().
+	    static constexpr T eps_2 = 1.0e2 * simd_helpers::machine_epsilon<T> ();
+	    static constexpr T eps_3 = 1.0e3 * simd_helpers::machine_epsilon<T> ();
+
+	    smask_t<T,S> valid = acc0.compare_gt(zero);
+	    simd_t<T,S> t0 = blendv(valid, acc0, one);
+	    simd_t<T,S> dmean = acc1 / t0;
+	    simd_t<T,S> dmean2 = dmean * dmean;
+
+	    mean = pilot + dmean;
+	    var = acc2/t0 - dmean2;
+
+	    simd_t<T,S> thresh1 = simd_t<T,S>(eps_2) * mean;
+	    simd_t<T,S> thresh2 = simd_t<T,S>(eps_3) * dmean2;
+	    thresh2 = thresh2.max(thresh1 * thresh1);
+
+	    valid = valid.bitwise_and(var.compare_gt(thresh2));
+	    var = var.apply_mask(valid);
+	    return;
+	}
+
 	static constexpr T eps_3 = 1.0e3 * simd_helpers::machine_epsilon<T> ();
 
 	smask_t<T,S> valid = acc0.compare_gt(zero);
@@ -285,6 +381,12 @@ struct _mean_visitor {
 	acc1 = acc1.horizontal_sum();
     }
 
+    inline void merge(const _mean_visitor &v)
+    {
+	acc0 += v.acc0;
+	acc1 += v.acc1;
+    }
+
     inline simd_t<T,S> get_mean() const
     {
 	smask_t<T,S> valid = acc0.compare_gt(zero);
@@ -331,6 +433,12 @@ struct _variance_visitor {
 	acc2 = acc2.horizontal_sum();
     }
 
+    inline void merge(const _variance_visitor &v)
+    {
+	acc0 += v.acc0;
+	acc2 += v.acc2;
+    }
+
     inline simd_t<T,S> get_variance() const
     {
 	static constexpr T eps_2 = 1.0e2 * simd_helpers::machine_epsilon<T> ();
@@ -403,6 +511,13 @@ struct _mean_variance_iterator {
 	acc2 = acc2.horizontal_sum();
     }
 
+    inline void merge(const _mean_variance_iterator &v)
+    {
+	acc0 += v.acc0;
+	acc1 += v.acc1;
+	acc2 += v.acc2;
+    }
+
     inline void get_mean_rms(simd_t<T,S> &out_mean, simd_t<T,S> &out_rms)
     {
 	static constexpr T eps_2 = 1.0e2 * simd_helpers::machine_epsilon<T> ();
@@ -433,19 +548,24 @@ struct _mean_variance_iterator {
 //
 // _kernel_mean_variance(): computes the mean and variance of an array (noniteratively) 
 //  using an appropriate visitor.
+//
+// If Shifted=true, the one-pass versions use the shifted _mean_variance_visitor (see above).  This
+// is opt-in, since it changes the output at the roundoff level, and since the pilot (the first
+// unmasked sample in each lane) is only a good shift if it is not a large outlier.  The Shifted
+// flag is ignored by the two-pass versions.
 
 
 // _kernel_mean_variance_2d() case 1: one-pass version
-template<typename T, unsigned int S, unsigned int Df, unsigned int Dt, bool Iflag, bool Wflag, bool TwoPass, typename std::enable_if<(!TwoPass),int>::type = 0>
+template<typename T, unsigned int S, unsigned int Df, unsigned int Dt, bool Iflag, bool Wflag, bool TwoPass, bool Shifted=false, typename std::enable_if<(!TwoPass),int>::type = 0>
 inline void _kernel_mean_variance_2d(simd_t<T,S> &mean, simd_t<T,S> &var, const T *intensity, const T *weights, int nfreq, int nt, int stride, T *ds_intensity, T *ds_weights)
 {
-    _mean_variance_visitor<T,S,Iflag,Wflag> v(ds_intensity, ds_weights);
+    _mean_variance_visitor<T,S,Iflag,Wflag,Shifted> v(ds_intensity, ds_weights);
     _kernel_visit_2d<Df,Dt> (v, intensity, weights, nfreq, nt, stride);
     v.get_mean_variance(mean, var);
 }
 
 // _kernel_mean_variance_2d() case 2: two-pass version, downsampled
-template<typename T, unsigned int S, unsigned int Df, unsigned int Dt, bool Iflag, bool Wflag, bool TwoPass, typename std::enable_if<(TwoPass && ((Df>1) || (Dt>1))),int>::type = 0>
+template<typename T, unsigned int S, unsigned int Df, unsigned int Dt, bool Iflag, bool Wflag, bool TwoPass, bool Shifted=false, typename std::enable_if<(TwoPass && ((Df>1) || (Dt>1))),int>::type = 0>
 inline void _kernel_mean_variance_2d(simd_t<T,S> &mean, simd_t<T,S> &var, const T *intensity, const T *weights, int nfreq, int nt, int stride, T *ds_intensity, T *ds_weights)
 {
     _mean_visitor<T,S,true,true> v(ds_intensity, ds_weights);
@@ -458,7 +578,7 @@ inline void _kernel_mean_variance_2d(simd_t<T,S> &mean, simd_t<T,S> &var, const
 }
 
 // _kernel_mean_variance_2d() case 3: two-pass version, non-downsampled
-template<typename T, unsigned int S, unsigned int Df, unsigned int Dt, bool Iflag, bool Wflag, bool TwoPass, typename std::enable_if<(TwoPass && (Df==1) && (Dt==1)),int>::type = 0>
+template<typename T, unsigned int S, unsigned int Df, unsigned int Dt, bool Iflag, bool Wflag, bool TwoPass, bool Shifted=false, typename std::enable_if<(TwoPass && (Df==1) && (Dt==1)),int>::type = 0>
 inline void _kernel_mean_variance_2d(simd_t<T,S> &mean, simd_t<T,S> &var, const T *intensity, const T *weights, int nfreq, int nt, int stride, T *ds_intensity, T *ds_weights)
 {
     _mean_visitor<T,S,Iflag,Wflag> v(ds_intensity, ds_weights);
@@ -472,16 +592,16 @@ inline void _kernel_mean_variance_2d(simd_t<T,S> &mean, simd_t<T,S> &var, const
 
 
 // _kernel_mean_variance_1d_f() case 1: one-pass version
-template<typename T, unsigned int S, unsigned int Df, unsigned int Dt, bool Iflag, bool Wflag, bool TwoPass, typename std::enable_if<(!TwoPass),int>::type = 0>
+template<typename T, unsigned int S, unsigned int Df, unsigned int Dt, bool Iflag, bool Wflag, bool TwoPass, bool Shifted=false, typename std::enable_if<(!TwoPass),int>::type = 0>
 inline void _kernel_mean_variance_1d_f(simd_t<T,S> &mean, simd_t<T,S> &var, const T *intensity, const T *weights, int nfreq, int stride, T *ds_intensity, T *ds_weights)
 {
-    _mean_variance_visitor<T,S,Iflag,Wflag> v(ds_intensity, ds_weights);
+    _mean_variance_visitor<T,S,Iflag,Wflag,Shifted> v(ds_intensity, ds_weights);
     _kernel_visit_1d_f<Df,Dt> (v, intensity, weights, nfreq, stride);
     v.get_mean_variance(mean, var);
 }
 
 // _kernel_mean_variance_1d_f() case 2: two-pass version, downsampled
-template<typename T, unsigned int S, unsigned int Df, unsigned int Dt, bool Iflag, bool Wflag, bool TwoPass, typename std::enable_if<(TwoPass && ((Df>1) || (Dt>1))),int>::type = 0>
+template<typename T, unsigned int S, unsigned int Df, unsigned int Dt, bool Iflag, bool Wflag, bool TwoPass, bool Shifted=false, typename std::enable_if<(TwoPass && ((Df>1) || (Dt>1))),int>::type = 0>
 inline void _kernel_mean_variance_1d_f(simd_t<T,S> &mean, simd_t<T,S> &var, const T *intensity, const T *weights, int nfreq, int stride, T *ds_intensity, T *ds_weights)
 {
     _mean_visitor<T,S,true,true> v(ds_intensity, ds_weights);
@@ -494,7 +614,7 @@ inline void _kernel_mean_variance_1d_f(simd_t<T,S> &mean, simd_t<T,S> &var, cons
 }
 
 // _kernel_mean_variance_1d_f() case 3: two-pass version, non-downsampled
-template<typename T, unsigned int S, unsigned int Df, unsigned int Dt, bool Iflag, bool Wflag, bool TwoPass, typename std::enable_if<(TwoPass && (Df==1) && (Dt==1)),int>::type = 0>
+template<typename T, unsigned int S, unsigned int Df, unsigned int Dt, bool Iflag, bool Wflag, bool TwoPass, bool Shifted=false, typename std::enable_if<(TwoPass && (Df==1) && (Dt==1)),int>::type = 0>
 inline void _kernel_mean_variance_1d_f(simd_t<T,S> &mean, simd_t<T,S> &var, const T *intensity, const T *weights, int nfreq, int stride, T *ds_intensity, T *ds_weights)
 {
     _mean_visitor<T,S,Iflag,Wflag> v(ds_intensity, ds_weights);
@@ -508,10 +628,10 @@ inline void _kernel_mean_variance_1d_f(simd_t<T,S> &mean, simd_t<T,S> &var, cons
 
 
 // Placeholder for future expansion
-template<typename T, unsigned int S, unsigned int Df, unsigned int Dt, bool Iflag, bool Wflag, bool TwoPass>
+template<typename T, unsigned int S, unsigned int Df, unsigned int Dt, bool Iflag, bool Wflag, bool TwoPass, bool Shifted=false>
 inline void _kernel_mean_variance_1d_t(simd_t<T,S> &mean, simd_t<T,S> &var, const T *intensity, const T *weights, int nt, int stride, T *ds_intensity, T *ds_weights)
 {
-    _kernel_mean_variance_2d<T,S,Df,Dt,Iflag,Wflag,TwoPass> (mean, var, intensity, weights, Df, nt, stride, ds_intensity, ds_weights);
+    _kernel_mean_variance_2d<T,S,Df,Dt,Iflag,Wflag,TwoPass,Shifted> (mean, var, intensity, weights, Df, nt, stride, ds_intensity, ds_weights);
 }
 
 
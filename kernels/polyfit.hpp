@@ -2,6 +2,7 @@
 #define _RF_PIPELINES_KERNELS_POLYFIT_HPP
 
 #include <cstring>
+#include <algorithm>
 #include <simd_helpers/simd_float32.hpp>
 #include <simd_helpers/simd_ntuple.hpp>
 #include <simd_helpers/simd_trimatrix.hpp>
@@ -20,6 +21,167 @@ namespace rf_pipelines {
 template<typename T, unsigned int S> using simd_t = simd_helpers::simd_t<T,S>;
 template<typename T, unsigned int S, unsigned int D> using simd_ntuple = simd_helpers::simd_ntuple<T,S,D>;
 template<typename T, unsigned int S, unsigned int N> using simd_trimatrix = simd_helpers::simd_trimatrix<T,S,N>;
+template<typename T, unsigned int S> using smask_t = simd_helpers::smask_t<T,S>;
+
+
+// -------------------------------------------------------------------------------------------------
+//
+// Precision helpers.
+//
+// The intensity and weights arrays are always single-precision, but the detrending kernels can
+// be instantiated with T=double, in which case the simd length S should be half the single-precision
+// simd length (so that a simd_t<double,S> occupies one register).  The helpers below load/store
+// single-precision arrays, converting to/from T.
+
+
+template<typename T, unsigned int S, typename std::enable_if<std::is_same<T,float>::value,int>::type = 0>
+inline simd_t<T,S> _kernel_loadu_f(const float *p)
+{
+    return simd_t<T,S>::loadu(p);
+}
+
+template<typename T, unsigned int S, typename std::enable_if<!std::is_same<T,float>::value,int>::type = 0>
+inline simd_t<T,S> _kernel_loadu_f(const float *p)
+{
+    T buf[S];
+    for (unsigned int i = 0; i < S; i++)
+	buf[i] = p[i];
+    return simd_t<T,S>::loadu(buf);
+}
+
+template<typename T, unsigned int S, typename std::enable_if<std::is_same<T,float>::value,int>::type = 0>
+inline void _kernel_storeu_f(float *p, simd_t<T,S> x)
+{
+    x.storeu(p);
+}
+
+template<typename T, unsigned int S, typename std::enable_if<!std::is_same<T,float>::value,int>::type = 0>
+inline void _kernel_storeu_f(float *p, simd_t<T,S> x)
+{
+    T buf[S];
+    x.storeu(buf);
+    for (unsigned int i = 0; i < S; i++)
+	p[i] = buf[i];
+}
+
+
+// _kernel_split_lanes<S> (dst, src, h): converts half 'h' (either 0 or 1) of the simd lanes of a
+// single-precision simd_t, simd_ntuple, or simd_trimatrix to double precision.
+//
+// _kernel_merge_lanes<S> (dst, src, h): the inverse operation, which overwrites half 'h' of the
+// simd lanes of 'dst'.  These are used in the mixed-precision kernels below.
+
+template<unsigned int S>
+inline void _kernel_split_lanes(simd_t<double,S/2> &dst, const simd_t<float,S> &src, int h)
+{
+    float fbuf[S];
+    double dbuf[S/2];
+
+    src.storeu(fbuf);
+    for (unsigned int i = 0; i < S/2; i++)
+	dbuf[i] = fbuf[h*(S/2) + i];
+
+    dst = simd_t<double,S/2>::loadu(dbuf);
+}
+
+template<unsigned int S>
+inline void _kernel_merge_lanes(simd_t<float,S> &dst, const simd_t<double,S/2> &src, int h)
+{
+    float fbuf[S];
+    double dbuf[S/2];
+
+    dst.storeu(fbuf);
+    src.storeu(dbuf);
+    for (unsigned int i = 0; i < S/2; i++)
+	fbuf[h*(S/2) + i] = dbuf[i];
+
+    dst = simd_t<float,S>::loadu(fbuf);
+}
+
+template<unsigned int S>
+inline void _kernel_split_lanes(simd_ntuple<double,S/2,0> &dst, const simd_ntuple<float,S,0> &src, int h) { }
+
+template<unsigned int S, unsigned int N, typename std::enable_if<(N>0),int>::type = 0>
+inline void _kernel_split_lanes(simd_ntuple<double,S/2,N> &dst, const simd_ntuple<float,S,N> &src, int h)
+{
+    _kernel_split_lanes<S> (dst.v, src.v, h);
+    _kernel_split_lanes<S> (dst.x, src.x, h);
+}
+
+template<unsigned int S>
+inline void _kernel_merge_lanes(simd_ntuple<float,S,0> &dst, const simd_ntuple<double,S/2,0> &src, int h) { }
+
+template<unsigned int S, unsigned int N, typename std::enable_if<(N>0),int>::type = 0>
+inline void _kernel_merge_lanes(simd_ntuple<float,S,N> &dst, const simd_ntuple<double,S/2,N> &src, int h)
+{
+    _kernel_merge_lanes<S> (dst.v, src.v, h);
+    _kernel_merge_lanes<S> (dst.x, src.x, h);
+}
+
+template<unsigned int S>
+inline void _kernel_split_lanes(simd_trimatrix<double,S/2,0> &dst, const simd_trimatrix<float,S,0> &src, int h) { }
+
+template<unsigned int S, unsigned int N, typename std::enable_if<(N>0),int>::type = 0>
+inline void _kernel_split_lanes(simd_trimatrix<double,S/2,N> &dst, const simd_trimatrix<float,S,N> &src, int h)
+{
+    _kernel_split_lanes<S> (dst.m, src.m, h);
+    _kernel_split_lanes<S> (dst.v, src.v, h);
+}
+
+
+// -------------------------------------------------------------------------------------------------
+//
+// Lane helpers, used to batch S independent polynomial fits into one Cholesky factorization.
+//
+// _kernel_blend_lanes(dst, src, mask): replaces the simd lanes of 'dst' selected by 'mask'
+// with the corresponding lanes of 'src', where dst/src are simd_t's, simd_ntuples, or simd_trimatrices.
+//
+// _kernel_broadcast_lane(dst, src, j): sets all lanes of 'dst' equal to lane j of 'src'.
+
+
+template<typename T, unsigned int S>
+inline void _kernel_blend_lanes(simd_t<T,S> &dst, const simd_t<T,S> &src, const smask_t<T,S> &mask)
+{
+    dst = blendv(mask, src, dst);
+}
+
+template<typename T, unsigned int S>
+inline void _kernel_blend_lanes(simd_ntuple<T,S,0> &dst, const simd_ntuple<T,S,0> &src, const smask_t<T,S> &mask) { }
+
+template<typename T, unsigned int S, unsigned int N, typename std::enable_if<(N>0),int>::type = 0>
+inline void _kernel_blend_lanes(simd_ntuple<T,S,N> &dst, const simd_ntuple<T,S,N> &src, const smask_t<T,S> &mask)
+{
+    _kernel_blend_lanes(dst.v, src.v, mask);
+    _kernel_blend_lanes(dst.x, src.x, mask);
+}
+
+template<typename T, unsigned int S>
+inline void _kernel_blend_lanes(simd_trimatrix<T,S,0> &dst, const simd_trimatrix<T,S,0> &src, const smask_t<T,S> &mask) { }
+
+template<typename T, unsigned int S, unsigned int N, typename std::enable_if<(N>0),int>::type = 0>
+inline void _kernel_blend_lanes(simd_trimatrix<T,S,N> &dst, const simd_trimatrix<T,S,N> &src, const smask_t<T,S> &mask)
+{
+    _kernel_blend_lanes(dst.m, src.m, mask);
+    _kernel_blend_lanes(dst.v, src.v, mask);
+}
+
+template<typename T, unsigned int S>
+inline void _kernel_broadcast_lane(simd_t<T,S> &dst, const simd_t<T,S> &src, int j)
+{
+    T buf[S];
+    src.storeu(buf);
+    dst = simd_t<T,S> (buf[j]);
+}
+
+template<typename T, unsigned int S>
+inline void _kernel_broadcast_lane(simd_ntuple<T,S,0> &dst, const simd_ntuple<T,S,0> &src, int j) { }
+
+template<typename T, unsigned int S, unsigned int N, typename std::enable_if<(N>0),int>::type = 0>
+inline void _kernel_broadcast_lane(simd_ntuple<T,S,N> &dst, const simd_ntuple<T,S,N> &src, int j)
+{
+    _kernel_broadcast_lane(dst.v, src.v, j);
+    _kernel_broadcast_lane(dst.x, src.x, j);
+}
 
 
 // -------------------------------------------------------------------------------------------------
@@ -83,10 +245,14 @@ inline void _kernel_detrend_accum_mv(simd_trimatrix<T,S,N> &outm, simd_ntuple<T,
 //
 // Detrend along time (=fastest varying) axis of 2D strided array.
 // Note: the degree of the polynomial fit is (N-1), not N!
+//
+// Rows are processed in batches of S.  Each row's (matrix, vector) is accumulated and horizontally
+// summed as usual, then stored in one simd lane of a "batch" (matrix, vector), so that a single
+// Cholesky factorization and triangular solve handles S independent fits.
 
 
 template<typename T, unsigned int S, unsigned int N>
-inline void _kernel_detrend_t_pass1(simd_trimatrix<T,S,N> &outm, simd_ntuple<T,S,N> &outv, int nt, const T *ivec, const T *wvec)
+inline void _kernel_detrend_t_pass1(simd_trimatrix<T,S,N> &outm, simd_ntuple<T,S,N> &outv, int nt, const float *ivec, const float *wvec)
 {
     outm.setzero();
     outv.setzero();
@@ -100,8 +266,8 @@ inline void _kernel_detrend_t_pass1(simd_trimatrix<T,S,N> &outm, simd_ntuple<T,S
     for (int i = 0; i < nt; i += S) {
 	simd_t<T,S> z = z0 + dz * simd_t<T,S>(i);
 
-	simd_t<T,S> ival = simd_t<T,S>::loadu(ivec+i);
-	simd_t<T,S> wval = simd_t<T,S>::loadu(wvec+i);
+	simd_t<T,S> ival = _kernel_loadu_f<T,S> (ivec+i);
+	simd_t<T,S> wval = _kernel_loadu_f<T,S> (wvec+i);
 
 	simd_ntuple<T,S,N> pvec;
 	_kernel_legpoly_eval(pvec, z);
@@ -115,7 +281,7 @@ inline void _kernel_detrend_t_pass1(simd_trimatrix<T,S,N> &outm, simd_ntuple<T,S
 
 
 template<typename T, unsigned int S, unsigned int N>
-inline void _kernel_detrend_t_pass2(T *ivec, int nt, const simd_ntuple<T,S,N> &coeffs)
+inline void _kernel_detrend_t_pass2(float *ivec, int nt, const simd_ntuple<T,S,N> &coeffs)
 {
     simd_t<T,S> z0 = simd_t<T,S>::range();
     z0 -= simd_t<T,S>(0.5 * (nt-1));
@@ -129,43 +295,85 @@ inline void _kernel_detrend_t_pass2(T *ivec, int nt, const simd_ntuple<T,S,N> &c
 	simd_ntuple<T,S,N> pvec;
 	_kernel_legpoly_eval(pvec, z);
 
-	simd_t<T,S> ival = simd_t<T,S>::loadu(ivec + i);
+	simd_t<T,S> ival = _kernel_loadu_f<T,S> (ivec + i);
 
 	ival = pvec._vertical_dotn(coeffs, ival);
-	ival.storeu(ivec + i);
+	_kernel_storeu_f<T,S> (ivec + i, ival);
+    }
+}
+
+
+// Accumulates rows [ifreq0, ifreq0+nrows) into "lane-per-row" form: lane j of (outm, outv) corresponds
+// to row (ifreq0+j).  If nrows < S, then the unused lanes are copies of row ifreq0.
+template<typename T, unsigned int S, unsigned int N>
+inline void _kernel_detrend_t_pass1_batch(simd_trimatrix<T,S,N> &outm, simd_ntuple<T,S,N> &outv, int nrows, int nt, const float *intensity, const float *weights, int stride)
+{
+    const simd_t<T,S> lanes = simd_t<T,S>::range();
+
+    _kernel_detrend_t_pass1(outm, outv, nt, intensity, weights);
+
+    for (int j = 1; j < nrows; j++) {
+	simd_trimatrix<T,S,N> rmat;
+	simd_ntuple<T,S,N> rvec;
+
+	_kernel_detrend_t_pass1(rmat, rvec, nt, intensity + j*stride, weights + j*stride);
+
+	smask_t<T,S> mask = lanes.compare_eq(simd_t<T,S>(j));
+	_kernel_blend_lanes(outm, rmat, mask);
+	_kernel_blend_lanes(outv, rvec, mask);
+    }
+}
+
+
+// Subtracts the fits from rows [ifreq0, ifreq0+nrows), given coefficients in "lane-per-row" form.
+// The 'good' array should be nonzero for rows where the fit is well-conditioned; other rows are masked.
+template<typename T, unsigned int S, unsigned int N, typename Tgood>
+inline void _kernel_detrend_t_pass2_batch(float *intensity, float *weights, int nrows, int nt, int stride, const simd_ntuple<T,S,N> &coeffs, const Tgood *good)
+{
+    for (int j = 0; j < nrows; j++) {
+	if (!good[j]) {
+	    // Case 1: Cholesky factorization was badly conditioned
+	    memset(weights + j*stride, 0, nt * sizeof(float));
+	    continue;
+	}
+
+	// Case 2: Cholesky factorization is numerically stable, polynomial fitting can be performed
+	simd_ntuple<T,S,N> c;
+	_kernel_broadcast_lane(c, coeffs, j);
+	_kernel_detrend_t_pass2(intensity + j*stride, nt, c);
     }
 }
 
 
 template<typename T, unsigned int S, unsigned int N>
-inline void _kernel_detrend_t(int nfreq, int nt, T *intensity, T *weights, int stride, double epsilon=1.0e-2)
+inline void _kernel_detrend_t(int nfreq, int nt, float *intensity, float *weights, int stride, double epsilon=1.0e-2)
 {
     // Caller should have asserted this already, but rechecking here should have negligible overhead
     if (_unlikely((nt % S) != 0))
 	throw std::runtime_error("rf_pipelines internal error: nt is not divisible by S in _kernel_detrend_t()");
 
-    for (int ifreq = 0; ifreq < nfreq; ifreq++) {
-	T *ivec = intensity + ifreq * stride;
-	T *wvec = weights + ifreq * stride;
+    for (int ifreq0 = 0; ifreq0 < nfreq; ifreq0 += S) {
+	int nrows = std::min(nfreq - ifreq0, int(S));
+	float *ivec = intensity + ifreq0 * stride;
+	float *wvec = weights + ifreq0 * stride;
 
 	simd_trimatrix<T,S,N> xmat;
 	simd_ntuple<T,S,N> xvec;
 
-	_kernel_detrend_t_pass1(xmat, xvec, nt, ivec, wvec);
+	_kernel_detrend_t_pass1_batch(xmat, xvec, nrows, nt, ivec, wvec, stride);
 
-	simd_t<int,S> flags = xmat.cholesky_in_place_checked(epsilon);
+	smask_t<T,S> flags = xmat.cholesky_in_place_checked(epsilon);
 
-	if (!flags.is_all_ones()) {
-	    // Case 1: Cholesky factorization was badly conditioned
-	    memset(weights + ifreq*stride, 0, nt * sizeof(T));
-	    continue;
-	}
+	// Lanes where the fit is poorly conditioned are zeroed here, and ignored in pass2.
+	xvec = xvec.apply_mask(flags);
 
-	// Case 2: Cholesky factorization is numerically stable, polynomial fitting can be performed
 	xmat.solve_lower_in_place(xvec);
 	xmat.solve_upper_in_place(xvec);
 
-	_kernel_detrend_t_pass2(ivec, nt, xvec);
+	T good[S];
+	simd_t<T,S>(1.0).apply_mask(flags).storeu(good);
+
+	_kernel_detrend_t_pass2_batch(ivec, wvec, nrows, nt, stride, xvec, good);
     }
 }
 
@@ -179,7 +387,7 @@ inline void _kernel_detrend_t(int nfreq, int nt, T *intensity, T *weights, int s
 
 
 template<typename T, unsigned int S, unsigned int N>
-inline void _kernel_detrend_f_pass1(simd_trimatrix<T,S,N> &outm, simd_ntuple<T,S,N> &outv, int nfreq, const T *ivec, const T *wvec, int stride)
+inline void _kernel_detrend_f_pass1(simd_trimatrix<T,S,N> &outm, simd_ntuple<T,S,N> &outv, int nfreq, const float *ivec, const float *wvec, int stride)
 {
     outm.setzero();
     outv.setzero();
@@ -190,8 +398,8 @@ inline void _kernel_detrend_f_pass1(simd_trimatrix<T,S,N> &outm, simd_ntuple<T,S
     for (int i = 0; i < nfreq; i++) {
 	T z = z0 + i*dz;
 
-	simd_t<T,S> ival = simd_t<T,S>::loadu(ivec + i*stride);
-	simd_t<T,S> wval = simd_t<T,S>::loadu(wvec + i*stride);
+	simd_t<T,S> ival = _kernel_loadu_f<T,S> (ivec + i*stride);
+	simd_t<T,S> wval = _kernel_loadu_f<T,S> (wvec + i*stride);
 
 	simd_ntuple<T,S,N> pvec;
 	_kernel_legpoly_eval(pvec, simd_t<T,S>(z));
@@ -200,7 +408,7 @@ inline void _kernel_detrend_f_pass1(simd_trimatrix<T,S,N> &outm, simd_ntuple<T,S
 }
 
 template<typename T, unsigned int S, unsigned int N>
-inline void _kernel_detrend_f_pass2(T *ivec, int nfreq, const simd_ntuple<T,S,N> &coeffs, int stride)
+inline void _kernel_detrend_f_pass2(float *ivec, int nfreq, const simd_ntuple<T,S,N> &coeffs, int stride)
 {
     T z0 = -(nfreq-1) / T(nfreq);
     T dz = 2.0 / T(nfreq);
@@ -211,19 +419,19 @@ inline void _kernel_detrend_f_pass2(T *ivec, int nfreq, const simd_ntuple<T,S,N>
 	simd_ntuple<T,S,N> pvec;
 	_kernel_legpoly_eval(pvec, simd_t<T,S>(z));
 
-	simd_t<T,S> ival = simd_t<T,S>::loadu(ivec + i*stride);
+	simd_t<T,S> ival = _kernel_loadu_f<T,S> (ivec + i*stride);
 
 	ival = pvec._vertical_dotn(coeffs, ival);
-	ival.storeu(ivec + i*stride);
+	_kernel_storeu_f<T,S> (ivec + i*stride, ival);
     }
 }
 
 
 // Zeros a complete block of S columns in the 'weights' array.
 template<typename T, unsigned int S>
-inline void _kernel_colzero_full(T *weights, int nfreq, int stride)
+inline void _kernel_colzero_full(float *weights, int nfreq, int stride)
 {
-    simd_t<T,S> z = simd_t<T,S>::zero();
+    simd_t<float,S> z = simd_t<float,S>::zero();
 
     for (int i = 0; i < nfreq; i++)
 	z.storeu(weights + i*stride);
@@ -232,8 +440,8 @@ inline void _kernel_colzero_full(T *weights, int nfreq, int stride)
 
 // Zeros a partial block of S columns in the 'weights' array.
 // Each word in the 'mask' array should be either 0 or -1=0xff..
-template<typename T, unsigned int S>
-inline void _kernel_colzero_partial(T *weights, int nfreq, int stride, simd_t<int,S> mask)
+template<typename T, unsigned int S, typename std::enable_if<std::is_same<T,float>::value,int>::type = 0>
+inline void _kernel_colzero_partial(float *weights, int nfreq, int stride, smask_t<T,S> mask)
 {
     for (int i = 0; i < nfreq; i++) {
 	simd_t<T,S> w = simd_t<T,S>::loadu(weights + i*stride);
@@ -242,45 +450,556 @@ inline void _kernel_colzero_partial(T *weights, int nfreq, int stride, simd_t<in
     }
 }
 
+// Double-precision version (the mask can't be applied directly to single-precision weights,
+// but this case is rare, so we just zero the masked columns one at a time).
+template<typename T, unsigned int S, typename std::enable_if<!std::is_same<T,float>::value,int>::type = 0>
+inline void _kernel_colzero_partial(float *weights, int nfreq, int stride, smask_t<T,S> mask)
+{
+    T keep[S];
+    simd_t<T,S>(1.0).apply_mask(mask).storeu(keep);
+
+    for (unsigned int j = 0; j < S; j++) {
+	if (keep[j] != 0)
+	    continue;
+	for (int i = 0; i < nfreq; i++)
+	    weights[i*stride + j] = 0;
+    }
+}
+
+
+// Tiled versions of pass1 and pass2, which process K adjacent S-wide column groups per sweep over
+// the rows.  Compared to processing one column group at a time, each row access reads K*S contiguous
+// elements (ideally full cache lines), and the Legendre polynomials are evaluated once per row rather
+// than once per (row, column group).  The arithmetic in each column is unchanged (but if the compiler
+// does FMA contraction, it may contract differently, so results can differ at the roundoff level).
+
+template<typename T, unsigned int S, unsigned int N, unsigned int K>
+inline void _kernel_detrend_f_pass1_tiled(simd_trimatrix<T,S,N> *outm, simd_ntuple<T,S,N> *outv, int nfreq, const float *ivec, const float *wvec, int stride)
+{
+    for (unsigned int k = 0; k < K; k++) {
+	outm[k].setzero();
+	outv[k].setzero();
+    }
+
+    T z0 = -(nfreq-1) / T(nfreq);
+    T dz = 2.0 / T(nfreq);
+
+    for (int i = 0; i < nfreq; i++) {
+	T z = z0 + i*dz;
+
+	simd_ntuple<T,S,N> pvec;
+	_kernel_legpoly_eval(pvec, simd_t<T,S>(z));
+
+	for (unsigned int k = 0; k < K; k++) {
+	    simd_t<T,S> ival = _kernel_loadu_f<T,S> (ivec + i*stride + k*S);
+	    simd_t<T,S> wval = _kernel_loadu_f<T,S> (wvec + i*stride + k*S);
+	    _kernel_detrend_accum_mv(outm[k], outv[k], pvec, ival, wval);
+	}
+    }
+}
+
+template<typename T, unsigned int S, unsigned int N, unsigned int K>
+inline void _kernel_detrend_f_pass2_tiled(float *ivec, int nfreq, const simd_ntuple<T,S,N> *coeffs, int stride)
+{
+    T z0 = -(nfreq-1) / T(nfreq);
+    T dz = 2.0 / T(nfreq);
+
+    for (int i = 0; i < nfreq; i++) {
+	T z = z0 + i*dz;
+    
+	simd_ntuple<T,S,N> pvec;
+	_kernel_legpoly_eval(pvec, simd_t<T,S>(z));
+
+	for (unsigned int k = 0; k < K; k++) {
+	    simd_t<T,S> ival = _kernel_loadu_f<T,S> (ivec + i*stride + k*S);
+	    ival = pvec._vertical_dotn(coeffs[k], ival);
+	    _kernel_storeu_f<T,S> (ivec + i*stride + k*S, ival);
+	}
+    }
+}
+
+
+// _kernel_detrend_f_solve<T,S,N,Mixed> (xmat, xvec, epsilon): Cholesky-factors 'xmat', and overwrites
+// 'xvec' with the polynomial coefficients.  Returns the mask of well-conditioned columns.  In columns
+// where the fit is poorly conditioned, the coefficients are zero (so that the intensity array is left
+// unmodified), or unspecified if no column is well-conditioned.
+//
+// If Mixed=true (only allowed if T=float), the factorization and solve are done in double precision.
+
+template<typename T, unsigned int S, unsigned int N, bool Mixed, typename std::enable_if<!Mixed,int>::type = 0>
+inline smask_t<T,S> _kernel_detrend_f_solve(simd_trimatrix<T,S,N> &xmat, simd_ntuple<T,S,N> &xvec, double epsilon)
+{
+    smask_t<T,S> flags = xmat.cholesky_in_place_checked(epsilon);
+
+    if (flags.is_all_zeros())
+	return flags;
+
+    xvec = xvec.apply_mask(flags);
+
+    xmat.solve_lower_in_place(xvec);
+    xmat.solve_upper_in_place(xvec);
+    return flags;
+}
+
+template<typename T, unsigned int S, unsigned int N, bool Mixed, typename std::enable_if<Mixed,int>::type = 0>
+inline smask_t<T,S> _kernel_detrend_f_solve(simd_trimatrix<T,S,N> &xmat, simd_ntuple<T,S,N> &xvec, double epsilon)
+{
+    static_assert(std::is_same<T,float>::value, "_kernel_detrend_f_solve(): Mixed=true requires T=float");
+
+    // Each half of the simd lanes is factored and solved separately in double precision.
+    // The 'good' vector is 1 in columns where the fit is well-conditioned, and 0 elsewhere.
+    simd_t<float,S> good;
+
+    for (int h = 0; h < 2; h++) {
+	simd_trimatrix<double,S/2,N> dmat;
+	simd_ntuple<double,S/2,N> dvec;
+
+	_kernel_split_lanes<S> (dmat, xmat, h);
+	_kernel_split_lanes<S> (dvec, xvec, h);
+
+	smask_t<double,S/2> dflags = dmat.cholesky_in_place_checked(epsilon);
+	dvec = dvec.apply_mask(dflags);
+
+	dmat.solve_lower_in_place(dvec);
+	dmat.solve_upper_in_place(dvec);
+
+	_kernel_merge_lanes<S> (xvec, dvec, h);
+	_kernel_merge_lanes<S> (good, simd_t<double,S/2>(1.0).apply_mask(dflags), h);
+    }
+
+    return good.compare_gt(simd_t<float,S>(0.5));
+}
+
+
+// Detrends one tile of K adjacent S-wide column groups.
+template<typename T, unsigned int S, unsigned int N, unsigned int K, bool Mixed>
+inline void _kernel_detrend_f_tile(int nfreq, float *ivec, float *wvec, int stride, double epsilon)
+{
+    simd_trimatrix<T,S,N> xmat[K];
+    simd_ntuple<T,S,N> xvec[K];
+    smask_t<T,S> flags[K];
+    bool any_valid = false;
+
+    _kernel_detrend_f_pass1_tiled<T,S,N,K> (xmat, xvec, nfreq, ivec, wvec, stride);
+
+    for (unsigned int k = 0; k < K; k++) {
+	flags[k] = _kernel_detrend_f_solve<T,S,N,Mixed> (xmat[k], xvec[k], epsilon);
+
+	if (flags[k].is_all_zeros())
+	    xvec[k].setzero();   // leave intensity unmodified
+	else
+	    any_valid = true;
+    }
+
+    if (any_valid)
+	_kernel_detrend_f_pass2_tiled<T,S,N,K> (ivec, nfreq, xvec, stride);
+
+    for (unsigned int k = 0; k < K; k++) {
+	// Columns where the fit is poorly conditioned are masked, by zeroing the weights.
+	if (flags[k].is_all_zeros())
+	    _kernel_colzero_full<T,S> (wvec + k*S, nfreq, stride);
+	else if (!flags[k].is_all_ones())
+	    _kernel_colzero_partial<T,S> (wvec + k*S, nfreq, stride, flags[k]);
+    }
+}
+
+
+// Number of S-wide column groups per tile in _kernel_detrend_f().  The tile width is at most 256 bytes
+// (4 cache lines) per row, and is reduced for high polynomial degree, so that the K accumulators
+// (each containing N(N+3)/2 simd_t's) fit in ~16 KB of L1 cache.
+
+constexpr unsigned int _kernel_detrend_f_tile_size(unsigned int kacc, unsigned int kmax)
+{
+    return (kacc < 1) ? 1 : ((kacc > kmax) ? kmax : kacc);
+}
 
 template<typename T, unsigned int S, unsigned int N>
-inline void _kernel_detrend_f(int nfreq, int nt, T *intensity, T *weights, int stride, double epsilon=1.0e-2)
+constexpr unsigned int _kernel_detrend_f_tile_size()
+{
+    return _kernel_detrend_f_tile_size(16384 / ((N*(N+3)/2) * S * sizeof(T)), 256 / (S * sizeof(float)));
+}
+
+
+template<typename T, unsigned int S, unsigned int N, bool Mixed=false>
+inline void _kernel_detrend_f(int nfreq, int nt, float *intensity, float *weights, int stride, double epsilon=1.0e-2)
 {
+    constexpr unsigned int K = _kernel_detrend_f_tile_size<T,S,N> ();
+
     // Caller should have asserted this already, but rechecking here should have negligible overhead
     if (_unlikely((nt % S) != 0))
 	throw std::runtime_error("rf_pipelines internal error: nt is not divisible by S in _kernel_detrend_f()");
 
-    for (int it = 0; it < nt; it += S) {
-	T *ivec = intensity + it;
-	T *wvec = weights + it;
+    int it = 0;
 
-	simd_trimatrix<T,S,N> xmat;
-	simd_ntuple<T,S,N> xvec;
+    for (; it + int(K*S) <= nt; it += K*S)
+	_kernel_detrend_f_tile<T,S,N,K,Mixed> (nfreq, intensity + it, weights + it, stride, epsilon);
 
-	_kernel_detrend_f_pass1(xmat, xvec, nfreq, ivec, wvec, stride);
+    // Leftover column groups, if nt is not divisible by K*S.
+    for (; it < nt; it += S)
+	_kernel_detrend_f_tile<T,S,N,1,Mixed> (nfreq, intensity + it, weights + it, stride, epsilon);
+}
 
-	simd_t<int,S> flags = xmat.cholesky_in_place_checked(epsilon);
 
-	if (flags.is_all_zeros()) {
-	    // If we get here, then all columns of the weights array should be zeroed,
-	    // but the intensity array can be left unmodified.
-	    _kernel_colzero_full<T,S> (wvec, nfreq, stride);
-	    continue;
+// -------------------------------------------------------------------------------------------------
+//
+// Mixed-precision kernels: the (matrix, vector) accumulation and the final subtraction are done
+// in single precision (with S-element simd_t's), but the Cholesky factorization and triangular
+// solves are done in double precision (with (S/2)-element simd_t's).
+//
+// Usage is the same as _kernel_detrend_t<float,S,N>() and _kernel_detrend_f<float,S,N>().
+
+
+template<unsigned int S, unsigned int N>
+inline void _kernel_detrend_t_mixed(int nfreq, int nt, float *intensity, float *weights, int stride, double epsilon=1.0e-2)
+{
+    // Caller should have asserted this already, but rechecking here should have negligible overhead
+    if (_unlikely((nt % S) != 0))
+	throw std::runtime_error("rf_pipelines internal error: nt is not divisible by S in _kernel_detrend_t_mixed()");
+
+    for (int ifreq0 = 0; ifreq0 < nfreq; ifreq0 += S) {
+	int nrows = std::min(nfreq - ifreq0, int(S));
+	float *ivec = intensity + ifreq0 * stride;
+	float *wvec = weights + ifreq0 * stride;
+
+	simd_trimatrix<float,S,N> xmat;
+	simd_ntuple<float,S,N> xvec;
+
+	_kernel_detrend_t_pass1_batch(xmat, xvec, nrows, nt, ivec, wvec, stride);
+
+	// Each half of the batch (S/2 rows) is factored and solved separately in double precision.
+	simd_t<float,S> good;
+
+	for (int h = 0; h < 2; h++) {
+	    simd_trimatrix<double,S/2,N> dmat;
+	    simd_ntuple<double,S/2,N> dvec;
+
+	    _kernel_split_lanes<S> (dmat, xmat, h);
+	    _kernel_split_lanes<S> (dvec, xvec, h);
+
+	    smask_t<double,S/2> dflags = dmat.cholesky_in_place_checked(epsilon);
+	    dvec = dvec.apply_mask(dflags);
+
+	    dmat.solve_lower_in_place(dvec);
+	    dmat.solve_upper_in_place(dvec);
+
+	    _kernel_merge_lanes<S> (xvec, dvec, h);
+	    _kernel_merge_lanes<S> (good, simd_t<double,S/2>(1.0).apply_mask(dflags), h);
 	}
 
-	// In columns where the fit is poorly conditioned, we leave the intensity array unmodified.
-	xvec = xvec.apply_mask(flags);
+	float gbuf[S];
+	good.storeu(gbuf);
 
-	xmat.solve_lower_in_place(xvec);
-	xmat.solve_upper_in_place(xvec);
-	
-	_kernel_detrend_f_pass2(ivec, nfreq, xvec, stride);
+	_kernel_detrend_t_pass2_batch(ivec, wvec, nrows, nt, stride, xvec, gbuf);
+    }
+}
+
+
+template<unsigned int S, unsigned int N>
+inline void _kernel_detrend_f_mixed(int nfreq, int nt, float *intensity, float *weights, int stride, double epsilon=1.0e-2)
+{
+    _kernel_detrend_f<float,S,N,true> (nfreq, nt, intensity, weights, stride, epsilon);
+}
+
+
+// -------------------------------------------------------------------------------------------------
+//
+// _kernel_detrend_t_sliding<T,S,N> (nfreq, nt, intensity, weights, stride, pp_intensity, pp_weights, pp_stride,
+//                                   nt_step, nt_window, epsilon, scratch)
+//
+// Sliding-window detrender along the time axis.  The chunk is divided into steps of 'nt_step' samples.
+// In each step, a polynomial is fit to the 'nt_window' samples centered on the step, and subtracted
+// from the samples in the step (only).  Equivalently, each step is detrended as if it were the central
+// step of a _kernel_detrend_t() call with nt=nt_window.  The window length must be an odd multiple of
+// nt_step, so that the window contains (2*m+1) steps, where m = (nt_window - nt_step) / (2*nt_step).
+//
+// The window extends by nt_pad = m*nt_step samples on either side of the chunk.  The samples to the
+// right of the chunk are in the intensity/weights arrays (at time indices [nt, nt+nt_pad)), and the
+// samples to the left are in the 'pp_intensity' and 'pp_weights' arrays, which have shape (nfreq, nt_pad).
+// Note that this is the same layout as the arguments to wi_transform::process_chunk(), if nt_prepad
+// and nt_postpad are both equal to nt_pad.
+//
+// Rows are processed in batches of S, with one row per simd lane (as in _kernel_detrend_t()).  Rather
+// than refitting from scratch in each step, the (matrix, vector) moments of the window are updated
+// incrementally: the step which leaves the window is subtracted, the Legendre basis is shifted to
+// the new window center (P_j(z-delta) is a linear combination of P_0(z) ... P_j(z), so this is a
+// fixed linear transformation of the moments), and the step which enters the window is added.
+//
+// The subtraction doesn't cancel exactly, and the shift amplifies the residual by a factor which grows
+// rapidly with the total distance shifted and the polynomial degree.  Therefore, the moments are recomputed
+// from scratch whenever the window has moved by 2/(N+1) of its length (empirically, this keeps the result
+// within float roundoff of a direct fit for N <= 21).  The amortized cost is ((N+1)/2 + 2) (matrix, vector)
+// accumulations per sample, independent of nt_window.  We recommend T=double here.
+//
+// In steps where the fit is poorly conditioned (or the window contains fewer than N unmasked samples),
+// the intensity is unmodified and the weights are set to zero.
+//
+// The 'scratch' array must have length at least 2*S*(nt+2*nt_pad).  It is used to store a transposed
+// copy of the undetrended data, with one row per simd lane.
+
+
+// _kernel_legshift_matrix<N> (A, delta): fills the (N,N) lower-triangular matrix A such that
+// P_j(z-delta) = sum_l A[j*N+l] P_l(z).  Uses the Legendre recurrence j P_j = (2j-1) z P_{j-1} - (j-1) P_{j-2},
+// together with z P_l = ((l+1) P_{l+1} + l P_{l-1}) / (2l+1).
+template<unsigned int N>
+inline void _kernel_legshift_matrix(double *A, double delta)
+{
+    for (unsigned int i = 0; i < N*N; i++)
+	A[i] = 0.0;
+
+    for (unsigned int j = 0; j < N; j++) {
+	double *a = A + j*N;
 
-	if (flags.is_all_ones())
+	if (j == 0) {
+	    a[0] = 1.0;
 	    continue;
+	}
+
+	// a = (2j-1)/j * (z-delta) * A[j-1]
+	const double *a1 = A + (j-1)*N;
+	double c = double(2*j-1) / double(j);
+
+	for (unsigned int l = 0; l < j; l++) {
+	    a[l+1] += c * a1[l] * double(l+1) / double(2*l+1);
+	    if (l > 0)
+		a[l-1] += c * a1[l] * double(l) / double(2*l+1);
+	    a[l] -= c * delta * a1[l];
+	}
+
+	// a -= (j-1)/j * A[j-2]
+	if (j >= 2) {
+	    const double *a2 = A + (j-2)*N;
+	    for (unsigned int l = 0; l < j-1; l++)
+		a[l] -= double(j-1) / double(j) * a2[l];
+	}
+    }
+}
+
+
+// _kernel_flatten(p, x) and _kernel_unflatten(x, p): convert a simd_ntuple or simd_trimatrix to/from
+// an array of simd_t's.  Element (i,j) of a simd_trimatrix (where j <= i) is stored at index i*(i+1)/2 + j.
+
+template<typename T, unsigned int S>
+inline void _kernel_flatten(simd_t<T,S> *p, const simd_ntuple<T,S,0> &x) { }
+
+template<typename T, unsigned int S, unsigned int N, typename std::enable_if<(N>0),int>::type = 0>
+inline void _kernel_flatten(simd_t<T,S> *p, const simd_ntuple<T,S,N> &x)
+{
+    _kernel_flatten(p, x.v);
+    p[N-1] = x.x;
+}
+
+template<typename T, unsigned int S>
+inline void _kernel_unflatten(simd_ntuple<T,S,0> &x, const simd_t<T,S> *p) { }
+
+template<typename T, unsigned int S, unsigned int N, typename std::enable_if<(N>0),int>::type = 0>
+inline void _kernel_unflatten(simd_ntuple<T,S,N> &x, const simd_t<T,S> *p)
+{
+    _kernel_unflatten(x.v, p);
+    x.x = p[N-1];
+}
+
+template<typename T, unsigned int S>
+inline void _kernel_flatten(simd_t<T,S> *p, const simd_trimatrix<T,S,0> &x) { }
+
+template<typename T, unsigned int S, unsigned int N, typename std::enable_if<(N>0),int>::type = 0>
+inline void _kernel_flatten(simd_t<T,S> *p, const simd_trimatrix<T,S,N> &x)
+{
+    _kernel_flatten(p, x.m);
+    _kernel_flatten(p + ((N-1)*N)/2, x.v);
+}
+
+template<typename T, unsigned int S>
+inline void _kernel_unflatten(simd_trimatrix<T,S,0> &x, const simd_t<T,S> *p) { }
+
+template<typename T, unsigned int S, unsigned int N, typename std::enable_if<(N>0),int>::type = 0>
+inline void _kernel_unflatten(simd_trimatrix<T,S,N> &x, const simd_t<T,S> *p)
+{
+    _kernel_unflatten(x.m, p);
+    _kernel_unflatten(x.v, p + ((N-1)*N)/2);
+}
+
+
+// Shifts the (matrix, vector) moments to a new Legendre basis: xmat -> A xmat A^T, xvec -> A xvec.
+template<typename T, unsigned int S, unsigned int N>
+inline void _kernel_sliding_shift(simd_trimatrix<T,S,N> &xmat, simd_ntuple<T,S,N> &xvec, const double *A)
+{
+    simd_t<T,S> m[(N*(N+1))/2];
+    simd_t<T,S> v[N];
+    simd_t<T,S> b[N*N];
+
+    _kernel_flatten(m, xmat);
+    _kernel_flatten(v, xvec);
+
+    // b = A xmat (full NxN, using the symmetry of xmat)
+    for (unsigned int i = 0; i < N; i++) {
+	for (unsigned int l = 0; l < N; l++) {
+	    simd_t<T,S> t = simd_t<T,S>::zero();
+	    for (unsigned int j = 0; j <= i; j++) {
+		const simd_t<T,S> &mjl = (j >= l) ? m[(j*(j+1))/2 + l] : m[(l*(l+1))/2 + j];
+		t += simd_t<T,S>(A[i*N+j]) * mjl;
+	    }
+	    b[i*N+l] = t;
+	}
+    }
+
+    // xmat = b A^T (lower triangle only)
+    for (unsigned int i = 0; i < N; i++) {
+	for (unsigned int k = 0; k <= i; k++) {
+	    simd_t<T,S> t = simd_t<T,S>::zero();
+	    for (unsigned int l = 0; l <= k; l++)
+		t += b[i*N+l] * simd_t<T,S>(A[k*N+l]);
+	    m[(i*(i+1))/2 + k] = t;
+	}
+    }
+
+    // xvec = A xvec (in place, by iterating i downwards)
+    for (int i = N-1; i >= 0; i--) {
+	simd_t<T,S> t = simd_t<T,S>::zero();
+	for (int j = 0; j <= i; j++)
+	    t += simd_t<T,S>(A[i*N+j]) * v[j];
+	v[i] = t;
+    }
 
-	// If we get here, then partial zeroing of the weights array is needed.
-	_kernel_colzero_partial<T,S> (wvec, nfreq, stride, flags);
+    _kernel_unflatten(xmat, m);
+    _kernel_unflatten(xvec, v);
+}
+
+
+// Adds (sign=1) or subtracts (sign=-1) the contribution of one step to the window moments.  The arrays
+// 'ibuf', 'wbuf' are in transposed form (one row per simd lane), and 'z0' is the Legendre coordinate
+// of the first sample.  The 'count' vector is the number of samples with nonzero weight.
+template<typename T, unsigned int S, unsigned int N>
+inline void _kernel_sliding_accum(simd_trimatrix<T,S,N> &xmat, simd_ntuple<T,S,N> &xvec, simd_t<T,S> &count,
+				  const float *ibuf, const float *wbuf, int nt_step, T z0, T dz, T sign)
+{
+    const simd_t<T,S> zero = simd_t<T,S>::zero();
+    const simd_t<T,S> one = simd_t<T,S>(sign);
+
+    for (int i = 0; i < nt_step; i++) {
+	simd_t<T,S> ival = _kernel_loadu_f<T,S> (ibuf + i*S);
+	simd_t<T,S> wval = _kernel_loadu_f<T,S> (wbuf + i*S);
+
+	simd_ntuple<T,S,N> pvec;
+	_kernel_legpoly_eval(pvec, simd_t<T,S>(z0 + i*dz));
+
+	count += one.apply_mask(wval.compare_gt(zero));
+	_kernel_detrend_accum_mv(xmat, xvec, pvec, ival, simd_t<T,S>(sign) * wval);
+    }
+}
+
+
+template<typename T, unsigned int S, unsigned int N>
+inline void _kernel_detrend_t_sliding(int nfreq, int nt, float *intensity, float *weights, int stride,
+				      const float *pp_intensity, const float *pp_weights, int pp_stride,
+				      int nt_step, int nt_window, double epsilon, float *scratch)
+{
+    // Caller should have asserted these already, but rechecking here should have negligible overhead
+    if (_unlikely((nt_step <= 0) || (nt % nt_step) || (nt_window % (2*nt_step) != nt_step)))
+	throw std::runtime_error("rf_pipelines internal error: bad (nt, nt_step, nt_window) in _kernel_detrend_t_sliding()");
+
+    const int m = (nt_window - nt_step) / (2*nt_step);
+    const int nt_pad = m * nt_step;
+    const int nt_tot = nt + 2*nt_pad;
+    const int nsteps = nt / nt_step;
+    const int nresync = std::max((2*m+1) / int((N+1)/2), 1);
+
+    // Legendre coordinate z = (2/nt_window) * (time offset from window center).
+    const T dz = 2.0 / T(nt_window);
+    const T zc = -0.5 * T(nt_step-1) * dz;   // value of z at the first sample of the central step
+
+    double A[N*N];
+    _kernel_legshift_matrix<N> (A, nt_step * dz);
+
+    float *ibuf = scratch;
+    float *wbuf = scratch + S * nt_tot;
+
+    for (int ifreq0 = 0; ifreq0 < nfreq; ifreq0 += S) {
+	int nrows = std::min(nfreq - ifreq0, int(S));
+
+	// Transposed copy of the undetrended data, including padding.  Unused lanes have zero weight.
+	for (int j = 0; j < int(S); j++) {
+	    if (j >= nrows) {
+		for (int it = 0; it < nt_tot; it++)
+		    ibuf[it*S+j] = wbuf[it*S+j] = 0.0f;
+		continue;
+	    }
+
+	    const float *pi = pp_intensity + (ifreq0+j) * pp_stride;
+	    const float *pw = pp_weights + (ifreq0+j) * pp_stride;
+	    const float *ci = intensity + (ifreq0+j) * stride;
+	    const float *cw = weights + (ifreq0+j) * stride;
+
+	    for (int it = 0; it < nt_pad; it++) {
+		ibuf[it*S+j] = pi[it];
+		wbuf[it*S+j] = pw[it];
+	    }
+	    for (int it = nt_pad; it < nt_tot; it++) {
+		ibuf[it*S+j] = ci[it-nt_pad];
+		wbuf[it*S+j] = cw[it-nt_pad];
+	    }
+	}
+
+	simd_trimatrix<T,S,N> wmat;
+	simd_ntuple<T,S,N> wvec;
+	simd_t<T,S> count;
+
+	for (int istep = 0; istep < nsteps; istep++) {
+	    if (istep % nresync == 0) {
+		// Compute moments of the window (centered on step 'istep') from scratch.
+		wmat.setzero();
+		wvec.setzero();
+		count = simd_t<T,S>::zero();
+
+		for (int d = -m; d <= m; d++) {
+		    int it = (istep+m+d) * nt_step;
+		    _kernel_sliding_accum(wmat, wvec, count, ibuf + it*S, wbuf + it*S, nt_step, zc + d*nt_step*dz, dz, T(1));
+		}
+	    }
+	    else {
+		// Advance the window by one step.
+		int it0 = (istep-1) * nt_step;
+		int it1 = (istep+2*m) * nt_step;
+
+		_kernel_sliding_accum(wmat, wvec, count, ibuf + it0*S, wbuf + it0*S, nt_step, zc - m*nt_step*dz, dz, T(-1));
+		_kernel_sliding_shift(wmat, wvec, A);
+		_kernel_sliding_accum(wmat, wvec, count, ibuf + it1*S, wbuf + it1*S, nt_step, zc + m*nt_step*dz, dz, T(1));
+	    }
+
+	    simd_trimatrix<T,S,N> xmat = wmat;
+	    simd_ntuple<T,S,N> xvec = wvec;
+
+	    smask_t<T,S> flags = xmat.cholesky_in_place_checked(epsilon);
+	    flags = flags.bitwise_and(count.compare_ge(simd_t<T,S>(T(N))));
+
+	    // Lanes where the fit is poorly conditioned are zeroed here, so that the intensity is unmodified.
+	    xvec = xvec.apply_mask(flags);
+
+	    xmat.solve_lower_in_place(xvec);
+	    xmat.solve_upper_in_place(xvec);
+
+	    T good[S];
+	    simd_t<T,S>(1.0).apply_mask(flags).storeu(good);
+
+	    // Subtract the fit from the central step.
+	    int it = (istep+m) * nt_step;
+
+	    for (int i = 0; i < nt_step; i++) {
+		simd_ntuple<T,S,N> pvec;
+		_kernel_legpoly_eval(pvec, simd_t<T,S>(zc + i*dz));
+
+		simd_t<T,S> ival = _kernel_loadu_f<T,S> (ibuf + (it+i)*S);
+		ival = pvec._vertical_dotn(xvec, ival);
+
+		float out[S];
+		_kernel_storeu_f<T,S> (out, ival);
+
+		for (int j = 0; j < nrows; j++) {
+		    intensity[(ifreq0+j)*stride + istep*nt_step + i] = out[j];
+		    if (!good[j])
+			weights[(ifreq0+j)*stride + istep*nt_step + i] = 0.0f;
+		}
+	    }
+	}
     }
 }
 
@@ -0,0 +1,322 @@
+#ifndef _RF_PIPELINES_KERNELS_SPLINE_HPP
+#define _RF_PIPELINES_KERNELS_SPLINE_HPP
+
+#include "polyfit.hpp"
+
+namespace rf_pipelines {
+#if 0
+}; // pacify emacs c-mode
+#endif
+
+
+// -------------------------------------------------------------------------------------------------
+//
+// Cubic B-spline detrending kernels.
+//
+// The detrending axis (of length 'nx') is divided into nb = nx/nx_knot bins of length 'nx_knot',
+// with knots at the bin boundaries, and the model is a linear combination of the (nb+3) uniform
+// cubic B-splines B_0 ... B_{nb+2}.  In bin b, only B_b ... B_{b+3} are nonzero, and their values
+// only depend on the position within the bin, so the basis is precomputed once (as a 4-by-nx_knot
+// array, see _spline_basis_init()) and shared by all bins.
+//
+// Since each sample contributes to a 4-by-4 block of the normal equations, the normal matrix is
+// banded (with three subdiagonals), and the fit is an O(nb) banded Cholesky solve.  We store the
+// lower band in "lane-major" form: L[(i*4+d)*S + j] is element (i,i-d) of the matrix in simd lane j,
+// followed by the vector (length nb+3).  Each lane is an independent fit (a row if axis=AXIS_TIME,
+// or a column if axis=AXIS_FREQ).  Thus the 'scratch' arg to the kernels below must have length
+// at least 5*(nb+3)*S.
+//
+// A basis function whose Cholesky pivot is poorly conditioned (relative to its diagonal element,
+// with threshold 'epsilon', as in the polynomial detrender) is dropped from the fit, rather than
+// masking the whole row.  This happens when there are few unmasked samples in the support of the
+// basis function, and only affects the fit locally.  The weights are never modified.
+
+
+// Precomputes the values of the four nonzero basis functions at the centers of the nx_knot samples
+// in a bin.  The 'basis' array has length 4*nx_knot, and basis[a*nx_knot + r] is the value of B_{b+a}
+// at sample r of bin b.
+inline void _spline_basis_init(float *basis, int nx_knot)
+{
+    for (int r = 0; r < nx_knot; r++) {
+	double u = (r + 0.5) / double(nx_knot);
+	double v = 1.0 - u;
+
+	basis[r] = v*v*v / 6.0;
+	basis[nx_knot + r] = (3.0*u*u*u - 6.0*u*u + 4.0) / 6.0;
+	basis[2*nx_knot + r] = (-3.0*u*u*u + 3.0*u*u + 3.0*u + 1.0) / 6.0;
+	basis[3*nx_knot + r] = u*u*u / 6.0;
+    }
+}
+
+
+// Per-bin accumulators: the 4-by-4 block of the normal matrix (lower triangle, in the order
+// (0,0), (1,0), (1,1), (2,0), ...) and the length-4 block of the normal vector.
+template<typename T, unsigned int S>
+struct _spline_accum {
+    simd_t<T,S> m[10];
+    simd_t<T,S> v[4];
+
+    inline void setzero()
+    {
+	for (int i = 0; i < 10; i++)
+	    m[i] = simd_t<T,S>::zero();
+	for (int i = 0; i < 4; i++)
+	    v[i] = simd_t<T,S>::zero();
+    }
+
+    inline void accum(const simd_t<T,S> *b, simd_t<T,S> ival, simd_t<T,S> wval)
+    {
+	simd_t<T,S> wi = wval * ival;
+
+	for (int c = 0, k = 0; c < 4; c++) {
+	    simd_t<T,S> wb = wval * b[c];
+	    for (int a = 0; a <= c; a++, k++)
+		m[k] += wb * b[a];
+	    v[c] += wi * b[c];
+	}
+    }
+
+    inline void horizontal_sum_in_place()
+    {
+	for (int i = 0; i < 10; i++)
+	    m[i] = m[i].horizontal_sum();
+	for (int i = 0; i < 4; i++)
+	    v[i] = v[i].horizontal_sum();
+    }
+
+    // Adds the accumulators for bin b to the (lane-major) band matrix and vector, in the lanes
+    // selected by 'mask'.
+    inline void add_to_band(T *band, T *vec, int b, const smask_t<T,S> &mask) const
+    {
+	for (int c = 0, k = 0; c < 4; c++) {
+	    for (int a = 0; a <= c; a++, k++) {
+		T *p = band + ((b+c)*4 + (c-a)) * S;
+		simd_t<T,S> x = simd_t<T,S>::loadu(p) + m[k].apply_mask(mask);
+		x.storeu(p);
+	    }
+
+	    T *p = vec + (b+c) * S;
+	    simd_t<T,S> x = simd_t<T,S>::loadu(p) + v[c].apply_mask(mask);
+	    x.storeu(p);
+	}
+    }
+};
+
+
+// In-place banded Cholesky factorization and solve.  On output, 'vec' contains the spline
+// coefficients (with dropped basis functions set to zero).  The number of basis functions is 'n'.
+template<typename T, unsigned int S>
+inline void _spline_band_solve(T *band, T *vec, int n, double epsilon)
+{
+    const simd_t<T,S> zero = simd_t<T,S>::zero();
+    const simd_t<T,S> one = simd_t<T,S>(1.0);
+    const simd_t<T,S> eps2 = simd_t<T,S>(epsilon * epsilon);
+
+    auto L = [band](int i, int d) -> T * { return band + (i*4+d) * S; };
+
+    // Factorization.  A dropped basis function i is represented by L(i,0)=1, L(i,d)=0 and L(i',i'-i)=0,
+    // which is equivalent to removing row and column i from the normal matrix.  We keep track of dropped
+    // functions by temporarily storing a zero in L(i,0), and fixing it after the solve.
+
+    for (int i = 0; i < n; i++) {
+	int dmax = std::min(i, 3);
+
+	for (int d = dmax; d >= 1; d--) {
+	    int j = i - d;
+	    simd_t<T,S> s = simd_t<T,S>::loadu(L(i,d));
+
+	    for (int k = i-dmax; k < j; k++)
+		s -= simd_t<T,S>::loadu(L(i,i-k)) * simd_t<T,S>::loadu(L(j,j-k));
+
+	    simd_t<T,S> ljj = simd_t<T,S>::loadu(L(j,0));
+	    smask_t<T,S> dropped = ljj.compare_eq(zero);
+	    s = blendv(dropped, zero, s / blendv(dropped, one, ljj));
+	    s.storeu(L(i,d));
+	}
+
+	simd_t<T,S> a = simd_t<T,S>::loadu(L(i,0));
+	simd_t<T,S> s = a;
+
+	for (int k = i-dmax; k < i; k++) {
+	    simd_t<T,S> t = simd_t<T,S>::loadu(L(i,i-k));
+	    s -= t * t;
+	}
+
+	smask_t<T,S> good = s.compare_gt(eps2 * a);
+	s = blendv(good, s, one).sqrt();
+	s.apply_mask(good).storeu(L(i,0));
+    }
+
+    // Forward substitution.
+    for (int i = 0; i < n; i++) {
+	simd_t<T,S> y = simd_t<T,S>::loadu(vec + i*S);
+
+	for (int d = 1; d <= std::min(i,3); d++)
+	    y -= simd_t<T,S>::loadu(L(i,d)) * simd_t<T,S>::loadu(vec + (i-d)*S);
+
+	simd_t<T,S> lii = simd_t<T,S>::loadu(L(i,0));
+	smask_t<T,S> dropped = lii.compare_eq(zero);
+	y = blendv(dropped, zero, y / blendv(dropped, one, lii));
+	y.storeu(vec + i*S);
+    }
+
+    // Back substitution.
+    for (int i = n-1; i >= 0; i--) {
+	simd_t<T,S> c = simd_t<T,S>::loadu(vec + i*S);
+
+	for (int d = 1; (d <= 3) && (i+d < n); d++)
+	    c -= simd_t<T,S>::loadu(L(i+d,d)) * simd_t<T,S>::loadu(vec + (i+d)*S);
+
+	simd_t<T,S> lii = simd_t<T,S>::loadu(L(i,0));
+	smask_t<T,S> dropped = lii.compare_eq(zero);
+	c = blendv(dropped, zero, c / blendv(dropped, one, lii));
+	c.storeu(vec + i*S);
+    }
+}
+
+
+// -------------------------------------------------------------------------------------------------
+//
+// _kernel_spline_detrend_t<T,S> (nfreq, nt, intensity, weights, stride, nx_knot, basis, epsilon, scratch)
+//
+// Detrend along time (=fastest varying) axis.  The knot spacing 'nx_knot' must be a multiple of S,
+// and 'nt' must be a multiple of nx_knot.  As in _kernel_detrend_t(), rows are processed in batches
+// of S, and each row's per-bin sums are horizontally summed into one simd lane of the band matrix.
+
+
+template<typename T, unsigned int S>
+inline void _kernel_spline_detrend_t(int nfreq, int nt, float *intensity, const float *weights, int stride, int nx_knot, const float *basis, double epsilon, T *scratch)
+{
+    // Caller should have asserted this already, but rechecking here should have negligible overhead
+    if (_unlikely((nx_knot % S) || (nt % nx_knot)))
+	throw std::runtime_error("rf_pipelines internal error: bad (nt, nx_knot) in _kernel_spline_detrend_t()");
+
+    const simd_t<T,S> lanes = simd_t<T,S>::range();
+    const int nb = nt / nx_knot;
+    const int n = nb + 3;
+
+    T *band = scratch;
+    T *vec = scratch + 4*n*S;
+
+    for (int ifreq0 = 0; ifreq0 < nfreq; ifreq0 += S) {
+	int nrows = std::min(nfreq - ifreq0, int(S));
+
+	for (int i = 0; i < 5*n*int(S); i++)
+	    scratch[i] = 0;
+
+	for (int j = 0; j < nrows; j++) {
+	    const float *ivec = intensity + (ifreq0+j) * stride;
+	    const float *wvec = weights + (ifreq0+j) * stride;
+	    smask_t<T,S> mask = lanes.compare_eq(simd_t<T,S>(j));
+
+	    for (int b = 0; b < nb; b++) {
+		_spline_accum<T,S> acc;
+		acc.setzero();
+
+		for (int r = 0; r < nx_knot; r += S) {
+		    simd_t<T,S> bvec[4];
+		    for (int a = 0; a < 4; a++)
+			bvec[a] = _kernel_loadu_f<T,S> (basis + a*nx_knot + r);
+
+		    simd_t<T,S> ival = _kernel_loadu_f<T,S> (ivec + b*nx_knot + r);
+		    simd_t<T,S> wval = _kernel_loadu_f<T,S> (wvec + b*nx_knot + r);
+		    acc.accum(bvec, ival, wval);
+		}
+
+		acc.horizontal_sum_in_place();
+		acc.add_to_band(band, vec, b, mask);
+	    }
+	}
+
+	_spline_band_solve<T,S> (band, vec, n, epsilon);
+
+	for (int j = 0; j < nrows; j++) {
+	    float *ivec = intensity + (ifreq0+j) * stride;
+
+	    for (int b = 0; b < nb; b++) {
+		simd_t<T,S> c[4];
+		for (int a = 0; a < 4; a++)
+		    c[a] = simd_t<T,S> (vec[(b+a)*S + j]);
+
+		for (int r = 0; r < nx_knot; r += S) {
+		    simd_t<T,S> ival = _kernel_loadu_f<T,S> (ivec + b*nx_knot + r);
+		    for (int a = 0; a < 4; a++)
+			ival -= c[a] * _kernel_loadu_f<T,S> (basis + a*nx_knot + r);
+		    _kernel_storeu_f<T,S> (ivec + b*nx_knot + r, ival);
+		}
+	    }
+	}
+    }
+}
+
+
+// -------------------------------------------------------------------------------------------------
+//
+// _kernel_spline_detrend_f<T,S> (nfreq, nt, intensity, weights, stride, nx_knot, basis, epsilon, scratch)
+//
+// Detrend along frequency (=slowest varying) axis.  Here 'nfreq' must be a multiple of nx_knot, and
+// 'nt' must be a multiple of S.  Each block of S columns is fit with one column per simd lane, so no
+// horizontal sums are needed.
+
+
+template<typename T, unsigned int S>
+inline void _kernel_spline_detrend_f(int nfreq, int nt, float *intensity, const float *weights, int stride, int nx_knot, const float *basis, double epsilon, T *scratch)
+{
+    // Caller should have asserted this already, but rechecking here should have negligible overhead
+    if (_unlikely((nt % S) || (nfreq % nx_knot)))
+	throw std::runtime_error("rf_pipelines internal error: bad (nfreq, nt, nx_knot) in _kernel_spline_detrend_f()");
+
+    const smask_t<T,S> all = simd_t<T,S>::zero().compare_eq(simd_t<T,S>::zero());
+    const int nb = nfreq / nx_knot;
+    const int n = nb + 3;
+
+    T *band = scratch;
+    T *vec = scratch + 4*n*S;
+
+    for (int it0 = 0; it0 < nt; it0 += S) {
+	float *ivec = intensity + it0;
+	const float *wvec = weights + it0;
+
+	for (int i = 0; i < 5*n*int(S); i++)
+	    scratch[i] = 0;
+
+	for (int b = 0; b < nb; b++) {
+	    _spline_accum<T,S> acc;
+	    acc.setzero();
+
+	    for (int r = 0; r < nx_knot; r++) {
+		simd_t<T,S> bvec[4];
+		for (int a = 0; a < 4; a++)
+		    bvec[a] = simd_t<T,S> (basis[a*nx_knot + r]);
+
+		int ifreq = b*nx_knot + r;
+		simd_t<T,S> ival = _kernel_loadu_f<T,S> (ivec + ifreq*stride);
+		simd_t<T,S> wval = _kernel_loadu_f<T,S> (wvec + ifreq*stride);
+		acc.accum(bvec, ival, wval);
+	    }
+
+	    acc.add_to_band(band, vec, b, all);
+	}
+
+	_spline_band_solve<T,S> (band, vec, n, epsilon);
+
+	for (int b = 0; b < nb; b++) {
+	    simd_t<T,S> c[4];
+	    for (int a = 0; a < 4; a++)
+		c[a] = simd_t<T,S>::loadu(vec + (b+a)*S);
+
+	    for (int r = 0; r < nx_knot; r++) {
+		int ifreq = b*nx_knot + r;
+		simd_t<T,S> ival = _kernel_loadu_f<T,S> (ivec + ifreq*stride);
+		for (int a = 0; a < 4; a++)
+		    ival -= c[a] * simd_t<T,S> (basis[a*nx_knot + r]);
+		_kernel_storeu_f<T,S> (ivec + ifreq*stride, ival);
+	    }
+	}
+    }
+}
+
+
+}  // namespace rf_pipelines
+
+#endif  // _RF_PIPELINES_KERNELS_SPLINE_HPP
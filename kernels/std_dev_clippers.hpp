@@ -11,7 +11,7 @@ namespace rf_pipelines {
 
 
 // Defined in std_dev_clippers.cpp
-extern void clip_1d(int n, float *tmp_sd, smask_t<float,1> *tmp_valid, double sigma);
+extern void clip_1d(int n, float *tmp_sd, smask_t<float,1> *tmp_valid, double sigma, int niter, double iter_sigma);
 
 
 // Stores temporary buffers which are needed in the std_dev_clipper kernels.
@@ -24,12 +24,17 @@ struct std_dev_clipper_buffers {
     T *ds_intensity = NULL;
     T *ds_weights = NULL;
 
+    // False if the buffers are borrowed from a clipper_workspace (and shouldn't be freed).
+    bool owns_memory = true;
+
     ~std_dev_clipper_buffers()
     {
-	free(sd);
-	free(sd_valid);
-	free(ds_intensity);
-	free(ds_weights);
+	if (owns_memory) {
+	    free(sd);
+	    free(sd_valid);
+	    free(ds_intensity);
+	    free(ds_weights);
+	}
 
 	sd = ds_intensity = ds_weights = NULL;
 	sd_valid = NULL;
@@ -69,11 +74,11 @@ inline void _kernel_std_dev_t(const std_dev_clipper_buffers<T> &buf, const T *in
 
 
 template<typename T, unsigned int S, unsigned int Df, unsigned int Dt, bool TwoPass>
-inline void _kernel_std_dev_clip_time_axis(const std_dev_clipper_buffers<T> &buf, const T *intensity, T *weights, int nfreq, int nt, int stride, double sigma)
+inline void _kernel_std_dev_clip_time_axis(const std_dev_clipper_buffers<T> &buf, const T *intensity, T *weights, int nfreq, int nt, int stride, int niter, double sigma, double iter_sigma)
 {
     _kernel_std_dev_t<T,S,Df,Dt,TwoPass> (buf, intensity, weights, nfreq, nt, stride);
 
-    clip_1d(nfreq/Df, buf.sd, buf.sd_valid, sigma);
+    clip_1d(nfreq/Df, buf.sd, buf.sd_valid, sigma, niter, iter_sigma);
 
     for (int i = 0; i < nfreq/Df; i++) {
 	if (buf.sd_valid[i])
@@ -122,11 +127,11 @@ inline void _kernel_std_dev_f(const std_dev_clipper_buffers<T> &buf, const T *in
 
 
 template<typename T, unsigned int S, unsigned int Df, unsigned int Dt, bool TwoPass>
-inline void _kernel_std_dev_clip_freq_axis(const std_dev_clipper_buffers<T> &buf, const T *intensity, T *weights, int nfreq, int nt, int stride, double sigma)
+inline void _kernel_std_dev_clip_freq_axis(const std_dev_clipper_buffers<T> &buf, const T *intensity, T *weights, int nfreq, int nt, int stride, int niter, double sigma, double iter_sigma)
 {
     _kernel_std_dev_f<T,S,Df,Dt,TwoPass> (buf, intensity, weights, nfreq, nt, stride);
 
-    clip_1d(nt/Dt, buf.sd, buf.sd_valid, sigma);
+    clip_1d(nt/Dt, buf.sd, buf.sd_valid, sigma, niter, iter_sigma);
 
     _kernel_mask_columns<T,S,Dt> (weights, buf.sd_valid, nfreq, nt, stride);
 }
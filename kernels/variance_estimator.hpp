@@ -0,0 +1,103 @@
+#ifndef _RF_PIPELINES_KERNELS_VARIANCE_ESTIMATOR_HPP
+#define _RF_PIPELINES_KERNELS_VARIANCE_ESTIMATOR_HPP
+
+#include "mean_variance.hpp"
+
+namespace rf_pipelines {
+#if 0
+}; // pacify emacs c-mode
+#endif
+
+
+// -------------------------------------------------------------------------------------------------
+//
+// _v1_visitor: like _mean_visitor (without downsampling), but also counts the number of samples
+// with nonzero weight.  The variance_estimator uses the count to decide whether a "v1" block is
+// too heavily masked to give a meaningful variance.
+
+
+template<typename T_, unsigned int S_>
+struct _v1_visitor {
+    using T = T_;
+    static constexpr unsigned int S = S_;
+
+    const simd_t<T,S> zero;
+    const simd_t<T,S> one;
+
+    simd_t<T,S> acc0;
+    simd_t<T,S> acc1;
+    simd_t<T,S> count;
+
+    _v1_visitor() :
+	zero(simd_t<T,S>::zero()), one(simd_t<T,S>(1.0))
+    {
+	acc0 = simd_t<T,S>::zero();
+	acc1 = simd_t<T,S>::zero();
+	count = simd_t<T,S>::zero();
+    }
+
+    inline void accumulate_i(simd_t<T,S> ival, simd_t<T,S> wval)
+    {
+	acc0 += wval;
+	acc1 += wval * ival;
+	count += one.apply_mask(wval.compare_gt(zero));
+    }
+
+    inline void horizontal_sum()
+    {
+	acc0 = acc0.horizontal_sum();
+	acc1 = acc1.horizontal_sum();
+	count = count.horizontal_sum();
+    }
+
+    inline simd_t<T,S> get_mean() const
+    {
+	smask_t<T,S> valid = acc0.compare_gt(zero);
+	return acc1 / blendv(valid, acc0, one);
+    }
+};
+
+
+// -------------------------------------------------------------------------------------------------
+//
+// _kernel_v1_t(): computes the weighted variance in blocks of length 'v1_chunk' along the time axis,
+// in every frequency channel.  The output array has shape (nfreq, nt/v1_chunk) and stride 'out_stride'.
+//
+// Blocks with fewer than 'min_count' unmasked samples are assigned variance zero.  This follows the
+// python variance_estimator, where zero is used as a sentinel for "no estimate available".
+//
+// We always use the two-pass algorithm, since the v1 blocks are small enough to stay in L1 cache
+// between passes.  The caller is responsible for checking that v1_chunk is a multiple of S, and
+// that nt is a multiple of v1_chunk.
+
+
+template<typename T, unsigned int S>
+inline void _kernel_v1_t(T *out, int out_stride, const T *intensity, const T *weights, int nfreq, int nt, int stride, int v1_chunk, T min_count)
+{
+    int nv1 = nt / v1_chunk;
+
+    for (int ifreq = 0; ifreq < nfreq; ifreq++) {
+	for (int iv1 = 0; iv1 < nv1; iv1++) {
+	    const T *iblock = intensity + ifreq*stride + iv1*v1_chunk;
+	    const T *wblock = weights + ifreq*stride + iv1*v1_chunk;
+
+	    _v1_visitor<T,S> v;
+	    _kernel_visit_2d<1,1> (v, iblock, wblock, 1, v1_chunk, stride);
+
+	    if (v.count.template extract<0> () < min_count) {
+		out[ifreq*out_stride + iv1] = 0;
+		continue;
+	    }
+
+	    _variance_visitor<T,S> vv(v.get_mean());
+	    _kernel_visit_2d<1,1> (vv, iblock, wblock, 1, v1_chunk, stride);
+
+	    out[ifreq*out_stride + iv1] = vv.get_variance().template extract<0> ();
+	}
+    }
+}
+
+
+}  // namespace rf_pipelines
+
+#endif
@@ -29,6 +29,21 @@ ostream &operator<<(ostream &os, axis_type axis)
 }
 
 
+ostream &operator<<(ostream &os, detrender_precision precision)
+{
+    if (precision == PRECISION_FLOAT)
+	os << "PRECISION_FLOAT";
+    else if (precision == PRECISION_DOUBLE)
+	os << "PRECISION_DOUBLE";
+    else if (precision == PRECISION_MIXED)
+	os << "PRECISION_MIXED";
+    else
+	os << int(precision);
+
+    return os;
+}
+
+
 bool file_exists(const string &filename)
 {
     struct stat s;
@@ -114,4 +129,56 @@ void makedirs(const string &dirname)
 }
 
 
+// -------------------------------------------------------------------------------------------------
+
+
+int parallel_nthreads(int nthreads, int n, int granularity)
+{
+    rf_assert(granularity > 0);
+    rf_assert(n % granularity == 0);
+
+    if (nthreads <= 0)
+	nthreads = std::thread::hardware_concurrency();
+
+    return max(min(nthreads, n / granularity), 1);
+}
+
+
+void parallel_for(int nthreads, int n, int granularity, const function<void(int,int,int)> &f)
+{
+    nthreads = parallel_nthreads(nthreads, n, granularity);
+
+    int nblocks = n / granularity;
+    auto endpoint = [=](int ithread) { return int((ssize_t(nblocks) * ssize_t(ithread)) / nthreads) * granularity; };
+
+    if (nthreads == 1) {
+	f(0, 0, n);
+	return;
+    }
+
+    vector<std::thread> threads;
+    vector<exception_ptr> errors(nthreads);
+
+    auto thread_main = [&](int ithread) {
+	try {
+	    f(ithread, endpoint(ithread), endpoint(ithread+1));
+	} catch (...) {
+	    errors[ithread] = current_exception();
+	}
+    };
+
+    for (int ithread = 1; ithread < nthreads; ithread++)
+	threads.push_back(std::thread(thread_main, ithread));
+
+    thread_main(0);
+
+    for (auto &t: threads)
+	t.join();
+
+    for (auto &e: errors)
+	if (e)
+	    rethrow_exception(e);
+}
+
+
 }  // namespace rf_pipelines
@@ -0,0 +1,527 @@
+#include <deque>
+#include <mutex>
+#include "rf_pipelines_internals.hpp"
+
+#ifdef HAVE_PNG
+#include <png.h>
+#endif
+
+using namespace std;
+
+namespace rf_pipelines {
+#if 0
+}; // pacify emacs c-mode
+#endif
+
+
+// Parameter checking is shared by the stub make_plotter_transform() below (if compiled without libpng),
+// so that invalid arguments are reported the same way in all builds.
+
+static void check_params(int img_nfreq, int img_nt, int downsample_nt, int n_zoom, int nt_chunk, int clip_niter, double sigma_clip)
+{
+    static constexpr int S = constants::single_precision_simd_length;
+
+    if (_unlikely(img_nfreq <= 0))
+	throw runtime_error("rf_pipelines: make_plotter_transform(): img_nfreq=" + to_string(img_nfreq) + ", positive value was expected");
+
+    if (_unlikely((img_nt <= 0) || (img_nt % S)))
+	throw runtime_error("rf_pipelines: make_plotter_transform(): img_nt=" + to_string(img_nt)
+			    + " must be positive, and a multiple of constants::single_precision_simd_length=" + to_string(S));
+
+    if (_unlikely(downsample_nt <= 0))
+	throw runtime_error("rf_pipelines: make_plotter_transform(): downsample_nt=" + to_string(downsample_nt) + ", positive value was expected");
+
+    if (_unlikely((n_zoom <= 0) || (n_zoom > 16)))
+	throw runtime_error("rf_pipelines: make_plotter_transform(): n_zoom=" + to_string(n_zoom) + " must be between 1 and 16");
+
+    if (_unlikely(nt_chunk < 0))
+	throw runtime_error("rf_pipelines: make_plotter_transform(): nt_chunk=" + to_string(nt_chunk) + ", non-negative value was expected");
+
+    // The downsampling factor at max zoom level, multiplied by S, is computed in 64 bits, and must fit in an int.
+    ssize_t ds_max = ssize_t(downsample_nt) << (n_zoom-1);
+
+    if (_unlikely(ds_max * S > numeric_limits<int>::max()))
+	throw runtime_error("rf_pipelines: make_plotter_transform(): downsample_nt=" + to_string(downsample_nt) + " and n_zoom=" + to_string(n_zoom)
+			    + " give a downsampling factor at max zoom level (=" + to_string(ds_max) + ") which is too large");
+
+    if (_unlikely(nt_chunk % (ds_max * S)))
+	throw runtime_error("rf_pipelines: make_plotter_transform(): nt_chunk=" + to_string(nt_chunk) + " must be a multiple of the downsampling factor"
+			    + " at max zoom level (=" + to_string(ds_max) + "), multiplied by constants::single_precision_simd_length=" + to_string(S));
+
+    if (_unlikely(clip_niter < 1))
+	throw runtime_error("rf_pipelines: make_plotter_transform(): clip_niter=" + to_string(clip_niter) + " must be >= 1");
+
+    // Following assert in rf_pipelines.utils.write_png()
+    if (_unlikely(sigma_clip < 2.0))
+	throw runtime_error("rf_pipelines: make_plotter_transform(): sigma_clip=" + to_string(sigma_clip) + " must be >= 2.0");
+}
+
+
+#ifndef HAVE_PNG
+
+shared_ptr<wi_transform> make_plotter_transform(const string &img_prefix, int img_nfreq, int img_nt, int downsample_nt, int n_zoom, int nt_chunk, int clip_niter, double sigma_clip)
+{
+    check_params(img_nfreq, img_nt, downsample_nt, n_zoom, nt_chunk, clip_niter, sigma_clip);
+    throw runtime_error("make_plotter_transform() was called, but this rf_pipelines instance was compiled without libpng");
+}
+
+#else  // HAVE_PNG
+
+
+// -------------------------------------------------------------------------------------------------
+//
+// plot_image: an (img_nfreq, img_nt) buffer of downsampled intensity/weights, which is filled
+// by the pipeline thread, and then handed off to the plot_writer thread.
+
+
+struct plot_image {
+    const int nfreq;
+    const int nt;
+
+    vector<float> intensity;   // shape (nfreq, nt)
+    vector<float> weights;     // shape (nfreq, nt)
+    string filename;
+
+    plot_image(int nfreq_, int nt_) :
+	nfreq(nfreq_), nt(nt_), intensity(nfreq_ * nt_, 0.0), weights(nfreq_ * nt_, 0.0)
+    { }
+};
+
+
+// Writes a plot_image to disk.  The color scheme is the same as rf_pipelines.write_png() in python.
+static void write_plot_image(const plot_image &img, int clip_niter, double sigma_clip)
+{
+    const int nfreq = img.nfreq;
+    const int nt = img.nt;
+    const float *intensity = &img.intensity[0];
+    const float *weights = &img.weights[0];
+
+    float wmax = 0.0;
+    for (int i = 0; i < nfreq*nt; i++)
+	wmax = max(wmax, weights[i]);
+
+    float mean = 0.0;
+    float rms = 1.0;
+
+    // If the array is completely masked, we fall through and write an all-black image.
+    if (wmax > 0.0) {
+	weighted_mean_and_rms(mean, rms, intensity, weights, nfreq, nt, nt, clip_niter, sigma_clip);
+	if (rms <= 0.0)
+	    rms = 1.0;
+    }
+
+    // Rows of the image correspond to frequency channels.  Since rf_pipelines uses a frequency
+    // channel ordering from highest frequency to lowest, the lowest frequency is on the bottom.
+    vector<png_byte> rgb(3 * nfreq * nt, 0);
+
+    for (int ifreq = 0; ifreq < nfreq; ifreq++) {
+	for (int it = 0; it < nt; it++) {
+	    float w = weights[ifreq*nt + it];
+	    if (w <= 0.0)
+		continue;
+
+	    float color = 0.5 + 0.16 * (intensity[ifreq*nt + it] - mean) / rms;
+	    color = min(max(color, 0.0001f), 0.9999f);
+	    w = min(w / wmax, 1.0f);
+
+	    png_byte *p = &rgb[3 * (ifreq*nt + it)];
+	    p[0] = png_byte(256. * color * w);
+	    p[2] = png_byte(256. * (1.-color) * w);
+	}
+    }
+
+    FILE *fp = fopen(img.filename.c_str(), "wb");
+    if (!fp)
+	throw runtime_error("rf_pipelines plotter_transform: couldn't open file " + img.filename);
+
+    png_structp png_ptr = png_create_write_struct(PNG_LIBPNG_VER_STRING, NULL, NULL, NULL);
+    png_infop info_ptr = png_ptr ? png_create_info_struct(png_ptr) : NULL;
+
+    if (!png_ptr || !info_ptr || setjmp(png_jmpbuf(png_ptr))) {
+	png_destroy_write_struct(&png_ptr, &info_ptr);
+	fclose(fp);
+	throw runtime_error("rf_pipelines plotter_transform: libpng error while writing " + img.filename);
+    }
+
+    png_init_io(png_ptr, fp);
+    png_set_IHDR(png_ptr, info_ptr, nt, nfreq, 8, PNG_COLOR_TYPE_RGB, PNG_INTERLACE_NONE, PNG_COMPRESSION_TYPE_DEFAULT, PNG_FILTER_TYPE_DEFAULT);
+    png_write_info(png_ptr, info_ptr);
+
+    for (int ifreq = 0; ifreq < nfreq; ifreq++)
+	png_write_row(png_ptr, &rgb[3 * ifreq * nt]);
+
+    png_write_end(png_ptr, NULL);
+    png_destroy_write_struct(&png_ptr, &info_ptr);
+
+    if (fclose(fp) != 0)
+	throw runtime_error("rf_pipelines plotter_transform: write to " + img.filename + " failed");
+}
+
+
+// -------------------------------------------------------------------------------------------------
+//
+// plot_writer: background thread which encodes and writes PNG files, so that the pipeline
+// thread doesn't block on compression or file I/O.
+//
+// The plot_writer owns a fixed pool of spare plot_images.  When the pipeline thread finishes an
+// image, it swaps it for a spare image with swap_image().  The spare is zeroed by the writer
+// thread after its PNG is written.  If the writer falls behind, swap_image() blocks, so memory
+// usage is bounded.
+//
+// Exceptions thrown in the writer thread are rethrown in the pipeline thread, on the next call
+// to swap_image() or wait_until_idle().
+
+
+class plot_writer {
+public:
+    const int clip_niter;
+    const double sigma_clip;
+
+    plot_writer(int nspare, int nfreq, int nt, int clip_niter_, double sigma_clip_) :
+	clip_niter(clip_niter_), sigma_clip(sigma_clip_)
+    {
+	for (int i = 0; i < nspare; i++)
+	    spares.push_back(make_unique<plot_image> (nfreq, nt));
+
+	this->thread = std::thread(&plot_writer::thread_main, this);
+    }
+
+    ~plot_writer()
+    {
+	unique_lock<mutex> l(lock);
+	this->is_shutdown = true;
+	l.unlock();
+
+	cond.notify_all();
+	thread.join();
+    }
+
+    // Noncopyable
+    plot_writer(const plot_writer &) = delete;
+    plot_writer &operator=(const plot_writer &) = delete;
+
+
+    // Called by pipeline thread: enqueues 'img' for writing, and replaces it with a zeroed image.
+    void swap_image(unique_ptr<plot_image> &img)
+    {
+	unique_lock<mutex> l(lock);
+
+	while (spares.empty() && error_msg.empty())
+	    cond.wait(l);
+
+	if (!error_msg.empty())
+	    throw runtime_error(error_msg);
+
+	queue.push_back(std::move(img));
+	img = std::move(spares.front());
+	spares.pop_front();
+	l.unlock();
+
+	cond.notify_all();
+    }
+
+    // Called by pipeline thread: blocks until all enqueued images have been written.
+    void wait_until_idle()
+    {
+	unique_lock<mutex> l(lock);
+
+	while ((!queue.empty() || is_busy) && error_msg.empty())
+	    cond.wait(l);
+
+	if (!error_msg.empty())
+	    throw runtime_error(error_msg);
+    }
+
+protected:
+    std::thread thread;
+    std::mutex lock;
+    std::condition_variable cond;
+
+    deque<unique_ptr<plot_image>> queue;    // images waiting to be written
+    deque<unique_ptr<plot_image>> spares;   // zeroed images, ready for use by the pipeline thread
+    bool is_busy = false;
+    bool is_shutdown = false;
+    string error_msg;
+
+    void thread_main()
+    {
+	for (;;) {
+	    unique_lock<mutex> l(lock);
+
+	    while (queue.empty() && !is_shutdown)
+		cond.wait(l);
+
+	    // Note: images remaining in the queue at shutdown are dropped.
+	    if (is_shutdown)
+		return;
+
+	    unique_ptr<plot_image> img = std::move(queue.front());
+	    queue.pop_front();
+	    this->is_busy = true;
+	    l.unlock();
+
+	    string err;
+
+	    try {
+		write_plot_image(*img, clip_niter, sigma_clip);
+	    } catch (exception &e) {
+		err = e.what();
+	    }
+
+	    std::fill(img->intensity.begin(), img->intensity.end(), 0.0);
+	    std::fill(img->weights.begin(), img->weights.end(), 0.0);
+
+	    l.lock();
+	    spares.push_back(std::move(img));
+	    this->is_busy = false;
+	    if (error_msg.empty())
+		this->error_msg = err;
+	    l.unlock();
+
+	    cond.notify_all();
+	}
+    }
+};
+
+
+// -------------------------------------------------------------------------------------------------
+//
+// plotter_transform
+//
+// Each chunk is downsampled once to the resolution of zoom level 0, and zoom level (i+1) is
+// obtained by downsampling zoom level i by a factor two in time.  The downsampled chunks are
+// copied into per-zoom plot_images, which are handed off to the plot_writer when full.
+
+
+struct plotter_transform : public wi_transform
+{
+    const string img_prefix;
+    const int img_nfreq;
+    const int img_nt;
+    const int downsample_nt;
+    const int n_zoom;
+    const int clip_niter;
+    const double sigma_clip;
+
+    // Frequency downsampling factor, initialized in set_stream()
+    int Df = 0;
+
+    // Per-zoom buffers for the downsampled chunk, shape (img_nfreq, ds_nt[izoom]).
+    // If no downsampling is needed at zoom level 0, then ds_intensity[0] is not allocated.
+    vector<int> ds_nt;
+    vector<float *> ds_intensity;
+    vector<float *> ds_weights;
+
+    // Per-zoom plot_images currently being accumulated.
+    vector<unique_ptr<plot_image>> images;
+    vector<int> ipos;    // number of (downsampled) time samples accumulated so far
+    vector<int> ifile;   // number of files written so far
+
+    unique_ptr<plot_writer> writer;
+    int isubstream = 0;
+
+    // Noncopyable
+    plotter_transform(const plotter_transform &) = delete;
+    plotter_transform &operator=(const plotter_transform &) = delete;
+
+
+    plotter_transform(const string &img_prefix_, int img_nfreq_, int img_nt_, int downsample_nt_, int n_zoom_, int nt_chunk_, int clip_niter_, double sigma_clip_) :
+	img_prefix(img_prefix_), img_nfreq(img_nfreq_), img_nt(img_nt_), downsample_nt(downsample_nt_),
+	n_zoom(n_zoom_), clip_niter(clip_niter_), sigma_clip(sigma_clip_)
+    {
+	stringstream ss;
+	ss << "plotter_transform_cpp(img_prefix=" << img_prefix << ", img_nfreq=" << img_nfreq << ", img_nt=" << img_nt
+	   << ", downsample_nt=" << downsample_nt << ", n_zoom=" << n_zoom << ", nt_chunk=" << nt_chunk_
+	   << ", clip_niter=" << clip_niter << ", sigma_clip=" << sigma_clip << ")";
+
+	this->name = ss.str();
+	this->nt_chunk = nt_chunk_;
+	this->nt_prepad = 0;
+	this->nt_postpad = 0;
+	this->is_read_only = true;
+
+	// No need to make these asserts "verbose", since they should have been checked in make_plotter_transform().
+	rf_assert(img_nfreq > 0);
+	rf_assert(img_nt > 0);
+	rf_assert(n_zoom > 0);
+	rf_assert(nt_chunk % (downsample_nt << (n_zoom-1)) == 0);
+
+	for (int izoom = 0; izoom < n_zoom; izoom++) {
+	    this->ds_nt.push_back(nt_chunk / (downsample_nt << izoom));
+	    this->add_plot_group("waterfall", downsample_nt << izoom, img_nfreq);
+	}
+
+	this->ds_intensity.resize(n_zoom, nullptr);
+	this->ds_weights.resize(n_zoom, nullptr);
+	this->ipos.resize(n_zoom, 0);
+	this->ifile.resize(n_zoom, 0);
+    }
+
+    virtual ~plotter_transform()
+    {
+	for (int izoom = 0; izoom < n_zoom; izoom++) {
+	    free(ds_intensity[izoom]);
+	    free(ds_weights[izoom]);
+	    ds_intensity[izoom] = ds_weights[izoom] = nullptr;
+	}
+    }
+
+    virtual void set_stream(const wi_stream &stream) override
+    {
+	if (stream.nfreq % img_nfreq)
+	    throw runtime_error("rf_pipelines plotter_transform: stream nfreq (=" + to_string(stream.nfreq)
+				+ ") is not divisible by img_nfreq=" + to_string(img_nfreq));
+
+	int nds_f = stream.nfreq / img_nfreq;
+
+	this->nfreq = stream.nfreq;
+	this->Df = nds_f;
+
+	// Buffers are allocated here (rather than the constructor), so that set_stream() can be called
+	// more than once, if the transform is reused with a different stream.
+	for (int izoom = 0; izoom < n_zoom; izoom++) {
+	    free(ds_intensity[izoom]);
+	    free(ds_weights[izoom]);
+	    ds_intensity[izoom] = ds_weights[izoom] = nullptr;
+
+	    if ((izoom == 0) && (Df == 1) && (downsample_nt == 1))
+		continue;
+
+	    ds_intensity[izoom] = aligned_alloc<float> (img_nfreq * ds_nt[izoom]);
+	    ds_weights[izoom] = aligned_alloc<float> (img_nfreq * ds_nt[izoom]);
+	}
+
+	// Destroy the old writer (if any) before creating the new one, so that the thread is joined.
+	this->writer.reset();
+	this->images.clear();
+
+	for (int izoom = 0; izoom < n_zoom; izoom++)
+	    this->images.push_back(make_unique<plot_image> (img_nfreq, img_nt));
+
+	// One spare image per zoom level, so that each zoom level can have one PNG "in flight".
+	this->writer = make_unique<plot_writer> (n_zoom, img_nfreq, img_nt, clip_niter, sigma_clip);
+    }
+
+    virtual void start_substream(int isubstream_, double t0) override
+    {
+	this->isubstream = isubstream_;
+
+	for (int izoom = 0; izoom < n_zoom; izoom++) {
+	    rf_assert(ipos[izoom] == 0);
+	    this->ifile[izoom] = 0;
+	}
+    }
+
+    virtual void process_chunk(double t0, double t1, float *intensity, float *weights, ssize_t stride, float *pp_intensity, float *pp_weights, ssize_t pp_stride) override
+    {
+	const float *src_intensity = intensity;
+	const float *src_weights = weights;
+	int src_nfreq = nfreq;
+	int src_nt = nt_chunk;
+	int src_stride = stride;
+
+	for (int izoom = 0; izoom < n_zoom; izoom++) {
+	    int nds_f = (izoom == 0) ? Df : 1;
+	    int nds_t = (izoom == 0) ? downsample_nt : 2;
+
+	    if ((izoom == 0) && ds_intensity[0] && ds_cache) {
+		// The zoom-0 downsampled chunk can be shared with other transforms (see 'struct downsample_cache').
+		ds_cache->get(nds_f, nds_t, src_intensity, src_weights);
+		src_nfreq = img_nfreq;
+		src_nt = ds_nt[0];
+		src_stride = ds_nt[0];
+	    }
+	    else if (ds_intensity[izoom]) {
+		wi_downsample(ds_intensity[izoom], ds_weights[izoom], ds_nt[izoom], src_intensity, src_weights, src_nfreq, src_nt, src_stride, nds_f, nds_t);
+
+		src_intensity = ds_intensity[izoom];
+		src_weights = ds_weights[izoom];
+		src_nfreq = img_nfreq;
+		src_nt = ds_nt[izoom];
+		src_stride = ds_nt[izoom];
+	    }
+
+	    _accumulate(izoom, src_intensity, src_weights, src_stride);
+	}
+    }
+
+    virtual void end_substream() override
+    {
+	for (int izoom = 0; izoom < n_zoom; izoom++)
+	    if (ipos[izoom] > 0)
+		_write_image(izoom);
+
+	writer->wait_until_idle();
+    }
+
+
+    // Copies one downsampled chunk, with shape (img_nfreq, ds_nt[izoom]), into the plot_image(s).
+    void _accumulate(int izoom, const float *src_intensity, const float *src_weights, int src_stride)
+    {
+	int ichunk = 0;
+
+	while (ichunk < ds_nt[izoom]) {
+	    // Move to end of chunk or end of current plot, whichever comes first.
+	    int n = min(ds_nt[izoom] - ichunk, img_nt - ipos[izoom]);
+	    plot_image &img = *images[izoom];
+
+	    for (int ifreq = 0; ifreq < img_nfreq; ifreq++) {
+		memcpy(&img.intensity[ifreq*img_nt + ipos[izoom]], src_intensity + ifreq*src_stride + ichunk, n * sizeof(float));
+		memcpy(&img.weights[ifreq*img_nt + ipos[izoom]], src_weights + ifreq*src_stride + ichunk, n * sizeof(float));
+	    }
+
+	    ipos[izoom] += n;
+	    ichunk += n;
+
+	    if (ipos[izoom] == img_nt)
+		_write_image(izoom);
+	}
+    }
+
+    // When we reach end-of-substream, the image might be partially full (i.e. ipos < img_nt).
+    // In this case, the image is padded with black, as in the python plotter_transform.
+    void _write_image(int izoom)
+    {
+	int nt_per_pix = downsample_nt << izoom;
+
+	string basename = img_prefix + "_zoom" + to_string(izoom);
+	if (isubstream > 0)
+	    basename += "_" + to_string(isubstream);
+	basename += "_" + to_string(ifile[izoom]) + ".png";
+
+	// The add_plot() method adds the plot to the JSON output, and returns the filename that should be written.
+	// Note that add_plot() must be called from the pipeline thread.
+	int64_t it0 = int64_t(ifile[izoom]) * int64_t(img_nt) * int64_t(nt_per_pix);
+	images[izoom]->filename = this->add_plot(basename, it0, img_nt * nt_per_pix, img_nt, img_nfreq, izoom);
+
+	writer->swap_image(images[izoom]);
+
+	this->ifile[izoom]++;
+	this->ipos[izoom] = 0;
+    }
+};
+
+
+// -------------------------------------------------------------------------------------------------
+
+
+// externally visible
+shared_ptr<wi_transform> make_plotter_transform(const string &img_prefix, int img_nfreq, int img_nt, int downsample_nt, int n_zoom, int nt_chunk, int clip_niter, double sigma_clip)
+{
+    static constexpr int S = constants::single_precision_simd_length;
+
+    check_params(img_nfreq, img_nt, downsample_nt, n_zoom, nt_chunk, clip_niter, sigma_clip);
+
+    if (nt_chunk == 0) {
+	// Choose default nt_chunk to be close to 1024, with added constraint of being evenly divisible by (max_downsample * S).
+	int m = (downsample_nt << (n_zoom-1)) * S;
+	nt_chunk = max(1024/m, 1) * m;
+    }
+
+    return make_shared<plotter_transform> (img_prefix, img_nfreq, img_nt, downsample_nt, n_zoom, nt_chunk, clip_niter, sigma_clip);
+}
+
+
+#endif  // HAVE_PNG
+
+}  // namespace rf_pipelines
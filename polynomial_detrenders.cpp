@@ -8,7 +8,7 @@
 #include <array>
 
 #include "rf_pipelines_internals.hpp"
-#include "kernels/polyfit.hpp"
+#include "kernels/kernel_tables.hpp"
 
 using namespace std;
 
@@ -18,9 +18,9 @@ namespace rf_pipelines {
 #endif
 
 
-// Usage: kernel(nfreq, nt, intensity, weights, stride, epsilon)
-
-using detrending_kernel_t = void (*)(int, int, float *, float *, int, double);
+// In monitor mode, a detrended sample is counted as a discrepancy if the single- and double-precision
+// results differ by more than (monitor_rtol) times the rms of the (undetrended) intensity in its row.
+static constexpr double monitor_rtol = 1.0e-3;
 
 
 struct polynomial_detrender : public wi_transform
@@ -28,83 +28,241 @@ struct polynomial_detrender : public wi_transform
     const int axis;
     const int polydeg;
     const double epsilon;
+    const detrender_precision precision;
+    const bool monitor;
     const detrending_kernel_t kernel;
-
-    polynomial_detrender(int axis_, int nt_chunk_, int polydeg_, double epsilon_, detrending_kernel_t kernel_) :
-	axis(axis_), polydeg(polydeg_), epsilon(epsilon_), kernel(kernel_)
+    const detrending_kernel_t monitor_kernel;   // double precision, only used if monitor=true
+
+    // Monitor mode state.  In each chunk, we detrend a copy of one "monitor block" in double precision.
+    // The monitor block is one row if axis=AXIS_TIME, or S columns if axis=AXIS_FREQ.
+    vector<float> monitor_intensity;
+    vector<float> monitor_weights;
+    vector<double> monitor_rms;
+    ssize_t monitor_iblock = 0;
+    ssize_t monitor_nrows = 0;
+    ssize_t monitor_ndiscrepancies = 0;
+
+    polynomial_detrender(int axis_, int nt_chunk_, int polydeg_, double epsilon_, detrender_precision precision_, bool monitor_, detrending_kernel_t kernel_, detrending_kernel_t monitor_kernel_) :
+	axis(axis_), polydeg(polydeg_), epsilon(epsilon_), precision(precision_), monitor(monitor_), kernel(kernel_), monitor_kernel(monitor_kernel_)
     {
 	stringstream ss;
-        ss << "polynomial_detrender_cpp(nt_chunk=" << nt_chunk_ << ", axis=" << axis << ", polydeg=" << polydeg << ", epsilon=" << epsilon_ << ")";
+        ss << "polynomial_detrender_cpp(nt_chunk=" << nt_chunk_ << ", axis=" << axis << ", polydeg=" << polydeg << ", epsilon=" << epsilon_;
+
+	// To preserve transform names in existing pipelines, precision/monitor are only included if non-default.
+	if (precision != PRECISION_FLOAT)
+	    ss << ", precision=" << precision;
+	if (monitor)
+	    ss << ", monitor=" << monitor;
+	ss << ")";
 
 	this->name = ss.str();
 	this->nt_chunk = nt_chunk_;
 	this->nt_prepad = 0;
 	this->nt_postpad = 0;
+	this->preserves_mask = true;
     }
     
     virtual void set_stream(const wi_stream &stream) override
     {
 	this->nfreq = stream.nfreq;
+
+	if (monitor) {
+	    static constexpr int S = constants::single_precision_simd_length;
+	    ssize_t n = (axis == AXIS_TIME) ? nt_chunk : (nfreq * S);
+	    this->monitor_intensity.resize(n);
+	    this->monitor_weights.resize(n);
+	    this->monitor_rms.resize(S);
+	}
+    }
+
+    // Fully masked rows and chunks are skipped (see 'struct chunk_mask_info').  This doesn't change
+    // the output, since the kernel leaves the intensity unchanged (and zeroes the weights) wherever
+    // the fit is poorly conditioned, which is always the case for a fully masked row or column.
+    void detrend_unmasked(float *intensity, float *weights, ssize_t stride)
+    {
+	mask_info->update();
+
+	if (mask_info->all_masked())
+	    return;
+
+	if ((axis != AXIS_TIME) || (mask_info->nrows_masked == 0)) {
+	    this->kernel(nfreq, nt_chunk, intensity, weights, stride, epsilon);
+	    return;
+	}
+
+	mask_info->foreach_block_range(1, [&](ssize_t ifreq0, ssize_t ifreq1, bool masked) {
+	    if (!masked)
+		this->kernel(ifreq1 - ifreq0, nt_chunk, intensity + ifreq0 * stride, weights + ifreq0 * stride, stride, epsilon);
+	});
     }
 
     virtual void process_chunk(double t0, double t1, float *intensity, float *weights, ssize_t stride, float *pp_intensity, float *pp_weights, ssize_t pp_stride) override
     {
+	if (!monitor && mask_info) {
+	    this->detrend_unmasked(intensity, weights, stride);
+	    return;
+	}
+
+	if (!monitor) {
+	    this->kernel(nfreq, nt_chunk, intensity, weights, stride, epsilon);
+	    return;
+	}
+
+	static constexpr int S = constants::single_precision_simd_length;
+
+	// Layout of the monitor block: 'nfits' independent polynomial fits, each containing 'nelts'
+	// samples.  In the original arrays, fit j starts at offset (j * fit_stride), and consecutive
+	// samples are separated by 'elt_stride'.  In the monitor arrays, the strides are (mfit_stride, melt_stride).
+	ssize_t nblocks = (axis == AXIS_TIME) ? nfreq : (nt_chunk / S);
+	ssize_t iblock = (monitor_iblock++) % nblocks;
+	ssize_t offset = (axis == AXIS_TIME) ? (iblock * stride) : (iblock * S);
+	int nfits = (axis == AXIS_TIME) ? 1 : S;
+	int nelts = (axis == AXIS_TIME) ? nt_chunk : nfreq;
+	int fit_stride = (axis == AXIS_TIME) ? 0 : 1;
+	int elt_stride = (axis == AXIS_TIME) ? 1 : stride;
+	int mfit_stride = (axis == AXIS_TIME) ? 0 : 1;
+	int melt_stride = (axis == AXIS_TIME) ? 1 : S;
+
+	for (int j = 0; j < nfits; j++) {
+	    double wsum = 0.0;
+	    double wxxsum = 0.0;
+
+	    for (int i = 0; i < nelts; i++) {
+		float x = intensity[offset + j*fit_stride + i*elt_stride];
+		float w = weights[offset + j*fit_stride + i*elt_stride];
+
+		monitor_intensity[j*mfit_stride + i*melt_stride] = x;
+		monitor_weights[j*mfit_stride + i*melt_stride] = w;
+		wsum += w;
+		wxxsum += double(w) * double(x) * double(x);
+	    }
+
+	    monitor_rms[j] = (wsum > 0.0) ? sqrt(wxxsum / wsum) : 0.0;
+	}
+
+	if (axis == AXIS_TIME)
+	    this->monitor_kernel(1, nt_chunk, &monitor_intensity[0], &monitor_weights[0], nt_chunk, epsilon);
+	else
+	    this->monitor_kernel(nfreq, S, &monitor_intensity[0], &monitor_weights[0], S, epsilon);
+
 	this->kernel(nfreq, nt_chunk, intensity, weights, stride, epsilon);
+
+	for (int j = 0; j < nfits; j++) {
+	    double thresh = monitor_rtol * monitor_rms[j];
+	    bool discrepant = false;
+
+	    for (int i = 0; i < nelts; i++) {
+		float x0 = intensity[offset + j*fit_stride + i*elt_stride];
+		float w0 = weights[offset + j*fit_stride + i*elt_stride];
+		float x1 = monitor_intensity[j*mfit_stride + i*melt_stride];
+		float w1 = monitor_weights[j*mfit_stride + i*melt_stride];
+
+		if (((w0 > 0.0f) != (w1 > 0.0f)) || ((w1 > 0.0f) && (fabs(x0-x1) > thresh))) {
+		    discrepant = true;
+		    break;
+		}
+	    }
+
+	    this->monitor_nrows++;
+	    this->monitor_ndiscrepancies += discrepant ? 1 : 0;
+	}
     }
 
-    virtual void start_substream(int isubstream, double t0) override { }
-    virtual void end_substream() override { }
+    virtual void start_substream(int isubstream, double t0) override
+    {
+	this->monitor_iblock = 0;
+	this->monitor_nrows = 0;
+	this->monitor_ndiscrepancies = 0;
+    }
+
+    virtual void end_substream() override
+    {
+	if (!monitor)
+	    return;
+
+	this->json_per_substream["monitor_nrows"] = Json::Int64(monitor_nrows);
+	this->json_per_substream["monitor_ndiscrepancies"] = Json::Int64(monitor_ndiscrepancies);
+    }
 };
 
 
 // -------------------------------------------------------------------------------------------------
 //
-// _fill_detrending_kernel_table<S,N>(): fills shape (N,2) array with kernels.
-// The outer index is a polynomial degree 0 <= polydeg < N, and the inner index is the axis.
-
+// sliding_polynomial_detrender
 
-template<unsigned int S, unsigned int N, typename std::enable_if<(N==0),int>::type = 0>
-inline void fill_detrending_kernel_table(detrending_kernel_t *out) { }
 
-template<unsigned int S, unsigned int N, typename std::enable_if<(N>0),int>::type = 0>
-inline void fill_detrending_kernel_table(detrending_kernel_t *out)
+struct sliding_polynomial_detrender : public wi_transform
 {
-    static_assert(AXIS_FREQ == 0, "polynomial_detrenders: current implementation assumes AXIS_FREQ==0");
-    static_assert(AXIS_TIME == 1, "polynomial_detrenders: current implementation assumes AXIS_TIME==1");
+    const int polydeg;
+    const int nt_window;
+    const double epsilon;
+    const sliding_detrending_kernel_t kernel;
 
-    fill_detrending_kernel_table<S,N-1> (out);
-    out[2*(N-1) + AXIS_FREQ] = _kernel_detrend_f<float,S,N>;
-    out[2*(N-1) + AXIS_TIME] = _kernel_detrend_t<float,S,N>;
-}
+    // Transposed copy of the undetrended data, see _kernel_detrend_t_sliding() in kernels/polyfit.hpp.
+    vector<float> scratch;
 
+    sliding_polynomial_detrender(int nt_chunk_, int polydeg_, int nt_window_, double epsilon_, sliding_detrending_kernel_t kernel_) :
+	polydeg(polydeg_), nt_window(nt_window_), epsilon(epsilon_), kernel(kernel_)
+    {
+	static constexpr int S = constants::single_precision_simd_length;
 
-struct detrending_kernel_table {
-    static constexpr int S = constants::single_precision_simd_length;
-    static constexpr int MaxDeg = constants::polynomial_detrender_max_degree;
+	stringstream ss;
+        ss << "sliding_polynomial_detrender_cpp(nt_chunk=" << nt_chunk_ << ", axis=" << int(AXIS_TIME) << ", polydeg=" << polydeg 
+	   << ", nt_window=" << nt_window << ", epsilon=" << epsilon << ")";
 
-    std::vector<detrending_kernel_t> entries;
+	this->name = ss.str();
+	this->nt_chunk = nt_chunk_;
+	this->nt_prepad = (nt_window - S) / 2;
+	this->nt_postpad = (nt_window - S) / 2;
+	this->preserves_mask = true;
+    }
 
-    detrending_kernel_table() : entries(2*MaxDeg+2)
+    virtual void set_stream(const wi_stream &stream) override
     {
-	fill_detrending_kernel_table<S,MaxDeg+1> (&entries[0]);
+	static constexpr int S = constants::single_precision_simd_length;
+
+	this->nfreq = stream.nfreq;
+	this->scratch.resize(S * (nt_chunk + nt_prepad + nt_postpad));
     }
 
-    // Caller must argument-check by calling check_params()!
-    inline detrending_kernel_t get_kernel(int axis, int polydeg)
+    virtual void process_chunk(double t0, double t1, float *intensity, float *weights, ssize_t stride, float *pp_intensity, float *pp_weights, ssize_t pp_stride) override
     {
-	return entries[2*polydeg + axis];
+	static constexpr int S = constants::single_precision_simd_length;
+
+	this->kernel(nfreq, nt_chunk, intensity, weights, stride, pp_intensity, pp_weights, pp_stride, S, nt_window, epsilon, &scratch[0]);
     }
+
+    virtual void start_substream(int isubstream, double t0) override { }
+    virtual void end_substream() override { }
 };
 
 
-static detrending_kernel_table global_detrending_kernel_table;
+// -------------------------------------------------------------------------------------------------
+//
+// Kernel dispatch (the kernel tables themselves are in kernels/kernel_tables.hpp)
+
+
+static detrending_kernel_table<constants::single_precision_simd_length> global_detrending_kernel_table;
+static sliding_detrending_kernel_table<constants::single_precision_simd_length> global_sliding_detrending_kernel_table;
+
+
+// Caller must call check_params()!
+static detrending_kernel_t get_detrending_kernel(int axis, int nt, int polydeg, detrender_precision precision)
+{
+#ifdef HAVE_AVX512
+    if ((simd_dispatch_length() == 16) && (nt % 16 == 0))
+	return get_avx512_detrending_kernel(axis, polydeg, precision);
+#endif
+
+    return global_detrending_kernel_table.get_kernel(axis, polydeg, precision);
+}
 
 
 // -------------------------------------------------------------------------------------------------
 
 
 // Helper function to check parameters passed to a detrending call
-static void check_params(axis_type axis, int nfreq, int nt, int stride, int polydeg, double epsilon)
+static void check_params(axis_type axis, int nfreq, int nt, int stride, int polydeg, double epsilon, detrender_precision precision)
 {
     static constexpr int MaxDeg = constants::polynomial_detrender_max_degree;
     static constexpr int S = constants::single_precision_simd_length;
@@ -134,34 +292,98 @@ static void check_params(axis_type axis, int nfreq, int nt, int stride, int poly
 
     if (_unlikely(epsilon <= 0.0))
 	throw runtime_error("rf_pipelines polynomial detrender: epsilon=" + to_string(epsilon) + ", positive number expected");
+
+    if (_unlikely((precision != PRECISION_FLOAT) && (precision != PRECISION_DOUBLE) && (precision != PRECISION_MIXED)))
+	throw runtime_error("rf_pipelines polynomial detrender: precision=" + to_string(int(precision)) + " is invalid");
+}
+
+
+// Externally callable factory function
+shared_ptr<wi_transform> make_polynomial_detrender(int nt_chunk, axis_type axis, int polydeg, double epsilon, detrender_precision precision, bool monitor)
+{
+    static constexpr int S = constants::single_precision_simd_length;
+
+    int dummy_nfreq = 16;         // arbitrary
+    int dummy_stride = nt_chunk;  // arbitrary
+
+    check_params(axis, dummy_nfreq, nt_chunk, dummy_stride, polydeg, epsilon, precision);
+
+    if (_unlikely(monitor && (precision == PRECISION_DOUBLE)))
+	throw runtime_error("rf_pipelines polynomial detrender: monitor=true is not meaningful if precision=PRECISION_DOUBLE");
+
+    detrending_kernel_t kernel = get_detrending_kernel(axis, nt_chunk, polydeg, precision);
+
+    // The monitor kernel is applied to a single row (AXIS_TIME) or S columns (AXIS_FREQ).
+    int monitor_nt = (axis == AXIS_TIME) ? nt_chunk : S;
+    detrending_kernel_t monitor_kernel = monitor ? get_detrending_kernel(axis, monitor_nt, polydeg, PRECISION_DOUBLE) : nullptr;
+
+    return make_shared<polynomial_detrender> (axis, nt_chunk, polydeg, epsilon, precision, monitor, kernel, monitor_kernel);
 }
 
 
 // Externally callable factory function
-shared_ptr<wi_transform> make_polynomial_detrender(int nt_chunk, axis_type axis, int polydeg, double epsilon)
+shared_ptr<wi_transform> make_sliding_polynomial_detrender(int nt_chunk, axis_type axis, int polydeg, int nt_window, double epsilon)
 {
+    static constexpr int S = constants::single_precision_simd_length;
+
     int dummy_nfreq = 16;         // arbitrary
     int dummy_stride = nt_chunk;  // arbitrary
 
-    check_params(axis, dummy_nfreq, nt_chunk, dummy_stride, polydeg, epsilon);
+    check_params(axis, dummy_nfreq, nt_chunk, dummy_stride, polydeg, epsilon, PRECISION_DOUBLE);
 
-    detrending_kernel_t kernel = global_detrending_kernel_table.get_kernel(axis, polydeg);
-    return make_shared<polynomial_detrender> (axis, nt_chunk, polydeg, epsilon, kernel);
+    if (_unlikely(axis != AXIS_TIME))
+	throw runtime_error("rf_pipelines sliding polynomial detrender: axis=" + stringify(axis) + " is not supported (currently only AXIS_TIME is implemented)");
+
+    if (_unlikely((nt_window <= 0) || (nt_window % (2*S) != S)))
+	throw runtime_error("rf_pipelines sliding polynomial detrender: nt_window=" + to_string(nt_window)
+			    + " must be an odd multiple of constants::single_precision_simd_length=" + to_string(S));
+
+    sliding_detrending_kernel_t kernel = global_sliding_detrending_kernel_table.get_kernel(polydeg);
+    return make_shared<sliding_polynomial_detrender> (nt_chunk, polydeg, nt_window, epsilon, kernel);
 }
 
 
-void apply_polynomial_detrender(float *intensity, float *weights, int nfreq, int nt, int stride, axis_type axis, int polydeg, double epsilon)
+void apply_polynomial_detrender(float *intensity, float *weights, int nfreq, int nt, int stride, axis_type axis, int polydeg, double epsilon, detrender_precision precision)
 {
-    check_params(axis, nfreq, nt, stride, polydeg, epsilon);
+    check_params(axis, nfreq, nt, stride, polydeg, epsilon, precision);
 
     if (_unlikely(!intensity))
 	throw runtime_error("rf_pipelines: apply_polynomial_detrender(): NULL intensity pointer");
     if (_unlikely(!weights))
 	throw runtime_error("rf_pipelines: apply_polynomial_detrender(): NULL weights pointer");
 
-    detrending_kernel_t kernel = global_detrending_kernel_table.get_kernel(axis, polydeg);
+    detrending_kernel_t kernel = get_detrending_kernel(axis, nt, polydeg, precision);
     kernel(nfreq, nt, intensity, weights, stride, epsilon);
 }
 
 
+// Multithreaded version: detrending is independent for each row (axis=AXIS_TIME) or column
+// (axis=AXIS_FREQ), so we just split the array into blocks and detrend each block in its own thread.
+void apply_polynomial_detrender_parallel(int nthreads, float *intensity, float *weights, int nfreq, int nt, int stride, axis_type axis, int polydeg, double epsilon, detrender_precision precision)
+{
+    static constexpr int S = constants::single_precision_simd_length;
+
+    check_params(axis, nfreq, nt, stride, polydeg, epsilon, precision);
+
+    if (_unlikely(!intensity))
+	throw runtime_error("rf_pipelines: apply_polynomial_detrender_parallel(): NULL intensity pointer");
+    if (_unlikely(!weights))
+	throw runtime_error("rf_pipelines: apply_polynomial_detrender_parallel(): NULL weights pointer");
+
+    if (axis == AXIS_TIME) {
+	parallel_for(nthreads, nfreq, 1, [&](int ithread, int f0, int f1) {
+	    apply_polynomial_detrender(intensity + f0*stride, weights + f0*stride, f1-f0, nt, stride, axis, polydeg, epsilon, precision);
+	});
+	return;
+    }
+
+    // Column blocks are multiples of the largest simd length, if possible, so that each block gets the same kernel.
+    int g = (nt % max_dispatch_simd_length) ? S : max_dispatch_simd_length;
+
+    parallel_for(nthreads, nt, g, [&](int ithread, int t0, int t1) {
+	apply_polynomial_detrender(intensity + t0, weights + t0, nfreq, t1-t0, stride, axis, polydeg, epsilon, precision);
+    });
+}
+
+
 }  // namespace rf_pipelines
@@ -52,9 +52,17 @@
 //   make_bonsai_dedisperser()     Runs data through bonsai dedisperser.
 //   make_chime_file_writer()      Writes stream to a single file in CHIME hdf5 format.
 //   make_chime_packetizer()       Converts a stream to UDP packets, and sends them over the network.
+//   make_frb_injector()           Adds many simulated FRB's to the stream.
 //   make_intensity_clipper()      "Clips" an array by masking outlier intensities.
+//   make_plotter_transform()      Makes waterfall plots, at one or more zoom levels.
 //   make_polynomial_detrender()   Detrends along time or frequenciy axis, by subtracting a best-fit polynomial.
+//   make_rfi_clipper_chain()      Runs a sequence of intensity/std_dev clippers, with fewer passes over memory.
+//   make_running_median_detrender()   Detrends along time axis, by subtracting a running median.
+//   make_sliding_polynomial_detrender()   Detrends along time axis, by subtracting a polynomial fit in a sliding window.
+//   make_spline_detrender()       Detrends along time or frequency axis, by subtracting a best-fit cubic spline.
 //   make_std_dev_clipper()        "Clips" an array by masking rows/cols whose standard deviation is an outlier.
+//   make_trigger_grouper()        Groups coarse-grained bonsai triggers into L1 events (see below, after wi_transform).
+//   make_variance_estimator()     Makes a running estimate of the variance in each frequency channel.
 //
 // See below for more info on all these functions!
 
@@ -82,6 +90,8 @@ struct wi_transform;
 class wi_run_state;
 struct outdir_manager;   // declared in rf_pipelines_internals.hpp
 struct plot_group;       // declared in rf_pipelines_internals.hpp
+struct downsample_cache; // declared in rf_pipelines_internals.hpp
+struct chunk_mask_info;  // declared in rf_pipelines_internals.hpp
 
 
 namespace constants {
@@ -100,10 +110,17 @@ namespace constants {
     //   - make sure that the downsampling-related parameters are still powers of two
     //   - the only downside is increased compile time and librf_pipelines.so file size
     //   - you will need to recompile rf_pipelines after the change
+    //
+    // The max_specialized_* parameters are the largest downsampling factors which get a fully
+    // specialized kernel.  Larger factors are handled by downsampling in stages, so they only
+    // affect speed.  The max_frequency_downsampling and max_time_downsampling parameters are
+    // the largest downsampling factors which are supported (and tested) in all transforms.
 
     static constexpr int polynomial_detrender_max_degree = 20;
     static constexpr int max_frequency_downsampling = 256;
     static constexpr int max_time_downsampling = 32;
+    static constexpr int max_specialized_frequency_downsampling = 16;
+    static constexpr int max_specialized_time_downsampling = 16;
 
     // Number of single-precision floats which fit into a SIMD word on this machine.
     // For now, we just hardcode 8, assuming a CPU with the AVX instruction set but not AVX-512,
@@ -180,6 +197,19 @@ enum axis_type {
 // In misc.cpp
 extern std::ostream &operator<<(std::ostream &os, axis_type axis);
 
+// Floating-point precision used in polynomial fitting.
+//   PRECISION_FLOAT    single precision throughout
+//   PRECISION_DOUBLE   double precision throughout (slower, but robust for high polynomial degree)
+//   PRECISION_MIXED    single-precision accumulation, double-precision Cholesky factorization and solve
+enum detrender_precision {
+    PRECISION_FLOAT = 0,
+    PRECISION_DOUBLE = 1,
+    PRECISION_MIXED = 2
+};
+
+// In misc.cpp
+extern std::ostream &operator<<(std::ostream &os, detrender_precision precision);
+
 //
 // polynomial_detrender: detrends along either the time or frequency axis,
 // by subtracting a best-fit polynomial.  The detrending is independent in
@@ -191,7 +221,68 @@ extern std::ostream &operator<<(std::ostream &os, axis_type axis);
 // 'epsilon'.  I think that 1.0e-2 is a reasonable default here, but haven't
 // experimented systematically.
 //
-extern std::shared_ptr<wi_transform> make_polynomial_detrender(int nt_chunk, axis_type axis, int polydeg, double epsilon=1.0e-2);
+// The 'precision' argument selects single, double, or mixed precision fitting
+// (see 'enum detrender_precision' above).  Single precision can be unreliable
+// for polydeg > 8.
+//
+// If 'monitor' is true (only allowed if precision != PRECISION_DOUBLE), then in
+// each chunk, one row is also detrended in double precision, and compared to the
+// result of the single/mixed-precision detrender.  The number of rows compared and
+// the number of discrepancies found are reported in the json output, as
+// 'monitor_nrows' and 'monitor_ndiscrepancies'.
+//
+extern std::shared_ptr<wi_transform> make_polynomial_detrender(int nt_chunk, axis_type axis, int polydeg, double epsilon=1.0e-2,
+							       detrender_precision precision=PRECISION_FLOAT, bool monitor=false);
+
+
+//
+// sliding_polynomial_detrender: detrends along the time axis, by subtracting a polynomial which is
+// fit in a sliding window of length 'nt_window', rather than independently in each chunk.  This avoids
+// discontinuities at chunk boundaries, and the chunk size can be chosen independently of the window.
+//
+// The window advances in steps of constants::single_precision_simd_length (=8) samples, and each step
+// is detrended using the fit from the window centered on the step.  Therefore, nt_window must be an odd
+// multiple of 8 (e.g. 1032 or 2056).  The transform uses prepadding and postpadding of (nt_window-8)/2
+// samples.  Currently only axis=AXIS_TIME is supported.
+//
+// If the fit is poorly conditioned (see 'epsilon' above), then the samples in the step are masked.
+// The fitting is always done in double precision.
+//
+extern std::shared_ptr<wi_transform> make_sliding_polynomial_detrender(int nt_chunk, axis_type axis, int polydeg, int nt_window, double epsilon=1.0e-2);
+
+
+//
+// running_median_detrender: detrends along the time axis, by subtracting the median of a sliding
+// window of length 'nt_window', which is roughly centered on each sample (specifically, the window
+// for sample t is [t - nt_window + nt_window/2 + 1, t + nt_window/2]).  The median is robust to
+// bright RFI, unlike a polynomial fit.
+//
+// If Dt > 1, then the median is computed in blocks of Dt samples first, and the baseline in each
+// block is the running median of the block medians.  This is approximate, but much faster than Dt=1
+// (which computes the exact running median), so the default is Dt=16.  Both nt_chunk and nt_window
+// must be multiples of Dt.
+//
+// Zero-weight samples are excluded from the median, and nonzero weights are treated as equal.
+// The window is carried across chunk boundaries, and each update takes O(log nt_window) time.
+// Currently only axis=AXIS_TIME is supported.
+//
+extern std::shared_ptr<wi_transform> make_running_median_detrender(int nt_chunk, axis_type axis, int nt_window, int Dt=16);
+
+
+//
+// spline_detrender: detrends along the time or frequency axis, by subtracting a best-fit cubic
+// B-spline with uniformly spaced knots.  Unlike a high-degree polynomial, the fit is numerically
+// stable, and its cost is independent of the number of knots (the normal equations are banded).
+//
+// The 'nx_knot' arg is the knot spacing (in samples along the detrending axis), which must divide
+// the axis length (nt_chunk or nfreq).  If axis=AXIS_TIME, it must also be a multiple of
+// constants::single_precision_simd_length (=8).
+//
+// Basis functions whose fit is poorly conditioned (e.g. because most samples in their support are
+// masked) are dropped from the fit, with threshold 'epsilon' as in the polynomial detrender.
+// The weights are not modified.
+//
+extern std::shared_ptr<wi_transform> make_spline_detrender(int nt_chunk, axis_type axis, int nx_knot, double epsilon=1.0e-2);
 
 
 // A "simple detrender" is a time-axis polynomial fitter with degree zero.
@@ -211,7 +302,8 @@ inline std::shared_ptr<wi_transform> make_simple_detrender(ssize_t nt_detrend)
 // that the weights are used when calculating both the mean and rms intensity.
 //
 // The (Df,Dt) args are downsampling factors on the frequency/time axes.
-// If no downsampling is desired, set Df=Dt=1.
+// If no downsampling is desired, set Df=Dt=1.  Factors which are not powers of two are allowed,
+// but are handled by a slower generic downsampling kernel.
 //
 // The 'axis' argument has the following meaning:
 //   axis=AXIS_FREQ   clip along frequency axis, with an outer loop over time samples
@@ -224,9 +316,15 @@ inline std::shared_ptr<wi_transform> make_simple_detrender(ssize_t nt_detrend)
 //
 // If the 'two_pass' flag is set, a more numerically stable but slightly slower algorithm will be used.
 //
+// If the 'robust' flag is set, then the mean/rms are replaced by the weighted median and the
+// median absolute deviation (scaled by 1.4826, so that 'sigma' has the same meaning for Gaussian
+// data).  These are insensitive to strong outliers, so iterated clipping is not needed, and
+// niter must be 1.  The 'two_pass' flag is not supported in robust mode (an exception is thrown).
+//
 
 extern std::shared_ptr<wi_transform> make_intensity_clipper(int nt_chunk, axis_type axis, double sigma, int niter=1, 
-							    double iter_sigma=0.0, int Df=1, int Dt=1, bool two_pass=false);
+							    double iter_sigma=0.0, int Df=1, int Dt=1, bool two_pass=false,
+							    bool robust=false);
 
 
 //
@@ -237,13 +335,85 @@ extern std::shared_ptr<wi_transform> make_intensity_clipper(int nt_chunk, axis_t
 //   axis=AXIS_TIME   clip frequency channels whose variance in time is high
 //
 // The (Df,Dt) args are downsampling factors on the frequency/time axes.
-// If no downsampling is desired, set Df=Dt=1.
+// If no downsampling is desired, set Df=Dt=1.  Factors which are not powers of two are allowed,
+// but are handled by a slower generic downsampling kernel.
 //
 // The 'sigma' argument is the threshold (in sigmas from the mean) for clipping.
 //
 // If the 'two_pass' flag is set, a more numerically stable but slightly slower algorithm will be used.
 //
-std::shared_ptr<wi_transform> make_std_dev_clipper(int nt_chunk, axis_type axis, double sigma, int Df=1, int Dt=1, bool two_pass=false);
+// If the 'robust' flag is set, then outlier rows/columns are identified using the median and
+// median absolute deviation of the variances, instead of their mean and rms.  In robust mode,
+// niter must be 1, and two_pass must be false.
+//
+// If niter > 1, then the mean/rms of the variances will be computed using iterated clipping,
+// with threshold 'iter_sigma', as in the intensity_clipper.  If the 'iter_sigma' argument is
+// zero, then it defaults to 'sigma'.
+//
+std::shared_ptr<wi_transform> make_std_dev_clipper(int nt_chunk, axis_type axis, double sigma, int Df=1, int Dt=1, bool two_pass=false, 
+						   bool robust=false, int niter=1, double iter_sigma=0.0);
+
+
+//
+// rfi_clipper_chain: runs a sequence of intensity_clippers and std_dev_clippers, specified by a
+// vector of rfi_clipper_spec structs (see above for the meaning of the fields).
+//
+// The output is the same as running the clippers one after another, but consecutive clippers
+// which are local to one row or column (i.e. intensity clippers with axis=AXIS_TIME or AXIS_FREQ)
+// are applied in cache-sized blocks, so that the chain makes fewer passes over memory.  A std_dev
+// clipper computes its variances in the same pass as the preceding clippers with the same axis,
+// and applies its mask in the next pass.
+//
+struct rfi_clipper_spec {
+    enum clipper_type { INTENSITY_CLIPPER, STD_DEV_CLIPPER };
+
+    clipper_type type = INTENSITY_CLIPPER;
+    axis_type axis = AXIS_NONE;
+    double sigma = 3.0;
+    int niter = 1;
+    double iter_sigma = 0.0;
+    int Df = 1;
+    int Dt = 1;
+    bool two_pass = false;
+    bool robust = false;
+};
+
+extern std::shared_ptr<wi_transform> make_rfi_clipper_chain(int nt_chunk, const std::vector<rfi_clipper_spec> &specs);
+
+
+//
+// variance_estimator: this is a pseudo-transform (meaning that it does not modify its input) which
+// makes a running estimate of the variance in each frequency channel.
+//
+// First, the weighted variance is computed in blocks of 'v1_chunk' time samples ("v1 estimates").
+// Then the median of 'v2_chunk' consecutive v1 estimates is taken ("v2 estimates").  A v1 estimate
+// is zero if more than 75% of the samples in the block are masked, and a v2 estimate is zero if
+// more than 75% of its v1 estimates are zero.  The 'v1_chunk' arg must be a multiple of
+// constants::single_precision_simd_length, and 'nt_chunk' must be a multiple of 'v1_chunk'.
+//
+// If 'fname' is a nonempty string, then the v2 estimates are written to the file ${fname}.npy
+// in the pipeline output directory, as an array of shape (nfreq, nv2) which can be read with
+// np.load().  Unlike the python variance_estimator, the zero entries are not interpolated.
+//
+// If the 'handle' arg is non-null, then the variance_estimate object is updated after every
+// v2 estimate.  This can be used by downstream transforms to get the current variance without
+// any file I/O.  (The variance_estimator must appear before these transforms in the pipeline.)
+//
+struct variance_estimate {
+    ssize_t nfreq = 0;          // initialized in variance_estimator::set_stream()
+    ssize_t nt_per_v2 = 0;      // number of time samples per v2 estimate (v1_chunk * v2_chunk)
+    ssize_t nv2 = 0;            // number of v2 estimates in current substream
+    double t1 = 0.0;            // end time of most recent v2 estimate, in seconds
+
+    // Most recent v2 estimate in each frequency channel (zero if the channel was masked).
+    std::vector<float> variance;
+
+    // Most recent nonzero v2 estimate in each frequency channel (zero if no estimate is available yet).
+    std::vector<float> last_valid_variance;
+};
+
+extern std::shared_ptr<wi_transform> make_variance_estimator(int v1_chunk, int v2_chunk, int nt_chunk, const std::string &fname,
+							     const std::shared_ptr<variance_estimate> &handle = std::shared_ptr<variance_estimate>());
 
 
 // Standalone functions with the equivalent functionality to the polynomial_detrender,
@@ -255,20 +425,85 @@ std::shared_ptr<wi_transform> make_std_dev_clipper(int nt_chunk, axis_type axis,
 
 
 extern void apply_polynomial_detrender(float *intensity, float *weights, int nfreq, int nt, 
-				       int stride, axis_type axis, int polydeg, double epsilon);
+				       int stride, axis_type axis, int polydeg, double epsilon,
+				       detrender_precision precision=PRECISION_FLOAT);
+
+
+// clipper_workspace: temporary buffers used by apply_intensity_clipper() and apply_std_dev_clipper().
+//
+// The buffers grow as needed and are never shrunk, so repeated calls with the same (or smaller)
+// arguments don't allocate memory.  If the 'ws' argument to apply_*() is null, then a thread-local
+// workspace is used (see thread_local_default() below), so that most callers don't need to think
+// about workspaces at all.  The constructor (or reserve()) can be used to preallocate buffers for
+// the largest (nfreq, nt, Df, Dt) which will be used.
+//
+// A workspace must not be used by more than one thread at a time.
+
+struct clipper_workspace {
+    static constexpr int nbuf = 7;
+
+    clipper_workspace() { }
+    clipper_workspace(int nfreq, int nt, int Df=1, int Dt=1);
+    ~clipper_workspace();
+
+    // Noncopyable
+    clipper_workspace(const clipper_workspace &) = delete;
+    clipper_workspace &operator=(const clipper_workspace &) = delete;
+
+    void reserve(int nfreq, int nt, int Df=1, int Dt=1);
+    void deallocate();
+    ssize_t get_nbytes_allocated() const;
+
+    // Returns buffer 'ibuf' (0 <= ibuf < nbuf), with room for at least 'n' elements of type T.
+    // If the buffer needs to grow, its previous contents are lost.
+    template<typename T> inline T *get(int ibuf, ssize_t n) { return reinterpret_cast<T *> (_get(ibuf, n * sizeof(T))); }
+
+    static clipper_workspace &thread_local_default();
+
+protected:
+    void *buf[nbuf] = { };
+    ssize_t nbytes[nbuf] = { };
+
+    void *_get(int ibuf, ssize_t nbytes);
+};
+
 
 extern void apply_intensity_clipper(const float *intensity, float *weights, int nfreq, int nt, 
 				    int stride, axis_type axis, double sigma, int niter=1, 
-				    double iter_sigma=0.0, int Df=1, int Dt=1, bool two_pass=false);
+				    double iter_sigma=0.0, int Df=1, int Dt=1, bool two_pass=false,
+				    bool robust=false, clipper_workspace *ws=nullptr);
 
 extern void apply_std_dev_clipper(const float *intensity, float *weights, int nfreq, int nt, int stride,
-				  axis_type axis, double sigma, int Df=1, int Dt=1, bool two_pass=false);
+				  axis_type axis, double sigma, int Df=1, int Dt=1, bool two_pass=false,
+				  bool robust=false, int niter=1, double iter_sigma=0.0, clipper_workspace *ws=nullptr);
+
+
+// Multithreaded versions of the standalone functions above, for large arrays.  The first argument
+// is the number of threads (if <= 0, then the number of cores is used).  Threads are created on
+// each call, and the array is split into blocks of rows or columns, depending on the axis.
+//
+// For the intensity_clipper with axis=AXIS_NONE, and for the std_dev_clipper, the mean/variance
+// reductions are done in parallel, so the result may differ from the single-threaded version by
+// floating-point roundoff.  In robust mode, these cases are not parallelized.
+
+extern void apply_polynomial_detrender_parallel(int nthreads, float *intensity, float *weights, int nfreq, int nt, 
+						int stride, axis_type axis, int polydeg, double epsilon,
+						detrender_precision precision=PRECISION_FLOAT);
+
+extern void apply_intensity_clipper_parallel(int nthreads, const float *intensity, float *weights, int nfreq, int nt, 
+					     int stride, axis_type axis, double sigma, int niter=1, 
+					     double iter_sigma=0.0, int Df=1, int Dt=1, bool two_pass=false,
+					     bool robust=false);
+
+extern void apply_std_dev_clipper_parallel(int nthreads, const float *intensity, float *weights, int nfreq, int nt, int stride,
+					   axis_type axis, double sigma, int Df=1, int Dt=1, bool two_pass=false,
+					   bool robust=false, int niter=1, double iter_sigma=0.0);
 
 
 // Helper routines for the RFI transforms above, factored out as standalone functions.
 //
 // wi_downsample(): downsamples an (intensity, weights) pair.  The downsampling factors (Df,Dt)
-// must be powers of two.  Note that the normalization of the downsampled weights array differs
+// need not be powers of two, but powers of two are fastest.  Note that the normalization of the downsampled weights array differs
 // (by a factor of Df*Dt) from the python version of wi_downsample().
 //
 // weighted_mean_and_rms(): computes weighted mean/rms of a 2D intensity array.
@@ -360,6 +595,61 @@ extern std::shared_ptr<wi_transform> make_bonsai_dedisperser(const std::string &
 							     const std::string &trigger_plot_stem, int nt_per_file=0);
 
 
+//
+// Returns a "transform" which doesn't actually modify the data, it just makes waterfall plots.
+// This is a C++ version of the python plotter_transform, and requires rf_pipelines to be compiled
+// with libpng (HAVE_PNG=y in Makefile.local).  PNG files are written in a background thread.
+//
+// Each plot has 'img_nfreq' y-pixels and 'img_nt' x-pixels, and output filenames are of the form
+//   ${img_prefix}_zoom${zoom_level}_${plot_number}.png
+//
+// At zoom level 0, each x-pixel corresponds to 'downsample_nt' time samples, and each subsequent
+// zoom level is downsampled by an additional factor two.  The ratio (stream nfreq)/img_nfreq must
+// be an integer.
+// The 'img_nt' arg must be a multiple of constants::single_precision_simd_length, and 'nt_chunk'
+// must be a multiple of (downsample_nt * 2^(n_zoom-1) * constants::single_precision_simd_length).
+// If 'nt_chunk' is zero, a default value will be chosen.
+//
+// The color scheme is assigned by computing the mean and rms after 'clip_niter' iterations of
+// 'sigma_clip'-sigma clipping, as in the python version.
+//
+extern std::shared_ptr<wi_transform> make_plotter_transform(const std::string &img_prefix, int img_nfreq, int img_nt, int downsample_nt=1,
+							    int n_zoom=1, int nt_chunk=0, int clip_niter=3, double sigma_clip=3.0);
+
+
+//
+// Returns a transform which adds simulated FRB's to the intensity array (leaving weights unmodified).
+// Unlike the python frb_injector_transform, many pulses can be injected by a single transform, and
+// the 'simpulse' library is not needed.  The pulses need not be sorted, and may overlap.
+//
+// The pulse parameters are defined as in the python frb_injector_transform:
+//
+//   snr: signal-to-noise ratio in "sigmas", assuming noise rms 'sample_rms' in every channel
+//     and uniform channel weighting.  (See caveats in the frb_injector_transform docstring.)
+//   undispersed_arrival_time: arrival time in seconds, without dispersion delay applied.
+//   dm: dispersion measure in pc cm^{-3}.
+//   intrinsic_width: width of the (Gaussian) pulse in seconds.
+//   sm: scattering timescale in milliseconds (not seconds!) at 1 GHz, scaling as frequency^(-4.4).
+//   spectral_index: pulse strength is proportional to frequency^(spectral_index).
+//
+// The 'nt_chunk' arg must be a multiple of constants::single_precision_simd_length.
+//
+struct frb_pulse {
+    double snr;
+    double undispersed_arrival_time;
+    double dm;
+    double intrinsic_width;
+    double sm;
+    double spectral_index;
+
+    frb_pulse(double snr_, double undispersed_arrival_time_, double dm_, double intrinsic_width_=0.0, double sm_=0.0, double spectral_index_=0.0) :
+	snr(snr_), undispersed_arrival_time(undispersed_arrival_time_), dm(dm_), intrinsic_width(intrinsic_width_), sm(sm_), spectral_index(spectral_index_)
+    { }
+};
+
+extern std::shared_ptr<wi_transform> make_frb_injector(const std::vector<frb_pulse> &pulses, double sample_rms=1.0, int nt_chunk=1024);
+
+
 // Some day, this factory function will return a C++ implementation of the 'badchannel_mask' class.
 // Right now, it is a placeholder which throws an exception if called.
 
@@ -482,6 +772,16 @@ struct wi_transform {
     ssize_t nt_prepad = 0;    // prepad size for process_chunk(), see below
     ssize_t nt_postpad = 0;   // postpad size for process_chunk(), see below
 
+    // Optional: a transform which never modifies the intensity or weights arrays (e.g. a plotter)
+    // can set this flag.  Downsampled copies of a chunk can then be reused by later transforms,
+    // without being recomputed (see 'struct downsample_cache' in rf_pipelines_internals.hpp).
+    bool is_read_only = false;
+
+    // Optional: a transform which never changes a zero weight to a nonzero value (e.g. a clipper or
+    // detrender) can set this flag.  Fully masked rows then stay masked, so the per-chunk mask metadata
+    // can be kept for later transforms (see 'struct chunk_mask_info' in rf_pipelines_internals.hpp).
+    bool preserves_mask = false;
+
     //
     // Each transform can define key/value pairs which get written to the pipeline json output file.
     // This data is always written on a per-substream basis, but it's convenient not to reinitialize it
@@ -554,6 +854,13 @@ struct wi_transform {
     std::shared_ptr<rf_pipelines::outdir_manager> outdir_manager;
     double time_spent_in_transform = 0.0;
 
+    // Non-null only during calls to process_chunk() from a running pipeline (i.e. it is null
+    // if the transform is called directly, for example in a timing thread).
+    downsample_cache *ds_cache = nullptr;
+
+    // Same as 'ds_cache': non-null only during calls to process_chunk() from a running pipeline.
+    chunk_mask_info *mask_info = nullptr;
+
 
     wi_transform() { }
 
@@ -646,6 +953,57 @@ struct wi_transform {
 };
 
 
+//
+// trigger_grouper: a streaming version of the L1 event grouping in grouper.py.
+//
+// This is a "transform" which doesn't look at the intensity data.  Instead, coarse-grained trigger
+// arrays from the bonsai dedisperser are supplied in every chunk, by calling process_triggers().
+// Each trigger array is a C-contiguous 4D array of shape (ndm, nsm, nbeta, nt), one per dedispersion
+// tree, as returned by bonsai.Dedisperser.get_triggers(), and 't0','t1' are the endpoints of the
+// chunk in seconds.  (Usually the grouper is passed to the python bonsai_dedisperser, which calls
+// process_triggers() for you, and should appear after it in the pipeline.)
+//
+// Triggers above 'threshold' (which must be finite and nonnegative) are clustered in (dm, time)
+// by friends-of-friends, merging across trees: two triggers are linked if they are within 'dm_link'
+// in DM and 't_link' (in seconds) in time, and each connected component becomes an l1_event whose
+// (dm, time, snr) are taken from its highest-S/N trigger.  Events are finalized as soon as no future
+// trigger can be linked to them, so that memory usage is bounded.
+//
+// If 'tree_max_dm' is nonempty, it should contain the max DM of each tree, and DM's are reported
+// in pc cm^{-3}.  Otherwise, DM's are reported in units of coarse-grained tree-0 DM indices.
+//
+// Finalized events are written to a ring buffer of size 'max_events', which can be read with
+// get_events(), and if 'fname' is nonempty, to the text file ${fname}.txt in the output directory.
+// At most 'max_events' clusters can be in progress at once; if this is exceeded, the oldest
+// clusters are finalized early.  Note that event times are chunk times, with no correction
+// for the latency of the dedisperser.
+//
+struct l1_event {
+    double dm = 0.0;       // DM of highest-S/N trigger
+    double time = 0.0;     // time of highest-S/N trigger, in seconds
+    double snr = 0.0;
+    double dm_lo = 0.0;    // bounding box of all triggers in the event
+    double dm_hi = 0.0;
+    double t_lo = 0.0;
+    double t_hi = 0.0;
+    int itree = 0;         // (tree, sm, beta) indices of highest-S/N trigger
+    int ism = 0;
+    int ibeta = 0;
+    int ntriggers = 0;     // number of above-threshold triggers in the event
+};
+
+struct trigger_grouper : public wi_transform {
+    virtual void process_triggers(int itree, const float *triggers, int ndm, int nsm, int nbeta, int nt, double t0, double t1) = 0;
+
+    // Returns all finalized events which have not been returned by a previous call to get_events().
+    virtual void get_events(std::vector<l1_event> &out) = 0;
+};
+
+extern std::shared_ptr<trigger_grouper> make_trigger_grouper(double threshold, double dm_link=5.0, double t_link=0.01,
+							     const std::vector<double> &tree_max_dm = std::vector<double>(),
+							     const std::string &fname = "", int max_events=4096, int nt_chunk=1024);
+
+
 // -------------------------------------------------------------------------------------------------
 //
 // Low-level classes.
@@ -788,6 +1146,12 @@ protected:
     // buffers
     wraparound_buf main_buffer;
     std::vector<wraparound_buf> prepad_buffers;
+
+    // Downsampled copies of the current chunk, shared between transforms.
+    std::shared_ptr<downsample_cache> ds_cache;
+
+    // Fully masked rows of the current chunk, shared between transforms.
+    std::shared_ptr<chunk_mask_info> mask_info;
     
     void output_substream_json();
     void clear_per_substream_data();
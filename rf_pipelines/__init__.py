@@ -61,14 +61,20 @@ Transforms:
    chime_packetizer()         send stream over network, to a chime_network_stream running on another machine (also available in C++)
    clipper_transform()        masks data based on intensity values
    frb_injector_transform()   simulates an FRB (currently S/N calculation only works for toy noise models)
+   frb_injector()             simulates many FRB's in a single C++ transform
    kurtosis_filter()          masks data based on kurtosis
    mask_expander()            expands mask based on weights
-   plotter_transform()        makes waterfall plots at a specified place in the pipeline, very useful for debugging
+   plotter_transform()        makes waterfall plots at a specified place in the pipeline, very useful for debugging (also available in C++)
    RC_detrender()             exponential detrender, with bidirectional feature intended to remove "step-like" features
+   running_median_detrender() subtracts a running median along the time axis, robust to RFI (C++ only)
+   rfi_clipper_chain()        runs a sequence of intensity/std_dev clippers with fewer passes over memory (C++ only)
    polynomial_detrender()     detrending algorithm (also available in C++)
    intensity_clipper()        clipping algorithm based on variance of intensity (also available in C++)
+   spline_detrender()         detrends by subtracting a best-fit cubic spline, stable for slow bandpass structure (C++ only)
    std_dev_clipper()          masks data based on variance of variances (also available in C++)
    thermal_noise_weight()     applies optimal weighting assuming flat gains and variance proportional to intensity
+   trigger_grouper()          groups bonsai triggers into L1 events in a streaming C++ transform (used with bonsai_dedisperser)
+   variance_estimator()       makes a running estimate of the variance in each channel (also available in C++)
 """
 
 
@@ -90,7 +96,7 @@ except:
 # is non-obvious, since it is implicitly defined by the C++ part of the library.  All
 # documentation is in the docstring for class 'py_wi_transform' below!
 
-from .rf_pipelines_c import wi_stream, wi_transform, wi_run_state
+from .rf_pipelines_c import wi_stream, wi_transform, wi_run_state, clipper_workspace
 
 
 
@@ -128,7 +134,7 @@ class py_wi_transform(wi_transform):
 
     If your transform creates plots, and you want plot information to end up in the JSON output,
     see the docstrings for the add_plot_group() and add_plot() methods of class py_wi_transform,
-    or see the plotter_transform class for an example.
+    or see the plotter_transform_python class for an example.
 
     The "plots" part of the transform's (per-substream) json output consists of
 
@@ -228,6 +234,22 @@ class py_wi_transform(wi_transform):
         many zeros arise is at the end of a stream, where the total stream length may not be
         a multiple of nt_chunk, and so the rf_pipelines library will append zero-weight data.
 
+        Batching: python transforms with small nt_chunk can spend most of their time in per-call
+        overhead.  To reduce this, a transform can set self.nchunks_per_call = K (with K > 1) in its
+        constructor or set_stream().  In this case, each call to process_chunk() processes K consecutive
+        chunks, and 'intensity' and 'weights' are 3D arrays with shape (K, self.nfreq, self.nt_chunk + self.nt_postpad),
+        where intensity[k,:,:] is the k-th chunk (including its postpadding, so consecutive chunks overlap
+        if nt_postpad > 0).  The (t0, t1) args are the endpoints of the whole batch.  If nt_prepad > 0, then
+        'pp_intensity' and 'pp_weights' are 3D arrays with shape (K, self.nfreq, self.nt_prepad), where pp_intensity[k,:,:]
+        is the prepadding for the k-th chunk.  As in the unbatched case, this is the data before process_chunk() was
+        called, even if process_chunk() modifies the (k-1)-th chunk first.  (For k > 0, the prepadding comes from the
+        end of the (k-1)-th chunk, so nt_prepad <= nt_chunk is required.)  Note that self.nt_chunk is still the size
+        of one chunk, not the whole batch.
+
+        Note: the 'intensity', 'weights', 'pp_intensity', 'pp_weights' array objects may be reused
+        between calls to process_chunk() (pointing to new data), so process_chunk() must not keep
+        references to them after it returns.  (This was already forbidden, and is checked.)
+
 
     end_substream(): counterpart to start_substream() above.
     """
@@ -324,6 +346,8 @@ class py_wi_stream(wi_stream):
 
         run_state.start_substream(t0)
         run_state.write(intensity_arr, weight_arr, t0=None)
+        run_state.setup_write(nt, zero_flag=False, t0=None) -> (intensity_arr, weight_arr)
+        run_state.finalize_write(nt)
         run_state.end_substream()
 
     The run_state.write() method is called by stream_body() to copy data into the rf_pipelines
@@ -335,6 +359,24 @@ class py_wi_stream(wi_stream):
     timestamp drifts over time.  For example in the chimefrb pipeline, the intensity samples 
     always correspond to a fixed number of FPGA counts, and the FPGA clock drifts on long timescales.
 
+    The run_state.setup_write() and run_state.finalize_write() methods are a zero-copy alternative
+    to run_state.write().  The setup_write() method returns a pair of writeable 2D arrays of shape
+    (nfreq, nt), which are views of the rf_pipelines ring buffer.  The stream fills these arrays
+    in place (e.g. by reading from a file with np.copyto() or readinto()), and then calls
+    finalize_write() with the same value of 'nt'.  If 'zero_flag' is True, then the arrays are
+    zeroed in setup_write(); otherwise their initial contents are unspecified.  Since the ring
+    buffer is reused, all references to the arrays must be dropped before finalize_write() is
+    called, for example:
+
+       (intensity, weights) = run_state.setup_write(nt)
+       f.readinto(intensity)
+       f.readinto(weights)
+       del intensity, weights
+       run_state.finalize_write(nt)
+
+    If a reference is still held, then finalize_write() raises an exception, and the arrays are
+    neutered (their shape is set to zero and they are made read-only).
+
     The run_state.start_substream() and run_state.end_substream() methods can be used to divide the
     stream into multiple substreams.  The downstream transforms should reset state between substreams.
     The 't0' arg to start_substream() is the initial time of the substream in seconds, relative to an 
@@ -358,8 +400,8 @@ class py_wi_stream(wi_stream):
     in frb_olympics/frb_olympics.py.  (Unfortunately, there's no example of a python stream in the rf_pipelines
     repo itself, so I have to recommend an example in a different repo!)
 
-    Comment: the python stream API has an extra copy relative to the C++ API, so python streams may be a little
-    slower than C++ streams, but it's hard to do anything about this!
+    Comment: run_state.write() has an extra copy relative to the C++ API, so python streams which use it
+    may be a little slower than C++ streams.  Use setup_write() and finalize_write() to avoid the extra copy.
     """
 
     def __init__(self, nfreq, freq_lo_MHz, freq_hi_MHz, dt_sample, nt_maxwrite):
@@ -409,15 +451,19 @@ from .transforms.chime_transforms import chime_file_writer
 from .transforms.plotter_transform import plotter_transform
 from .transforms.bonsai_dedisperser import bonsai_dedisperser
 from .transforms.bonsai_dedisperser import old_bonsai_dedisperser
-from .transforms.frb_injector_transform import frb_injector_transform
+from .transforms.bonsai_dedisperser import trigger_grouper, trigger_grouper_events
+from .transforms.frb_injector_transform import frb_injector_transform, frb_injector
 from .transforms.badchannel_mask import badchannel_mask
 from .transforms.intensity_clipper import intensity_clipper
 from .transforms.polynomial_detrender import polynomial_detrender
 from .transforms.mask_expander import mask_expander
 from .transforms.kurtosis_filter import kurtosis_filter
 from .transforms.std_dev_clipper import std_dev_clipper
+from .transforms.rfi_clipper_chain import rfi_clipper_chain
 from .transforms.thermal_noise_weight import thermal_noise_weight
 from .transforms.RC_detrender import RC_detrender
+from .transforms.running_median_detrender import running_median_detrender
+from .transforms.spline_detrender import spline_detrender
 from .transforms.variance_estimator import variance_estimator
 
 # Helper routines for implementing new transforms in python.
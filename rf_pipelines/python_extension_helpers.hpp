@@ -436,6 +436,44 @@ struct object {
 };
 
 
+// -------------------------------------------------------------------------------------------------
+//
+// Helper classes for managing the GIL.
+//
+//   gil_releaser: releases the GIL in its constructor, and reacquires it in its destructor.
+//     The caller must hold the GIL.  Use this around long-running C++ code which doesn't
+//     touch python objects (e.g. running a pipeline).
+//
+//   gil_acquirer: acquires the GIL in its constructor, and restores the previous GIL state
+//     in its destructor.  Use this in callbacks which may be called from C++ code which has
+//     released the GIL.  Since object destructors call Py_DECREF(), the gil_acquirer must be
+//     constructed before (and therefore destroyed after) any 'object' in the same scope.
+//
+// Note that PyEval_InitThreads() must be called (in the module init function) before these are used.
+
+
+struct gil_releaser {
+    PyThreadState *save;
+
+    gil_releaser() : save(PyEval_SaveThread()) { }
+    ~gil_releaser() { PyEval_RestoreThread(save); }
+
+    gil_releaser(const gil_releaser &) = delete;
+    gil_releaser& operator=(const gil_releaser &) = delete;
+};
+
+
+struct gil_acquirer {
+    PyGILState_STATE state;
+
+    gil_acquirer() : state(PyGILState_Ensure()) { }
+    ~gil_acquirer() { PyGILState_Release(state); }
+
+    gil_acquirer(const gil_acquirer &) = delete;
+    gil_acquirer& operator=(const gil_acquirer &) = delete;
+};
+
+
 // -------------------------------------------------------------------------------------------------
 //
 // Misc
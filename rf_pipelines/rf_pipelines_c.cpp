@@ -70,6 +70,13 @@ struct arr_2d_helper {
 	// If either of these exception is thrown, then my understsanding of the python array API is incomplete!
 	if (!try_array(a, writeback))
 	    throw runtime_error("rf_pipelines internal error: try_array() failed in arr_2d_helper::set_contiguous()");
+
+	// With relaxed strides (the numpy default since 1.12), an array with one row counts as
+	// C-contiguous whatever its row stride, so PyArray_FromAny() may return it unchanged.
+	// The row stride is never used in this case.
+	if (nfreq == 1)
+	    this->stride = nt;
+
 	if (stride != nt)
 	    throw runtime_error("rf_pipelines internal error: unexpected stride in arr_2d_helper::set_contiguous()");
     }
@@ -134,12 +141,35 @@ struct arr_wi_helper {
 
 
 // "Upcalling" transform whose virtual functions are implemented by python upcalls.
+//
+// Since wi_stream.run() releases the GIL, each upcall must reacquire it (see gil_acquirer in
+// python_extension_helpers.hpp).  The gil_acquirer is always the first local variable, so
+// that it is destroyed after the 'object' locals, whose destructors call Py_DECREF().
 struct upcalling_wi_transform : public rf_pipelines::wi_transform
 {
     object weakref;
 
+    // Number of chunks per process_chunk() upcall (see "batching" in the py_wi_transform docstring).
+    // When nbatch > 1, the C++ 'nt_chunk' member is (nbatch * python nt_chunk).
+    ssize_t nbatch = 1;
+
+    // Cached method name and array wrappers, to reduce the per-chunk overhead of process_chunk().
+    // The array wrappers are reused between calls, by rebinding their data pointers.
+    object process_chunk_name;
+    object np_intensity;
+    object np_weights;
+    object np_pp_intensity;
+    object np_pp_weights;
+
+    // When nbatch > 1 and nt_prepad > 0, the prepadding for each chunk in the batch is copied here
+    // before the upcall (shape (nbatch, nfreq, nt_prepad)), since the python transform may modify
+    // chunk k-1 before it processes chunk k.
+    vector<float> pp_batch_intensity;
+    vector<float> pp_batch_weights;
+
     upcalling_wi_transform(PyObject *self) :
-	weakref(PyWeakref_NewRef(self,NULL), false)
+	weakref(PyWeakref_NewRef(self,NULL), false),
+	process_chunk_name(PyString_InternFromString("process_chunk"), false)
     { }
 
     virtual ~upcalling_wi_transform() { }
@@ -155,23 +185,49 @@ struct upcalling_wi_transform : public rf_pipelines::wi_transform
 	return ret;
     }
 
-    // helper function
-    static object array2d_to_python(ssize_t m, ssize_t n, const float *src, ssize_t src_stride)
+    //
+    // Helper function: points 'a' to a float32 array with the given shape and strides (in floats).
+    //
+    // If 'a' already refers to an array with the same shape and strides, and no other references
+    // to the array exist, then it is reused by rebinding its data pointer (this is safe since the
+    // array doesn't own its data).  Otherwise a new array is created.
+    //
+    static void bind_array(object &a, int ndim, const npy_intp *dims, const npy_intp *fstrides, float *data)
     {
-	if ((m <= 0) || (n <= 0) || !src)
-	    throw runtime_error("rf_pipelines: array2d_to_python: internal checks failed [should never happen]");
+	if ((ndim < 1) || (ndim > 3) || !data)
+	    throw runtime_error("rf_pipelines: bind_array: internal checks failed [should never happen]");
 
-	npy_intp dims[2] = { m, n };
-	npy_intp strides[2] = { src_stride * (ssize_t)sizeof(float), (ssize_t)sizeof(float) };
+	npy_intp strides[3];
+	for (int i = 0; i < ndim; i++)
+	    strides[i] = fstrides[i] * (ssize_t)sizeof(float);
 
-	// PyArray_New(subtype, nd, dims, type_num, npy_intp* strides, void* data, int itemsize, int flags, PyObject* obj)
-	PyObject *p = PyArray_New(&PyArray_Type, 2, dims, NPY_FLOAT, strides, (void *)src, 0, NPY_ARRAY_WRITEABLE, NULL);
+	if ((a.ptr != Py_None) && (a.get_refcount() == 1)) {
+	    PyArrayObject *arr = (PyArrayObject *) a.ptr;
+	    bool match = (PyArray_NDIM(arr) == ndim);
+
+	    for (int i = 0; match && (i < ndim); i++)
+		match = (PyArray_DIM(arr,i) == dims[i]) && (PyArray_STRIDE(arr,i) == strides[i]);
 
-	return object(p, false);
+	    if (match) {
+		((PyArrayObject_fields *) arr)->data = (char *) data;
+		PyArray_ENABLEFLAGS(arr, NPY_ARRAY_WRITEABLE);
+		return;
+	    }
+	}
+
+	// PyArray_New(subtype, nd, dims, type_num, npy_intp* strides, void* data, int itemsize, int flags, PyObject* obj)
+	PyObject *p = PyArray_New(&PyArray_Type, ndim, const_cast<npy_intp *> (dims), NPY_FLOAT, strides, (void *)data, 0, NPY_ARRAY_WRITEABLE, NULL);
+	a = object(p, false);
     }
 
     virtual void set_stream(const rf_pipelines::wi_stream &stream) override
     {
+	gil_acquirer gil;
+
+	// Undo batching from a previous run, before the python set_stream() sees nt_chunk.
+	this->nt_chunk /= nbatch;
+	this->nbatch = 1;
+
 	PyObject *sp = make_temporary_stream(stream);
 	object s(sp, false);
 
@@ -180,31 +236,86 @@ struct upcalling_wi_transform : public rf_pipelines::wi_transform
 
 	if (s.get_refcount() > 1)
 	    throw runtime_error("fatal: wi_transform.set_stream() callback kept a reference to the stream");
+
+	// Batching is opt-in, by setting the 'nchunks_per_call' attribute to a value > 1.
+	if (PyObject_HasAttrString(this->get_pyobj(), "nchunks_per_call")) {
+	    object n(PyObject_GetAttrString(this->get_pyobj(), "nchunks_per_call"), false);
+	    ssize_t k = ssize_t_from_python(n.ptr);
+
+	    if (k <= 0)
+		throw runtime_error("rf_pipelines: py_wi_transform.nchunks_per_call must be positive (name=" + this->name + ")");
+	    if ((k > 1) && (nt_prepad > nt_chunk))
+		throw runtime_error("rf_pipelines: py_wi_transform with nchunks_per_call > 1 must have nt_prepad <= nt_chunk (name=" + this->name + ")");
+
+	    this->nbatch = k;
+	    this->nt_chunk *= k;
+	}
     }
 
     virtual void start_substream(int isubstream, double t0) override
     {	
+	gil_acquirer gil;
 	PyObject *p = PyObject_CallMethod(this->get_pyobj(), (char *)"start_substream", (char *)"id", isubstream, t0);
 	object ret(p, false);  // a convenient way to ensure Py_DECREF gets called, and throw an exception on failure
     }
 
     virtual void process_chunk(double t0, double t1, float *intensity, float *weights, ssize_t stride, float *pp_intensity, float *pp_weights, ssize_t pp_stride) override
     {
-	object np_intensity = array2d_to_python(nfreq, nt_chunk + nt_postpad, intensity, stride);
-	object np_weights = array2d_to_python(nfreq, nt_chunk + nt_postpad, weights, stride);
-	object np_pp_intensity;
-	object np_pp_weights;
+	gil_acquirer gil;
+
+	// If nbatch > 1, the (intensity, weights) arrays are 3D views with shape (nbatch, nfreq, nt_sub + nt_postpad),
+	// where nt_sub = nt_chunk / nbatch.  Note that consecutive chunks overlap in memory if nt_postpad > 0.
+	ssize_t nt_sub = nt_chunk / nbatch;
 
-	if (nt_prepad > 0) {
-	    np_pp_intensity = array2d_to_python(nfreq, nt_prepad, pp_intensity, pp_stride);
-	    np_pp_weights = array2d_to_python(nfreq, nt_prepad, pp_weights, pp_stride);
+	if (nbatch == 1) {
+	    npy_intp dims[2] = { nfreq, nt_chunk + nt_postpad };
+	    npy_intp fstrides[2] = { stride, 1 };
+	    bind_array(np_intensity, 2, dims, fstrides, intensity);
+	    bind_array(np_weights, 2, dims, fstrides, weights);
+	}
+	else {
+	    npy_intp dims[3] = { nbatch, nfreq, nt_sub + nt_postpad };
+	    npy_intp fstrides[3] = { nt_sub, stride, 1 };
+	    bind_array(np_intensity, 3, dims, fstrides, intensity);
+	    bind_array(np_weights, 3, dims, fstrides, weights);
+	}
+
+	if ((nt_prepad > 0) && (nbatch == 1)) {
+	    npy_intp dims[2] = { nfreq, nt_prepad };
+	    npy_intp fstrides[2] = { pp_stride, 1 };
+	    bind_array(np_pp_intensity, 2, dims, fstrides, pp_intensity);
+	    bind_array(np_pp_weights, 2, dims, fstrides, pp_weights);
+	}
+	else if (nt_prepad > 0) {
+	    // Prepadding for chunk 0 comes from the pp arrays, and for chunk k > 0 from the end of chunk k-1.
+	    pp_batch_intensity.resize(nbatch * nfreq * nt_prepad);
+	    pp_batch_weights.resize(nbatch * nfreq * nt_prepad);
+
+	    for (ssize_t k = 0; k < nbatch; k++) {
+		const float *src_i = (k > 0) ? (intensity + k * nt_sub - nt_prepad) : pp_intensity;
+		const float *src_w = (k > 0) ? (weights + k * nt_sub - nt_prepad) : pp_weights;
+		ssize_t src_stride = (k > 0) ? stride : pp_stride;
+
+		for (int ifreq = 0; ifreq < nfreq; ifreq++) {
+		    memcpy(&pp_batch_intensity[(k*nfreq + ifreq) * nt_prepad], src_i + ifreq * src_stride, nt_prepad * sizeof(float));
+		    memcpy(&pp_batch_weights[(k*nfreq + ifreq) * nt_prepad], src_w + ifreq * src_stride, nt_prepad * sizeof(float));
+		}
+	    }
+
+	    npy_intp dims[3] = { nbatch, nfreq, nt_prepad };
+	    npy_intp fstrides[3] = { nfreq * nt_prepad, nt_prepad, 1 };
+	    bind_array(np_pp_intensity, 3, dims, fstrides, &pp_batch_intensity[0]);
+	    bind_array(np_pp_weights, 3, dims, fstrides, &pp_batch_weights[0]);
 	}
 
+	object np_t0(PyFloat_FromDouble(t0), false);
+	object np_t1(PyFloat_FromDouble(t1), false);
+
 	// FIXME: a weird corner case that I'd like to understand more generally: control-C can
 	// cause the np_intensity refcount to equal 2 when PyObject_CallMethod() returns.  Does
 	// this means it leaks memory?
-	PyObject *p = PyObject_CallMethod(this->get_pyobj(), (char *)"process_chunk", (char *)"ddOOOO", t0, t1,
-					  np_intensity.ptr, np_weights.ptr, np_pp_intensity.ptr, np_pp_weights.ptr);
+	PyObject *p = PyObject_CallMethodObjArgs(this->get_pyobj(), process_chunk_name.ptr, np_t0.ptr, np_t1.ptr, np_intensity.ptr, np_weights.ptr, 
+						 (nt_prepad > 0) ? np_pp_intensity.ptr : Py_None, (nt_prepad > 0) ? np_pp_weights.ptr : Py_None, NULL);
 
 	object ret(p, false);  // a convenient way to ensure Py_DECREF gets called, and throw an exception on failure
 
@@ -220,6 +331,7 @@ struct upcalling_wi_transform : public rf_pipelines::wi_transform
 
     virtual void end_substream() override
     {
+	gil_acquirer gil;
 	PyObject *p = PyObject_CallMethod(this->get_pyobj(), (char *)"end_substream", NULL);
 	object ret(p, false);
     }
@@ -308,14 +420,23 @@ struct wi_transform_object {
 	return 0;
     }
 
+    // Python transforms with nchunks_per_call > 1 see the unbatched nt_chunk (see upcalling_wi_transform).
+    static inline ssize_t get_nbatch(rf_pipelines::wi_transform *t)
+    {
+	upcalling_wi_transform *u = dynamic_cast<upcalling_wi_transform *> (t);
+	return u ? u->nbatch : 1;
+    }
+
     static PyObject *nt_chunk_getter(PyObject *self, void *closure)
     {
-	return Py_BuildValue("i", get_pbare(self)->nt_chunk);
+	rf_pipelines::wi_transform *t = get_pbare(self);
+	return Py_BuildValue("i", t->nt_chunk / get_nbatch(t));
     }
 
     static int nt_chunk_setter(PyObject *self, PyObject *value, void *closure)
     {
-	get_pbare(self)->nt_chunk = ssize_t_from_python(value);
+	rf_pipelines::wi_transform *t = get_pbare(self);
+	t->nt_chunk = ssize_t_from_python(value) * get_nbatch(t);
 	return 0;
     }
 
@@ -529,6 +650,13 @@ bool wi_transform_object::isinstance(PyObject *obj)
 //   whenever process_chunk() is called.  This ensures that control-C always gets caught,
 //   in the case where we're running rf_pipelines through the python interpreter, but all 
 //   streams and transforms are C++ classes.
+//
+//   Since python only delivers signals to the main thread, the GIL is only reacquired (once
+//   per chunk) if the pipeline is running in the main thread.  Pipelines running in other
+//   python threads don't touch the GIL at all, unless they contain python transforms/streams.
+
+// Initialized in initrf_pipelines_c().
+static std::thread::id main_thread_id;
 
 
 struct exception_monitor : public rf_pipelines::wi_transform
@@ -550,6 +678,11 @@ struct exception_monitor : public rf_pipelines::wi_transform
 
     virtual void process_chunk(double t0, double t1, float *intensity, float *weights, ssize_t stride, float *pp_intensity, float *pp_weights, ssize_t pp_stride) override
     {
+	if (std::this_thread::get_id() != main_thread_id)
+	    return;
+
+	gil_acquirer gil;
+
 	if (PyErr_Occurred() || PyErr_CheckSignals())
 	    throw python_exception();
     }
@@ -566,9 +699,15 @@ struct exception_monitor : public rf_pipelines::wi_transform
 struct wi_run_state_object {
     PyObject_HEAD
 
-    // "Borrowed" reference, cannot be NULL
+    // "Borrowed" reference, cannot be NULL while the stream is running.  Reset to NULL by detach().
     rf_pipelines::wi_run_state *pbare;
 
+    // The ring buffer views returned by setup_write(), which are pending until finalize_write()
+    // (owned references, or NULL).  The base object of each view is the wi_run_state object, so
+    // that a view which outlives the stream is detected in upcalling_wi_stream::stream_body().
+    PyObject *pending_intensity;
+    PyObject *pending_weights;
+
     // Forward declarations (these guys need to come after 'wi_run_state_type')
     static PyObject *make(rf_pipelines::wi_run_state &rs);
     static bool isinstance(PyObject *obj);
@@ -594,15 +733,71 @@ struct wi_run_state_object {
 
 	wi_run_state_object *self = (wi_run_state_object *) self_;
 	self->pbare = nullptr;
+	self->pending_intensity = nullptr;
+	self->pending_weights = nullptr;
 	return self_;
     }
 
+    static void tp_dealloc(PyObject *self_)
+    {
+	wi_run_state_object *self = (wi_run_state_object *) self_;
+	Py_XDECREF(self->pending_intensity);
+	Py_XDECREF(self->pending_weights);
+	Py_TYPE(self_)->tp_free(self_);
+    }
+
+    // Makes a ring buffer view unusable, by setting its shape to zero and clearing its WRITEABLE
+    // flag, in case python still holds a reference to it.
+    static void neuter_view(PyObject *view)
+    {
+	PyArrayObject *arr = (PyArrayObject *) view;
+	PyArray_CLEARFLAGS(arr, NPY_ARRAY_WRITEABLE);
+
+	for (int i = 0; i < PyArray_NDIM(arr); i++)
+	    PyArray_DIMS(arr)[i] = 0;
+    }
+
+    // Drops the references to the pending views (if any).  Returns false if python still holds a
+    // reference to one of them, in which case both views are neutered.
+    static bool release_views(wi_run_state_object *self)
+    {
+	PyObject *views[2] = { self->pending_intensity, self->pending_weights };
+	bool ok = true;
+
+	for (PyObject *v: views)
+	    if (v && (Py_REFCNT(v) > 1))
+		ok = false;
+
+	for (PyObject *v: views) {
+	    if (v && !ok)
+		neuter_view(v);
+	    Py_XDECREF(v);
+	}
+
+	self->pending_intensity = nullptr;
+	self->pending_weights = nullptr;
+	return ok;
+    }
+
+    // Called when the stream_body() upcall returns, after which the C++ wi_run_state is no longer valid.
+    static void detach(PyObject *self_)
+    {
+	wi_run_state_object *self = (wi_run_state_object *) self_;
+	release_views(self);
+	self->pbare = nullptr;
+    }
+
     // void start_substream(double t0);
     // Note: this one is METH_O
     static PyObject *start_substream(PyObject *self, PyObject *arg)
     {
 	double t0 = double_from_python(arg);
-	get_pbare(self)->start_substream(t0);
+	rf_pipelines::wi_run_state *run_state = get_pbare(self);
+
+	{
+	    gil_releaser nogil;   // transforms may run here
+	    run_state->start_substream(t0);
+	}
 
 	Py_INCREF(Py_None);
 	return Py_None;
@@ -687,7 +882,94 @@ struct wi_run_state_object {
 	if (PyArray_CopyInto((PyArrayObject *)dst_weight, src_weight))
 	    return NULL;
 	
-	run_state->finalize_write(nt);
+	{
+	    gil_releaser nogil;   // transforms may run here
+	    run_state->finalize_write(nt);
+	}
+
+	Py_INCREF(Py_None);
+	return Py_None;
+    }
+
+    //
+    // Zero-copy alternative to write():
+    //
+    //   (intensity, weights) = setup_write(nt, zero_flag=False, t0=None)
+    //   ... fill intensity, weights in place ...
+    //   finalize_write(nt)
+    //
+    // The returned arrays are writeable views of the ring buffer, with shape (nfreq, nt).
+    // Python must drop all references to them (e.g. 'del intensity, weights') before calling
+    // finalize_write(), which raises an exception (and neuters the views) otherwise.
+    //
+    static PyObject *setup_write(PyObject *self, PyObject *args, PyObject *kwds)
+    {
+	rf_pipelines::wi_run_state *run_state = get_pbare(self);
+	wi_run_state_object *rs = (wi_run_state_object *) self;
+	ssize_t nt = 0;
+	int zero_flag = 0;
+	PyObject *t0_obj = Py_None;
+
+	static const char *kwlist[] = { "nt", "zero_flag", "t0", NULL };
+
+	// Note: the object pointer will be a borrowed reference
+	if (!PyArg_ParseTupleAndKeywords(args, kwds, "n|iO", (char **)kwlist, &nt, &zero_flag, &t0_obj))
+            return NULL;
+
+	float *dst_intensity_ptr = nullptr;
+	float *dst_weight_ptr = nullptr;
+	ssize_t dst_cstride = 0;
+
+	// Note: wi_run_state::setup_write() checks 0 < nt <= nt_maxwrite.
+	if (t0_obj == Py_None)
+	    run_state->setup_write(nt, dst_intensity_ptr, dst_weight_ptr, dst_cstride, zero_flag);
+	else
+	    run_state->setup_write(nt, dst_intensity_ptr, dst_weight_ptr, dst_cstride, zero_flag, double_from_python(t0_obj));
+
+	npy_intp dst_dims[2] = { run_state->nfreq, nt };
+	npy_intp dst_strides[2] = { dst_cstride * (ssize_t)sizeof(float), (ssize_t)sizeof(float) };
+
+	PyObject *dst_intensity = PyArray_New(&PyArray_Type, 2, dst_dims, NPY_FLOAT, dst_strides, (void *)dst_intensity_ptr, 0, NPY_ARRAY_WRITEABLE, NULL);
+	object ref1(dst_intensity, false);   // manages refcount, throws exception on NULL
+
+	PyObject *dst_weight = PyArray_New(&PyArray_Type, 2, dst_dims, NPY_FLOAT, dst_strides, (void *)dst_weight_ptr, 0, NPY_ARRAY_WRITEABLE, NULL);
+	object ref2(dst_weight, false);   // manages refcount, throws exception on NULL
+
+	// Note: PyArray_SetBaseObject() steals a reference to the base object.
+	for (PyObject *v: { dst_intensity, dst_weight }) {
+	    Py_INCREF(self);
+	    if (PyArray_SetBaseObject((PyArrayObject *) v, self) < 0)
+		return NULL;
+	}
+
+	// Views from a previous setup_write() without finalize_write() are dropped here
+	// (wi_run_state::setup_write() has already thrown an exception in this case).
+	release_views(rs);
+
+	Py_INCREF(dst_intensity);
+	Py_INCREF(dst_weight);
+	rs->pending_intensity = dst_intensity;
+	rs->pending_weights = dst_weight;
+
+	return Py_BuildValue("OO", dst_intensity, dst_weight);   // Note: Py_BuildValue() increments refcounts
+    }
+
+    // void finalize_write(nt);
+    // Note: this one is METH_O
+    static PyObject *finalize_write(PyObject *self, PyObject *arg)
+    {
+	ssize_t nt = ssize_t_from_python(arg);
+	rf_pipelines::wi_run_state *run_state = get_pbare(self);
+
+	// The ring buffer views from setup_write() (if any) must not be referenced after this point.
+	if (!release_views((wi_run_state_object *) self))
+	    throw runtime_error("rf_pipelines.wi_run_state.finalize_write(): python still holds a reference to an array returned by setup_write()"
+				" (these arrays must be released, e.g. with 'del', before calling finalize_write())");
+
+	{
+	    gil_releaser nogil;   // transforms may run here
+	    run_state->finalize_write(nt);
+	}
 
 	Py_INCREF(Py_None);
 	return Py_None;
@@ -697,7 +979,12 @@ struct wi_run_state_object {
     // Note: this one is METH_NOARGS
     static PyObject *end_substream(PyObject *self)
     {
-	get_pbare(self)->end_substream();
+	rf_pipelines::wi_run_state *run_state = get_pbare(self);
+
+	{
+	    gil_releaser nogil;   // transforms may run here
+	    run_state->end_substream();
+	}
 
 	Py_INCREF(Py_None);
 	return Py_None;
@@ -712,6 +999,8 @@ struct wi_run_state_object {
 static PyMethodDef wi_run_state_methods[] = {
     { "start_substream", tc_wrap2<wi_run_state_object::start_substream>, METH_O, wi_run_state_object::dummy_docstring },
     { "write", (PyCFunction) tc_wrap3<wi_run_state_object::write>, METH_VARARGS | METH_KEYWORDS, wi_run_state_object::dummy_docstring },
+    { "setup_write", (PyCFunction) tc_wrap3<wi_run_state_object::setup_write>, METH_VARARGS | METH_KEYWORDS, wi_run_state_object::dummy_docstring },
+    { "finalize_write", tc_wrap2<wi_run_state_object::finalize_write>, METH_O, wi_run_state_object::dummy_docstring },
     { "end_substream", (PyCFunction) tc_wrap1<wi_run_state_object::end_substream>, METH_NOARGS, wi_run_state_object::dummy_docstring },
     { NULL, NULL, 0, NULL }
 };
@@ -722,7 +1011,7 @@ static PyTypeObject wi_run_state_type = {
     "rf_pipelines_c.wi_run_state",  /* tp_name */
     sizeof(wi_run_state_object),    /* tp_basicsize */
     0,                         /* tp_itemsize */
-    0,                         /* tp_dealloc */
+    wi_run_state_object::tp_dealloc,  /* tp_dealloc */
     0,                         /* tp_print */
     0,                         /* tp_getattr */
     0,                         /* tp_setattr */
@@ -806,16 +1095,22 @@ struct upcalling_wi_stream : public rf_pipelines::wi_stream
 
     virtual void stream_start()
     {
+	gil_acquirer gil;
 	PyObject *p = PyObject_CallMethod(this->get_pyobj(), (char *)"stream_start", NULL);
 	object ret(p, false);
     }
     
     virtual void stream_body(rf_pipelines::wi_run_state &run_state)
     {
+	gil_acquirer gil;
 	PyObject *rs = wi_run_state_object::make(run_state);
 	object rs_ref(rs, false);
 
 	PyObject *ret = PyObject_CallMethod(this->get_pyobj(), (char *)"stream_body", (char *)"O", rs);
+
+	// The C++ run_state (and its ring buffer) goes away after stream_body() returns.  Views which
+	// are still referenced hold a reference to 'rs' through their base object, and are caught below.
+	wi_run_state_object::detach(rs);
 	object ret_ref(ret, false);
 	
 	if (rs_ref.get_refcount() > 1)
@@ -923,7 +1218,15 @@ struct wi_stream_object {
 
 	Json::Value json_out;
 	Json::Value *json_outp = return_json ? &json_out : nullptr;
-	stream->run(transform_list, outdir, json_outp, verbosity, clobber);
+
+	// The GIL is released while the pipeline runs, so that other python threads (including
+	// other pipelines) can run concurrently.  Python streams and transforms reacquire it in
+	// their upcalls.  Note that all python objects referenced by the pipeline are kept alive
+	// by 'item_references' (and 'self') until the GIL is reacquired.
+	{
+	    gil_releaser nogil;
+	    stream->run(transform_list, outdir, json_outp, verbosity, clobber);
+	}
 
 	if (!return_json) {
 	    Py_INCREF(Py_None);
@@ -963,7 +1266,10 @@ struct wi_stream_object {
 	"     json output (i.e. same data which is written to rf_pipelines.json)\n"
 	"\n"
 	"     A kludge: eventually, the run() return value will be a json object, but for now it returns\n"
-	"     the string representation, which can be converted to a json object by calling json.loads().\n";
+	"     the string representation, which can be converted to a json object by calling json.loads().\n"
+	"\n"
+	"The GIL is released while the pipeline runs, and only reacquired for python streams/transforms.\n"
+	"Therefore, pipelines consisting of C++ streams/transforms can run concurrently in python threads.\n";
 
     // Properties
 
@@ -1142,6 +1448,195 @@ bool wi_stream_object::isinstance(PyObject *obj)
 }
 
 
+// -------------------------------------------------------------------------------------------------
+//
+// clipper_workspace
+
+
+struct clipper_workspace_object {
+    PyObject_HEAD
+
+    rf_pipelines::clipper_workspace *ws;
+
+    static PyObject *tp_new(PyTypeObject *type, PyObject *args, PyObject *kwds)
+    {
+	static const char *kwlist[] = { "nfreq", "nt", "Df", "Dt", NULL };
+
+	int nfreq = 0;
+	int nt = 0;
+	int Df = 1;   // meaningful default value
+	int Dt = 1;   // meaningful default value
+
+	if (!PyArg_ParseTupleAndKeywords(args, kwds, "|iiii", (char **)kwlist, &nfreq, &nt, &Df, &Dt))
+	    return NULL;
+
+	PyObject *self_ = type->tp_alloc(type, 0);
+	if (!self_)
+	    return NULL;
+
+	clipper_workspace_object *self = (clipper_workspace_object *) self_;
+	self->ws = new rf_pipelines::clipper_workspace();
+
+	try {
+	    if ((nfreq > 0) || (nt > 0))
+		self->ws->reserve(nfreq, nt, Df, Dt);
+	} catch (std::exception &e) {
+	    PyErr_SetString(PyExc_RuntimeError, e.what());
+	    Py_DECREF(self_);
+	    return NULL;
+	}
+
+	return self_;
+    }
+
+    static void tp_dealloc(PyObject *self_)
+    {
+	clipper_workspace_object *self = (clipper_workspace_object *)self_;
+
+	delete self->ws;
+	self->ws = nullptr;
+	Py_TYPE(self)->tp_free((PyObject*) self);
+    }
+
+    static bool isinstance(PyObject *obj);
+
+    // Converts an optional 'workspace' argument (None or a clipper_workspace) to a bare pointer.
+    static rf_pipelines::clipper_workspace *from_python(PyObject *obj)
+    {
+	if (obj == Py_None)
+	    return nullptr;
+	if (!isinstance(obj))
+	    throw runtime_error("rf_pipelines: 'workspace' argument must be either None or an object of type clipper_workspace");
+
+	return ((clipper_workspace_object *) obj)->ws;
+    }
+
+    static PyObject *reserve(PyObject *self, PyObject *args, PyObject *kwds)
+    {
+	static const char *kwlist[] = { "nfreq", "nt", "Df", "Dt", NULL };
+
+	int nfreq = 0;
+	int nt = 0;
+	int Df = 1;   // meaningful default value
+	int Dt = 1;   // meaningful default value
+
+	if (!PyArg_ParseTupleAndKeywords(args, kwds, "ii|ii", (char **)kwlist, &nfreq, &nt, &Df, &Dt))
+	    return NULL;
+
+	((clipper_workspace_object *) self)->ws->reserve(nfreq, nt, Df, Dt);
+
+	Py_INCREF(Py_None);
+	return Py_None;
+    }
+
+    static PyObject *deallocate(PyObject *self, PyObject *args, PyObject *kwds)
+    {
+	static const char *kwlist[] = { NULL };
+
+	if (!PyArg_ParseTupleAndKeywords(args, kwds, "", (char **)kwlist))
+	    return NULL;
+
+	((clipper_workspace_object *) self)->ws->deallocate();
+
+	Py_INCREF(Py_None);
+	return Py_None;
+    }
+
+    static PyObject *nbytes_allocated_getter(PyObject *self, void *closure)
+    {
+	return Py_BuildValue("n", ((clipper_workspace_object *) self)->ws->get_nbytes_allocated());
+    }
+
+    static constexpr const char *docstring =
+	"clipper_workspace(nfreq=0, nt=0, Df=1, Dt=1)\n"
+	"\n"
+	"Temporary buffers for apply_intensity_clipper() and apply_std_dev_clipper(), which can be\n"
+	"passed as the 'workspace' argument, to avoid allocating memory on every call.  The buffers\n"
+	"grow as needed, and are never shrunk (except by calling deallocate()).\n"
+	"\n"
+	"If (nfreq, nt) are specified, then buffers are preallocated for arrays of that shape\n"
+	"(and downsampling factors (Df,Dt)), which is equivalent to calling reserve().\n"
+	"\n"
+	"If the 'workspace' argument is omitted, then a workspace which is shared by all calls\n"
+	"in the same thread is used.\n";
+
+    static constexpr const char *reserve_docstring =
+	"reserve(nfreq, nt, Df=1, Dt=1): preallocates buffers large enough for any clipper with the given array shape and downsampling factors";
+
+    static constexpr const char *deallocate_docstring =
+	"deallocate(): frees all buffers";
+
+    static constexpr const char *nbytes_allocated_docstring =
+	"Total size of the buffers, in bytes";
+};
+
+
+static PyMethodDef clipper_workspace_methods[] = {
+    { "reserve", (PyCFunction) tc_wrap3<clipper_workspace_object::reserve>, METH_VARARGS | METH_KEYWORDS, clipper_workspace_object::reserve_docstring },
+    { "deallocate", (PyCFunction) tc_wrap3<clipper_workspace_object::deallocate>, METH_VARARGS | METH_KEYWORDS, clipper_workspace_object::deallocate_docstring },
+    { NULL, NULL, 0, NULL }
+};
+
+
+static PyGetSetDef clipper_workspace_getseters[] = {
+    { (char *)"nbytes_allocated", 
+      tc_wrap_getter<clipper_workspace_object::nbytes_allocated_getter>, 
+      NULL,
+      (char *)clipper_workspace_object::nbytes_allocated_docstring, NULL },
+
+    { NULL, NULL, NULL, NULL, NULL }
+};
+
+
+static PyTypeObject clipper_workspace_type = {
+    PyVarObject_HEAD_INIT(NULL, 0)
+    "rf_pipelines_c.clipper_workspace",  /* tp_name */
+    sizeof(clipper_workspace_object),    /* tp_basicsize */
+    0,                         /* tp_itemsize */
+    clipper_workspace_object::tp_dealloc,  /* tp_dealloc */
+    0,                         /* tp_print */
+    0,                         /* tp_getattr */
+    0,                         /* tp_setattr */
+    0,                         /* tp_reserved */
+    0,                         /* tp_repr */
+    0,                         /* tp_as_number */
+    0,                         /* tp_as_sequence */
+    0,                         /* tp_as_mapping */
+    0,                         /* tp_hash  */
+    0,                         /* tp_call */
+    0,                         /* tp_str */
+    0,                         /* tp_getattro */
+    0,                         /* tp_setattro */
+    0,                         /* tp_as_buffer */
+    Py_TPFLAGS_DEFAULT,        /* tp_flags */
+    clipper_workspace_object::docstring,  /* tp_doc */
+    0,                         /* tp_traverse */
+    0,                         /* tp_clear */
+    0,                         /* tp_richcompare */
+    0,                         /* tp_weaklistoffset */
+    0,                         /* tp_iter */
+    0,                         /* tp_iternext */
+    clipper_workspace_methods,   /* tp_methods */
+    0,                         /* tp_members */
+    clipper_workspace_getseters, /* tp_getset */
+    0,                         /* tp_base */
+    0,                         /* tp_dict */
+    0,                         /* tp_descr_get */
+    0,                         /* tp_descr_set */
+    0,                         /* tp_dictoffset */
+    0,                         /* tp_init */
+    0,                         /* tp_alloc */
+    clipper_workspace_object::tp_new,  /* tp_new */
+};
+
+
+// static member function
+bool clipper_workspace_object::isinstance(PyObject *obj)
+{
+    return PyObject_IsInstance(obj, (PyObject *) &clipper_workspace_type);
+}
+
+
 // -------------------------------------------------------------------------------------------------
 //
 // Library
@@ -1294,29 +1789,106 @@ static rf_pipelines::axis_type axis_type_from_python(const char *function_name,
 }
 
 
+static rf_pipelines::detrender_precision detrender_precision_from_python(const char *function_name, const char *s)
+{
+    if (!strcmp(s, "float"))
+	return rf_pipelines::PRECISION_FLOAT;
+    if (!strcmp(s, "double"))
+	return rf_pipelines::PRECISION_DOUBLE;
+    if (!strcmp(s, "mixed"))
+	return rf_pipelines::PRECISION_MIXED;
+
+    throw runtime_error(string(function_name) + ": bad 'precision' parameter (expected 'float', 'double', or 'mixed')");
+}
+
+
 static PyObject *make_polynomial_detrender(PyObject *self, PyObject *args, PyObject *kwds)
 {
-    static const char *kwlist[] = { "nt_chunk", "axis", "polydeg", "epsilon", NULL };
+    static const char *kwlist[] = { "nt_chunk", "axis", "polydeg", "epsilon", "precision", "monitor", NULL };
 
     int nt_chunk = 0;
     PyObject *axis_ptr = Py_None;
     int polydeg = 0;
-    double epsilon = 1.0e-2;   // meaningful default value
+    double epsilon = 1.0e-2;          // meaningful default value
+    const char *precision_str = "float";  // meaningful default value
+    int monitor = 0;                  // meaningful default value
 
     // Note: the object pointers will be borrowed references
-    if (!PyArg_ParseTupleAndKeywords(args, kwds, "iOi|d", (char **)kwlist, &nt_chunk, &axis_ptr, &polydeg, &epsilon))
+    if (!PyArg_ParseTupleAndKeywords(args, kwds, "iOi|dsi", (char **)kwlist, &nt_chunk, &axis_ptr, &polydeg, &epsilon, &precision_str, &monitor))
 	return NULL;
 
-    rf_pipelines::axis_type axis = axis_type_from_python("make_intensity_clipper()", axis_ptr);
+    rf_pipelines::axis_type axis = axis_type_from_python("make_polynomial_detrender()", axis_ptr);
+    rf_pipelines::detrender_precision precision = detrender_precision_from_python("make_polynomial_detrender()", precision_str);
 
-    shared_ptr<rf_pipelines::wi_transform> ret = rf_pipelines::make_polynomial_detrender(nt_chunk, axis, polydeg, epsilon);
+    shared_ptr<rf_pipelines::wi_transform> ret = rf_pipelines::make_polynomial_detrender(nt_chunk, axis, polydeg, epsilon, precision, monitor);
+    return wi_transform_object::make(ret);
+}
+
+
+static PyObject *make_sliding_polynomial_detrender(PyObject *self, PyObject *args, PyObject *kwds)
+{
+    static const char *kwlist[] = { "nt_chunk", "axis", "polydeg", "nt_window", "epsilon", NULL };
+
+    int nt_chunk = 0;
+    PyObject *axis_ptr = Py_None;
+    int polydeg = 0;
+    int nt_window = 0;
+    double epsilon = 1.0e-2;          // meaningful default value
+
+    // Note: the object pointers will be borrowed references
+    if (!PyArg_ParseTupleAndKeywords(args, kwds, "iOii|d", (char **)kwlist, &nt_chunk, &axis_ptr, &polydeg, &nt_window, &epsilon))
+	return NULL;
+
+    rf_pipelines::axis_type axis = axis_type_from_python("make_sliding_polynomial_detrender()", axis_ptr);
+
+    shared_ptr<rf_pipelines::wi_transform> ret = rf_pipelines::make_sliding_polynomial_detrender(nt_chunk, axis, polydeg, nt_window, epsilon);
+    return wi_transform_object::make(ret);
+}
+
+
+static PyObject *make_running_median_detrender(PyObject *self, PyObject *args, PyObject *kwds)
+{
+    static const char *kwlist[] = { "nt_chunk", "axis", "nt_window", "Dt", NULL };
+
+    int nt_chunk = 0;
+    PyObject *axis_ptr = Py_None;
+    int nt_window = 0;
+    int Dt = 16;         // meaningful default value
+
+    // Note: the object pointers will be borrowed references
+    if (!PyArg_ParseTupleAndKeywords(args, kwds, "iOi|i", (char **)kwlist, &nt_chunk, &axis_ptr, &nt_window, &Dt))
+	return NULL;
+
+    rf_pipelines::axis_type axis = axis_type_from_python("make_running_median_detrender()", axis_ptr);
+
+    shared_ptr<rf_pipelines::wi_transform> ret = rf_pipelines::make_running_median_detrender(nt_chunk, axis, nt_window, Dt);
+    return wi_transform_object::make(ret);
+}
+
+
+static PyObject *make_spline_detrender(PyObject *self, PyObject *args, PyObject *kwds)
+{
+    static const char *kwlist[] = { "nt_chunk", "axis", "nx_knot", "epsilon", NULL };
+
+    int nt_chunk = 0;
+    PyObject *axis_ptr = Py_None;
+    int nx_knot = 0;
+    double epsilon = 1.0e-2;          // meaningful default value
+
+    // Note: the object pointers will be borrowed references
+    if (!PyArg_ParseTupleAndKeywords(args, kwds, "iOi|d", (char **)kwlist, &nt_chunk, &axis_ptr, &nx_knot, &epsilon))
+	return NULL;
+
+    rf_pipelines::axis_type axis = axis_type_from_python("make_spline_detrender()", axis_ptr);
+
+    shared_ptr<rf_pipelines::wi_transform> ret = rf_pipelines::make_spline_detrender(nt_chunk, axis, nx_knot, epsilon);
     return wi_transform_object::make(ret);
 }
 
 
 static PyObject *make_intensity_clipper(PyObject *self, PyObject *args, PyObject *kwds)
 {
-    static const char *kwlist[] = { "nt_chunk", "axis", "sigma", "niter", "iter_sigma", "Df", "Dt", "two_pass", NULL }; 
+    static const char *kwlist[] = { "nt_chunk", "axis", "sigma", "niter", "iter_sigma", "Df", "Dt", "two_pass", "robust", NULL }; 
 
     int nt_chunk = 0;
     PyObject *axis_ptr = Py_None;
@@ -1326,21 +1898,22 @@ static PyObject *make_intensity_clipper(PyObject *self, PyObject *args, PyObject
     int Df = 1;                // meaningful default value
     int Dt = 1;                // meaningful default value
     int two_pass = 0;          // meaningful default value
+    int robust = 0;            // meaningful default value
 
     // Note: the object pointers will be borrowed references
-    if (!PyArg_ParseTupleAndKeywords(args, kwds, "iOd|idiii", (char **)kwlist, &nt_chunk, &axis_ptr, &sigma, &niter, &iter_sigma, &Df, &Dt, &two_pass))
+    if (!PyArg_ParseTupleAndKeywords(args, kwds, "iOd|idiiii", (char **)kwlist, &nt_chunk, &axis_ptr, &sigma, &niter, &iter_sigma, &Df, &Dt, &two_pass, &robust))
 	return NULL;
 
     rf_pipelines::axis_type axis = axis_type_from_python("make_intensity_clipper()", axis_ptr);
 
-    shared_ptr<rf_pipelines::wi_transform> ret = rf_pipelines::make_intensity_clipper(nt_chunk, axis, sigma, niter, iter_sigma, Df, Dt, two_pass);
+    shared_ptr<rf_pipelines::wi_transform> ret = rf_pipelines::make_intensity_clipper(nt_chunk, axis, sigma, niter, iter_sigma, Df, Dt, two_pass, robust);
     return wi_transform_object::make(ret);
 }
 
 
 static PyObject *make_std_dev_clipper(PyObject *self, PyObject *args, PyObject *kwds)
 {
-    static const char *kwlist[] = { "nt_chunk", "axis", "sigma", "Df", "Dt", "two_pass", NULL };
+    static const char *kwlist[] = { "nt_chunk", "axis", "sigma", "Df", "Dt", "two_pass", "robust", "niter", "iter_sigma", NULL };
 
     int nt_chunk = 0;
     PyObject *axis_ptr = Py_None;
@@ -1348,30 +1921,273 @@ static PyObject *make_std_dev_clipper(PyObject *self, PyObject *args, PyObject *
     int Df = 1;        // meaningful default value
     int Dt = 1;        // meaningful default value
     int two_pass = 0;  // meaningful default value
+    int robust = 0;    // meaningful default value
+    int niter = 1;             // meaningful default value
+    double iter_sigma = 0.0;   // meaningful default value
 
     // Note: the object pointers will be borrowed references
-    if (!PyArg_ParseTupleAndKeywords(args, kwds, "iOd|iii", (char **)kwlist, &nt_chunk, &axis_ptr, &sigma, &Df, &Dt, &two_pass))
+    if (!PyArg_ParseTupleAndKeywords(args, kwds, "iOd|iiiiid", (char **)kwlist, &nt_chunk, &axis_ptr, &sigma, &Df, &Dt, &two_pass, &robust, &niter, &iter_sigma))
 	return NULL;
 
     rf_pipelines::axis_type axis = axis_type_from_python("make_std_dev_clipper()", axis_ptr);
 
-    shared_ptr<rf_pipelines::wi_transform> ret = rf_pipelines::make_std_dev_clipper(nt_chunk, axis, sigma, Df, Dt, two_pass);
+    shared_ptr<rf_pipelines::wi_transform> ret = rf_pipelines::make_std_dev_clipper(nt_chunk, axis, sigma, Df, Dt, two_pass, robust, niter, iter_sigma);
+    return wi_transform_object::make(ret);
+}
+
+
+// The 'specs' argument is a list/iterator of tuples (type, axis, sigma, niter, iter_sigma, Df, Dt, two_pass, robust),
+// where 'type' is either "intensity" or "std_dev".  (The python wrapper rf_pipelines.rfi_clipper_chain()
+// converts a more friendly list of dictionaries to this form.)
+
+static PyObject *make_rfi_clipper_chain(PyObject *self, PyObject *args, PyObject *kwds)
+{
+    static const char *kwlist[] = { "nt_chunk", "specs", NULL };
+
+    int nt_chunk = 0;
+    PyObject *specs_ptr = Py_None;
+
+    // Note: the object pointers will be borrowed references
+    if (!PyArg_ParseTupleAndKeywords(args, kwds, "iO", (char **)kwlist, &nt_chunk, &specs_ptr))
+	return NULL;
+
+    PyObject *iter_ptr = PyObject_GetIter(specs_ptr);
+    if (!iter_ptr)
+	throw runtime_error("rf_pipelines: expected 'specs' argument to make_rfi_clipper_chain() to be a list/iterator of tuples");
+
+    object iter(iter_ptr, false);
+    vector<rf_pipelines::rfi_clipper_spec> specs;
+
+    for (;;) {
+	PyObject *item_ptr = PyIter_Next(iter_ptr);
+	if (!item_ptr)
+	    break;
+
+	object item(item_ptr, false);
+
+	const char *type = nullptr;
+	PyObject *axis_ptr = Py_None;
+	int two_pass = 0;
+	int robust = 0;
+	rf_pipelines::rfi_clipper_spec s;
+
+	if (!PyArg_ParseTuple(item_ptr, "sOdidiiii", &type, &axis_ptr, &s.sigma, &s.niter, &s.iter_sigma, &s.Df, &s.Dt, &two_pass, &robust))
+	    return NULL;
+
+	if (!strcmp(type, "intensity"))
+	    s.type = rf_pipelines::rfi_clipper_spec::INTENSITY_CLIPPER;
+	else if (!strcmp(type, "std_dev"))
+	    s.type = rf_pipelines::rfi_clipper_spec::STD_DEV_CLIPPER;
+	else
+	    throw runtime_error("rf_pipelines: make_rfi_clipper_chain(): clipper type '" + string(type) + "' is invalid (expected 'intensity' or 'std_dev')");
+
+	s.axis = axis_type_from_python("make_rfi_clipper_chain()", axis_ptr);
+	s.two_pass = two_pass;
+	s.robust = robust;
+	specs.push_back(s);
+    }
+
+    if (PyErr_Occurred())
+	throw python_exception();
+
+    shared_ptr<rf_pipelines::wi_transform> ret = rf_pipelines::make_rfi_clipper_chain(nt_chunk, specs);
     return wi_transform_object::make(ret);
 }
 
 
+static PyObject *make_variance_estimator(PyObject *self, PyObject *args, PyObject *kwds)
+{
+    static const char *kwlist[] = { "v1_chunk", "v2_chunk", "nt_chunk", "fname", NULL };
+
+    int v1_chunk = 0;
+    int v2_chunk = 0;
+    int nt_chunk = 0;
+    const char *fname = nullptr;
+
+    if (!PyArg_ParseTupleAndKeywords(args, kwds, "iiis", (char **)kwlist, &v1_chunk, &v2_chunk, &nt_chunk, &fname))
+	return NULL;
+
+    shared_ptr<rf_pipelines::wi_transform> ret = rf_pipelines::make_variance_estimator(v1_chunk, v2_chunk, nt_chunk, fname);
+    return wi_transform_object::make(ret);
+}
+
+
+static PyObject *make_plotter_transform(PyObject *self, PyObject *args, PyObject *kwds)
+{
+    static const char *kwlist[] = { "img_prefix", "img_nfreq", "img_nt", "downsample_nt", "n_zoom", "nt_chunk", "clip_niter", "sigma_clip", NULL };
+
+    const char *img_prefix = nullptr;
+    int img_nfreq = 0;
+    int img_nt = 0;
+    int downsample_nt = 1;    // meaningful default value
+    int n_zoom = 1;           // meaningful default value
+    int nt_chunk = 0;         // meaningful default value
+    int clip_niter = 3;       // meaningful default value
+    double sigma_clip = 3.0;  // meaningful default value
+
+    if (!PyArg_ParseTupleAndKeywords(args, kwds, "sii|iiiid", (char **)kwlist, &img_prefix, &img_nfreq, &img_nt, &downsample_nt, &n_zoom, &nt_chunk, &clip_niter, &sigma_clip))
+	return NULL;
+
+    shared_ptr<rf_pipelines::wi_transform> ret = rf_pipelines::make_plotter_transform(img_prefix, img_nfreq, img_nt, downsample_nt, n_zoom, nt_chunk, clip_niter, sigma_clip);
+    return wi_transform_object::make(ret);
+}
+
+
+static PyObject *make_frb_injector(PyObject *self, PyObject *args, PyObject *kwds)
+{
+    static const char *kwlist[] = { "pulses", "sample_rms", "nt_chunk", NULL };
+
+    PyObject *pulses_obj = Py_None;
+    double sample_rms = 1.0;   // meaningful default value
+    int nt_chunk = 1024;       // meaningful default value
+
+    // Note: the object pointer will be a borrowed reference
+    if (!PyArg_ParseTupleAndKeywords(args, kwds, "O|di", (char **)kwlist, &pulses_obj, &sample_rms, &nt_chunk))
+	return NULL;
+
+    // The 'pulses' arg is converted to a shape (npulses, 6) array, whose columns are
+    // (snr, undispersed_arrival_time, dm, intrinsic_width, sm, spectral_index).
+    // An empty list (shape (0,) after conversion) is also accepted, and gives an injector which does nothing.
+    int requirements = NPY_ARRAY_C_CONTIGUOUS | NPY_ARRAY_ALIGNED | NPY_ARRAY_ENSUREARRAY | NPY_ARRAY_FORCECAST;
+    PyObject *a0 = PyArray_FromAny(pulses_obj, PyArray_DescrFromType(NPY_DOUBLE), 1, 2, requirements, NULL);
+    object a_ref(a0, false);   // manages refcount, throws exception on NULL
+
+    PyArrayObject *a = (PyArrayObject *) a0;
+    bool is_empty = (PyArray_SIZE(a) == 0) && (PyArray_DIM(a,0) == 0);
+
+    if (!is_empty && ((PyArray_NDIM(a) != 2) || (PyArray_DIM(a,1) != 6)))
+	throw runtime_error("rf_pipelines: make_frb_injector(): expected 'pulses' argument to have shape (npulses, 6)");
+
+    int npulses = is_empty ? 0 : PyArray_DIM(a,0);
+    const double *p = (const double *) PyArray_DATA(a);
+
+    vector<rf_pipelines::frb_pulse> pulses;
+    for (int i = 0; i < npulses; i++)
+	pulses.push_back(rf_pipelines::frb_pulse(p[6*i], p[6*i+1], p[6*i+2], p[6*i+3], p[6*i+4], p[6*i+5]));
+
+    shared_ptr<rf_pipelines::wi_transform> ret = rf_pipelines::make_frb_injector(pulses, sample_rms, nt_chunk);
+    return wi_transform_object::make(ret);
+}
+
+
+static PyObject *make_trigger_grouper(PyObject *self, PyObject *args, PyObject *kwds)
+{
+    static const char *kwlist[] = { "threshold", "dm_link", "t_link", "tree_max_dm", "fname", "max_events", "nt_chunk", NULL };
+
+    double threshold = 0.0;
+    double dm_link = 5.0;       // meaningful default value
+    double t_link = 0.01;       // meaningful default value
+    PyObject *tree_max_dm_obj = Py_None;
+    const char *fname = "";
+    int max_events = 4096;      // meaningful default value
+    int nt_chunk = 1024;        // meaningful default value
+
+    // Note: the object pointer will be a borrowed reference
+    if (!PyArg_ParseTupleAndKeywords(args, kwds, "d|ddOsii", (char **)kwlist, &threshold, &dm_link, &t_link, &tree_max_dm_obj, &fname, &max_events, &nt_chunk))
+	return NULL;
+
+    vector<double> tree_max_dm;
+
+    if (tree_max_dm_obj != Py_None) {
+	int requirements = NPY_ARRAY_C_CONTIGUOUS | NPY_ARRAY_ALIGNED | NPY_ARRAY_ENSUREARRAY | NPY_ARRAY_FORCECAST;
+	PyObject *a0 = PyArray_FromAny(tree_max_dm_obj, PyArray_DescrFromType(NPY_DOUBLE), 1, 1, requirements, NULL);
+	object a_ref(a0, false);   // manages refcount, throws exception on NULL
+
+	PyArrayObject *a = (PyArrayObject *) a0;
+	const double *p = (const double *) PyArray_DATA(a);
+	tree_max_dm.assign(p, p + PyArray_DIM(a,0));
+    }
+
+    shared_ptr<rf_pipelines::wi_transform> ret = rf_pipelines::make_trigger_grouper(threshold, dm_link, t_link, tree_max_dm, fname, max_events, nt_chunk);
+    return wi_transform_object::make(ret);
+}
+
+
+// Helper for the trigger_grouper_*() functions below.
+static rf_pipelines::trigger_grouper *get_trigger_grouper(PyObject *obj)
+{
+    if (!wi_transform_object::isinstance(obj))
+	throw runtime_error("rf_pipelines: expected 'grouper' argument to be a transform returned by make_trigger_grouper()");
+
+    rf_pipelines::trigger_grouper *ret = dynamic_cast<rf_pipelines::trigger_grouper *> (wi_transform_object::get_pbare(obj));
+
+    if (!ret)
+	throw runtime_error("rf_pipelines: expected 'grouper' argument to be a transform returned by make_trigger_grouper()");
+
+    return ret;
+}
+
+
+static PyObject *trigger_grouper_process_triggers(PyObject *self, PyObject *args, PyObject *kwds)
+{
+    static const char *kwlist[] = { "grouper", "itree", "triggers", "t0", "t1", NULL };
+
+    PyObject *grouper_obj = Py_None;
+    int itree = 0;
+    PyObject *triggers_obj = Py_None;
+    double t0 = 0.0;
+    double t1 = 0.0;
+
+    // Note: the object pointers will be borrowed references
+    if (!PyArg_ParseTupleAndKeywords(args, kwds, "OiOdd", (char **)kwlist, &grouper_obj, &itree, &triggers_obj, &t0, &t1))
+	return NULL;
+
+    rf_pipelines::trigger_grouper *grouper = get_trigger_grouper(grouper_obj);
+
+    // Note: no copy is made if the trigger array is already float32 and C-contiguous (as returned by bonsai).
+    int requirements = NPY_ARRAY_C_CONTIGUOUS | NPY_ARRAY_ALIGNED | NPY_ARRAY_ENSUREARRAY | NPY_ARRAY_FORCECAST;
+    PyObject *a0 = PyArray_FromAny(triggers_obj, PyArray_DescrFromType(NPY_FLOAT), 4, 4, requirements, NULL);
+    object a_ref(a0, false);   // manages refcount, throws exception on NULL
+
+    PyArrayObject *a = (PyArrayObject *) a0;
+    grouper->process_triggers(itree, (const float *) PyArray_DATA(a), PyArray_DIM(a,0), PyArray_DIM(a,1), PyArray_DIM(a,2), PyArray_DIM(a,3), t0, t1);
+
+    Py_INCREF(Py_None);
+    return Py_None;
+}
+
+
+static PyObject *trigger_grouper_get_events(PyObject *self, PyObject *args, PyObject *kwds)
+{
+    static const char *kwlist[] = { "grouper", NULL };
+
+    PyObject *grouper_obj = Py_None;
+
+    // Note: the object pointer will be a borrowed reference
+    if (!PyArg_ParseTupleAndKeywords(args, kwds, "O", (char **)kwlist, &grouper_obj))
+	return NULL;
+
+    vector<rf_pipelines::l1_event> events;
+    get_trigger_grouper(grouper_obj)->get_events(events);
+
+    npy_intp shape[2] = { (npy_intp) events.size(), 11 };
+    PyObject *ret = PyArray_SimpleNew(2, shape, NPY_DOUBLE);
+    double *p = (double *) PyArray_DATA((PyArrayObject *) ret);
+
+    for (const rf_pipelines::l1_event &e: events) {
+	double row[11] = { e.dm, e.time, e.snr, e.dm_lo, e.dm_hi, e.t_lo, e.t_hi, double(e.itree), double(e.ism), double(e.ibeta), double(e.ntriggers) };
+	memcpy(p, row, sizeof(row));
+	p += 11;
+    }
+
+    return ret;
+}
+
+
 static PyObject *apply_polynomial_detrender(PyObject *self, PyObject *args, PyObject *kwds)
 {
-    static const char *kwlist[] = { "intensity", "weights", "axis", "polydeg", "epsilon", NULL };
+    static const char *kwlist[] = { "intensity", "weights", "axis", "polydeg", "epsilon", "precision", "nthreads", NULL };
 
     PyObject *intensity_obj = Py_None;
     PyObject *weights_obj = Py_None;
     PyObject *axis_ptr = Py_None;
     int polydeg = -1;
-    double epsilon = 1.0e-2;   // meaningful default value
+    double epsilon = 1.0e-2;              // meaningful default value
+    const char *precision_str = "float";  // meaningful default value
+    int nthreads = 1;                     // meaningful default value
 
     // Note: the object pointers will be borrowed references
-    if (!PyArg_ParseTupleAndKeywords(args, kwds, "OOOi|d", (char **)kwlist, &intensity_obj, &weights_obj, &axis_ptr, &polydeg, &epsilon))
+    if (!PyArg_ParseTupleAndKeywords(args, kwds, "OOOi|dsi", (char **)kwlist, &intensity_obj, &weights_obj, &axis_ptr, &polydeg, &epsilon, &precision_str, &nthreads))
 	return NULL;
 
     // (intensity_writeback, weights_writeback) = (true, true)
@@ -1379,8 +2195,17 @@ static PyObject *apply_polynomial_detrender(PyObject *self, PyObject *args, PyOb
     arr_wi_helper wi(intensity_obj, weights_obj, true, true); 
 
     rf_pipelines::axis_type axis = axis_type_from_python("apply_polynomial_detrender", axis_ptr);
+    rf_pipelines::detrender_precision precision = detrender_precision_from_python("apply_polynomial_detrender", precision_str);
 
-    rf_pipelines::apply_polynomial_detrender(wi.intensity.data, wi.weights.data, wi.nfreq, wi.nt, wi.stride, axis, polydeg, epsilon);
+    // The GIL is released while the detrender runs (the arrays are kept alive by 'wi').
+    {
+	gil_releaser nogil;
+
+	if (nthreads == 1)
+	    rf_pipelines::apply_polynomial_detrender(wi.intensity.data, wi.weights.data, wi.nfreq, wi.nt, wi.stride, axis, polydeg, epsilon, precision);
+	else
+	    rf_pipelines::apply_polynomial_detrender_parallel(nthreads, wi.intensity.data, wi.weights.data, wi.nfreq, wi.nt, wi.stride, axis, polydeg, epsilon, precision);
+    }
 
     Py_INCREF(Py_None);
     return Py_None;
@@ -1389,7 +2214,7 @@ static PyObject *apply_polynomial_detrender(PyObject *self, PyObject *args, PyOb
 
 static PyObject *apply_intensity_clipper(PyObject *self, PyObject *args, PyObject *kwds)
 {
-    static const char *kwlist[] = { "intensity", "weights", "axis", "sigma", "niter", "iter_sigma", "Df", "Dt", "two_pass", NULL };
+    static const char *kwlist[] = { "intensity", "weights", "axis", "sigma", "niter", "iter_sigma", "Df", "Dt", "two_pass", "robust", "workspace", "nthreads", NULL };
 
     PyObject *intensity_obj = Py_None;
     PyObject *weights_obj = Py_None;
@@ -1400,16 +2225,29 @@ static PyObject *apply_intensity_clipper(PyObject *self, PyObject *args, PyObjec
     int Df = 1;                // meaningful default value
     int Dt = 1;                // meaningful default value
     int two_pass = 0;          // meaningful default value
+    int robust = 0;            // meaningful default value
+    PyObject *ws_obj = Py_None;
+    int nthreads = 1;          // meaningful default value
 
     // Note: the object pointers will be borrowed references
-    if (!PyArg_ParseTupleAndKeywords(args, kwds, "OOOd|idiii", (char **)kwlist, &intensity_obj, &weights_obj, &axis_ptr, &sigma, &niter, &iter_sigma, &Df, &Dt, &two_pass))
+    if (!PyArg_ParseTupleAndKeywords(args, kwds, "OOOd|idiiiiOi", (char **)kwlist, &intensity_obj, &weights_obj, &axis_ptr, &sigma, &niter, &iter_sigma, &Df, &Dt, &two_pass, &robust, &ws_obj, &nthreads))
 	return NULL;
 
     arr_wi_helper wi(intensity_obj, weights_obj, false, true);   // (intensity_writeback, weights_writeback) = (false, true)
 
     rf_pipelines::axis_type axis = axis_type_from_python("apply_intensity_clipper", axis_ptr);
 
-    rf_pipelines::apply_intensity_clipper(wi.intensity.data, wi.weights.data, wi.nfreq, wi.nt, wi.stride, axis, sigma, niter, iter_sigma, Df, Dt, two_pass);
+    rf_pipelines::clipper_workspace *ws = clipper_workspace_object::from_python(ws_obj);
+
+    // The GIL is released while the clipper runs (the arrays are kept alive by 'wi').
+    {
+	gil_releaser nogil;
+
+	if (nthreads == 1)
+	    rf_pipelines::apply_intensity_clipper(wi.intensity.data, wi.weights.data, wi.nfreq, wi.nt, wi.stride, axis, sigma, niter, iter_sigma, Df, Dt, two_pass, robust, ws);
+	else
+	    rf_pipelines::apply_intensity_clipper_parallel(nthreads, wi.intensity.data, wi.weights.data, wi.nfreq, wi.nt, wi.stride, axis, sigma, niter, iter_sigma, Df, Dt, two_pass, robust);
+    }
 
     Py_INCREF(Py_None);
     return Py_None;    
@@ -1418,7 +2256,7 @@ static PyObject *apply_intensity_clipper(PyObject *self, PyObject *args, PyObjec
 
 static PyObject *apply_std_dev_clipper(PyObject *self, PyObject *args, PyObject *kwds)
 {
-    static const char *kwlist[] = { "intensity", "weights", "axis", "sigma", "Df", "Dt", "two_pass", NULL };
+    static const char *kwlist[] = { "intensity", "weights", "axis", "sigma", "Df", "Dt", "two_pass", "robust", "niter", "iter_sigma", "workspace", "nthreads", NULL };
 
     PyObject *intensity_obj = Py_None;
     PyObject *weights_obj = Py_None;
@@ -1427,16 +2265,31 @@ static PyObject *apply_std_dev_clipper(PyObject *self, PyObject *args, PyObject
     int Df = 1;   // meaningful default value
     int Dt = 1;   // meaningful default value
     int two_pass = 0;  // meaningful default valuex
+    int robust = 0;    // meaningful default value
+    int niter = 1;             // meaningful default value
+    double iter_sigma = 0.0;   // meaningful default value
+    PyObject *ws_obj = Py_None;
+    int nthreads = 1;  // meaningful default value
 
     // Note: the object pointers will be borrowed references
-    if (!PyArg_ParseTupleAndKeywords(args, kwds, "OOOd|iii", (char **)kwlist, &intensity_obj, &weights_obj, &axis_ptr, &sigma, &Df, &Dt, &two_pass))
+    if (!PyArg_ParseTupleAndKeywords(args, kwds, "OOOd|iiiiidOi", (char **)kwlist, &intensity_obj, &weights_obj, &axis_ptr, &sigma, &Df, &Dt, &two_pass, &robust, &niter, &iter_sigma, &ws_obj, &nthreads))
 	return NULL;
 
     arr_wi_helper wi(intensity_obj, weights_obj, false, true);   // (intensity_writeback, weights_writeback) = (false, true)
 
     rf_pipelines::axis_type axis = axis_type_from_python("apply_std_dev_clipper", axis_ptr);
 
-    rf_pipelines::apply_std_dev_clipper(wi.intensity.data, wi.weights.data, wi.nfreq, wi.nt, wi.stride, axis, sigma, Df, Dt, two_pass);
+    rf_pipelines::clipper_workspace *ws = clipper_workspace_object::from_python(ws_obj);
+
+    // The GIL is released while the clipper runs (the arrays are kept alive by 'wi').
+    {
+	gil_releaser nogil;
+
+	if (nthreads == 1)
+	    rf_pipelines::apply_std_dev_clipper(wi.intensity.data, wi.weights.data, wi.nfreq, wi.nt, wi.stride, axis, sigma, Df, Dt, two_pass, robust, niter, iter_sigma, ws);
+	else
+	    rf_pipelines::apply_std_dev_clipper_parallel(nthreads, wi.intensity.data, wi.weights.data, wi.nfreq, wi.nt, wi.stride, axis, sigma, Df, Dt, two_pass, robust, niter, iter_sigma);
+    }
 
     Py_INCREF(Py_None);
     return Py_None;
@@ -1632,7 +2485,7 @@ static constexpr const char *make_gaussian_noise_stream_docstring =
 
 
 static constexpr const char *make_polynomial_detrender_docstring =
-    "make_polynomial_detrender(nt_chunk, axis, polydeg, epsilon = 1.0e-2)\n"
+    "make_polynomial_detrender(nt_chunk, axis, polydeg, epsilon = 1.0e-2, precision='float', monitor=False)\n"
     "\n"
     "Detrends along the specified axis by subtracting a best-fit polynomial.\n"
     "axis=0 means 'detrend in time', axis=1 means 'detrend in frequency'.\n"
@@ -1640,11 +2493,51 @@ static constexpr const char *make_polynomial_detrender_docstring =
     "If the fit is poorly conditioned then the entire frequency channel (FIXME or the entire time sample when axis=1 ?? ) will be masked\n"
     "(by setting its weights to zero).  The threshold is controlled by the parameter\n"
     "'epsilon'.  I think that 1.0e-2 is a reasonable default here, but haven't\n"
-    "experimented systematically.\n";
+    "experimented systematically.\n"
+    "\n"
+    "The 'precision' argument is one of 'float', 'double', or 'mixed' (single-precision\n"
+    "accumulation, double-precision solve).  Single precision can be unreliable for polydeg > 8.\n"
+    "\n"
+    "If monitor=True (not allowed with precision='double'), then one row per chunk is also\n"
+    "detrended in double precision for comparison, and the json output contains the number\n"
+    "of rows compared ('monitor_nrows') and discrepancies found ('monitor_ndiscrepancies').\n";
+
+
+static constexpr const char *make_sliding_polynomial_detrender_docstring =
+    "make_sliding_polynomial_detrender(nt_chunk, axis, polydeg, nt_window, epsilon = 1.0e-2)\n"
+    "\n"
+    "Detrends along the time axis by subtracting a polynomial which is fit in a sliding window\n"
+    "of length 'nt_window', rather than independently in each chunk.  Currently only axis=1 is supported.\n"
+    "\n"
+    "The window advances in steps of 8 samples, and each step is detrended using the fit from the\n"
+    "window centered on the step, so 'nt_window' must be an odd multiple of 8.  Steps where the fit\n"
+    "is poorly conditioned (see 'epsilon' in make_polynomial_detrender()) are masked.\n";
+
+
+static constexpr const char *make_running_median_detrender_docstring =
+    "make_running_median_detrender(nt_chunk, axis, nt_window, Dt=16)\n"
+    "\n"
+    "Detrends along the time axis by subtracting the median of a sliding window of length 'nt_window',\n"
+    "which is roughly centered on each sample.  Currently only axis=1 is supported.  Masked samples\n"
+    "are excluded from the median.\n"
+    "\n"
+    "If Dt > 1, the median of each block of Dt samples is computed first, and the baseline is the\n"
+    "running median of the block medians (approximate, but much faster than Dt=1, which is exact).\n"
+    "Both nt_chunk and nt_window must be multiples of Dt.\n";
+
+
+static constexpr const char *make_spline_detrender_docstring =
+    "make_spline_detrender(nt_chunk, axis, nx_knot, epsilon = 1.0e-2)\n"
+    "\n"
+    "Detrends along the time axis (axis=1) or frequency axis (axis=0) by subtracting a best-fit cubic\n"
+    "B-spline, with knots spaced by 'nx_knot' samples.  This is a numerically stable alternative to a\n"
+    "high-degree polynomial.  The knot spacing must divide the axis length (nt_chunk or nfreq), and if\n"
+    "axis=1, it must also be a multiple of 8.  Poorly conditioned basis functions (see 'epsilon' in\n"
+    "make_polynomial_detrender()) are dropped from the fit, and the weights are not modified.\n";
 
 
 static constexpr const char *make_intensity_clipper_docstring =
-    "make_intensity_clipper(nt_chunk, axis, sigma, niter=1, iter_sigma=0, Df=1, Dt=1)\n"
+    "make_intensity_clipper(nt_chunk, axis, sigma, niter=1, iter_sigma=0, Df=1, Dt=1, two_pass=False, robust=False)\n"
     "\n"
     "'Clips' an array by masking outlier intensities.\n"
     "The masking is performed by setting elements of the weights array to zero.\n"
@@ -1664,11 +2557,14 @@ static constexpr const char *make_intensity_clipper_docstring =
     "with threshold 'iter_sigma'.  If the 'iter_sigma' argument is zero, then it defaults\n"
     "to 'sigma', but the two thresholds need not be the same.\n"
     "\n"
-    "If the 'two_pass' flag is set, a more numerically stable but slightly slower algorithm will be used.\n";
+    "If the 'two_pass' flag is set, a more numerically stable but slightly slower algorithm will be used.\n"
+    "\n"
+    "If the 'robust' flag is set, then the mean/rms are replaced by the weighted median and the median\n"
+    "absolute deviation (scaled by 1.4826).  In robust mode, niter must be 1.\n";
 
 
 static constexpr const char *make_std_dev_clipper_docstring =
-    "make_std_dev_clipper(nt_chunk, axis, sigma, Df=1, Dt=1, two_pass=False)\n"
+    "make_std_dev_clipper(nt_chunk, axis, sigma, Df=1, Dt=1, two_pass=False, robust=False, niter=1, iter_sigma=0)\n"
     "\n"
     "'Clips' an array by masking rows/columns whose standard deviation is an outlier.\n"
     "The masking is performed by setting elements of the weights array to zero.\n"
@@ -1681,11 +2577,78 @@ static constexpr const char *make_std_dev_clipper_docstring =
     "If no downsampling is desired, set Df=Dt=1.\n"
     "\n"
     "The 'sigma' argument is the threshold (in sigmas from the mean) for clipping.\n"
-    "If the 'two_pass' flag is set, then a more numerically stable but slightly slower algorithm will be used.\n";
+    "If the 'two_pass' flag is set, then a more numerically stable but slightly slower algorithm will be used.\n"
+    "If the 'robust' flag is set, then outliers are identified using the median/MAD of the variances.\n"
+    "\n"
+    "If niter > 1, then the mean/rms of the variances will be computed using iterated clipping,\n"
+    "with threshold 'iter_sigma'.  If the 'iter_sigma' argument is zero, then it defaults\n"
+    "to 'sigma'.  In robust mode, niter must be 1.\n";
+
+
+static constexpr const char *make_rfi_clipper_chain_docstring =
+    "make_rfi_clipper_chain(nt_chunk, specs)\n"
+    "\n"
+    "Runs a sequence of intensity/std_dev clippers as a single transform.  The output is the same as\n"
+    "running the clippers one after another, but row-local and column-local clippers are applied in\n"
+    "cache-sized blocks, so that the chain makes fewer passes over memory.\n"
+    "\n"
+    "The 'specs' argument is a list of tuples (type, axis, sigma, niter, iter_sigma, Df, Dt, two_pass, robust),\n"
+    "where 'type' is either 'intensity' or 'std_dev', and the remaining fields have the same meaning as\n"
+    "in make_intensity_clipper() and make_std_dev_clipper().\n";
+
+
+static constexpr const char *make_variance_estimator_docstring =
+    "make_variance_estimator(v1_chunk, v2_chunk, nt_chunk, fname)\n"
+    "\n"
+    "Pseudo-transform which makes a running estimate of the variance in each frequency channel.\n"
+    "The weighted variance is computed in blocks of 'v1_chunk' samples, and the median of 'v2_chunk'\n"
+    "consecutive estimates is taken.  If 'fname' is a nonempty string, the estimates are written to\n"
+    "${fname}.npy in the pipeline output directory, as an array of shape (nfreq, nv2).\n";
+
+
+static constexpr const char *make_plotter_transform_docstring =
+    "make_plotter_transform(img_prefix, img_nfreq, img_nt, downsample_nt=1, n_zoom=1, nt_chunk=0, clip_niter=3, sigma_clip=3.0)\n"
+    "\n"
+    "Pseudo-transform which makes waterfall plots at one or more zoom levels (C++ version of plotter_transform).\n"
+    "Filenames are ${img_prefix}_zoom${zoom_level}_${plot_number}.png, and are written in a background thread.\n"
+    "Requires rf_pipelines to be compiled with libpng (HAVE_PNG=y in Makefile.local).\n";
+
+
+static constexpr const char *make_frb_injector_docstring =
+    "make_frb_injector(pulses, sample_rms=1.0, nt_chunk=1024)\n"
+    "\n"
+    "Transform which adds many simulated FRB's to the intensity array.  The 'pulses' arg is a 2D array\n"
+    "(or list of tuples) of shape (npulses, 6), whose columns are\n"
+    "   (snr, undispersed_arrival_time, dm, intrinsic_width, sm, spectral_index)\n"
+    "with the same meanings as in frb_injector_transform.  The pulses need not be sorted.\n";
+
+
+static constexpr const char *make_trigger_grouper_docstring =
+    "make_trigger_grouper(threshold, dm_link=5.0, t_link=0.01, tree_max_dm=None, fname='', max_events=4096, nt_chunk=1024)\n"
+    "\n"
+    "Streaming grouper which clusters coarse-grained bonsai triggers into L1 events, by friends-of-friends\n"
+    "in (dm, time) with linking lengths (dm_link, t_link).  The grouper doesn't look at the intensity data;\n"
+    "triggers are supplied with trigger_grouper_process_triggers(), usually by passing the grouper to\n"
+    "bonsai_dedisperser(..., trigger_grouper=g).  If 'tree_max_dm' is None, DM's are in units of tree-0\n"
+    "trigger indices.  If 'fname' is nonempty, events are written to ${fname}.txt in the output directory.\n";
+
+
+static constexpr const char *trigger_grouper_process_triggers_docstring =
+    "trigger_grouper_process_triggers(grouper, itree, triggers, t0, t1)\n"
+    "\n"
+    "Sends one tree's trigger array of shape (ndm, nsm, nbeta, nt) to a grouper returned by make_trigger_grouper().\n"
+    "The (t0, t1) args are the endpoints of the chunk in seconds.\n";
+
+
+static constexpr const char *trigger_grouper_get_events_docstring =
+    "trigger_grouper_get_events(grouper)\n"
+    "\n"
+    "Returns all L1 events which have been finalized since the last call, as an array of shape (nevents, 11)\n"
+    "whose columns are (dm, time, snr, dm_lo, dm_hi, t_lo, t_hi, itree, ism, ibeta, ntriggers).\n";
 
 
 static constexpr const char *apply_polynomial_detrender_docstring =
-    "apply_polynomial_detrender(intensity, weights, axis, polydeg, epsilon=1.0e-2)\n"
+    "apply_polynomial_detrender(intensity, weights, axis, polydeg, epsilon=1.0e-2, precision='float', nthreads=1)\n"
     "\n"
     "Detrends along the specified axis by subtracting a best-fit polynomial.\n"
     "axis=0 means 'detrend in time', axis=1 means 'detrend in frequency'.\n"
@@ -1693,11 +2656,14 @@ static constexpr const char *apply_polynomial_detrender_docstring =
     "If the fit is poorly conditioned then the entire frequency channel will be masked\n"
     "(by setting its weights to zero).  The threshold is controlled by the parameter\n"
     "'epsilon'.  I think that 1.0e-2 is a reasonable default here, but haven't\n"
-    "experimented systematically.\n";
+    "experimented systematically.\n"
+    "\n"
+    "If nthreads != 1, then the array is processed in parallel by that many threads (or by one thread\n"
+    "per core, if nthreads <= 0).\n";
 
 
 static constexpr const char *apply_intensity_clipper_docstring =
-    "apply_intensity_clipper(intensity, weights, axis, sigma, niter=1, iter_sigma=0.0, Df=1, Dt=1)\n"
+    "apply_intensity_clipper(intensity, weights, axis, sigma, niter=1, iter_sigma=0.0, Df=1, Dt=1, two_pass=False, robust=False, workspace=None, nthreads=1)\n"
     "\n"
     "'Clips' an array by masking outlier intensities.\n"
     "The masking is performed by setting elements of the weights array to zero.\n"
@@ -1715,11 +2681,19 @@ static constexpr const char *apply_intensity_clipper_docstring =
     "\n"
     "If niter > 1, then the mean/rms intensity will be computed using iterated clipping,\n"
     "with threshold 'iter_sigma'.  If the 'iter_sigma' argument is zero, then it defaults\n"
-    "to 'sigma', but the two thresholds need not be the same.\n";
+    "to 'sigma', but the two thresholds need not be the same.\n"
+    "\n"
+    "If the 'robust' flag is set, then the mean/rms are replaced by the weighted median and the median\n"
+    "absolute deviation (scaled by 1.4826).  In robust mode, niter must be 1.\n"
+    "\n"
+    "The optional 'workspace' argument is a clipper_workspace, which holds temporary buffers between calls.\n"
+    "\n"
+    "If nthreads != 1, then the array is processed in parallel by that many threads (or by one thread\n"
+    "per core, if nthreads <= 0).  In this case, the 'workspace' argument is ignored.\n";
 
 
 static constexpr const char *apply_std_dev_clipper_docstring =
-    "apply_std_dev_clipper(intensity, weights, axis, sigma, Df=1, Dt=1, two_pass=False)\n"
+    "apply_std_dev_clipper(intensity, weights, axis, sigma, Df=1, Dt=1, two_pass=False, robust=False, niter=1, iter_sigma=0.0, workspace=None, nthreads=1)\n"
     "\n"
     "'Clips' an array by masking rows/columns whose standard deviation is an outlier.\n"
     "The masking is performed by setting elements of the weights array to zero.\n"
@@ -1732,14 +2706,24 @@ static constexpr const char *apply_std_dev_clipper_docstring =
     "If no downsampling is desired, set Df=Dt=1.\n"
     "\n"
     "The 'sigma' argument is the threshold (in sigmas from the mean) for clipping.\n"
-    "If the 'two_pass' flag is set, then a more numerically stable but slightly slower algorithm will be used.\n";
+    "If the 'two_pass' flag is set, then a more numerically stable but slightly slower algorithm will be used.\n"
+    "If the 'robust' flag is set, then outliers are identified using the median/MAD of the variances.\n"
+    "\n"
+    "If niter > 1, then the mean/rms of the variances will be computed using iterated clipping,\n"
+    "with threshold 'iter_sigma'.  If the 'iter_sigma' argument is zero, then it defaults\n"
+    "to 'sigma'.  In robust mode, niter must be 1.\n"
+    "\n"
+    "The optional 'workspace' argument is a clipper_workspace, which holds temporary buffers between calls.\n"
+    "\n"
+    "If nthreads != 1, then the array is processed in parallel by that many threads (or by one thread\n"
+    "per core, if nthreads <= 0).  In this case, the 'workspace' argument is ignored.\n";
 
 
 static constexpr const char *wi_downsample_docstring =
     "wi_downsample(intensity, weights, Df, Dt)\n"
     "\n"
     "Downsamples a weighted intensity array, and returns a new pair (intensity, weights).\n"
-    "The downsampling factors (Df,Dt) must be powers of two.\n"
+    "The downsampling factors (Df,Dt) need not be powers of two, but powers of two are fastest.\n"
     "\n"
     "Note that the normalization of the downsampled 'weights' array differs\n"
     "(by a factor of Df*Dt) from the python version of wi_downsample().\n";
@@ -1776,9 +2760,19 @@ static PyMethodDef module_methods[] = {
     { "make_chime_network_stream", tc_wrap2<make_chime_network_stream>, METH_VARARGS, dummy_module_method_docstring },
     { "make_gaussian_noise_stream", tc_wrap2<make_gaussian_noise_stream>, METH_VARARGS, make_gaussian_noise_stream_docstring },
     { "make_chime_packetizer", tc_wrap2<make_chime_packetizer>, METH_VARARGS, dummy_module_method_docstring },
-    { "make_polynomial_detrender", (PyCFunction) tc_wrap3<make_polynomial_detrender>, METH_VARARGS, make_polynomial_detrender_docstring },
+    { "make_polynomial_detrender", (PyCFunction) tc_wrap3<make_polynomial_detrender>, METH_VARARGS | METH_KEYWORDS, make_polynomial_detrender_docstring },
+    { "make_sliding_polynomial_detrender", (PyCFunction) tc_wrap3<make_sliding_polynomial_detrender>, METH_VARARGS | METH_KEYWORDS, make_sliding_polynomial_detrender_docstring },
+    { "make_running_median_detrender", (PyCFunction) tc_wrap3<make_running_median_detrender>, METH_VARARGS | METH_KEYWORDS, make_running_median_detrender_docstring },
+    { "make_spline_detrender", (PyCFunction) tc_wrap3<make_spline_detrender>, METH_VARARGS | METH_KEYWORDS, make_spline_detrender_docstring },
     { "make_intensity_clipper", (PyCFunction) tc_wrap3<make_intensity_clipper>, METH_VARARGS, make_intensity_clipper_docstring },
     { "make_std_dev_clipper", (PyCFunction) tc_wrap3<make_std_dev_clipper>, METH_VARARGS, make_std_dev_clipper_docstring },
+    { "make_rfi_clipper_chain", (PyCFunction) tc_wrap3<make_rfi_clipper_chain>, METH_VARARGS | METH_KEYWORDS, make_rfi_clipper_chain_docstring },
+    { "make_variance_estimator", (PyCFunction) tc_wrap3<make_variance_estimator>, METH_VARARGS | METH_KEYWORDS, make_variance_estimator_docstring },
+    { "make_frb_injector", (PyCFunction) tc_wrap3<make_frb_injector>, METH_VARARGS | METH_KEYWORDS, make_frb_injector_docstring },
+    { "make_trigger_grouper", (PyCFunction) tc_wrap3<make_trigger_grouper>, METH_VARARGS | METH_KEYWORDS, make_trigger_grouper_docstring },
+    { "trigger_grouper_process_triggers", (PyCFunction) tc_wrap3<trigger_grouper_process_triggers>, METH_VARARGS | METH_KEYWORDS, trigger_grouper_process_triggers_docstring },
+    { "trigger_grouper_get_events", (PyCFunction) tc_wrap3<trigger_grouper_get_events>, METH_VARARGS | METH_KEYWORDS, trigger_grouper_get_events_docstring },
+    { "make_plotter_transform", (PyCFunction) tc_wrap3<make_plotter_transform>, METH_VARARGS | METH_KEYWORDS, make_plotter_transform_docstring },
     { "make_chime_file_writer", tc_wrap2<make_chime_file_writer>, METH_VARARGS, dummy_module_method_docstring },
     { "make_bonsai_dedisperser", tc_wrap2<make_bonsai_dedisperser>, METH_VARARGS, dummy_module_method_docstring },
     { "make_badchannel_mask", tc_wrap2<make_badchannel_mask>, METH_VARARGS, make_badchannel_mask_docstring },
@@ -1797,12 +2791,18 @@ PyMODINIT_FUNC initrf_pipelines_c(void)
 {
     import_array();
 
+    // Needed for gil_releaser/gil_acquirer (see python_extension_helpers.hpp).
+    PyEval_InitThreads();
+    main_thread_id = std::this_thread::get_id();
+
     if (PyType_Ready(&wi_stream_type) < 0)
         return;
     if (PyType_Ready(&wi_transform_type) < 0)
         return;
     if (PyType_Ready(&wi_run_state_type) < 0)
         return;
+    if (PyType_Ready(&clipper_workspace_type) < 0)
+        return;
 
     PyObject *m = Py_InitModule3("rf_pipelines_c", module_methods, "rf_pipelines_c: a C++ library containing low-level rf_pipelines code");
     if (!m)
@@ -1816,4 +2816,7 @@ PyMODINIT_FUNC initrf_pipelines_c(void)
 
     Py_INCREF(&wi_run_state_type);
     PyModule_AddObject(m, "wi_run_state", (PyObject *)&wi_run_state_type);
+
+    Py_INCREF(&clipper_workspace_type);
+    PyModule_AddObject(m, "clipper_workspace", (PyObject *)&clipper_workspace_type);
 }
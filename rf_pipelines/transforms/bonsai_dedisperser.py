@@ -29,6 +29,10 @@ class bonsai_dedisperser(rf_pipelines.py_wi_transform):
 
        - trigger_hdf5_filename: If specified, coarse-grained triggers will be written to an HDF5 file.
 
+       - trigger_grouper: If specified, should be a transform returned by trigger_grouper() (see below).
+           The coarse-grained triggers are sent to the grouper in every chunk, to be clustered into
+           L1 events.  The grouper should also appear after the bonsai_dedisperser in the pipeline.
+
 
     FIXME: Currently the dedisperser must be initialized from a config hdf5 file (rather than
     the simpler config text file) since we use analytic weights to normalize the triggers.
@@ -38,7 +42,7 @@ class bonsai_dedisperser(rf_pipelines.py_wi_transform):
     is implemented in bonsai.
     """
 
-    def __init__(self, config_hdf5_filename, img_prefix="triggers", img_ndm=256, img_nt=256, downsample_nt=1, n_zoom=1, trigger_hdf5_filename=None):
+    def __init__(self, config_hdf5_filename, img_prefix="triggers", img_ndm=256, img_nt=256, downsample_nt=1, n_zoom=1, trigger_hdf5_filename=None, trigger_grouper=None):
         # We import the bonsai module here, rather than at the top of the file, so that bonsai isn't
         # required to import rf_pipelines (but is required when you try to construct a bonsai_dedisperser).
         try:
@@ -55,6 +59,7 @@ class bonsai_dedisperser(rf_pipelines.py_wi_transform):
         rf_pipelines.py_wi_transform.__init__(self, name)
 
         self.config_hdf5_filename = config_hdf5_filename
+        self.trigger_grouper = trigger_grouper
         self.dedisperser = bonsai.Dedisperser(config_hdf5_filename, 'hdf5')
         self.dedisperser.read_analytic_variance(config_hdf5_filename)
         
@@ -124,9 +129,14 @@ class bonsai_dedisperser(rf_pipelines.py_wi_transform):
         # of the (DM, pulse_width) parameter space.)
         #
         # Each 4D array is indexed by (DM_index, SM_index, beta_index, time_index).
-        if self.make_plot:
+        if self.make_plot or (self.trigger_grouper is not None):
             triggers = self.dedisperser.get_triggers()
 
+        if self.trigger_grouper is not None:
+            for (itree, t) in enumerate(triggers):
+                rf_pipelines_c.trigger_grouper_process_triggers(self.trigger_grouper, itree, t, t0, t1)
+
+        if self.make_plot:
             # First, let's flatten the SM_index and beta_index axes by taking max values to get an array indexed only by dm and time
             preserved_dm_t = np.amax(np.amax(triggers[0], axis=1), axis=1)
     
@@ -238,3 +248,39 @@ def old_bonsai_dedisperser(config_hdf5_filename, trigger_hdf5_filename=None, tri
 
     # Note: 'ibeam' argument ignored, as of bonsai v7_devel.
     return rf_pipelines_c.make_bonsai_dedisperser(config_hdf5_filename, trigger_hdf5_filename, trigger_plot_stem, nt_per_file)
+
+
+####################################################################################################
+
+
+def trigger_grouper(threshold, dm_link=5.0, t_link=0.01, tree_max_dm=None, fname='events', max_events=4096, nt_chunk=1024):
+    """
+    Returns a C++ "transform" which groups coarse-grained bonsai triggers into L1 events.  This is a
+    streaming version of group_bonsai_output(), intended to be passed to the bonsai_dedisperser:
+
+       g = rf_pipelines.trigger_grouper(8.0)
+       t = rf_pipelines.bonsai_dedisperser('bonsai_config.hdf5', trigger_grouper=g)
+       s.run([ ..., t, g ])
+
+    Triggers above 'threshold' are clustered in (dm, time) by friends-of-friends, with linking lengths
+    'dm_link' and 't_link' (in seconds).  Each event's (dm, time, snr) are taken from its highest-S/N trigger.
+    If 'tree_max_dm' is specified, it should be a list containing the max DM of each dedispersion tree.
+    Otherwise, DM's are in units of coarse-grained tree-0 DM indices, as in group_bonsai_output().
+
+    Events are written to ${fname}.txt in the pipeline output directory (unless fname=None), and kept in
+    a ring buffer of size 'max_events' which can be read with trigger_grouper_events().
+    """
+
+    if fname is None:
+        fname = ''
+
+    return rf_pipelines_c.make_trigger_grouper(threshold, dm_link, t_link, tree_max_dm, fname, max_events, nt_chunk)
+
+
+def trigger_grouper_events(grouper):
+    """
+    Returns the L1 events which have been finalized by a trigger_grouper since the last call, as an array
+    of shape (nevents, 11) whose columns are (dm, time, snr, dm_lo, dm_hi, t_lo, t_hi, itree, ism, ibeta, ntriggers).
+    """
+
+    return rf_pipelines_c.trigger_grouper_get_events(grouper)
@@ -1,6 +1,32 @@
 import sys
 import rf_pipelines
 
+from rf_pipelines import rf_pipelines_c
+
+
+def frb_injector(pulses, sample_rms=1.0, nt_chunk=1024):
+    """
+    Returns a C++ transform which adds many simulated FRB's to the intensity array (leaving weights
+    unmodified).  This is much faster than using one frb_injector_transform per pulse, and doesn't
+    need the 'simpulse' library.
+
+    The 'pulses' argument is a 2D array (or list of tuples) with shape (npulses, 6), whose columns are
+
+       (snr, undispersed_arrival_time, dm, intrinsic_width, sm, spectral_index)
+
+    with the same meanings as the frb_injector_transform constructor arguments.  The pulses need not
+    be sorted.  The same caveats about 'snr' and 'sample_rms' apply (see frb_injector_transform docstring).
+    An empty list of pulses is allowed, and gives a transform which leaves the intensity unmodified.
+
+    The 'nt_chunk' argument must be a multiple of 8.
+
+    The number of pulses which were injected (and the number which were only partially contained in
+    the stream) are written to the pipeline json output.
+    """
+
+    return rf_pipelines_c.make_frb_injector(pulses, sample_rms, nt_chunk)
+
+
 class frb_injector_transform(rf_pipelines.py_wi_transform):
     """
     This transform modifies the intensities in the pipeline by adding a simulated FRB
@@ -5,7 +5,7 @@ import rf_pipelines
 from rf_pipelines import rf_pipelines_c
 
 
-def intensity_clipper(nt_chunk=1024, sigma=3., axis=None, niter=1, iter_sigma=0., Df=1, Dt=1, two_pass=False, cpp=True):
+def intensity_clipper(nt_chunk=1024, sigma=3., axis=None, niter=1, iter_sigma=0., Df=1, Dt=1, two_pass=False, robust=False, cpp=True):
     """
     This transform clips the intensity along a selected 
     axis -- also works in planar (2D) mode -- and above 
@@ -15,7 +15,7 @@ def intensity_clipper(nt_chunk=1024, sigma=3., axis=None, niter=1, iter_sigma=0.
 
     Constructor syntax:
 
-      t = intensity_clipper(nt_chunk=1024, sigma=3., axis=None, niter=1, iter_sigma=0., Df=1, Dt=1, two_pass=False, cpp=True)
+      t = intensity_clipper(nt_chunk=1024, sigma=3., axis=None, niter=1, iter_sigma=0., Df=1, Dt=1, two_pass=False, robust=False, cpp=True)
 
       'nt_chunk=1024' is the buffer size.
 
@@ -40,10 +40,17 @@ def intensity_clipper(nt_chunk=1024, sigma=3., axis=None, niter=1, iter_sigma=0.
 
       If 'two_pass=True' then a more numerically stable but slightly slower clipping algorithm
       will be used (only meaningful if cpp=True).
+
+      If 'robust=True' then the weighted median and median absolute deviation are used, instead
+      of the weighted mean/rms.  In robust mode, niter must be 1 and two_pass must be False
+      (only available if cpp=True).
     """
 
     if cpp:
-        return rf_pipelines_c.make_intensity_clipper(nt_chunk, axis, sigma, niter, iter_sigma, Df, Dt, two_pass)
+        return rf_pipelines_c.make_intensity_clipper(nt_chunk, axis, sigma, niter, iter_sigma, Df, Dt, two_pass, robust)
+
+    if robust:
+        raise RuntimeError("rf_pipelines intensity_clipper(): robust=True is currently only implemented in C++ (cpp=True)")
 
     if (iter_sigma != 0) and (iter_sigma != sigma):
         print >>sys.stderr, 'rf_pipelines intensity_clipper(): warning: iter_sigma argument is currently ignored by python transform'
@@ -2,8 +2,34 @@ import sys
 import numpy as np
 import rf_pipelines
 
+from rf_pipelines import rf_pipelines_c
 
-class plotter_transform(rf_pipelines.py_wi_transform):
+
+def plotter_transform(img_prefix, img_nfreq, img_nt, downsample_nt=1, n_zoom=1, nt_chunk=0, clip_niter=3, sigma_clip=3.0, cpp=False):
+    """
+    This is a pseudo-transform (meaning that it does not actually modify its input)
+    which makes waterfall plots.  See the plotter_transform_python docstring for the
+    meaning of the arguments.
+
+      'cpp=False' will use the reference python transform
+      'cpp=True' will use the fast C++ transform
+
+    The C++ transform downsamples each chunk once and cascades to coarser zoom levels,
+    and writes PNG files in a background thread.  It requires rf_pipelines to be compiled
+    with libpng (HAVE_PNG=y in Makefile.local), and has some extra restrictions: img_nt
+    must be a multiple of 8, and nt_chunk (if specified) must be a multiple of 8 times the
+    downsampling factor at the max zoom level.
+
+    The C++ output filenames are ${img_prefix}_zoom${zoom_level}_${plot_number}.png.
+    """
+
+    if cpp:
+        return rf_pipelines_c.make_plotter_transform(img_prefix, img_nfreq, img_nt, downsample_nt, n_zoom, nt_chunk, clip_niter, sigma_clip)
+
+    return plotter_transform_python(img_prefix, img_nfreq, img_nt, downsample_nt, n_zoom, nt_chunk, clip_niter, sigma_clip)
+
+
+class plotter_transform_python(rf_pipelines.py_wi_transform):
     """
     This is a pseudo-transform (meaning that it does not actually modify its input)
     which makes waterfall plots.  It's primitive so please feel free to improve it!
@@ -13,7 +39,7 @@ class plotter_transform(rf_pipelines.py_wi_transform):
 
     Constructor syntax:
     
-      t = plotter_transform(img_prefix, img_nfreq, img_nt, downsample_nt=1, n_zoom=4,  nt_chunk=0)
+      t = plotter_transform_python(img_prefix, img_nfreq, img_nt, downsample_nt=1, n_zoom=4,  nt_chunk=0)
       
       The 'img_prefix' arg determines the output filenames: ${img_prefix}_0.png,
       ${img_prefix}_1.png ...
@@ -4,7 +4,7 @@ import rf_pipelines
 from rf_pipelines import rf_pipelines_c
 
 
-def polynomial_detrender(nt_chunk=1024, deg=0, axis=0, cpp=True, epsilon=0.01, test=False):
+def polynomial_detrender(nt_chunk=1024, deg=0, axis=0, cpp=True, epsilon=0.01, test=False, precision='float', monitor=False, nt_window=0):
     """
     This transform removes a degree-d weighted-fit legendre 
     polynomial from the intensity along a specified axis. 
@@ -16,7 +16,7 @@ def polynomial_detrender(nt_chunk=1024, deg=0, axis=0, cpp=True, epsilon=0.01, t
 
     Constructor syntax:
 
-      t = polynomial_detrender(nt_chunk=1024, deg=0, axis=0, cpp=True, epsilon=0.01, test=False)
+      t = polynomial_detrender(nt_chunk=1024, deg=0, axis=0, cpp=True, epsilon=0.01, test=False, precision='float', monitor=False, nt_window=0)
       
       'nt_chunk=1024' is the buffer size.
 
@@ -33,10 +33,24 @@ def polynomial_detrender(nt_chunk=1024, deg=0, axis=0, cpp=True, epsilon=0.01, t
          (only meaningful if cpp=True)
 
       'test=False' enables a test mode (only meaningful if cpp=False)
+
+      'precision' is one of 'float', 'double', or 'mixed' (single-precision accumulation,
+         double-precision solve).  Single precision can be unreliable for deg > 8.
+         (Only meaningful if cpp=True.)
+
+      'monitor=True' compares one row per chunk to a double-precision fit, and reports the
+         number of discrepancies in the json output (only meaningful if cpp=True).
+
+      'nt_window' selects sliding-window mode if nonzero: the polynomial is fit in a window of
+         length 'nt_window' centered on each 8-sample step, rather than independently in each chunk.
+         Must be an odd multiple of 8.  (Only meaningful if cpp=True and axis=1, and the fitting
+         is always double precision, so 'precision' and 'monitor' are ignored.)
     """
 
-    if cpp:
-        return rf_pipelines_c.make_polynomial_detrender(nt_chunk, axis, deg, epsilon)
+    if cpp and (nt_window > 0):
+        return rf_pipelines_c.make_sliding_polynomial_detrender(nt_chunk, axis, deg, nt_window, epsilon)
+    elif cpp:
+        return rf_pipelines_c.make_polynomial_detrender(nt_chunk, axis, deg, epsilon, precision, monitor)
     else:
         return polynomial_detrender_python(nt_chunk, deg, axis, test)
 
@@ -0,0 +1,31 @@
+from rf_pipelines import rf_pipelines_c
+
+
+def rfi_clipper_chain(specs, nt_chunk=1024):
+    """
+    Runs a sequence of intensity/std_dev clippers as a single C++ transform.  The output is the same
+    as running the clippers one after another, but row-local and column-local clippers are applied in
+    cache-sized blocks, so that the chain makes fewer passes over memory.
+
+    Constructor syntax:
+
+      t = rfi_clipper_chain(specs, nt_chunk=1024)
+
+      'specs' is a list of dictionaries, one per clipper, with the following keys:
+
+         'type'          either 'intensity' or 'std_dev'
+         'axis'          same convention as intensity_clipper() and std_dev_clipper()
+         'sigma'         clipping threshold
+         'niter'         number of iterations (optional, default 1)
+         'iter_sigma'    iterated clipping threshold (optional, default 0)
+         'Df', 'Dt'      downsampling factors in frequency, time (optional, default 1)
+         'two_pass'      use a more numerically stable algorithm (optional, default False)
+         'robust'        use median/MAD statistics (optional, default False, incompatible with two_pass)
+
+      'nt_chunk=1024' is the buffer size.
+    """
+
+    tuples = [ (s['type'], s['axis'], s['sigma'], s.get('niter',1), s.get('iter_sigma',0.0),
+                s.get('Df',1), s.get('Dt',1), s.get('two_pass',False), s.get('robust',False)) for s in specs ]
+
+    return rf_pipelines_c.make_rfi_clipper_chain(nt_chunk, tuples)
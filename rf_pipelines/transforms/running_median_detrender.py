@@ -0,0 +1,28 @@
+from rf_pipelines import rf_pipelines_c
+
+
+def running_median_detrender(nt_window, nt_chunk=1024, axis=1, Dt=16):
+    """
+    Detrends along the time axis by subtracting the median of a sliding window of length 'nt_window',
+    which is roughly centered on each sample.  Unlike polynomial_detrender(), the baseline is robust
+    to bright RFI.  The window is carried across chunk boundaries.  (C++ only.)
+
+    Constructor syntax:
+
+      t = running_median_detrender(nt_window, nt_chunk=1024, axis=1, Dt=16)
+
+      'nt_window' is the length of the sliding window, in samples.
+
+      'nt_chunk=1024' is the buffer size.
+
+      'axis=1' is the axis convention (currently only axis=1, i.e. along time, is supported).
+
+      'Dt=16' is a block size.  If Dt > 1, the median of each block of Dt samples is computed first,
+         and the baseline is the running median of the block medians.  This is approximate, but
+         much faster.  Dt=1 gives the exact running median.  Both 'nt_window' and 'nt_chunk' must
+         be multiples of Dt.
+
+    Masked samples (weight zero) are excluded from the median, and nonzero weights are treated as equal.
+    """
+
+    return rf_pipelines_c.make_running_median_detrender(nt_chunk, axis, nt_window, Dt)
@@ -0,0 +1,27 @@
+from rf_pipelines import rf_pipelines_c
+
+
+def spline_detrender(nt_chunk=1024, axis=0, nx_knot=64, epsilon=0.01):
+    """
+    Detrends by subtracting a best-fit cubic B-spline with uniformly spaced knots.  This can follow
+    slow structure (e.g. the bandpass) like a high-degree polynomial_detrender(), but is numerically
+    stable, and its cost doesn't depend on the number of knots.  (C++ only.)
+
+    Constructor syntax:
+
+      t = spline_detrender(nt_chunk=1024, axis=0, nx_knot=64, epsilon=0.01)
+
+      'nt_chunk=1024' is the buffer size.
+
+      'axis=0' is the axis convention:
+        0: along freq; constant time.
+        1: along time; constant freq.
+
+      'nx_knot=64' is the knot spacing, in samples along the detrending axis.  It must divide the
+         axis length (nfreq or nt_chunk), and if axis=1, it must also be a multiple of 8.
+
+      'epsilon' controls the threshold for a basis function being poorly conditioned (e.g. because
+         most samples in its support are masked), in which case it is dropped from the fit.
+    """
+
+    return rf_pipelines_c.make_spline_detrender(nt_chunk, axis, nx_knot, epsilon)
@@ -5,14 +5,14 @@ import rf_pipelines
 from rf_pipelines import rf_pipelines_c
 
 
-def std_dev_clipper(nt_chunk=1024, sigma=3, axis=1, Df=1, Dt=1, two_pass=False, cpp=True):
+def std_dev_clipper(nt_chunk=1024, sigma=3, axis=1, Df=1, Dt=1, two_pass=False, robust=False, niter=1, iter_sigma=0, cpp=True):
     """
     Masks weights array based on the weighted (intensity) 
     standard deviation deviating by some sigma. 
    
     Constructor syntax:
 
-      t = std_dev_clipper(nt_chunk=1024, sigma=3, axis=1, Df=1, Dt=1, two_pass=False, cpp=True)
+      t = std_dev_clipper(nt_chunk=1024, sigma=3, axis=1, Df=1, Dt=1, two_pass=False, robust=False, niter=1, iter_sigma=0, cpp=True)
 
       'nt_chunk=1024' is the buffer size.
       
@@ -30,10 +30,21 @@ def std_dev_clipper(nt_chunk=1024, sigma=3, axis=1, Df=1, Dt=1, two_pass=False,
       If 'two_pass=True' then a more numerically stable but slightly slower clipping algorithm
       will be used (only meaningful if cpp=True).
 
+      If 'robust=True' then outliers are identified using the median and median absolute
+      deviation of the variances, instead of their mean/rms.  In robust mode, niter must be 1 and
+      two_pass must be False (only available if cpp=True).
+
+      If 'niter > 1', then the mean/rms of the variances is computed using iterated clipping,
+      with threshold 'iter_sigma' (if zero, then 'sigma' is used).  Only available if cpp=True.
+
     """
     
     if cpp:
-        return rf_pipelines_c.make_std_dev_clipper(nt_chunk, axis, sigma, Df, Dt, two_pass)
+        return rf_pipelines_c.make_std_dev_clipper(nt_chunk, axis, sigma, Df, Dt, two_pass, robust, niter, iter_sigma)
+    elif robust:
+        raise RuntimeError("rf_pipelines std_dev_clipper(): robust=True is currently only implemented in C++ (cpp=True)")
+    elif niter != 1:
+        raise RuntimeError("rf_pipelines std_dev_clipper(): niter > 1 is currently only implemented in C++ (cpp=True)")
     else:
         return std_dev_clipper_python(sigma, axis, nt_chunk, Df, Dt)
 
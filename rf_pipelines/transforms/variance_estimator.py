@@ -2,8 +2,50 @@ import rf_pipelines
 import numpy as np
 import time
 
+from rf_pipelines import rf_pipelines_c
 
-class variance_estimator(rf_pipelines.py_wi_transform):
+
+def variance_estimator(v1_chunk=128, v2_chunk=64, nt_chunk=1024, fname=None, cpp=False):
+    """
+    This is a pseudo-transform (meaning that it does not actually modify its input),
+    which estimates the variance in each frequency channel.
+
+    Constructor syntax:
+
+      t = variance_estimator(v1_chunk=128, v2_chunk=64, nt_chunk=1024, fname=None, cpp=False)
+
+      'v1_chunk=128' is the number of time samples used for each weighted variance ("v1") estimate.
+
+      'v2_chunk=64' is the number of v1 estimates whose median is taken to get each "v2" estimate.
+
+      'nt_chunk=1024' is the buffer size, and must be a multiple of v1_chunk.
+
+      'fname' determines the output filename (see below).
+
+      'cpp=False' will use the reference python transform
+      'cpp=True' will use the fast C++ transform
+
+    The final variance array has shape (nfreq, total number of time samples / v1_chunk / v2_chunk).
+
+    If cpp=False, the array is written as a timestamped .npy file in the current directory,
+    as described in the variance_estimator_python docstring.
+
+    If cpp=True, the array is written to ${fname}.npy in the pipeline output directory (default
+    fname is 'var-v1-${v1_chunk}-v2-${v2_chunk}').  Zero entries (i.e. masked channels) are left
+    in the output, rather than being interpolated over.  The C++ transform requires v1_chunk to
+    be a multiple of 8.
+    """
+
+    if not cpp:
+        return variance_estimator_python(v1_chunk, v2_chunk, nt_chunk, fname)
+
+    if fname is None:
+        fname = 'var-v1-%d-v2-%d' % (v1_chunk, v2_chunk)
+
+    return rf_pipelines_c.make_variance_estimator(v1_chunk, v2_chunk, nt_chunk, fname)
+
+
+class variance_estimator_python(rf_pipelines.py_wi_transform):
     """
     This is a pseudo-transform (meaning that it does not actually modify its input). 
     
@@ -7,12 +7,15 @@
 
 #include <cmath>
 #include <cstring>
+#include <limits>
+#include <algorithm>
 #include <sstream>
 #include <stdexcept>
 #include <sys/time.h>
 
 #include <thread>
 #include <condition_variable>
+#include <functional>
 
 #include "rf_pipelines.hpp"
 
@@ -124,6 +127,333 @@ template<unsigned int D, typename std::enable_if<(D>1 && (D%2)==0),int>::type =
 inline constexpr int IntegerLog2() { return IntegerLog2<(D/2)>() + 1; }
 
 
+// Buffer indices in the clipper_workspace (see rf_pipelines.hpp).  Buffers which are never needed
+// at the same time can share an index.
+enum clipper_workspace_buffer {
+    WS_STAGE_INTENSITY = 0,    // staged_downsampler::intensity_ds, or robust clipper downsampled intensity
+    WS_STAGE_WEIGHTS = 1,      // staged_downsampler::weights_ds, or robust clipper downsampled weights
+    WS_KERNEL_INTENSITY = 2,   // 'ds_intensity' arg to clipper kernels
+    WS_KERNEL_WEIGHTS = 3,     // 'ds_weights' arg to clipper kernels
+    WS_SD = 4,                 // std_dev_clipper_buffers::sd, or robust clipper (value, weight) pairs
+    WS_SD_VALID = 5,           // std_dev_clipper_buffers::sd_valid, or robust clipper variances
+    WS_DOWNSAMPLE = 6          // intermediate arrays in wi_downsample(), if (Df,Dt) are done in stages
+};
+
+static_assert(WS_DOWNSAMPLE < clipper_workspace::nbuf, "clipper_workspace::nbuf is too small");
+
+
+// Version of wi_downsample() (see rf_pipelines.hpp) which takes a caller-owned workspace.  If (Df,Dt)
+// exceed the largest specialized kernel, then the intermediate arrays are stored in buffer WS_DOWNSAMPLE,
+// and wi_downsample_scratch_size() returns the number of floats needed.  (The public version of
+// wi_downsample() uses clipper_workspace::thread_local_default().)  Defined in udsample.cpp.
+
+extern void wi_downsample(float *out_intensity, float *out_weights, int out_stride, const float *in_intensity, const float *in_weights,
+			  int in_nfreq, int in_nt, int in_stride, int Df, int Dt, clipper_workspace &ws);
+
+extern ssize_t wi_downsample_scratch_size(int in_nfreq, int in_nt, int Df, int Dt);
+
+
+// -------------------------------------------------------------------------------------------------
+//
+// staged_downsampler: helper for clippers whose downsampling factors (Df,Dt) exceed the largest
+// factors with specialized kernels (constants::max_specialized_frequency_downsampling, etc.)
+//
+// The factors are split as Df = Df1 * Df_kernel (and similarly for Dt), where Df_kernel is the largest
+// power of two which divides Df, and is <= constants::max_specialized_frequency_downsampling.  (Thus, any factors
+// which are not powers of two always end up in Df1, Dt1.)  The (Df1,Dt1) part is done first,
+// by calling wi_downsample() into the buffers below, and then the specialized (Df_kernel,Dt_kernel)
+// kernel is run on the buffers.  Finally, upsample_mask() propagates the mask back to full resolution.
+//
+// If (Df,Dt) are small powers of two, so that no staging is needed, then is_active() returns false and no
+// buffers are allocated.  Defined in udsample.cpp.
+
+
+struct staged_downsampler {
+    int Df1 = 1;
+    int Dt1 = 1;
+    int Df_kernel = 1;
+    int Dt_kernel = 1;
+
+    // Shape of the first-stage downsampled arrays (which are unstrided, i.e. stride=nt_ds).
+    int nfreq_ds = 0;
+    int nt_ds = 0;
+    float *intensity_ds = nullptr;
+    float *weights_ds = nullptr;
+
+    staged_downsampler() { }
+    ~staged_downsampler();
+
+    // Noncopyable
+    staged_downsampler(const staged_downsampler &) = delete;
+    staged_downsampler &operator=(const staged_downsampler &) = delete;
+
+    // Note: (D & -D) is the largest power of two which divides D.
+    static inline int kernel_Df(int Df) { return std::min(Df & -Df, constants::max_specialized_frequency_downsampling); }
+    static inline int kernel_Dt(int Dt) { return std::min(Dt & -Dt, constants::max_specialized_time_downsampling); }
+
+    // If the buffers are borrowed from a clipper_workspace, then they aren't freed in the destructor.
+    // The workspace is also used for the intermediate arrays in wi_downsample().
+    bool owns_buffers = true;
+    clipper_workspace *ws = nullptr;
+
+    inline clipper_workspace &get_workspace() const { return ws ? *ws : clipper_workspace::thread_local_default(); }
+
+    // Caller must check that Df,Dt are positive, nfreq % Df == 0, and nt % Dt == 0.
+    // If 'ws' is non-null, then the buffers are taken from the workspace instead of being allocated.
+    void init(int nfreq, int nt, int Df, int Dt, clipper_workspace *ws = nullptr);
+
+    inline bool is_active() const { return (Df1 > 1) || (Dt1 > 1); }
+
+    // If 'cache' is non-null and already contains the downsampled chunk, then it is copied
+    // from the cache instead of being recomputed.  If 'mask' is non-null, then blocks of Df1 rows
+    // which are fully masked are zeroed instead of being downsampled (see 'struct chunk_mask_info').
+    void downsample(const float *intensity, const float *weights, int stride, const downsample_cache *cache = nullptr, const chunk_mask_info *mask = nullptr);
+
+    // Sets each (Df1,Dt1) block of 'weights' to zero, if the corresponding element of weights_ds is zero.
+    void upsample_mask(float *weights, int stride) const;
+};
+
+
+// -------------------------------------------------------------------------------------------------
+//
+// blocked_std_dev_clipper: the std_dev_clipper, split into its three steps, so that the first and
+// last steps can be done one block at a time (see rfi_clipper_chain.cpp).
+//
+//   compute_sd()   computes the variances of rows [i0,i0+n) if axis=AXIS_TIME, or columns [i0,i0+n)
+//                  if axis=AXIS_FREQ.  The caller must call it (or skip_sd(), if the rows are known
+//                  to be fully masked) exactly once for every row or column in the chunk.
+//   clip()         runs clip_1d() on the variances.
+//   apply_mask()   masks rows [f0,f0+nf) and columns [t0,t0+nt) of the chunk.
+//
+// Rows must be aligned to Df if axis=AXIS_TIME, and columns must be aligned to (Dt * simd length)
+// if axis=AXIS_FREQ, where the simd length is 16 if the AVX-512 kernel is used (see uses_avx512()),
+// and 8 otherwise.  The 'intensity' and 'weights' pointers always point to the start of the chunk.
+// The output is bit-for-bit identical to apply_std_dev_clipper().
+//
+// Only non-robust clippers whose (Df,Dt) don't need a staged_downsampler can be blocked (see
+// is_blockable()).  Caller must check parameters!  Defined in std_dev_clippers.cpp.
+
+template<typename T> struct std_dev_clipper_buffers;
+
+struct blocked_std_dev_clipper {
+    const int nfreq;
+    const int nt;
+    const axis_type axis;
+    const double sigma;
+    const int Df;
+    const int Dt;
+    const bool two_pass;
+    const int niter;
+    const double iter_sigma;
+
+    // Length of the 'sd' and 'sd_valid' arrays.
+    const int nsd;
+
+    blocked_std_dev_clipper(int nfreq, int nt, axis_type axis, double sigma, int Df, int Dt, bool two_pass, int niter, double iter_sigma);
+    ~blocked_std_dev_clipper();
+
+    // Noncopyable
+    blocked_std_dev_clipper(const blocked_std_dev_clipper &) = delete;
+    blocked_std_dev_clipper &operator=(const blocked_std_dev_clipper &) = delete;
+
+    static bool is_blockable(int Df, int Dt, bool robust);
+    bool uses_avx512() const;
+
+    void compute_sd(const float *intensity, const float *weights, int stride, int i0, int n);
+    void skip_sd(int i0, int n);
+    void clip();
+    void apply_mask(float *weights, int stride, int f0, int nf, int t0, int nt) const;
+
+    // Returns true if clip() masked row 'ifreq' (only meaningful if axis=AXIS_TIME).
+    bool is_row_masked(int ifreq) const;
+
+protected:
+    using sd_kernel_t = void (*)(const std_dev_clipper_buffers<float> &, const float *, const float *, int, int, int);
+
+    sd_kernel_t kernel = nullptr;
+    std_dev_clipper_buffers<float> *buf = nullptr;
+};
+
+
+// downsample_cache: downsampled copies of the current chunk, which can be shared between transforms.
+//
+// The cache is owned by the wi_run_state, which calls set_chunk() before each call to
+// wi_transform::process_chunk(), and invalidate() after each transform which is not read-only
+// (see wi_transform::is_read_only).  A transform accesses the cache through wi_transform::ds_cache.
+//
+// A cached entry is identified by the sample range of the chunk, the downsampling factors,
+// and a "version" which is incremented whenever the cache is invalidated.
+
+struct downsample_cache {
+    struct entry {
+	ssize_t it0 = 0;
+	ssize_t nt = 0;
+	ssize_t version = -1;
+	int Df = 0;
+	int Dt = 0;
+
+	// Unstrided arrays of shape (nfreq/Df, nt/Dt).
+	float *intensity = nullptr;
+	float *weights = nullptr;
+
+	entry() { }
+	~entry();
+
+	// Noncopyable
+	entry(const entry &) = delete;
+	entry &operator=(const entry &) = delete;
+    };
+
+    // Current chunk (set by wi_run_state).
+    ssize_t nfreq = 0;
+    ssize_t it0 = 0;
+    ssize_t nt = 0;
+    const float *intensity = nullptr;
+    const float *weights = nullptr;
+    ssize_t stride = 0;
+    ssize_t version = 0;
+
+    std::vector<std::unique_ptr<entry> > entries;
+
+    void set_chunk(ssize_t nfreq, ssize_t it0, ssize_t nt, const float *intensity, const float *weights, ssize_t stride);
+    void invalidate() { version++; }
+
+    // Returns the current chunk downsampled by (Df,Dt), computing it if necessary.  The returned
+    // arrays are unstrided (stride nt/Dt), and the same constraints as wi_downsample() apply.
+    void get(int Df, int Dt, const float* &ds_intensity, const float* &ds_weights);
+
+    // Like get(), but returns false (without computing anything) if the entry is not cached.
+    bool lookup(int Df, int Dt, const float* &ds_intensity, const float* &ds_weights) const;
+};
+
+
+// chunk_mask_info: per-chunk metadata which records the rows (frequency channels) of the current
+// chunk which are fully masked, i.e. all weights are zero, so that kernels can skip them.
+//
+// As with the downsample_cache, the wi_run_state owns the metadata and calls set_chunk() before each
+// call to wi_transform::process_chunk(), and a transform accesses it through wi_transform::mask_info.
+// The weights are scanned lazily, when a transform calls update().  The scan of a row stops at its
+// first nonzero weight, so only fully masked rows are read in full, and rows which are already known
+// to be masked are not read at all.
+//
+// The metadata is kept from one transform to the next if the next chunk is contained in the current
+// one (e.g. if both transforms have the same nt_chunk), and the transform in between can't have
+// unmasked any samples (see wi_transform::preserves_mask).  A transform which masks entire rows can
+// record them with mask_row(), so that they don't need to be scanned again.  The zero-weight padding
+// which is appended in wi_run_state::end_substream() is known to be masked, and is never scanned.
+//
+// The metadata is conservative: a row which is marked is always fully masked, but an unmarked row may
+// be fully masked too, if update() hasn't been called since the last transform modified the weights.
+
+struct chunk_mask_info {
+    // Current chunk (set by wi_run_state).
+    ssize_t nfreq = 0;
+    ssize_t it0 = 0;
+    ssize_t nt = 0;
+    const float *weights = nullptr;
+    ssize_t stride = 0;
+
+    // Samples with index >= it_padding are known to be zero-weight padding.
+    ssize_t it_padding = std::numeric_limits<ssize_t>::max();
+
+    // Bitset (one bit per row) of fully masked rows.  If 'scanned' is true, then every row which
+    // is not in the bitset has been checked to contain an unmasked sample.
+    std::vector<uint64_t> row_bits;
+    ssize_t nrows_masked = 0;
+    bool scanned = false;
+
+    void set_chunk(ssize_t nfreq, ssize_t it0, ssize_t nt, const float *weights, ssize_t stride);
+
+    // Forgets all metadata.  Called after a transform which may have unmasked samples, and at the
+    // start of each substream (since sample indices restart from zero).
+    void invalidate();
+
+    // Called after a transform which may have masked (but not unmasked) samples.  Rows which are
+    // known to be masked stay masked, but the other rows will be rescanned in the next update().
+    void weights_changed() { scanned = false; }
+
+    // Scans the weights of rows which are not known to be masked (if not done already).
+    void update();
+
+    // Records that every weight in row 'ifreq' of the current chunk is zero.
+    void mask_row(ssize_t ifreq);
+
+    inline bool is_row_masked(ssize_t ifreq) const { return (row_bits[ifreq >> 6] >> (ifreq & 63)) & 1; }
+    inline bool all_masked() const { return (nfreq > 0) && (nrows_masked == nfreq); }
+
+    // Returns true if rows [ifreq0, ifreq0+n) are all masked.
+    inline bool rows_masked(ssize_t ifreq0, ssize_t n) const
+    {
+	for (ssize_t i = ifreq0; i < ifreq0+n; i++)
+	    if (!is_row_masked(i))
+		return false;
+	return true;
+    }
+
+    // Divides the rows into blocks of Df (caller must check nfreq % Df == 0), and calls f(ifreq0, ifreq1, masked)
+    // for each maximal range of rows [ifreq0, ifreq1) in which either every block is fully masked (masked=true),
+    // or no block is fully masked (masked=false).
+    template<typename F>
+    inline void foreach_block_range(int Df, const F &f) const
+    {
+	ssize_t i0 = 0;
+	bool m0 = rows_masked(0, Df);
+
+	for (ssize_t i = Df; i < nfreq; i += Df) {
+	    bool m = rows_masked(i, Df);
+	    if (m != m0) {
+		f(i0, i, m0);
+		i0 = i;
+		m0 = m;
+	    }
+	}
+
+	f(i0, nfreq, m0);
+    }
+};
+
+
+// -------------------------------------------------------------------------------------------------
+//
+// parallel_downsampler: used by the multithreaded apply_*_parallel() functions (see rf_pipelines.hpp),
+// in cases where a reduction over the whole array is needed.  The array is downsampled by (Df,Dt) in
+// parallel over blocks of rows, so that the reduction and masking kernels can run with (Df,Dt)=(1,1).
+// After the downsampled weights have been masked, upsample_mask() propagates the mask back to full
+// resolution.
+//
+// If (Df,Dt) = (1,1), then no buffers are allocated, and (intensity, weights, stride) refer to the
+// original arrays.  Caller must check that nfreq % Df == 0 and nt % (Dt*S) == 0.  Defined in udsample.cpp.
+
+
+struct parallel_downsampler {
+    const int nthreads;
+    const int Df;
+    const int Dt;
+    const int nfreq_ds;
+    const int nt_ds;
+
+    // Downsampled arrays (or the original arrays, if Df=Dt=1).
+    const float *intensity = nullptr;
+    float *weights = nullptr;
+    int stride = 0;
+
+    parallel_downsampler(int nthreads, const float *intensity, float *weights, int nfreq, int nt, int stride, int Df, int Dt);
+    ~parallel_downsampler();
+
+    // Noncopyable
+    parallel_downsampler(const parallel_downsampler &) = delete;
+    parallel_downsampler &operator=(const parallel_downsampler &) = delete;
+
+    inline bool is_active() const { return (Df > 1) || (Dt > 1); }
+
+    void upsample_mask(float *weights_hires, int stride_hires) const;
+
+protected:
+    float *intensity_ds = nullptr;
+    float *weights_ds = nullptr;
+};
+
+
 // -------------------------------------------------------------------------------------------------
 //
 // timing_thread (general-purpose timing thread), and transform_timing_thread (subclass for timing wi_transforms).
@@ -195,6 +525,7 @@ struct transform_timing_thread : public timing_thread
 
     float *intensity = nullptr;
     float *weights = nullptr;
+    ssize_t nt_alloc = 0;    // length of intensity/weights arrays (nfreq * stride, plus postpadding)
 
     std::vector<std::shared_ptr<wi_transform>> transform_list;
     int ntransforms = 0;
@@ -232,6 +563,22 @@ extern bool file_exists(const std::string &filename);
 extern void makedirs(const std::string &dirname);
 extern std::vector<std::string> listdir(const std::string &dirname);
 
+// Splits [0,n) into contiguous blocks whose endpoints are multiples of 'granularity', and calls
+// f(ithread, i, j) for each block [i,j), in parallel.  The number of blocks is parallel_nthreads(),
+// and the calling thread processes block 0.  If nthreads <= 0, then the number of cores is used.
+// Exceptions thrown by f() are rethrown in the calling thread.  Defined in misc.cpp.
+extern int parallel_nthreads(int nthreads, int n, int granularity);
+extern void parallel_for(int nthreads, int n, int granularity, const std::function<void(int,int,int)> &f);
+
+// Returns the simd length (8 or 16) of the kernel tables which will be used on this machine.
+// Defined in simd_dispatch.cpp; see comments there for the environment variable override.
+extern int simd_dispatch_length();
+
+// Robust (median/MAD) clippers, called by the intensity/std_dev clippers if robust=true.
+// Defined in robust_clippers.cpp.  Caller must check parameters!
+extern void robust_intensity_clip(const float *intensity, float *weights, int nfreq, int nt, int stride, axis_type axis, double sigma, int Df, int Dt, clipper_workspace &ws);
+extern void robust_std_dev_clip(const float *intensity, float *weights, int nfreq, int nt, int stride, axis_type axis, double sigma, int Df, int Dt, clipper_workspace &ws);
+
 // The "wrms_hack_for_testing" is explained in test-cpp-python-equivalence.py
 extern void _wrms_hack_for_testing1(std::vector<float> &mean_hint, const float *intensity, const float *weights, int nfreq, int nt, int stride, int niter, double sigma, bool two_pass);
 extern void _wrms_hack_for_testing2(float &mean, float &rms, const float *intensity, const float *weights, int nfreq, int nt, int stride, const std::vector<float> &mean_hint);
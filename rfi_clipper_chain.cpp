@@ -0,0 +1,288 @@
+// rfi_clipper_chain: runs a sequence of intensity_clippers and std_dev_clippers as a single transform.
+//
+// The output is identical to running the clippers one after another, since each clipper sees
+// the mask produced by its predecessors.  The point of the chain is to reduce memory traffic.
+// Consecutive clippers which are "local" along one axis are cache-blocked, so that the chunk is
+// swept once per group of clippers, rather than once per clipper:
+//
+//   - intensity_clipper(AXIS_TIME) only couples samples in the same (downsampled) row, so a group
+//     of these is applied one block of rows at a time.
+//
+//   - intensity_clipper(AXIS_FREQ) only couples samples in the same (downsampled) column, so a group
+//     of these is applied one block of columns at a time.
+//
+//   - std_dev_clipper(AXIS_TIME) computes one variance per row, and then clips rows using statistics
+//     of all the variances.  The variances are computed in the same sweep as the preceding group of
+//     intensity_clipper(AXIS_TIME), and the rows are masked in the next sweep (which can be along
+//     either axis).  Similarly for std_dev_clipper(AXIS_FREQ) and columns.  (See
+//     'struct blocked_std_dev_clipper' in rf_pipelines_internals.hpp.)
+//
+//   - intensity_clipper(AXIS_NONE) computes statistics over the whole chunk, so it is applied to the
+//     whole chunk.  So are robust std_dev_clippers, and std_dev_clippers whose downsampling factors
+//     are too large for a specialized kernel.
+
+#include "rf_pipelines_internals.hpp"
+
+using namespace std;
+
+namespace rf_pipelines {
+#if 0
+}; // pacify emacs c-mode
+#endif
+
+
+// Target size of a cache block, including both the intensity and weights arrays.
+static constexpr ssize_t target_block_bytes = 256 * 1024;
+
+
+inline ssize_t lcm(ssize_t m, ssize_t n)
+{
+    return (m / gcd(m,n)) * n;
+}
+
+
+struct rfi_clipper_chain : public wi_transform
+{
+    const vector<rfi_clipper_spec> specs;
+
+    // A group of consecutive specs [ispec_begin, ispec_end) which are applied blockwise.
+    //   axis=AXIS_TIME   blocks of 'block_size' rows (frequency channels)
+    //   axis=AXIS_FREQ   blocks of 'block_size' columns (time samples)
+    //   axis=AXIS_NONE   a single spec, applied to the whole chunk
+    //
+    // In each block, the mask of the 'pending' std_dev_clipper (from the previous group) is applied
+    // first, then the specs, and then the variances of the 'sd' std_dev_clipper are computed.
+    struct group {
+	int ispec_begin = 0;
+	int ispec_end = 0;
+	axis_type axis = AXIS_NONE;
+	ssize_t block_size = 0;
+
+	shared_ptr<blocked_std_dev_clipper> sd;
+	shared_ptr<blocked_std_dev_clipper> pending;
+    };
+
+    vector<group> groups;   // initialized in set_stream()
+
+    // Temporary buffers shared by all clippers in the chain.
+    clipper_workspace ws;
+
+    rfi_clipper_chain(int nt_chunk_, const vector<rfi_clipper_spec> &specs_, const string &name_)
+	: specs(specs_)
+    {
+	this->name = name_;
+	this->nt_chunk = nt_chunk_;
+	this->nt_prepad = 0;
+	this->nt_postpad = 0;
+	this->preserves_mask = true;
+    }
+
+    // Returns AXIS_TIME (row-local), AXIS_FREQ (column-local), or AXIS_NONE (not blockable).
+    // For a std_dev_clipper, "local" means that the variances are computed independently for
+    // each row (or column).
+    static axis_type block_axis(const rfi_clipper_spec &s)
+    {
+	if ((s.type == rfi_clipper_spec::STD_DEV_CLIPPER) && !blocked_std_dev_clipper::is_blockable(s.Df, s.Dt, s.robust))
+	    return AXIS_NONE;
+	return s.axis;
+    }
+
+    // If isd >= 0, then specs[isd] is a std_dev_clipper whose variances are computed in the group.
+    void append_group(int ispec_begin, int ispec_end, axis_type axis, int isd)
+    {
+	static constexpr int S = constants::single_precision_simd_length;
+
+	group g;
+	g.ispec_begin = ispec_begin;
+	g.ispec_end = ispec_end;
+	g.axis = axis;
+
+	if (groups.size() > 0)
+	    g.pending = groups.back().sd;
+
+	if (isd >= 0) {
+	    const rfi_clipper_spec &s = specs[isd];
+	    g.sd = make_shared<blocked_std_dev_clipper> (nfreq, nt_chunk, s.axis, s.sigma, s.Df, s.Dt, s.two_pass, s.niter, s.iter_sigma);
+	}
+
+	// Blocks must be aligned to the downsampling factors of every clipper in the group.
+	// Column blocks are also aligned to the simd length, and to the AVX-512 simd length if
+	// the AVX-512 kernels are used, so that each block is processed by the same kernel as the
+	// whole chunk.  (If the AVX-512 kernels are only used for some of the clippers, then the
+	// columns aren't blocked.)
+	ssize_t align = 1;
+	ssize_t align16 = 1;
+
+	for (int i = ispec_begin; i < ispec_end + ((isd >= 0) ? 1 : 0); i++) {
+	    if (axis == AXIS_TIME)
+		align = lcm(align, specs[i].Df);
+	    else if (axis == AXIS_FREQ) {
+		align = lcm(align, S * specs[i].Dt);
+		align16 = lcm(align16, 16 * specs[i].Dt);
+	    }
+	}
+
+	// The pending mask is applied to columns in units of Dt.
+	if ((axis == AXIS_FREQ) && g.pending && (g.pending->axis == AXIS_FREQ)) {
+	    align = lcm(align, g.pending->Dt);
+	    align16 = lcm(align16, g.pending->Dt);
+	}
+
+	if ((axis == AXIS_FREQ) && (simd_dispatch_length() == 16))
+	    align = (nt_chunk % align16 == 0) ? align16 : nt_chunk;
+
+	if (axis == AXIS_TIME) {
+	    ssize_t n = target_block_bytes / (2 * sizeof(float) * nt_chunk);
+	    g.block_size = min(ssize_t(nfreq), max(align, (n / align) * align));
+	}
+	else if (axis == AXIS_FREQ) {
+	    ssize_t n = target_block_bytes / (2 * sizeof(float) * nfreq);
+	    g.block_size = min(ssize_t(nt_chunk), max(align, (n / align) * align));
+	}
+
+	groups.push_back(g);
+    }
+
+    virtual void set_stream(const wi_stream &stream) override
+    {
+	for (const auto &s: specs) {
+	    if (stream.nfreq % s.Df)
+		throw runtime_error("rf_pipelines rfi_clipper_chain: stream nfreq (=" + to_string(stream.nfreq)
+				    + ") is not divisible by frequency downsampling factor Df=" + to_string(s.Df));
+	}
+
+	this->nfreq = stream.nfreq;
+	this->groups.clear();
+
+	int nspecs = specs.size();
+	int ispec = 0;
+
+	// Each group is either a single spec which isn't blockable, or a run of intensity_clippers
+	// with the same axis (possibly empty), followed by at most one std_dev_clipper with that axis.
+	while (ispec < nspecs) {
+	    axis_type axis = block_axis(specs[ispec]);
+
+	    if (axis == AXIS_NONE) {
+		append_group(ispec, ispec+1, AXIS_NONE, -1);
+		ispec++;
+		continue;
+	    }
+
+	    int jspec = ispec;
+	    while ((jspec < nspecs) && (specs[jspec].type == rfi_clipper_spec::INTENSITY_CLIPPER) && (block_axis(specs[jspec]) == axis))
+		jspec++;
+
+	    bool has_sd = (jspec < nspecs) && (specs[jspec].type == rfi_clipper_spec::STD_DEV_CLIPPER) && (block_axis(specs[jspec]) == axis);
+
+	    append_group(ispec, jspec, axis, has_sd ? jspec : -1);
+	    ispec = has_sd ? (jspec+1) : jspec;
+	}
+    }
+
+    // Applies a single spec to the (nf, nt) subarray starting at (intensity, weights).
+    inline void apply_spec(const rfi_clipper_spec &s, const float *intensity, float *weights, int nf, int nt, int stride)
+    {
+	if (s.type == rfi_clipper_spec::INTENSITY_CLIPPER)
+	    apply_intensity_clipper(intensity, weights, nf, nt, stride, s.axis, s.sigma, s.niter, s.iter_sigma, s.Df, s.Dt, s.two_pass, s.robust, &ws);
+	else
+	    apply_std_dev_clipper(intensity, weights, nf, nt, stride, s.axis, s.sigma, s.Df, s.Dt, s.two_pass, s.robust, s.niter, s.iter_sigma, &ws);
+    }
+
+    virtual void process_chunk(double t0, double t1, float *intensity, float *weights, ssize_t stride, float *pp_intensity, float *pp_weights, ssize_t pp_stride) override
+    {
+	// Clipping doesn't change a fully masked chunk, or a fully masked block of rows
+	// (see 'struct chunk_mask_info').  Since a group of clippers can mask entire rows,
+	// the rows which aren't known to be masked are rescanned before each group.
+	//
+	// Note that the mask of a std_dev_clipper isn't applied until the next group, so its masked
+	// rows are only recorded in the mask_info by the rescan which follows that group.
+	for (const group &g: groups) {
+	    if (mask_info) {
+		if (&g != &groups[0])
+		    mask_info->weights_changed();
+
+		mask_info->update();
+		if (mask_info->all_masked())
+		    return;
+	    }
+
+	    if (g.axis == AXIS_TIME) {
+		for (ssize_t f0 = 0; f0 < nfreq; f0 += g.block_size) {
+		    int nf = min(g.block_size, nfreq - f0);
+
+		    if (mask_info && mask_info->rows_masked(f0, nf)) {
+			if (g.sd)
+			    g.sd->skip_sd(f0, nf);
+			continue;
+		    }
+
+		    if (g.pending)
+			g.pending->apply_mask(weights, stride, f0, nf, 0, nt_chunk);
+		    for (int i = g.ispec_begin; i < g.ispec_end; i++)
+			apply_spec(specs[i], intensity + f0*stride, weights + f0*stride, nf, nt_chunk, stride);
+		    if (g.sd)
+			g.sd->compute_sd(intensity, weights, stride, f0, nf);
+		}
+	    }
+	    else if (g.axis == AXIS_FREQ) {
+		for (ssize_t it0 = 0; it0 < nt_chunk; it0 += g.block_size) {
+		    int nt = min(g.block_size, nt_chunk - it0);
+
+		    if (g.pending)
+			g.pending->apply_mask(weights, stride, 0, nfreq, it0, nt);
+		    for (int i = g.ispec_begin; i < g.ispec_end; i++)
+			apply_spec(specs[i], intensity + it0, weights + it0, nfreq, nt, stride);
+		    if (g.sd)
+			g.sd->compute_sd(intensity, weights, stride, it0, nt);
+		}
+	    }
+	    else {
+		if (g.pending)
+		    g.pending->apply_mask(weights, stride, 0, nfreq, 0, nt_chunk);
+		apply_spec(specs[g.ispec_begin], intensity, weights, nfreq, nt_chunk, stride);
+	    }
+
+	    if (g.sd)
+		g.sd->clip();
+	}
+
+	// The last group's std_dev_clipper (if any) has no next group to apply its mask.
+	if (groups.back().sd)
+	    groups.back().sd->apply_mask(weights, stride, 0, nfreq, 0, nt_chunk);
+    }
+
+    virtual void start_substream(int isubstream, double t0) override { }
+    virtual void end_substream() override { }
+};
+
+
+// externally visible
+shared_ptr<wi_transform> make_rfi_clipper_chain(int nt_chunk, const vector<rfi_clipper_spec> &specs)
+{
+    if (_unlikely(specs.size() == 0))
+	throw runtime_error("rf_pipelines: make_rfi_clipper_chain(): empty list of clipper specs");
+
+    stringstream ss;
+    ss << "rfi_clipper_chain_cpp(nt_chunk=" << nt_chunk;
+
+    // The make_*_clipper() factory functions are called here to check the parameters (throwing
+    // an exception if they are invalid), and to construct a name for the chain.
+    for (const auto &s: specs) {
+	shared_ptr<wi_transform> t;
+
+	if (s.type == rfi_clipper_spec::INTENSITY_CLIPPER)
+	    t = make_intensity_clipper(nt_chunk, s.axis, s.sigma, s.niter, s.iter_sigma, s.Df, s.Dt, s.two_pass, s.robust);
+	else if (s.type == rfi_clipper_spec::STD_DEV_CLIPPER)
+	    t = make_std_dev_clipper(nt_chunk, s.axis, s.sigma, s.Df, s.Dt, s.two_pass, s.robust, s.niter, s.iter_sigma);
+	else
+	    throw runtime_error("rf_pipelines: make_rfi_clipper_chain(): invalid clipper type");
+
+	ss << ", " << t->name;
+    }
+
+    ss << ")";
+    return make_shared<rfi_clipper_chain> (nt_chunk, specs, ss.str());
+}
+
+
+}  // namespace rf_pipelines
@@ -0,0 +1,252 @@
+// Robust (median/MAD) versions of the intensity_clipper and std_dev_clipper.
+//
+// In robust mode, the center and scale of the data are estimated by the weighted median and
+// the weighted median absolute deviation (MAD), instead of the weighted mean and rms.  These
+// estimates are insensitive to strong outliers, so there is no need for iterated clipping.
+// The MAD is multiplied by 1.4826, so that 'sigma' has the same meaning as in the non-robust
+// clippers for Gaussian data.
+//
+// The weighted medians are computed by a weighted quickselect, which takes O(n) time.
+
+#include "rf_pipelines_internals.hpp"
+
+using namespace std;
+
+namespace rf_pipelines {
+#if 0
+}; // pacify emacs c-mode
+#endif
+
+
+// Scale factor which converts the MAD to a standard deviation, for Gaussian data.
+static constexpr double mad_to_sigma = 1.4826;
+
+
+// Returns the weighted median of v[0:n], where each element of v is a (value, weight) pair
+// with positive weight.  The array v is reordered.  Caller must check that n > 0.
+//
+// If the cumulative weight equals half the total weight exactly (e.g. an even number of equal
+// weights), then the lower median is returned, so that the result doesn't depend on the pivots.
+static float weighted_median(pair<float,float> *v, int n)
+{
+    double wtot = 0.0;
+    for (int i = 0; i < n; i++)
+	wtot += v[i].second;
+
+    double target = 0.5 * wtot;
+    double wacc = 0.0;   // total weight of elements v[0:lo], which are all <= v[lo:hi]
+    int lo = 0;
+    int hi = n;
+
+    while (hi - lo > 1) {
+	int mid = lo + (hi-lo)/2;
+	nth_element(v+lo, v+mid, v+hi);
+
+	double wl = 0.0;
+	for (int i = lo; i < mid; i++)
+	    wl += v[i].second;
+
+	if (wacc + wl >= target)
+	    hi = mid;
+	else if (wacc + wl + v[mid].second >= target)
+	    return v[mid].first;
+	else {
+	    wacc += wl + v[mid].second;
+	    lo = mid + 1;
+	}
+    }
+
+    return v[lo].first;
+}
+
+
+// Computes the weighted median and scale (1.4826 * MAD) of v[0:n].  The array v is reordered.
+// Returns false if n == 0.
+static bool weighted_median_and_scale(pair<float,float> *v, int n, float &median, float &scale)
+{
+    if (n == 0)
+	return false;
+
+    median = weighted_median(v, n);
+
+    for (int i = 0; i < n; i++)
+	v[i].first = fabs(v[i].first - median);
+
+    scale = mad_to_sigma * weighted_median(v, n);
+    return true;
+}
+
+
+// Downsampled arrays (or the original arrays, if Df=Dt=1), with helper functions for
+// applying a mask computed at low resolution to the original weights array.
+struct robust_ds_arrays {
+    int Df = 1;
+    int Dt = 1;
+    int nfreq_ds = 0;
+    int nt_ds = 0;
+    int stride_ds = 0;
+
+    const float *intensity = nullptr;
+    float *weights = nullptr;
+
+    // If Df > 1 or Dt > 1, the downsampled arrays are stored in the workspace (buffers WS_STAGE_*).
+    robust_ds_arrays(const float *intensity_, float *weights_, int nfreq, int nt, int stride, int Df_, int Dt_, clipper_workspace &ws) :
+	Df(Df_), Dt(Dt_), nfreq_ds(nfreq/Df_), nt_ds(nt/Dt_)
+    {
+	if ((Df == 1) && (Dt == 1)) {
+	    this->intensity = intensity_;
+	    this->weights = weights_;
+	    this->stride_ds = stride;
+	    return;
+	}
+
+	float *ibuf = ws.get<float> (WS_STAGE_INTENSITY, nfreq_ds * nt_ds);
+	float *wbuf = ws.get<float> (WS_STAGE_WEIGHTS, nfreq_ds * nt_ds);
+	this->stride_ds = nt_ds;
+
+	wi_downsample(ibuf, wbuf, nt_ds, intensity_, weights_, nfreq, nt, stride, Df, Dt, ws);
+
+	this->intensity = ibuf;
+	this->weights = wbuf;
+    }
+
+    // Masks the (Df,Dt) block of the original weights array corresponding to downsampled element (ifreq_ds, it_ds).
+    // (In the case Df=Dt=1, the original weights array has already been modified, so this is a no-op.)
+    inline void mask(float *weights_hires, int stride, int ifreq_ds, int it_ds)
+    {
+	weights[ifreq_ds*stride_ds + it_ds] = 0.0f;
+
+	if (weights == weights_hires)
+	    return;
+
+	for (int ifreq = ifreq_ds*Df; ifreq < (ifreq_ds+1)*Df; ifreq++)
+	    memset(weights_hires + ifreq*stride + it_ds*Dt, 0, Dt * sizeof(float));
+    }
+};
+
+
+// externally visible (declared in rf_pipelines_internals.hpp)
+void robust_intensity_clip(const float *intensity, float *weights, int nfreq, int nt, int stride, axis_type axis, double sigma, int Df, int Dt, clipper_workspace &ws)
+{
+    robust_ds_arrays ds(intensity, weights, nfreq, nt, stride, Df, Dt, ws);
+
+    const int nf = ds.nfreq_ds;
+    const int nt_ds = ds.nt_ds;
+    const int s = ds.stride_ds;
+
+    // The outer loop is over independent "groups" (rows, columns, or the whole array),
+    // and each group is specified by a starting offset 'i0' and strides along its two axes.
+    int ngroups = 1;
+    int group_stride = 0;
+    int n0 = nf;
+    int n1 = nt_ds;
+    int stride0 = s;
+    int stride1 = 1;
+
+    if (axis == AXIS_FREQ) {
+	ngroups = nt_ds;
+	group_stride = 1;
+	n1 = 1;
+    }
+    else if (axis == AXIS_TIME) {
+	ngroups = nf;
+	group_stride = s;
+	n0 = 1;
+    }
+
+    pair<float,float> *v = ws.get<pair<float,float>> (WS_SD, n0 * n1);
+
+    for (int g = 0; g < ngroups; g++) {
+	int i0 = g * group_stride;
+	int n = 0;
+
+	for (int i = 0; i < n0; i++) {
+	    for (int j = 0; j < n1; j++) {
+		int k = i0 + i*stride0 + j*stride1;
+		if (ds.weights[k] > 0.0f)
+		    v[n++] = make_pair(ds.intensity[k], ds.weights[k]);
+	    }
+	}
+
+	float median, scale;
+	if (!weighted_median_and_scale(v, n, median, scale))
+	    continue;
+
+	float thresh = sigma * scale;
+
+	for (int i = 0; i < n0; i++) {
+	    for (int j = 0; j < n1; j++) {
+		int k = i0 + i*stride0 + j*stride1;
+		if ((ds.weights[k] > 0.0f) && (fabs(ds.intensity[k] - median) >= thresh))
+		    ds.mask(weights, stride, k / s, k % s);
+	    }
+	}
+    }
+}
+
+
+// externally visible (declared in rf_pipelines_internals.hpp)
+void robust_std_dev_clip(const float *intensity, float *weights, int nfreq, int nt, int stride, axis_type axis, double sigma, int Df, int Dt, clipper_workspace &ws)
+{
+    robust_ds_arrays ds(intensity, weights, nfreq, nt, stride, Df, Dt, ws);
+
+    const int nf = ds.nfreq_ds;
+    const int nt_ds = ds.nt_ds;
+    const int s = ds.stride_ds;
+
+    // Each row (axis=AXIS_TIME) or column (axis=AXIS_FREQ) is reduced to its weighted variance.
+    int ngroups = (axis == AXIS_TIME) ? nf : nt_ds;
+    int n = (axis == AXIS_TIME) ? nt_ds : nf;
+    int group_stride = (axis == AXIS_TIME) ? s : 1;
+    int elt_stride = (axis == AXIS_TIME) ? 1 : s;
+
+    float *var = ws.get<float> (WS_SD_VALID, ngroups);
+    pair<float,float> *v = ws.get<pair<float,float>> (WS_SD, ngroups);
+    int nvalid = 0;
+
+    memset(var, 0, ngroups * sizeof(float));
+
+    for (int g = 0; g < ngroups; g++) {
+	const float *ip = ds.intensity + g * group_stride;
+	const float *wp = ds.weights + g * group_stride;
+
+	double acc0 = 0.0;
+	double acc1 = 0.0;
+	double acc2 = 0.0;
+
+	for (int i = 0; i < n; i++) {
+	    double w = wp[i*elt_stride];
+	    double x = ip[i*elt_stride];
+	    acc0 += w;
+	    acc1 += w * x;
+	    acc2 += w * x * x;
+	}
+
+	if (acc0 <= 0.0)
+	    continue;
+
+	double mean = acc1 / acc0;
+	var[g] = max(acc2/acc0 - mean*mean, 0.0);
+
+	if (var[g] > 0.0f)
+	    v[nvalid++] = make_pair(var[g], 1.0f);
+    }
+
+    float median = 0.0f;
+    float scale = 0.0f;
+    bool valid = weighted_median_and_scale(v, nvalid, median, scale);
+    float thresh = sigma * scale;
+
+    for (int g = 0; g < ngroups; g++) {
+	if (valid && (var[g] > 0.0f) && (fabs(var[g] - median) < thresh))
+	    continue;
+
+	for (int i = 0; i < n; i++) {
+	    int k = g * group_stride + i * elt_stride;
+	    ds.mask(weights, stride, k / s, k % s);
+	}
+    }
+}
+
+
+}  // namespace rf_pipelines
@@ -4,7 +4,16 @@
 // soon.  In the meantime if you want to python-wrap a C++ class, just email me
 // and I'll help navigate the mess!
 
+#include <mutex>
+#include <tuple>
+#include <unistd.h>
 #include "rf_pipelines_internals.hpp"
+#include "kernels/mask.hpp"
+#include "kernels/std_dev_clippers.hpp"
+
+#ifdef HAVE_PNG
+#include <png.h>
+#endif
 
 using namespace std;
 using namespace rf_pipelines;
@@ -251,12 +260,1898 @@ static void run_pipeline_unit_tests()
 
 
 // -------------------------------------------------------------------------------------------------
+//
+// The rfi_clipper_chain should give bitwise identical output to the unchained clippers.
 
 
-int main(int argc, char **argv)
+// A stream which only exists to give 'nfreq' to wi_transform::set_stream().
+struct dummy_wi_stream : public wi_stream {
+    dummy_wi_stream(int nfreq_)
+    {
+	this->nfreq = nfreq_;
+	this->nt_maxwrite = 1;
+	this->freq_lo_MHz = 400.;
+	this->freq_hi_MHz = 800.;
+	this->dt_sample = 1.0e-3;
+    }
+
+    virtual void stream_body(wi_run_state &run_state) override
+    {
+	throw runtime_error("dummy_wi_stream::stream_body() called");
+    }
+};
+
+
+// Roughly gaussian intensities, with a few high-variance rows and columns (so that the std_dev
+// clippers have something to clip), and a few masked rows and samples.
+static void make_random_clipper_input(vector<float> &intensity, vector<float> &weights, int nfreq, int nt, int stride)
 {
-    wraparound_buf::run_unit_tests();
-    run_pipeline_unit_tests();
+    intensity.assign(nfreq * stride, 0.0);
+    weights.assign(nfreq * stride, 0.0);
+
+    vector<double> col_rms(nt, 1.0);
+    for (int it = 0; it < nt; it++)
+	if (randint(0,50) == 0)
+	    col_rms[it] = uniform_rand(2.0, 5.0);
+
+    for (int ifreq = 0; ifreq < nfreq; ifreq++) {
+	double row_rms = (randint(0,20) == 0) ? uniform_rand(2.0, 5.0) : 1.0;
+	bool row_masked = (randint(0,20) == 0);
+
+	for (int it = 0; it < nt; it++) {
+	    double x = uniform_rand() + uniform_rand() + uniform_rand() - 1.5;
+	    intensity[ifreq*stride + it] = 2.0 * x * row_rms * col_rms[it];
+	    weights[ifreq*stride + it] = (row_masked || (randint(0,100) == 0)) ? 0.0 : uniform_rand(0.5, 1.0);
+	}
+    }
+}
+
+
+static rfi_clipper_spec make_random_clipper_spec()
+{
+    rfi_clipper_spec s;
+    s.type = (randint(0,3) == 0) ? rfi_clipper_spec::STD_DEV_CLIPPER : rfi_clipper_spec::INTENSITY_CLIPPER;
+
+    int iaxis = randint(0, (s.type == rfi_clipper_spec::STD_DEV_CLIPPER) ? 2 : 3);
+    s.axis = (iaxis == 0) ? AXIS_FREQ : ((iaxis == 1) ? AXIS_TIME : AXIS_NONE);
+
+    s.sigma = uniform_rand(1.5, 3.0);
+    s.Df = 1 << randint(0,6);   // Df=32 needs a staged_downsampler
+    s.Dt = 1 << randint(0,6);   // Dt=32 needs a staged_downsampler
+    s.robust = (randint(0,10) == 0);
+    s.two_pass = !s.robust && (randint(0,2) == 0);   // two_pass isn't supported in robust mode
+    s.niter = s.robust ? 1 : randint(1,4);
+    s.iter_sigma = (randint(0,2) == 0) ? 0.0 : uniform_rand(1.5, 3.0);
+
+    return s;
+}
+
+
+static void test_rfi_clipper_chain()
+{
+    cerr << "test_rfi_clipper_chain()";
+
+    for (int iouter = 0; iouter < 100; iouter++) {
+	if (iouter % 10 == 0)
+	    cerr << ".";
+
+	int nfreq = 32 * randint(1,9);
+	int nt_chunk = 256 * randint(1,9);
+	int stride = nt_chunk + randint(0,17);
+
+	vector<rfi_clipper_spec> specs(randint(1,7));
+	for (auto &s: specs)
+	    s = make_random_clipper_spec();
+
+	dummy_wi_stream stream(nfreq);
+
+	shared_ptr<wi_transform> chain = make_rfi_clipper_chain(nt_chunk, specs);
+	chain->set_stream(stream);
+
+	vector<shared_ptr<wi_transform>> unchained;
+	for (const auto &s: specs) {
+	    if (s.type == rfi_clipper_spec::INTENSITY_CLIPPER)
+		unchained.push_back(make_intensity_clipper(nt_chunk, s.axis, s.sigma, s.niter, s.iter_sigma, s.Df, s.Dt, s.two_pass, s.robust));
+	    else
+		unchained.push_back(make_std_dev_clipper(nt_chunk, s.axis, s.sigma, s.Df, s.Dt, s.two_pass, s.robust, s.niter, s.iter_sigma));
+	    unchained.back()->set_stream(stream);
+	}
+
+	vector<float> intensity, weights;
+	make_random_clipper_input(intensity, weights, nfreq, nt_chunk, stride);
+	vector<float> weights2 = weights;
+
+	// The chain is run with a chunk_mask_info, to test the skipping of fully masked rows.
+	chunk_mask_info mask_info;
+	mask_info.set_chunk(nfreq, 0, nt_chunk, &weights[0], stride);
+	chain->mask_info = &mask_info;
+	chain->process_chunk(0.0, 1.0, &intensity[0], &weights[0], stride, nullptr, nullptr, 0);
+	chain->mask_info = nullptr;
+
+	for (const auto &t: unchained)
+	    t->process_chunk(0.0, 1.0, &intensity[0], &weights2[0], stride, nullptr, nullptr, 0);
+
+	for (int ifreq = 0; ifreq < nfreq; ifreq++) {
+	    if (memcmp(&weights[ifreq*stride], &weights2[ifreq*stride], nt_chunk * sizeof(float)))
+		throw runtime_error("test_rfi_clipper_chain() failed: " + chain->name);
+	}
+    }
+
+    cerr << "done\n";
+}
+
+
+// -------------------------------------------------------------------------------------------------
+//
+// apply_intensity_clipper() and apply_std_dev_clipper() should give bitwise identical output with
+// the thread-local default workspace, a new workspace, a workspace which is reused (with stale
+// contents) from previous calls, and a preallocated workspace.  A preallocated workspace should
+// not grow.
+
+
+static void apply_clipper(const rfi_clipper_spec &s, const float *intensity, float *weights, int nfreq, int nt, int stride, clipper_workspace *ws)
+{
+    if (s.type == rfi_clipper_spec::INTENSITY_CLIPPER)
+	apply_intensity_clipper(intensity, weights, nfreq, nt, stride, s.axis, s.sigma, s.niter, s.iter_sigma, s.Df, s.Dt, s.two_pass, s.robust, ws);
+    else
+	apply_std_dev_clipper(intensity, weights, nfreq, nt, stride, s.axis, s.sigma, s.Df, s.Dt, s.two_pass, s.robust, s.niter, s.iter_sigma, ws);
+}
+
+
+static void test_clipper_workspace()
+{
+    cerr << "test_clipper_workspace()";
+
+    clipper_workspace reused_ws;
+
+    for (int iouter = 0; iouter < 100; iouter++) {
+	if (iouter % 10 == 0)
+	    cerr << ".";
+
+	int nfreq = 32 * randint(1,9);
+	int nt = 256 * randint(1,9);
+	int stride = nt + randint(0,17);
+	rfi_clipper_spec s = make_random_clipper_spec();
+
+	vector<float> intensity, weights;
+	make_random_clipper_input(intensity, weights, nfreq, nt, stride);
+
+	vector<float> weights0 = weights;
+	apply_clipper(s, &intensity[0], &weights0[0], nfreq, nt, stride, nullptr);
+
+	clipper_workspace new_ws;
+	clipper_workspace reserved_ws(nfreq, nt, s.Df, s.Dt);
+	ssize_t nbytes = reserved_ws.get_nbytes_allocated();
+
+	clipper_workspace *ws_list[3] = { &new_ws, &reused_ws, &reserved_ws };
+
+	for (clipper_workspace *ws: ws_list) {
+	    vector<float> weights1 = weights;
+	    apply_clipper(s, &intensity[0], &weights1[0], nfreq, nt, stride, ws);
+
+	    if (memcmp(&weights0[0], &weights1[0], nfreq * stride * sizeof(float)))
+		throw runtime_error("test_clipper_workspace() failed: output depends on workspace");
+	}
+
+	if (reserved_ws.get_nbytes_allocated() != nbytes)
+	    throw runtime_error("test_clipper_workspace() failed: preallocated workspace was too small");
+    }
+
+    cerr << "done\n";
+}
+
+
+// -------------------------------------------------------------------------------------------------
+//
+// The robust (median/MAD) clippers are checked against a naive reference, which computes each
+// weighted median by sorting.  The reference uses the lower weighted median (the smallest value
+// whose cumulative weight is >= half the total weight), and repeats the float arithmetic of
+// robust_clippers.cpp, so that the masks agree exactly.
+
+
+static float reference_weighted_median(vector<pair<float,float>> v)
+{
+    sort(v.begin(), v.end());
+
+    double wtot = 0.0;
+    for (const auto &p: v)
+	wtot += p.second;
+
+    double wacc = 0.0;
+    for (const auto &p: v) {
+	wacc += p.second;
+	if (wacc >= 0.5 * wtot)
+	    return p.first;
+    }
+
+    return v.back().first;
+}
+
+
+// Returns the masking threshold, and sets 'median'.  Returns -1 if v is empty.
+static float reference_robust_thresh(const vector<pair<float,float>> &v, double sigma, float &median)
+{
+    if (v.size() == 0)
+	return -1.0f;
+
+    median = reference_weighted_median(v);
+
+    vector<pair<float,float>> dev(v.size());
+    for (unsigned int i = 0; i < v.size(); i++)
+	dev[i] = make_pair(float(fabs(v[i].first - median)), v[i].second);
+
+    float scale = 1.4826 * reference_weighted_median(dev);
+    return float(sigma * scale);
+}
+
+
+static void reference_robust_clipper(bool std_dev, const float *intensity, float *weights, int nfreq, int nt, int stride, axis_type axis, double sigma, int Df, int Dt)
+{
+    int nf = nfreq / Df;
+    int nt_ds = nt / Dt;
+
+    vector<float> ds_intensity(nf * nt_ds);
+    vector<float> ds_weights(nf * nt_ds);
+    vector<bool> ds_mask(nf * nt_ds, false);
+
+    if ((Df > 1) || (Dt > 1))
+	wi_downsample(&ds_intensity[0], &ds_weights[0], nt_ds, intensity, weights, nfreq, nt, stride, Df, Dt);
+    else {
+	for (int ifreq = 0; ifreq < nf; ifreq++) {
+	    memcpy(&ds_intensity[ifreq*nt_ds], intensity + ifreq*stride, nt_ds * sizeof(float));
+	    memcpy(&ds_weights[ifreq*nt_ds], weights + ifreq*stride, nt_ds * sizeof(float));
+	}
+    }
+
+    // Each "group" is a list of downsampled array indices.
+    vector<vector<int>> groups;
+
+    if (axis == AXIS_TIME) {
+	for (int ifreq = 0; ifreq < nf; ifreq++) {
+	    groups.push_back(vector<int> ());
+	    for (int it = 0; it < nt_ds; it++)
+		groups.back().push_back(ifreq*nt_ds + it);
+	}
+    }
+    else if (axis == AXIS_FREQ) {
+	for (int it = 0; it < nt_ds; it++) {
+	    groups.push_back(vector<int> ());
+	    for (int ifreq = 0; ifreq < nf; ifreq++)
+		groups.back().push_back(ifreq*nt_ds + it);
+	}
+    }
+    else {
+	groups.push_back(vector<int> ());
+	for (int i = 0; i < nf * nt_ds; i++)
+	    groups.back().push_back(i);
+    }
+
+    if (std_dev) {
+	vector<float> var(groups.size(), 0.0f);
+	vector<pair<float,float>> v;
+
+	for (unsigned int g = 0; g < groups.size(); g++) {
+	    double acc0 = 0.0;
+	    double acc1 = 0.0;
+	    double acc2 = 0.0;
+
+	    for (int k: groups[g]) {
+		double w = ds_weights[k];
+		double x = ds_intensity[k];
+		acc0 += w;
+		acc1 += w * x;
+		acc2 += w * x * x;
+	    }
+
+	    if (acc0 > 0.0) {
+		double mean = acc1 / acc0;
+		var[g] = max(acc2/acc0 - mean*mean, 0.0);
+	    }
+
+	    if (var[g] > 0.0f)
+		v.push_back(make_pair(var[g], 1.0f));
+	}
+
+	float median = 0.0f;
+	float thresh = reference_robust_thresh(v, sigma, median);
+
+	for (unsigned int g = 0; g < groups.size(); g++)
+	    if ((var[g] <= 0.0f) || !(fabs(var[g] - median) < thresh))
+		for (int k: groups[g])
+		    ds_mask[k] = true;
+    }
+    else {
+	for (const auto &group: groups) {
+	    vector<pair<float,float>> v;
+	    for (int k: group)
+		if (ds_weights[k] > 0.0f)
+		    v.push_back(make_pair(ds_intensity[k], ds_weights[k]));
+
+	    float median = 0.0f;
+	    float thresh = reference_robust_thresh(v, sigma, median);
+
+	    for (int k: group)
+		if ((ds_weights[k] > 0.0f) && (fabs(ds_intensity[k] - median) >= thresh))
+		    ds_mask[k] = true;
+	}
+    }
+
+    for (int ifreq = 0; ifreq < nfreq; ifreq++)
+	for (int it = 0; it < nt; it++)
+	    if (ds_mask[(ifreq/Df)*nt_ds + (it/Dt)])
+		weights[ifreq*stride + it] = 0.0f;
+}
+
+
+static void test_robust_clippers()
+{
+    cerr << "test_robust_clippers()";
+
+    for (int iouter = 0; iouter < 200; iouter++) {
+	if (iouter % 20 == 0)
+	    cerr << ".";
+
+	int nfreq = 32 * randint(1,9);
+	int nt = 256 * randint(1,5);
+	int stride = nt + randint(0,17);
+	int Df = 1 << randint(0,5);
+	int Dt = 1 << randint(0,5);
+	bool std_dev = (randint(0,2) == 0);
+	int iaxis = randint(0, std_dev ? 2 : 3);
+	axis_type axis = (iaxis == 0) ? AXIS_FREQ : ((iaxis == 1) ? AXIS_TIME : AXIS_NONE);
+	double sigma = uniform_rand(1.5, 3.0);
+
+	vector<float> intensity, weights;
+	make_random_clipper_input(intensity, weights, nfreq, nt, stride);
+
+	// Equal weights give ties in the cumulative weight, where the choice of median matters.
+	if (randint(0,2) == 0)
+	    for (float &w: weights)
+		w = (w > 0.0f) ? 1.0f : 0.0f;
+
+	vector<float> weights0 = weights;
+	vector<float> weights1 = weights;
+
+	if (std_dev)
+	    apply_std_dev_clipper(&intensity[0], &weights0[0], nfreq, nt, stride, axis, sigma, Df, Dt, false, true);
+	else
+	    apply_intensity_clipper(&intensity[0], &weights0[0], nfreq, nt, stride, axis, sigma, 1, 0.0, Df, Dt, false, true);
+
+	reference_robust_clipper(std_dev, &intensity[0], &weights1[0], nfreq, nt, stride, axis, sigma, Df, Dt);
+
+	if (memcmp(&weights0[0], &weights1[0], nfreq * stride * sizeof(float))) {
+	    stringstream ss;
+	    ss << "test_robust_clippers() failed: " << (std_dev ? "std_dev" : "intensity") << " clipper (nfreq=" << nfreq << ", nt=" << nt
+	       << ", axis=" << axis << ", Df=" << Df << ", Dt=" << Dt << ") disagrees with reference";
+	    throw runtime_error(ss.str());
+	}
+    }
+
+    cerr << "done\n";
+}
+
+
+// -------------------------------------------------------------------------------------------------
+//
+// Transforms which skip fully masked rows or chunks (see 'struct chunk_mask_info') should give
+// bitwise identical output with and without a chunk_mask_info.  The same holds for the
+// staged_downsampler, which zeroes fully masked blocks of rows instead of downsampling them.
+
+
+// Masks additional rows of a chunk: either nothing, random blocks of rows, or the whole chunk.
+// The intensities of masked rows are left nonzero, to check that the transforms don't modify them.
+static void mask_random_rows(vector<float> &weights, int nfreq, int nt, int stride, int mode)
+{
+    for (int ifreq0 = 0; ifreq0 < nfreq; ) {
+	int ifreq1 = min(ifreq0 + int(randint(1,65)), nfreq);
+	bool masked = (mode == 2) || ((mode == 1) && (randint(0,3) == 0));
+
+	for (int ifreq = ifreq0; masked && (ifreq < ifreq1); ifreq++)
+	    memset(&weights[ifreq*stride], 0, nt * sizeof(float));
+
+	ifreq0 = ifreq1;
+    }
+}
+
+
+static void test_chunk_mask_info()
+{
+    cerr << "test_chunk_mask_info()";
+
+    for (int iouter = 0; iouter < 100; iouter++) {
+	if (iouter % 10 == 0)
+	    cerr << ".";
+
+	int nfreq = 64 * randint(1,5);
+	int nt_chunk = 256 * randint(1,9);
+	int stride = nt_chunk + randint(0,17);
+	int mode = randint(0,3);
+
+	vector<float> intensity, weights;
+	make_random_clipper_input(intensity, weights, nfreq, nt_chunk, stride);
+	mask_random_rows(weights, nfreq, nt_chunk, stride, mode);
+
+	axis_type axis = (randint(0,2) == 0) ? AXIS_FREQ : AXIS_TIME;
+	int nx_knot = (axis == AXIS_TIME) ? (32 << randint(0,2)) : (8 << randint(0,3));
+	rfi_clipper_spec s = make_random_clipper_spec();
+
+	vector<rfi_clipper_spec> specs(randint(1,4));
+	for (auto &cs: specs)
+	    cs = make_random_clipper_spec();
+
+	vector<shared_ptr<wi_transform>> transforms = {
+	    make_polynomial_detrender(nt_chunk, axis, randint(0,5)),
+	    make_spline_detrender(nt_chunk, axis, nx_knot),
+	    make_rfi_clipper_chain(nt_chunk, specs),
+	    (s.type == rfi_clipper_spec::INTENSITY_CLIPPER)
+	        ? make_intensity_clipper(nt_chunk, s.axis, s.sigma, s.niter, s.iter_sigma, s.Df, s.Dt, s.two_pass, s.robust)
+	        : make_std_dev_clipper(nt_chunk, s.axis, s.sigma, s.Df, s.Dt, s.two_pass, s.robust, s.niter, s.iter_sigma)
+	};
+
+	dummy_wi_stream stream(nfreq);
+
+	for (const auto &t: transforms) {
+	    t->set_stream(stream);
+
+	    vector<float> intensity0 = intensity, weights0 = weights;
+	    vector<float> intensity1 = intensity, weights1 = weights;
+
+	    // If the whole chunk is masked, then sometimes we mark it as zero-weight padding, so that it isn't scanned.
+	    chunk_mask_info mask_info;
+	    if ((mode == 2) && (randint(0,2) == 0))
+		mask_info.it_padding = 0;
+
+	    mask_info.set_chunk(nfreq, 0, nt_chunk, &weights1[0], stride);
+	    t->mask_info = &mask_info;
+	    t->process_chunk(0.0, 1.0, &intensity1[0], &weights1[0], stride, nullptr, nullptr, 0);
+	    t->mask_info = nullptr;
+
+	    t->process_chunk(0.0, 1.0, &intensity0[0], &weights0[0], stride, nullptr, nullptr, 0);
+
+	    for (int ifreq = 0; ifreq < nfreq; ifreq++) {
+		if (memcmp(&intensity0[ifreq*stride], &intensity1[ifreq*stride], nt_chunk * sizeof(float)) ||
+		    memcmp(&weights0[ifreq*stride], &weights1[ifreq*stride], nt_chunk * sizeof(float)))
+		    throw runtime_error("test_chunk_mask_info() failed: " + t->name);
+	    }
+	}
+
+	// staged_downsampler (only active if Df or Dt is larger than the kernels support).  Note that
+	// Df <= 64 and Dt <= 64 always divide nfreq and nt_chunk.
+	int Df, Dt;
+	do {
+	    Df = 1 << randint(0,7);
+	    Dt = 1 << randint(0,7);
+	} while ((staged_downsampler::kernel_Df(Df) == Df) && (staged_downsampler::kernel_Dt(Dt) == Dt));
+
+	staged_downsampler stage0, stage1;
+	stage0.init(nfreq, nt_chunk, Df, Dt);
+	stage1.init(nfreq, nt_chunk, Df, Dt);
+
+	chunk_mask_info mask_info;
+	mask_info.set_chunk(nfreq, 0, nt_chunk, &weights[0], stride);
+	mask_info.update();
+
+	stage0.downsample(&intensity[0], &weights[0], stride);
+	stage1.downsample(&intensity[0], &weights[0], stride, nullptr, &mask_info);
+
+	int nds = stage0.nfreq_ds * stage0.nt_ds;
+
+	if (memcmp(stage0.intensity_ds, stage1.intensity_ds, nds * sizeof(float)) ||
+	    memcmp(stage0.weights_ds, stage1.weights_ds, nds * sizeof(float)))
+	    throw runtime_error("test_chunk_mask_info() failed: staged_downsampler");
+    }
+
+    cerr << "done\n";
+}
+
+
+// -------------------------------------------------------------------------------------------------
+//
+// parallel_for(), and the apply_*_parallel() functions.  The separable cases (detrenders, and the
+// intensity_clipper along AXIS_FREQ or AXIS_TIME) should give bitwise identical output to the
+// serial versions.  The intensity_clipper with AXIS_NONE and the std_dev_clipper do their reductions
+// in parallel, so a few samples near the clipping threshold may differ.
+
+
+static void test_parallel_for()
+{
+    for (int iouter = 0; iouter < 100; iouter++) {
+	int granularity = randint(1,5);
+	int n = granularity * randint(1,40);
+	int nthreads = randint(-1,10);
+	int nblocks = parallel_nthreads(nthreads, n, granularity);
+
+	vector<int> count(n, 0);
+	vector<int> thread_count(nblocks, 0);
+	std::mutex lock;
+
+	parallel_for(nthreads, n, granularity, [&](int ithread, int i, int j) {
+	    std::lock_guard<std::mutex> lg(lock);
+	    rf_assert((ithread >= 0) && (ithread < nblocks));
+	    rf_assert((i % granularity == 0) && (j % granularity == 0));
+	    thread_count[ithread]++;
+	    for (int k = i; k < j; k++)
+		count[k]++;
+	});
+
+	for (int k = 0; k < n; k++)
+	    rf_assert(count[k] == 1);
+	for (int ithread = 0; ithread < nblocks; ithread++)
+	    rf_assert(thread_count[ithread] == 1);
+
+	// An exception thrown by any thread should be rethrown by parallel_for().
+	int ithrow = randint(0, nblocks);
+	bool caught = false;
+
+	try {
+	    parallel_for(nthreads, n, granularity, [&](int ithread, int i, int j) {
+		if (ithread == ithrow)
+		    throw runtime_error("test_parallel_for: expected exception");
+	    });
+	} catch (runtime_error &) {
+	    caught = true;
+	}
+
+	rf_assert(caught);
+    }
+}
+
+
+static int count_differences(const vector<float> &v, const vector<float> &w)
+{
+    rf_assert(v.size() == w.size());
+
+    int ret = 0;
+    for (size_t i = 0; i < v.size(); i++)
+	if (v[i] != w[i])
+	    ret++;
+    return ret;
+}
+
+
+static void test_parallel_apply()
+{
+    cerr << "test_parallel_apply()";
+
+    test_parallel_for();
+
+    for (int iouter = 0; iouter < 100; iouter++) {
+	if (iouter % 10 == 0)
+	    cerr << ".";
+
+	int nthreads = randint(2,9);
+	int nfreq = 32 * randint(1,9);
+	int nt = 256 * randint(1,9);
+	int stride = nt + randint(0,17);
+
+	vector<float> intensity, weights;
+	make_random_clipper_input(intensity, weights, nfreq, nt, stride);
+
+	// Detrenders.
+	axis_type axis = (randint(0,2) == 0) ? AXIS_FREQ : AXIS_TIME;
+	int polydeg = randint(0,6);
+	detrender_precision precision = detrender_precision(randint(0,3));
+
+	vector<float> intensity0 = intensity, weights0 = weights;
+	vector<float> intensity1 = intensity, weights1 = weights;
+
+	apply_polynomial_detrender(&intensity0[0], &weights0[0], nfreq, nt, stride, axis, polydeg, 1.0e-2, precision);
+	apply_polynomial_detrender_parallel(nthreads, &intensity1[0], &weights1[0], nfreq, nt, stride, axis, polydeg, 1.0e-2, precision);
+
+	if ((intensity0 != intensity1) || (weights0 != weights1))
+	    throw runtime_error("test_parallel_apply(): apply_polynomial_detrender_parallel() failed");
+
+	// Clippers.
+	rfi_clipper_spec s = make_random_clipper_spec();
+
+	weights0 = weights1 = weights;
+
+	if (s.type == rfi_clipper_spec::INTENSITY_CLIPPER) {
+	    apply_intensity_clipper(&intensity[0], &weights0[0], nfreq, nt, stride, s.axis, s.sigma, s.niter, s.iter_sigma, s.Df, s.Dt, s.two_pass, s.robust);
+	    apply_intensity_clipper_parallel(nthreads, &intensity[0], &weights1[0], nfreq, nt, stride, s.axis, s.sigma, s.niter, s.iter_sigma, s.Df, s.Dt, s.two_pass, s.robust);
+	}
+	else {
+	    apply_std_dev_clipper(&intensity[0], &weights0[0], nfreq, nt, stride, s.axis, s.sigma, s.Df, s.Dt, s.two_pass, s.robust, s.niter, s.iter_sigma);
+	    apply_std_dev_clipper_parallel(nthreads, &intensity[0], &weights1[0], nfreq, nt, stride, s.axis, s.sigma, s.Df, s.Dt, s.two_pass, s.robust, s.niter, s.iter_sigma);
+	}
+
+	bool exact = s.robust || ((s.type == rfi_clipper_spec::INTENSITY_CLIPPER) && (s.axis != AXIS_NONE));
+	int ndiff = count_differences(weights0, weights1);
+
+	if (ndiff > (exact ? 0 : (nfreq*nt/1000 + s.Df*s.Dt)))
+	    throw runtime_error("test_parallel_apply(): apply_*_clipper_parallel() failed: ndiff=" + to_string(ndiff));
+    }
+
+    cerr << "done\n";
+}
+
+
+// -------------------------------------------------------------------------------------------------
+//
+// clip_1d(): the last step of the std_dev_clipper (see std_dev_clippers.cpp), compared with a
+// naive double-precision reference.  The reference always runs all 'niter' iterations, which also
+// checks that clip_1d() only stops early when it has converged.
+//
+// Entries which are within roundoff of a clipping threshold can legitimately be masked differently.
+// If this happens in an intermediate iteration, it changes the mean/rms, so we skip the comparison.
+
+
+// Returns false if some entry is within roundoff of an intermediate clipping threshold.
+static bool reference_clip_1d(int n, const float *sd, vector<int> &valid, double sigma, int niter, double iter_sigma, double &mean, double &rms)
+{
+    vector<int> in_valid = valid;
+    mean = rms = 0.0;
+
+    for (int iter = 0; iter < niter; iter++) {
+	double thresh = (iter > 0) ? (iter_sigma * rms) : 1.0e10;
+	double acc0 = 0.0, acc1 = 0.0, acc2 = 0.0;
+
+	for (int i = 0; i < n; i++) {
+	    double x = fabs(sd[i] - mean);
+	    if (!in_valid[i])
+		continue;
+	    if (fabs(x - thresh) < 1.0e-5 * thresh)
+		return false;
+	    if (x < thresh) {
+		acc0 += 1.0;
+		acc1 += sd[i];
+		acc2 += square(sd[i]);
+	    }
+	}
+
+	if (acc0 < 1.5) {
+	    valid.assign(n, 0);
+	    return true;
+	}
+
+	mean = acc1 / acc0;
+	rms = sqrt(max(acc2/acc0 - square(mean), 0.0));
+    }
+
+    for (int i = 0; i < n; i++)
+	if (fabs(sd[i] - mean) >= sigma * rms)
+	    valid[i] = 0;
+
+    return true;
+}
+
+
+static void test_clip_1d()
+{
+    cerr << "test_clip_1d()";
+
+    int nskipped = 0;
+
+    for (int iouter = 0; iouter < 1000; iouter++) {
+	if (iouter % 100 == 0)
+	    cerr << ".";
+
+	int n = randint(1, 2000);
+	int niter = randint(1, 7);
+	double sigma = uniform_rand(1.5, 3.0);
+	double iter_sigma = uniform_rand(1.5, 3.0);
+	double pvalid = (randint(0,10) == 0) ? uniform_rand(0.0, 0.01) : uniform_rand(0.5, 1.0);
+
+	vector<float> sd(n);
+	vector<int> valid(n);
+
+	for (int i = 0; i < n; i++) {
+	    sd[i] = uniform_rand(1.0, 2.0);
+	    if (randint(0,10) == 0)
+		sd[i] *= uniform_rand(1.0, 10.0);
+	    valid[i] = (uniform_rand() < pvalid) ? -1 : 0;
+	}
+
+	vector<smask_t<float,1>> valid0(n);
+	for (int i = 0; i < n; i++)
+	    valid0[i] = valid[i];
+
+	double mean, rms;
+	vector<float> sd0 = sd;
+	clip_1d(n, &sd0[0], &valid0[0], sigma, niter, iter_sigma);
+
+	if (!reference_clip_1d(n, &sd[0], valid, sigma, niter, iter_sigma, mean, rms)) {
+	    nskipped++;
+	    continue;
+	}
+
+	for (int i = 0; i < n; i++) {
+	    if (bool(valid0[i]) == bool(valid[i]))
+		continue;
+	    if (fabs(fabs(sd[i] - mean) - sigma * rms) < 1.0e-5 * sigma * rms)
+		continue;
+	    throw runtime_error("test_clip_1d(): clip_1d() disagrees with reference");
+	}
+    }
+
+    if (nskipped > 100)
+	throw runtime_error("test_clip_1d(): too many iterations were skipped");
+
+    cerr << "done\n";
+}
+
+
+// -------------------------------------------------------------------------------------------------
+//
+// running_median_detrender: compared with a brute-force median, on a stream which is processed in
+// chunks of random size.  The result should be bitwise identical, independent of nt_chunk.
+
+
+// Median of the first n elements of v (which are sorted in place), using the same rounding as the detrender.
+static float brute_force_median(vector<float> &v, int n)
+{
+    sort(v.begin(), v.begin() + n);
+    return (n % 2) ? v[n/2] : (0.5f * (v[n/2] + v[n/2-1]));
+}
+
+
+static void test_running_median_detrender()
+{
+    cerr << "test_running_median_detrender()";
+
+    for (int iouter = 0; iouter < 100; iouter++) {
+	if (iouter % 10 == 0)
+	    cerr << ".";
+
+	int nfreq = randint(1, 5);
+	int Dt = (randint(0,2) == 0) ? 1 : randint(2, 81);   // Dt > 64 uses nth_element() for block medians
+	int nb_window = randint(1, 40);
+	int nt_window = nb_window * Dt;
+	int nt_chunk = randint(1, 20) * Dt;
+	int nchunks = randint(1, 10);
+	int nt = nchunks * nt_chunk;
+	int stride = nt + nt_window;   // the postpadding at the end of the stream has zero weight
+
+	// Intensities take a few discrete values, so that there are lots of ties.
+	vector<float> intensity(nfreq * stride, 0.0);
+	vector<float> weights(nfreq * stride, 0.0);
+	double pmask = uniform_rand(0.0, 0.8);
+
+	for (int ifreq = 0; ifreq < nfreq; ifreq++) {
+	    for (int it = 0; it < nt; it++) {
+		intensity[ifreq*stride + it] = 0.25 * randint(0,5) + 0.01 * (it % 7);
+		weights[ifreq*stride + it] = (uniform_rand() < pmask) ? 0.0 : uniform_rand(0.5, 1.0);
+	    }
+	}
+
+	// Brute-force reference.
+	int nb = nt / Dt;
+	int nb_lag = nb_window / 2;
+	vector<float> expected = intensity;
+	vector<float> bmed(nb);
+	vector<bool> bvalid(nb);
+	vector<float> tmp(max(nb_window, Dt));
+
+	for (int ifreq = 0; ifreq < nfreq; ifreq++) {
+	    const float *irow = &intensity[ifreq*stride];
+	    const float *wrow = &weights[ifreq*stride];
+
+	    for (int ib = 0; ib < nb; ib++) {
+		int n = 0;
+		for (int it = ib*Dt; it < (ib+1)*Dt; it++)
+		    if (wrow[it] > 0.0)
+			tmp[n++] = irow[it];
+
+		bvalid[ib] = (n > 0);
+		bmed[ib] = (n > 0) ? brute_force_median(tmp, n) : 0.0;
+	    }
+
+	    for (int ib = 0; ib < nb; ib++) {
+		int n = 0;
+		for (int jb = max(ib + nb_lag - nb_window + 1, 0); jb <= min(ib + nb_lag, nb-1); jb++)
+		    if (bvalid[jb])
+			tmp[n++] = bmed[jb];
+
+		if (n == 0)
+		    continue;
+
+		float med = brute_force_median(tmp, n);
+		for (int it = ib*Dt; it < (ib+1)*Dt; it++)
+		    if (wrow[it] > 0.0)
+			expected[ifreq*stride + it] -= med;
+	    }
+	}
+
+	dummy_wi_stream stream(nfreq);
+	shared_ptr<wi_transform> t = make_running_median_detrender(nt_chunk, AXIS_TIME, nt_window, Dt);
+	t->set_stream(stream);
+	t->start_substream(0, 0.0);
+
+	for (int it0 = 0; it0 < nt; it0 += nt_chunk)
+	    t->process_chunk(0.0, 1.0, &intensity[it0], &weights[it0], stride, nullptr, nullptr, 0);
+
+	for (int ifreq = 0; ifreq < nfreq; ifreq++) {
+	    if (memcmp(&intensity[ifreq*stride], &expected[ifreq*stride], nt * sizeof(float)))
+		throw runtime_error("test_running_median_detrender() failed: " + t->name);
+	}
+    }
+
+    cerr << "done\n";
+}
+
+
+// -------------------------------------------------------------------------------------------------
+//
+// variance_estimator: the v2 estimates in the variance_estimate handle are compared with a naive
+// double-precision reference, on a stream which is processed in chunks.
+
+
+// Weighted variance of a block, or zero if fewer than 25% of the samples are unmasked.
+static double reference_v1(const float *ivec, const float *wvec, int n)
+{
+    double count = 0.0, acc0 = 0.0, acc1 = 0.0, acc2 = 0.0;
+
+    for (int i = 0; i < n; i++) {
+	count += (wvec[i] > 0.0) ? 1.0 : 0.0;
+	acc0 += wvec[i];
+	acc1 += wvec[i] * ivec[i];
+    }
+
+    if (count < 0.25 * n)
+	return 0.0;
+
+    double mean = acc1 / acc0;
+    for (int i = 0; i < n; i++)
+	acc2 += wvec[i] * square(ivec[i] - mean);
+
+    return acc2 / acc0;
+}
+
+
+// Median of the nonzero v1 estimates, or zero if fewer than 25% are nonzero.
+static double reference_v2(vector<double> v1)
+{
+    int n = v1.size();
+    v1.erase(std::remove(v1.begin(), v1.end(), 0.0), v1.end());
+
+    int m = v1.size();
+    if ((m == 0) || (m < 0.25 * n))
+	return 0.0;
+
+    std::sort(v1.begin(), v1.end());
+    return (m % 2) ? v1[m/2] : (0.5 * (v1[m/2-1] + v1[m/2]));
+}
+
+
+static void test_variance_estimator()
+{
+    static constexpr int S = constants::single_precision_simd_length;
+
+    cerr << "test_variance_estimator()";
+
+    for (int iouter = 0; iouter < 100; iouter++) {
+	if (iouter % 10 == 0)
+	    cerr << ".";
+
+	int nfreq = randint(1,65);
+	int v1_chunk = S * randint(1,9);
+	int v2_chunk = randint(1,10);
+	int nt_chunk = v1_chunk * randint(1,10);
+	int nchunks = randint(1,10);
+	int nt = nt_chunk * nchunks;
+
+	// Each row has its own rms, and a random fraction of masked samples (so that some v1
+	// and v2 estimates are zero).
+	vector<float> intensity(nfreq * nt, 0.0);
+	vector<float> weights(nfreq * nt, 0.0);
+
+	for (int ifreq = 0; ifreq < nfreq; ifreq++) {
+	    double rms = uniform_rand(0.5, 2.0);
+	    double pmask = (randint(0,2) == 0) ? 0.0 : uniform_rand(0.0, 1.0);
+
+	    for (int it = 0; it < nt; it++) {
+		intensity[ifreq*nt + it] = rms * (uniform_rand() + uniform_rand() + uniform_rand() - 1.5) + 3.0;
+		weights[ifreq*nt + it] = (uniform_rand() < pmask) ? 0.0 : uniform_rand(0.5, 1.0);
+	    }
+	}
+
+	auto handle = make_shared<variance_estimate> ();
+	shared_ptr<wi_transform> t = make_variance_estimator(v1_chunk, v2_chunk, nt_chunk, "", handle);
+
+	dummy_wi_stream stream(nfreq);
+	t->set_stream(stream);
+	t->start_substream(0, 0.0);
+
+	vector<double> last_valid(nfreq, 0.0);
+	ssize_t nt_per_v2 = v1_chunk * v2_chunk;
+	ssize_t nv2 = 0;
+
+	for (int ichunk = 0; ichunk < nchunks; ichunk++) {
+	    int it0 = ichunk * nt_chunk;
+	    t->process_chunk(it0, it0 + nt_chunk, &intensity[it0], &weights[it0], nt, nullptr, nullptr, 0);
+
+	    // Reference v2 estimates which were completed in this chunk.
+	    vector<double> v2(nfreq, 0.0);
+
+	    for ( ; (nv2+1) * nt_per_v2 <= it0 + nt_chunk; nv2++) {
+		for (int ifreq = 0; ifreq < nfreq; ifreq++) {
+		    vector<double> v1(v2_chunk);
+		    for (int j = 0; j < v2_chunk; j++) {
+			ssize_t i = ifreq*nt + nv2*nt_per_v2 + j*v1_chunk;
+			v1[j] = reference_v1(&intensity[i], &weights[i], v1_chunk);
+		    }
+
+		    v2[ifreq] = reference_v2(v1);
+		    if (v2[ifreq] > 0.0)
+			last_valid[ifreq] = v2[ifreq];
+		}
+	    }
+
+	    if (handle->nv2 != nv2)
+		throw runtime_error("test_variance_estimator(): wrong number of v2 estimates");
+	    if ((nv2 > 0) && (fabs(handle->t1 - nv2 * nt_per_v2) > 1.0e-6 * nt))
+		throw runtime_error("test_variance_estimator(): wrong end time for v2 estimate");
+
+	    // If no v2 estimate was completed, then the handle still contains the previous one.
+	    if (handle->nv2 * nt_per_v2 <= it0)
+		continue;
+
+	    for (int ifreq = 0; ifreq < nfreq; ifreq++) {
+		if ((fabs(handle->variance[ifreq] - v2[ifreq]) > 1.0e-4 * v2[ifreq]) ||
+		    (fabs(handle->last_valid_variance[ifreq] - last_valid[ifreq]) > 1.0e-4 * last_valid[ifreq]))
+		    throw runtime_error("test_variance_estimator(): v2 estimate disagrees with reference");
+	    }
+	}
+
+	t->end_substream();
+    }
+
+    cerr << "done\n";
+}
+
+
+// -------------------------------------------------------------------------------------------------
+//
+// frb_injector: a single injector with many pulses should agree with the sum of single-pulse injectors,
+// independent of nt_chunk.  Each pulse is compared with properties of the pulse model which can be
+// computed directly: the signal-to-noise, the fluence in each channel (which scales with the spectral
+// index), and the mean arrival time in each channel (which is the dispersion delay at the top of the
+// channel, plus half the dispersion delay across the channel, plus the scattering time).
+
+
+// Returns the injected signal, as an array of shape (nfreq, nt).
+static vector<float> run_frb_injector(const vector<frb_pulse> &pulses, int nfreq, int nt, int nt_chunk)
+{
+    ssize_t nt_alloc = round_up(nt, nt_chunk);
+    vector<float> intensity(nfreq * nt_alloc, 0.0);
+    vector<float> weights(nfreq * nt_alloc, 1.0);
+
+    dummy_wi_stream stream(nfreq);
+    shared_ptr<wi_transform> t = make_frb_injector(pulses, 1.0, nt_chunk);
+
+    t->set_stream(stream);
+    t->start_substream(0, 0.0);
+
+    for (ssize_t it0 = 0; it0 < nt_alloc; it0 += nt_chunk)
+	t->process_chunk(it0 * stream.dt_sample, (it0 + nt_chunk) * stream.dt_sample, &intensity[it0], &weights[it0], nt_alloc, nullptr, nullptr, 0);
+
+    t->end_substream();
+
+    if ((t->json_per_substream["npulses_injected"].asInt64() != ssize_t(pulses.size())) || (t->json_per_substream["npulses_partial"].asInt64() != 0))
+	throw runtime_error("test_frb_injector(): wrong pulse count in json output");
+
+    vector<float> ret(nfreq * nt);
+    for (int ifreq = 0; ifreq < nfreq; ifreq++)
+	memcpy(&ret[ifreq*nt], &intensity[ifreq*nt_alloc], nt * sizeof(float));
+
+    return ret;
+}
+
+
+static void test_frb_injector()
+{
+    static constexpr int S = constants::single_precision_simd_length;
+
+    cerr << "test_frb_injector()";
+
+    for (int iouter = 0; iouter < 20; iouter++) {
+	if (iouter % 2 == 0)
+	    cerr << ".";
+
+	int nfreq = randint(8, 65);
+	int npulses = randint(1, 11);
+
+	dummy_wi_stream stream(nfreq);
+	const double dt = stream.dt_sample;
+	const double flo = stream.freq_lo_MHz;
+	const double fhi = stream.freq_hi_MHz;
+
+	vector<frb_pulse> pulses;
+	double t_end = 0.0;
+
+	for (int ipulse = 0; ipulse < npulses; ipulse++) {
+	    frb_pulse p(uniform_rand(5.0, 50.0),            // snr
+			uniform_rand(0.05, 0.5),            // undispersed_arrival_time
+			uniform_rand(0.0, 50.0),            // dm
+			uniform_rand(0.0, 3.0e-3),          // intrinsic_width
+			uniform_rand(0.0, 0.5),             // sm
+			uniform_rand(-3.0, 3.0));           // spectral_index
+
+	    if (randint(0,4) == 0)
+		p.intrinsic_width = 0.0;
+	    if (randint(0,4) == 0)
+		p.sm = 0.0;
+
+	    double tau_max = 1.0e-3 * p.sm * pow(flo/1000., -4.4);
+	    t_end = max(t_end, p.undispersed_arrival_time + 4.148808e3 * p.dm / (flo*flo) + 6 * p.intrinsic_width + 12 * tau_max);
+	    pulses.push_back(p);
+	}
+
+	int nt = int(t_end / dt) + 100;
+	int nt_chunk1 = S * randint(1, 65);
+	int nt_chunk2 = S * randint(1, 65);
+
+	vector<float> all_pulses1 = run_frb_injector(pulses, nfreq, nt, nt_chunk1);
+	vector<float> all_pulses2 = run_frb_injector(pulses, nfreq, nt, nt_chunk2);
+	vector<double> sum_pulses(nfreq * nt, 0.0);
+
+	// An injector with no pulses should leave the intensity unmodified.
+	for (float x: run_frb_injector({}, nfreq, nt, nt_chunk1))
+	    if (x != 0.0)
+		throw runtime_error("test_frb_injector(): empty injector modified the intensity");
+
+	for (const frb_pulse &p: pulses) {
+	    vector<float> x = run_frb_injector({ p }, nfreq, nt, nt_chunk2);
+
+	    double snr = 0.0;
+	    for (int i = 0; i < nfreq * nt; i++) {
+		sum_pulses[i] += x[i];
+		snr += square(x[i]);
+	    }
+
+	    if (fabs(sqrt(snr) - p.snr) > 1.0e-4 * p.snr)
+		throw runtime_error("test_frb_injector(): pulse has wrong signal-to-noise");
+
+	    double fmid = 0.5 * (flo + fhi);
+	    double fluence0 = 0.0;
+
+	    for (int ifreq = 0; ifreq < nfreq; ifreq++) {
+		double f_hi = fhi - ifreq * (fhi - flo) / nfreq;
+		double f_lo = fhi - (ifreq+1) * (fhi - flo) / nfreq;
+		double f_mid = 0.5 * (f_lo + f_hi);
+
+		double acc0 = 0.0, acc1 = 0.0;
+		for (int it = 0; it < nt; it++) {
+		    acc0 += x[ifreq*nt + it];
+		    acc1 += x[ifreq*nt + it] * (it + 0.5) * dt;
+		}
+
+		// Fluence, divided by the spectral dependence, should be the same in every channel.
+		double fluence = acc0 / pow(f_mid/fmid, p.spectral_index);
+		if (ifreq == 0)
+		    fluence0 = fluence;
+
+		if (fabs(fluence - fluence0) > 1.0e-4 * fluence0)
+		    throw runtime_error("test_frb_injector(): pulse has wrong spectral dependence");
+
+		// Mean arrival time.  Binning the pulse changes the mean by at most half a sample.
+		double t_expected = p.undispersed_arrival_time + 4.148808e3 * p.dm * (0.5/(f_hi*f_hi) + 0.5/(f_lo*f_lo)) + 1.0e-3 * p.sm * pow(f_mid/1000., -4.4);
+
+		if (fabs(acc1/acc0 - t_expected) > 0.501 * dt)
+		    throw runtime_error("test_frb_injector(): pulse has wrong arrival time");
+	    }
+	}
+
+	double xmax = 0.0;
+	for (int i = 0; i < nfreq * nt; i++)
+	    xmax = max(xmax, fabs(sum_pulses[i]));
+
+	for (int i = 0; i < nfreq * nt; i++) {
+	    if ((fabs(all_pulses1[i] - sum_pulses[i]) > 1.0e-5 * xmax) || (fabs(all_pulses2[i] - sum_pulses[i]) > 1.0e-5 * xmax))
+		throw runtime_error("test_frb_injector(): multi-pulse injection disagrees with sum of single-pulse injections");
+	}
+    }
+
+    cerr << "done\n";
+}
+
+
+// -------------------------------------------------------------------------------------------------
+//
+// trigger_grouper: the streaming grouper is compared with an offline reference, which makes a list of
+// all above-threshold triggers in the stream, and then finds the connected components of the
+// friends-of-friends graph with a union-find, without ever finalizing a cluster early.  The result
+// should be identical, independent of chunking, since the grouper only finalizes clusters which
+// can't be linked to future triggers.
+
+
+struct ref_trigger {
+    double dm, time, snr;
+    int itree, ism, ibeta;
+};
+
+
+static int ref_find(vector<int> &parent, int i)
+{
+    while (parent[i] != i)
+	i = parent[i] = parent[parent[i]];
+    return i;
+}
+
+
+static vector<l1_event> reference_group(const vector<ref_trigger> &triggers, double dm_link, double t_link)
+{
+    int n = triggers.size();
+    vector<int> parent(n);
+
+    for (int i = 0; i < n; i++)
+	parent[i] = i;
+
+    // Link all pairs of triggers, visiting them in time order so that the inner loop can stop early.
+    vector<int> order(n);
+    for (int i = 0; i < n; i++)
+	order[i] = i;
+
+    std::sort(order.begin(), order.end(), [&triggers](int i, int j) { return triggers[i].time < triggers[j].time; });
+
+    for (int a = 0; a < n; a++) {
+	const ref_trigger &ta = triggers[order[a]];
+
+	for (int b = a+1; (b < n) && (triggers[order[b]].time - ta.time <= t_link); b++) {
+	    const ref_trigger &tb = triggers[order[b]];
+	    if (fabs(ta.dm - tb.dm) <= dm_link)
+		parent[ref_find(parent, order[a])] = ref_find(parent, order[b]);
+	}
+    }
+
+    // One l1_event per connected component.
+    vector<int> icluster(n, -1);
+    vector<l1_event> clusters;
+
+    for (int i = 0; i < n; i++) {
+	const ref_trigger &t = triggers[i];
+	int r = ref_find(parent, i);
+
+	if (icluster[r] < 0) {
+	    icluster[r] = clusters.size();
+	    clusters.push_back(l1_event());
+	    clusters.back().snr = -1.0;
+	    clusters.back().dm_lo = clusters.back().t_lo = 1.0e30;
+	    clusters.back().dm_hi = clusters.back().t_hi = -1.0e30;
+	}
+
+	l1_event &e = clusters[icluster[r]];
+
+	// Ties in S/N are broken by (time, dm, itree).
+	if ((t.snr > e.snr) || ((t.snr == e.snr) && (std::tie(t.time, t.dm, t.itree) < std::tie(e.time, e.dm, e.itree)))) {
+	    e.dm = t.dm;
+	    e.time = t.time;
+	    e.snr = t.snr;
+	    e.itree = t.itree;
+	    e.ism = t.ism;
+	    e.ibeta = t.ibeta;
+	}
+
+	e.dm_lo = min(e.dm_lo, t.dm);
+	e.dm_hi = max(e.dm_hi, t.dm);
+	e.t_lo = min(e.t_lo, t.time);
+	e.t_hi = max(e.t_hi, t.time);
+	e.ntriggers++;
+    }
+
+    return clusters;
+}
+
+
+static void sort_events(vector<l1_event> &events)
+{
+    std::sort(events.begin(), events.end(), [](const l1_event &a, const l1_event &b) {
+	return std::tie(a.t_lo, a.dm_lo, a.t_hi, a.dm_hi, a.ntriggers) < std::tie(b.t_lo, b.dm_lo, b.t_hi, b.dm_hi, b.ntriggers);
+    });
+}
+
+
+static void test_trigger_grouper()
+{
+    cerr << "test_trigger_grouper()";
+
+    for (double threshold: { -1.0, std::numeric_limits<double>::infinity(), std::numeric_limits<double>::quiet_NaN() }) {
+	try {
+	    make_trigger_grouper(threshold, 1.0, 1.0, {}, "", 100);
+	} catch (runtime_error &) {
+	    continue;
+	}
+	throw runtime_error("test_trigger_grouper(): expected make_trigger_grouper() to throw for threshold=" + to_string(threshold));
+    }
+
+    for (int iouter = 0; iouter < 100; iouter++) {
+	if (iouter % 10 == 0)
+	    cerr << ".";
+
+	int ntrees = randint(1,4);
+	int nchunks = randint(1,20);
+	double chunk_duration = uniform_rand(0.1, 1.0);
+	double threshold = uniform_rand(0.9, 0.99);
+	bool use_max_dm = (randint(0,2) == 0);
+
+	vector<int> ndm(ntrees), nsm(ntrees), nbeta(ntrees), nt(ntrees);
+	vector<double> tree_max_dm;
+
+	for (int itree = 0; itree < ntrees; itree++) {
+	    ndm[itree] = randint(1,30);
+	    nsm[itree] = randint(1,3);
+	    nbeta[itree] = randint(1,3);
+	    nt[itree] = randint(1,30);
+	    if (use_max_dm)
+		tree_max_dm.push_back(uniform_rand(10.0, 100.0));
+	}
+
+	double dm_link = use_max_dm ? uniform_rand(0.0, 10.0) : uniform_rand(0.0, 3.0);
+	double t_link = uniform_rand(0.0, 3.0) * chunk_duration / nt[0];
+
+	shared_ptr<trigger_grouper> g = make_trigger_grouper(threshold, dm_link, t_link, tree_max_dm, "", 1000000);
+	dummy_wi_stream stream(1);
+
+	g->set_stream(stream);
+	g->start_substream(0, 0.0);
+
+	vector<ref_trigger> ref_triggers;
+	vector<l1_event> events;
+
+	for (int ichunk = 0; ichunk < nchunks; ichunk++) {
+	    double t0 = ichunk * chunk_duration;
+	    double t1 = (ichunk+1) * chunk_duration;
+
+	    for (int itree = 0; itree < ntrees; itree++) {
+		int nsb = nsm[itree] * nbeta[itree];
+		vector<float> triggers(ndm[itree] * nsb * nt[itree]);
+
+		for (float &x: triggers)
+		    x = uniform_rand();
+
+		g->process_triggers(itree, &triggers[0], ndm[itree], nsm[itree], nbeta[itree], nt[itree], t0, t1);
+
+		// Reference triggers, in the same order as process_triggers() (time-major).
+		double dt = (t1 - t0) / nt[itree];
+
+		for (int it = 0; it < nt[itree]; it++) {
+		    for (int idm = 0; idm < ndm[itree]; idm++) {
+			ref_trigger t;
+			t.snr = -1.0;
+
+			for (int isb = 0; isb < nsb; isb++) {
+			    float x = triggers[(idm*nsb + isb) * nt[itree] + it];
+			    if (x > t.snr) {
+				t.snr = x;
+				t.ism = isb / nbeta[itree];
+				t.ibeta = isb % nbeta[itree];
+			    }
+			}
+
+			if (t.snr < threshold)
+			    continue;
+
+			t.dm = use_max_dm ? ((idm + 0.5) * (tree_max_dm[itree] / ndm[itree])) : (idm * double(1 << itree));
+			t.time = t0 + (it + 0.5) * dt;
+			t.itree = itree;
+			ref_triggers.push_back(t);
+		    }
+		}
+	    }
+
+	    vector<l1_event> v;
+	    g->get_events(v);
+	    events.insert(events.end(), v.begin(), v.end());
+	}
+
+	g->end_substream();
+
+	vector<l1_event> v;
+	g->get_events(v);
+	events.insert(events.end(), v.begin(), v.end());
+
+	vector<l1_event> ref_events = reference_group(ref_triggers, dm_link, t_link);
+
+	sort_events(events);
+	sort_events(ref_events);
+
+	if (events.size() != ref_events.size())
+	    throw runtime_error("test_trigger_grouper(): wrong number of events");
+
+	if (g->json_per_substream["ntriggers_above_threshold"].asInt64() != ssize_t(ref_triggers.size()))
+	    throw runtime_error("test_trigger_grouper(): wrong number of above-threshold triggers");
+
+	for (size_t i = 0; i < events.size(); i++) {
+	    const l1_event &a = events[i];
+	    const l1_event &b = ref_events[i];
+
+	    if ((a.dm != b.dm) || (a.time != b.time) || (a.snr != b.snr) || (a.dm_lo != b.dm_lo) || (a.dm_hi != b.dm_hi) ||
+		(a.t_lo != b.t_lo) || (a.t_hi != b.t_hi) || (a.itree != b.itree) || (a.ism != b.ism) || (a.ibeta != b.ibeta) || (a.ntriggers != b.ntriggers))
+		throw runtime_error("test_trigger_grouper(): event disagrees with reference");
+	}
+    }
+
+    cerr << "done\n";
+}
+
+
+// -------------------------------------------------------------------------------------------------
+//
+// wi_downsample(): factors (Df,Dt) which exceed the largest specialized kernel are done in stages,
+// with intermediate arrays in the workspace.  The result is compared with a double-precision
+// reference, and the public version (thread-local workspace) is compared with the workspace version.
+
+
+static void reference_wi_downsample(vector<double> &out_intensity, vector<double> &out_weights, const vector<float> &intensity, const vector<float> &weights, int nfreq, int nt, int stride, int Df, int Dt)
+{
+    out_intensity.assign((nfreq/Df) * (nt/Dt), 0.0);
+    out_weights.assign((nfreq/Df) * (nt/Dt), 0.0);
+
+    for (int ifreq = 0; ifreq < nfreq; ifreq++) {
+	for (int it = 0; it < nt; it++) {
+	    int i = (ifreq/Df) * (nt/Dt) + (it/Dt);
+	    out_intensity[i] += double(weights[ifreq*stride + it]) * double(intensity[ifreq*stride + it]);
+	    out_weights[i] += double(weights[ifreq*stride + it]);
+	}
+    }
+
+    for (unsigned int i = 0; i < out_intensity.size(); i++)
+	if (out_weights[i] > 0.0)
+	    out_intensity[i] /= out_weights[i];
+}
+
+
+static void test_wi_downsample()
+{
+    static constexpr int S = constants::single_precision_simd_length;
+
+    cerr << "test_wi_downsample()";
+
+    clipper_workspace reused_ws;
+
+    for (int iouter = 0; iouter < 100; iouter++) {
+	if (iouter % 10 == 0)
+	    cerr << ".";
+
+	// Mostly powers of two up to (max_frequency_downsampling, max_time_downsampling), which can
+	// need several stages, and occasionally factors which are not powers of two.
+	int Df = 1 << randint(0,9);
+	int Dt = 1 << randint(0,6);
+
+	if (randint(0,10) == 0)
+	    Df = 3 * randint(1,9);
+	if (randint(0,10) == 0)
+	    Dt = randint(1,21);
+
+	int nfreq = Df * randint(1,4);
+	int nt = Dt * S * randint(1,4);
+	int stride = nt + randint(0,17);
+	int nfreq_ds = nfreq / Df;
+	int nt_ds = nt / Dt;
+	int stride_ds = nt_ds + randint(0,5);
+
+	vector<float> intensity, weights;
+	make_random_clipper_input(intensity, weights, nfreq, nt, stride);
+
+	// A fully masked (Df,Dt) block, to test the zero-weight convention.
+	for (int ifreq = 0; ifreq < Df; ifreq++)
+	    memset(&weights[ifreq*stride], 0, Dt * sizeof(float));
+
+	vector<float> ds_intensity0(nfreq_ds * stride_ds, 0.0);
+	vector<float> ds_weights0(nfreq_ds * stride_ds, 0.0);
+	vector<float> ds_intensity1(nfreq_ds * stride_ds, 0.0);
+	vector<float> ds_weights1(nfreq_ds * stride_ds, 0.0);
+
+	wi_downsample(&ds_intensity0[0], &ds_weights0[0], stride_ds, &intensity[0], &weights[0], nfreq, nt, stride, Df, Dt);
+	wi_downsample(&ds_intensity1[0], &ds_weights1[0], stride_ds, &intensity[0], &weights[0], nfreq, nt, stride, Df, Dt, reused_ws);
+
+	if (memcmp(&ds_intensity0[0], &ds_intensity1[0], nfreq_ds * stride_ds * sizeof(float)) || memcmp(&ds_weights0[0], &ds_weights1[0], nfreq_ds * stride_ds * sizeof(float)))
+	    throw runtime_error("test_wi_downsample() failed: output depends on workspace");
+
+	vector<double> ref_intensity, ref_weights;
+	reference_wi_downsample(ref_intensity, ref_weights, intensity, weights, nfreq, nt, stride, Df, Dt);
+
+	for (int ifreq = 0; ifreq < nfreq_ds; ifreq++) {
+	    for (int it = 0; it < nt_ds; it++) {
+		double ival = ds_intensity0[ifreq*stride_ds + it];
+		double wval = ds_weights0[ifreq*stride_ds + it];
+		double ref_ival = ref_intensity[ifreq*nt_ds + it];
+		double ref_wval = ref_weights[ifreq*nt_ds + it];
+
+		// Intensities are O(1), so an absolute tolerance is used (as in test-kernels).
+		if ((fabs(ival - ref_ival) > 1.0e-4) || (fabs(wval - ref_wval) > 1.0e-5 * Df * Dt)) {
+		    stringstream ss;
+		    ss << "test_wi_downsample() failed: (Df,Dt)=(" << Df << "," << Dt << "), (nfreq,nt)=(" << nfreq << "," << nt << ")"
+		       << ", element (" << ifreq << "," << it << "): (intensity,weight)=(" << ival << "," << wval << "), expected (" << ref_ival << "," << ref_wval << ")";
+		    throw runtime_error(ss.str());
+		}
+	    }
+	}
+
+	if ((ds_intensity0[0] != 0.0f) || signbit(ds_intensity0[0]) || (ds_weights0[0] != 0.0f))
+	    throw runtime_error("test_wi_downsample() failed: fully masked block should have intensity and weight +0");
+    }
+
+    cerr << "done\n";
+}
+
+
+// -------------------------------------------------------------------------------------------------
+//
+// downsample_cache: a pipeline whose transforms share downsampled chunks through the cache is compared
+// with the same transforms applied directly (without a cache).  The pipeline also contains read-only
+// transforms which check that every downsampled chunk returned by the cache agrees with wi_downsample(),
+// i.e. that the cache never returns stale data after a transform modifies the chunk.
+
+
+// A stream which writes the arrays (intensity, weights), of shape (nfreq, nt_stream), in random-sized pieces.
+struct array_wi_stream : public wi_stream {
+    ssize_t nt_stream;
+    const vector<float> &intensity;
+    const vector<float> &weights;
+
+    array_wi_stream(int nfreq_, ssize_t nt_stream_, const vector<float> &intensity_, const vector<float> &weights_) :
+	nt_stream(nt_stream_), intensity(intensity_), weights(weights_)
+    {
+	this->nfreq = nfreq_;
+	this->nt_maxwrite = 64;
+	this->freq_lo_MHz = 400.;
+	this->freq_hi_MHz = 800.;
+	this->dt_sample = 1.0e-3;
+    }
+
+    virtual void stream_body(wi_run_state &run_state) override
+    {
+	run_state.start_substream(0.0);
+
+	for (ssize_t ipos = 0; ipos < nt_stream; ) {
+	    ssize_t nt = min(ssize_t(randint(1, nt_maxwrite+1)), nt_stream - ipos);
+
+	    float *dst_intensity;
+	    float *dst_weights;
+	    ssize_t stride;
+	    bool zero_flag = false;
+
+	    run_state.setup_write(nt, dst_intensity, dst_weights, stride, zero_flag);
+
+	    for (ssize_t ifreq = 0; ifreq < nfreq; ifreq++) {
+		memcpy(dst_intensity + ifreq*stride, &intensity[ifreq*nt_stream + ipos], nt * sizeof(float));
+		memcpy(dst_weights + ifreq*stride, &weights[ifreq*nt_stream + ipos], nt * sizeof(float));
+	    }
+
+	    run_state.finalize_write(nt);
+	    ipos += nt;
+	}
+
+	run_state.end_substream();
+    }
+};
+
+
+
+// Read-only transform which gets downsampled chunks from the cache, and compares them with wi_downsample().
+struct cache_checking_transform : public wi_transform {
+    vector<pair<int,int>> factors;
+    ssize_t ncalls = 0;
+
+    cache_checking_transform(int nt_chunk_, const vector<pair<int,int>> &factors_) : factors(factors_)
+    {
+	this->name = "cache_checking_transform";
+	this->nt_chunk = nt_chunk_;
+	this->is_read_only = true;
+    }
+
+    virtual void set_stream(const wi_stream &stream) override { this->nfreq = stream.nfreq; }
+    virtual void start_substream(int isubstream, double t0) override { }
+    virtual void end_substream() override { }
+
+    virtual void process_chunk(double t0, double t1, float *intensity, float *weights, ssize_t stride, float *pp_intensity, float *pp_weights, ssize_t pp_stride) override
+    {
+	rf_assert(ds_cache != nullptr);
+
+	for (const auto &f: factors) {
+	    int Df = f.first;
+	    int Dt = f.second;
+	    int n = (nfreq/Df) * (nt_chunk/Dt);
+
+	    vector<float> ds_intensity(n), ds_weights(n);
+	    wi_downsample(&ds_intensity[0], &ds_weights[0], nt_chunk/Dt, intensity, weights, nfreq, nt_chunk, stride, Df, Dt);
+
+	    // The second call to get() should return the cached entry.
+	    const float *cached_intensity;
+	    const float *cached_weights;
+	    ds_cache->get(Df, Dt, cached_intensity, cached_weights);
+	    rf_assert(ds_cache->lookup(Df, Dt, cached_intensity, cached_weights));
+
+	    if (memcmp(&ds_intensity[0], cached_intensity, n * sizeof(float)) || memcmp(&ds_weights[0], cached_weights, n * sizeof(float)))
+		throw runtime_error("test_downsample_cache(): cached chunk disagrees with wi_downsample()");
+	}
+
+	this->ncalls++;
+    }
+};
+
+
+// Read-only transform which saves the processed stream.
+struct saving_transform : public wi_transform {
+    vector<float> intensity;
+    vector<float> weights;
+    ssize_t nt_stream;
+    ssize_t ipos = 0;
+
+    saving_transform(int nt_chunk_, ssize_t nt_stream_) : nt_stream(nt_stream_)
+    {
+	this->name = "saving_transform";
+	this->nt_chunk = nt_chunk_;
+	this->is_read_only = true;
+    }
+
+    virtual void set_stream(const wi_stream &stream) override
+    {
+	this->nfreq = stream.nfreq;
+	this->intensity.assign(nfreq * nt_stream, 0.0);
+	this->weights.assign(nfreq * nt_stream, 0.0);
+    }
+
+    virtual void start_substream(int isubstream, double t0) override { }
+    virtual void end_substream() override { }
+
+    virtual void process_chunk(double t0, double t1, float *intensity_, float *weights_, ssize_t stride, float *pp_intensity, float *pp_weights, ssize_t pp_stride) override
+    {
+	for (int ifreq = 0; ifreq < nfreq; ifreq++) {
+	    memcpy(&intensity[ifreq*nt_stream + ipos], intensity_ + ifreq*stride, nt_chunk * sizeof(float));
+	    memcpy(&weights[ifreq*nt_stream + ipos], weights_ + ifreq*stride, nt_chunk * sizeof(float));
+	}
+
+	this->ipos += nt_chunk;
+    }
+};
+
+
+static void test_downsample_cache()
+{
+    cerr << "test_downsample_cache()";
+
+    for (int iouter = 0; iouter < 100; iouter++) {
+	if (iouter % 10 == 0)
+	    cerr << ".";
+
+	int nfreq = 32 * randint(1,9);
+	int nt_chunk = 256 * randint(1,5);
+	int nt_stream = nt_chunk * randint(1,5);
+	axis_type axis = (randint(0,2) == 0) ? AXIS_FREQ : AXIS_TIME;
+	int polydeg = randint(0,4);
+
+	vector<rfi_clipper_spec> specs(2);
+	for (auto &s: specs)
+	    s = make_random_clipper_spec();
+
+	// Factors requested by the cache_checking_transforms, including those used by the staged_downsamplers.
+	vector<pair<int,int>> factors = { { 1, 2 } };
+	for (const auto &s: specs)
+	    factors.push_back({ s.Df / staged_downsampler::kernel_Df(s.Df), s.Dt / staged_downsampler::kernel_Dt(s.Dt) });
+
+	auto make_clipper = [nt_chunk](const rfi_clipper_spec &s) -> shared_ptr<wi_transform>
+	{
+	    if (s.type == rfi_clipper_spec::INTENSITY_CLIPPER)
+		return make_intensity_clipper(nt_chunk, s.axis, s.sigma, s.niter, s.iter_sigma, s.Df, s.Dt, s.two_pass, s.robust);
+	    return make_std_dev_clipper(nt_chunk, s.axis, s.sigma, s.Df, s.Dt, s.two_pass, s.robust, s.niter, s.iter_sigma);
+	};
+
+	vector<float> intensity, weights;
+	make_random_clipper_input(intensity, weights, nfreq, nt_stream, nt_stream);
+
+	// Pipeline, with the downsample_cache.
+	auto saver = make_shared<saving_transform> (nt_chunk, nt_stream);
+	vector<shared_ptr<cache_checking_transform>> checkers;
+
+	for (int i = 0; i < 3; i++)
+	    checkers.push_back(make_shared<cache_checking_transform> (nt_chunk, factors));
+
+	vector<shared_ptr<wi_transform>> transforms = {
+	    checkers[0],
+	    make_clipper(specs[0]),
+	    checkers[1],
+	    make_polynomial_detrender(nt_chunk, axis, polydeg),
+	    checkers[2],
+	    make_clipper(specs[1]),
+	    saver
+	};
+
+	array_wi_stream stream(nfreq, nt_stream, intensity, weights);
+	stream.run(transforms, ".", nullptr, 0);
+
+	for (const auto &c: checkers)
+	    if (c->ncalls != nt_stream / nt_chunk)
+		throw runtime_error("test_downsample_cache(): cache_checking_transform was not called");
+
+	// Same transforms, applied directly.
+	vector<shared_ptr<wi_transform>> unpipelined = {
+	    make_clipper(specs[0]),
+	    make_polynomial_detrender(nt_chunk, axis, polydeg),
+	    make_clipper(specs[1])
+	};
+
+	dummy_wi_stream dummy_stream(nfreq);
+
+	for (const auto &t: unpipelined) {
+	    t->set_stream(dummy_stream);
+	    t->start_substream(0, 0.0);
+
+	    for (int it0 = 0; it0 < nt_stream; it0 += nt_chunk)
+		t->process_chunk(0.0, 1.0, &intensity[it0], &weights[it0], nt_stream, nullptr, nullptr, 0);
+
+	    t->end_substream();
+	}
+
+	if ((intensity != saver->intensity) || (weights != saver->weights))
+	    throw runtime_error("test_downsample_cache(): pipeline output depends on the downsample_cache");
+    }
+
+    cerr << "done\n";
+}
+
+
+// -------------------------------------------------------------------------------------------------
+//
+// plotter_transform: invalid parameters, including (downsample_nt, n_zoom) pairs whose downsampling
+// factor overflows an int, should throw exceptions.  This test runs whether or not rf_pipelines was
+// compiled with libpng (without libpng, valid parameters throw a "compiled without libpng" exception).
+
+
+static void test_plotter_transform_params()
+{
+    static constexpr int S = constants::single_precision_simd_length;
+    static constexpr int imax = numeric_limits<int>::max();
+
+    cerr << "test_plotter_transform_params()";
+
+    // (img_nfreq, img_nt, downsample_nt, n_zoom, nt_chunk, clip_niter, sigma_clip)
+    vector<tuple<int,int,int,int,int,int,double>> bad_params = {
+	make_tuple(0, 8*S, 1, 1, 0, 3, 3.0),
+	make_tuple(64, 8*S+1, 1, 1, 0, 3, 3.0),
+	make_tuple(64, 8*S, 0, 1, 0, 3, 3.0),
+	make_tuple(64, 8*S, 1, 0, 0, 3, 3.0),
+	make_tuple(64, 8*S, 1, 17, 0, 3, 3.0),
+	make_tuple(64, 8*S, 1, 1, -S, 3, 3.0),
+	make_tuple(64, 8*S, 2, 2, 2*S, 3, 3.0),
+	make_tuple(64, 8*S, 1 << 20, 16, 0, 3, 3.0),
+	make_tuple(64, 8*S, imax, 1, 0, 3, 3.0),
+	make_tuple(64, 8*S, (imax/S) + 1, 1, 0, 3, 3.0),
+	make_tuple(64, 8*S, 1, 1, 0, 0, 3.0),
+	make_tuple(64, 8*S, 1, 1, 0, 3, 1.0)
+    };
+
+    for (unsigned int i = 0; i < bad_params.size(); i++) {
+	const auto &p = bad_params[i];
+	bool thrown = false;
+
+	try {
+	    make_plotter_transform("test", get<0>(p), get<1>(p), get<2>(p), get<3>(p), get<4>(p), get<5>(p), get<6>(p));
+	} catch (runtime_error &e) {
+	    thrown = (string(e.what()).find("libpng") == string::npos);
+	}
+
+	if (!thrown)
+	    throw runtime_error("test_plotter_transform_params(): invalid parameters (case " + to_string(i) + ") were not detected");
+    }
+
+    // Largest downsampling factor which is allowed, with default nt_chunk.
+    int ds_max = (imax / S) & ~((1 << 15) - 1);
+    vector<tuple<int,int>> good_params = { make_tuple(1,1), make_tuple(2,3), make_tuple(ds_max >> 15, 16), make_tuple(ds_max, 1) };
+
+    for (const auto &p: good_params) {
+	try {
+	    make_plotter_transform("test", 64, 8*S, get<0>(p), get<1>(p), 0, 3, 3.0);
+	} catch (runtime_error &e) {
+#ifdef HAVE_PNG
+	    throw;
+#else
+	    if (string(e.what()).find("libpng") == string::npos)
+		throw;
+#endif
+	}
+    }
+
+    cerr << "done\n";
+}
+
+
+// -------------------------------------------------------------------------------------------------
+//
+// plotter_transform: the PNG files are read back, and compared with images which are made by
+// downsampling the full-resolution stream directly (rather than by cascading from zoom level 0),
+// using the same color scheme.  Pixels may differ by roundoff, i.e. by one color level.
+
+
+#ifdef HAVE_PNG
+
+// Returns RGB image with shape (ny, nx, 3).
+static vector<png_byte> read_png(const string &filename, int nx, int ny)
+{
+    FILE *fp = fopen(filename.c_str(), "rb");
+    if (!fp)
+	throw runtime_error("test_plotter_transform(): couldn't open file " + filename);
+
+    png_structp png_ptr = png_create_read_struct(PNG_LIBPNG_VER_STRING, NULL, NULL, NULL);
+    png_infop info_ptr = png_create_info_struct(png_ptr);
+    rf_assert(png_ptr && info_ptr);
+
+    if (setjmp(png_jmpbuf(png_ptr))) {
+	png_destroy_read_struct(&png_ptr, &info_ptr, NULL);
+	fclose(fp);
+	throw runtime_error("test_plotter_transform(): libpng error while reading " + filename);
+    }
+
+    png_init_io(png_ptr, fp);
+    png_read_png(png_ptr, info_ptr, PNG_TRANSFORM_IDENTITY, NULL);
+
+    rf_assert(png_get_image_width(png_ptr, info_ptr) == png_uint_32(nx));
+    rf_assert(png_get_image_height(png_ptr, info_ptr) == png_uint_32(ny));
+    rf_assert(png_get_color_type(png_ptr, info_ptr) == PNG_COLOR_TYPE_RGB);
+
+    vector<png_byte> ret(ny * nx * 3);
+    png_bytepp rows = png_get_rows(png_ptr, info_ptr);
+
+    for (int iy = 0; iy < ny; iy++)
+	memcpy(&ret[iy * nx * 3], rows[iy], nx * 3);
+
+    png_destroy_read_struct(&png_ptr, &info_ptr, NULL);
+    fclose(fp);
+    return ret;
+}
+
+
+// Makes the RGB image for pixels [it0, it0+img_nt) of a downsampled array with shape (img_nfreq, nds),
+// with the color scheme in plotter_transform.cpp (pixels past the end of the array are black).
+static vector<png_byte> reference_plot(const vector<float> &ds_intensity, const vector<float> &ds_weights, int img_nfreq, int nds, int it0, int img_nt, int clip_niter, double sigma_clip)
+{
+    vector<float> intensity(img_nfreq * img_nt, 0.0);
+    vector<float> weights(img_nfreq * img_nt, 0.0);
+
+    for (int ifreq = 0; ifreq < img_nfreq; ifreq++) {
+	for (int it = 0; (it < img_nt) && (it0 + it < nds); it++) {
+	    intensity[ifreq*img_nt + it] = ds_intensity[ifreq*nds + it0 + it];
+	    weights[ifreq*img_nt + it] = ds_weights[ifreq*nds + it0 + it];
+	}
+    }
+
+    float wmax = *std::max_element(weights.begin(), weights.end());
+    float mean = 0.0;
+    float rms = 1.0;
+
+    if (wmax > 0.0) {
+	weighted_mean_and_rms(mean, rms, &intensity[0], &weights[0], img_nfreq, img_nt, img_nt, clip_niter, sigma_clip);
+	if (rms <= 0.0)
+	    rms = 1.0;
+    }
+
+    vector<png_byte> rgb(img_nfreq * img_nt * 3, 0);
+
+    for (int i = 0; i < img_nfreq * img_nt; i++) {
+	if (weights[i] <= 0.0)
+	    continue;
+
+	float color = 0.5 + 0.16 * (intensity[i] - mean) / rms;
+	color = min(max(color, 0.0001f), 0.9999f);
+	float w = min(weights[i] / wmax, 1.0f);
+
+	rgb[3*i] = png_byte(256. * color * w);
+	rgb[3*i+2] = png_byte(256. * (1.-color) * w);
+    }
+
+    return rgb;
+}
+
+
+static void test_plotter_transform()
+{
+    static constexpr int S = constants::single_precision_simd_length;
+
+    cerr << "test_plotter_transform()";
+
+    for (int iouter = 0; iouter < 30; iouter++) {
+	if (iouter % 3 == 0)
+	    cerr << ".";
+
+	int img_nfreq = randint(1,17);
+	int Df = randint(1,5);
+	int nfreq = img_nfreq * Df;
+	int img_nt = S * randint(1,5);
+	int downsample_nt = randint(1,4);
+	int n_zoom = randint(1,4);
+	int m = (downsample_nt << (n_zoom-1)) * S;
+	int nt_chunk = (randint(0,2) == 0) ? 0 : (m * randint(1,4));
+	int clip_niter = randint(1,4);
+	double sigma_clip = uniform_rand(2.0, 4.0);
+	ssize_t nt_stream = randint(1, 4 * img_nt * (downsample_nt << (n_zoom-1)));
+
+	vector<float> intensity(nfreq * nt_stream);
+	vector<float> weights(nfreq * nt_stream);
+
+	for (ssize_t i = 0; i < nfreq * nt_stream; i++) {
+	    intensity[i] = uniform_rand() + uniform_rand() + uniform_rand() - 1.5;
+	    weights[i] = (randint(0,10) == 0) ? 0.0 : uniform_rand(0.5, 1.0);
+	}
+
+	shared_ptr<wi_transform> t = make_plotter_transform("plot", img_nfreq, img_nt, downsample_nt, n_zoom, nt_chunk, clip_niter, sigma_clip);
+	array_wi_stream stream(nfreq, nt_stream, intensity, weights);
+
+	char outdir[] = "/tmp/rf_pipelines_test_XXXXXX";
+	if (!mkdtemp(outdir))
+	    throw runtime_error("test_plotter_transform(): mkdtemp() failed");
+
+	stream.run({ t }, outdir, nullptr, 0);
+
+	// The stream is padded with zeros to a multiple of nt_chunk.
+	ssize_t nt_padded = round_up(nt_stream, t->nt_chunk);
+
+	for (int izoom = 0; izoom < n_zoom; izoom++) {
+	    int nt_per_pix = downsample_nt << izoom;
+	    int nds = nt_padded / nt_per_pix;
+	    int nfiles = (nds + img_nt - 1) / img_nt;
+
+	    vector<float> ds_intensity(img_nfreq * nds, 0.0);
+	    vector<float> ds_weights(img_nfreq * nds, 0.0);
+
+	    for (int ifreq = 0; ifreq < img_nfreq; ifreq++) {
+		for (int it = 0; it < nds; it++) {
+		    double wi = 0.0, w = 0.0;
+
+		    for (int jfreq = ifreq*Df; jfreq < (ifreq+1)*Df; jfreq++) {
+			for (int jt = it*nt_per_pix; jt < min(ssize_t(it+1) * nt_per_pix, nt_stream); jt++) {
+			    wi += weights[jfreq*nt_stream + jt] * intensity[jfreq*nt_stream + jt];
+			    w += weights[jfreq*nt_stream + jt];
+			}
+		    }
+
+		    ds_intensity[ifreq*nds + it] = (w > 0.0) ? (wi/w) : 0.0;
+		    ds_weights[ifreq*nds + it] = w;
+		}
+	    }
+
+	    for (int ifile = 0; ifile < nfiles; ifile++) {
+		string filename = string(outdir) + "/plot_zoom" + to_string(izoom) + "_" + to_string(ifile) + ".png";
+		vector<png_byte> rgb = read_png(filename, img_nt, img_nfreq);
+		vector<png_byte> rgb_ref = reference_plot(ds_intensity, ds_weights, img_nfreq, nds, ifile * img_nt, img_nt, clip_niter, sigma_clip);
+
+		for (size_t i = 0; i < rgb.size(); i++)
+		    if (abs(int(rgb[i]) - int(rgb_ref[i])) > 1)
+			throw runtime_error("test_plotter_transform(): " + filename + " disagrees with reference");
+	    }
+
+	    if (file_exists(string(outdir) + "/plot_zoom" + to_string(izoom) + "_" + to_string(nfiles) + ".png"))
+		throw runtime_error("test_plotter_transform(): too many files were written");
+	}
+
+	for (const string &f: listdir(outdir))
+	    if ((f != ".") && (f != ".."))
+		unlink((string(outdir) + "/" + f).c_str());
+
+	rmdir(outdir);
+    }
+
+    cerr << "done\n";
+}
+
+#endif  // HAVE_PNG
+
+
+// -------------------------------------------------------------------------------------------------
+
+
+int main(int argc, char **argv)
+{
+    wraparound_buf::run_unit_tests();
+    run_pipeline_unit_tests();
+    test_rfi_clipper_chain();
+    test_clipper_workspace();
+    test_robust_clippers();
+    test_chunk_mask_info();
+    test_parallel_apply();
+    test_clip_1d();
+    test_running_median_detrender();
+    test_variance_estimator();
+    test_frb_injector();
+    test_trigger_grouper();
+    test_wi_downsample();
+    test_downsample_cache();
+
+    test_plotter_transform_params();
+
+#ifdef HAVE_PNG
+    test_plotter_transform();
+#endif
 
     return 0;
 }
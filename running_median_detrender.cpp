@@ -0,0 +1,417 @@
+// running_median_detrender: detrends along the time axis, by subtracting the running median of
+// each frequency channel in a sliding window.
+//
+// The chunk is divided into blocks of Dt samples.  If Dt=1, the baseline for sample t is the median
+// of the samples in the window [t-a, t+b], where b = nt_window/2 and a = nt_window-b-1.  If Dt > 1,
+// then the median of each block is computed first, and the baseline for every sample in block j is the
+// median of the block medians in the window [j-a, j+b] (in units of blocks).  This is much faster,
+// and still robust to outliers, but is not exactly equal to the median of the samples.  The default
+// is Dt=16.  Block medians are computed by counting ranks in simd registers (see _select_two() below).
+//
+// Medians in the window are kept in a "double heap" (a max-heap containing the smaller half, and a
+// min-heap containing the larger half), with an auxiliary array which maps each window slot to its
+// position in the heaps, so that the value which leaves the window can be replaced in O(log nt_window)
+// time.  The heaps are persistent across chunks, so each block is inserted and removed exactly once,
+// and the transform only needs postpadding (of b blocks) to see the end of the window.
+//
+// Zero-weight samples are excluded from the medians, and (nonzero) weights are otherwise ignored.
+// Since the window for block j includes j, the window is nonempty whenever a sample in block j is unmasked.
+
+#include "rf_pipelines_internals.hpp"
+#include "kernels/mask.hpp"
+
+using namespace std;
+
+namespace rf_pipelines {
+#if 0
+}; // pacify emacs c-mode
+#endif
+
+
+// Blocks with more samples than this use nth_element() instead of _select_two().
+static constexpr int max_rank_select = 64;
+
+
+// Returns the k0-th and k1-th smallest elements (counting from zero) of v[0:n).  The array must be
+// padded with (+FLT_MAX) to a multiple of S.  The ranks of S elements are computed at once, by
+// comparing with every element.  This is O(n^2), but branch-free and vectorized, and much faster
+// than nth_element() for small n.  With ties, v[i] is the k-th smallest if nlt(i) <= k < n - ngt(i),
+// where nlt(i) (resp. ngt(i)) is the number of elements less (resp. greater) than v[i].  (A padding
+// element is only selected if the answer is FLT_MAX.)
+template<unsigned int S>
+inline void _select_two(float &x0, float &x1, const float *v, int n, int k0, int k1)
+{
+    const simd_t<float,S> zero = simd_t<float,S>::zero();
+    const simd_t<float,S> one = simd_t<float,S>(1.0f);
+    const simd_t<float,S> lt0 = simd_t<float,S>(k0+1);
+    const simd_t<float,S> lt1 = simd_t<float,S>(k1+1);
+    const simd_t<float,S> gt0 = simd_t<float,S>(n-k0);
+    const simd_t<float,S> gt1 = simd_t<float,S>(n-k1);
+
+    simd_t<float,S> s0 = simd_t<float,S>(-numeric_limits<float>::max());
+    simd_t<float,S> s1 = simd_t<float,S>(-numeric_limits<float>::max());
+
+    for (int i = 0; i < n; i += S) {
+	simd_t<float,S> vi = simd_t<float,S>::loadu(v + i);
+	simd_t<float,S> nlt = zero;
+	simd_t<float,S> ngt = zero;
+
+	for (int j = 0; j < n; j++) {
+	    simd_t<float,S> vj = simd_t<float,S>(v[j]);
+	    nlt += one.apply_mask(vj.compare_lt(vi));
+	    ngt += one.apply_mask(vj.compare_gt(vi));
+	}
+
+	s0 = blendv(nlt.compare_lt(lt0).bitwise_and(ngt.compare_lt(gt0)), vi, s0);
+	s1 = blendv(nlt.compare_lt(lt1).bitwise_and(ngt.compare_lt(gt1)), vi, s1);
+    }
+
+    float t0[S], t1[S];
+    s0.storeu(t0);
+    s1.storeu(t1);
+
+    x0 = t0[0];
+    x1 = t1[0];
+
+    for (unsigned int i = 1; i < S; i++) {
+	x0 = max(x0, t0[i]);
+	x1 = max(x1, t1[i]);
+    }
+}
+
+
+// A double heap which supports insertion, removal by "slot" (an index into the ring buffer
+// of window samples), and median queries.  To use the same sift logic for both heaps, the
+// values in the max-heap 'lo' are stored with a minus sign, so that both are min-heaps.
+class median_heap {
+public:
+    // Empties the heap, and sets the number of slots (the window length).
+    void reset(int nslots)
+    {
+	this->lo.resize(nslots/2 + 2);
+	this->hi.resize(nslots/2 + 2);
+	this->where.assign(nslots, 0);
+	this->nlo = 0;
+	this->nhi = 0;
+    }
+
+    inline void insert(int slot, float x)
+    {
+	if ((nlo == 0) || (x <= -lo[0].x))
+	    push(&lo[0], nlo, entry{-x,slot}, -1);
+	else
+	    push(&hi[0], nhi, entry{x,slot}, 1);
+
+	rebalance();
+    }
+
+    // Replaces the sample in the given slot (which must be nonempty) by a new value.  This is
+    // equivalent to remove() followed by insert(), but faster, since the heap sizes don't change.
+    inline void replace(int slot, float x)
+    {
+	int w = where[slot];
+
+	if (w < 0) {
+	    lo[-w-1].x = -x;
+	    resift(&lo[0], nlo, -w-1, -1);
+	}
+	else {
+	    hi[w-1].x = x;
+	    resift(&hi[0], nhi, w-1, 1);
+	}
+
+	// If the new value is out of order, it is now at the top of its heap, and swapping the
+	// tops restores the invariant.
+	if ((nhi > 0) && (-lo[0].x > hi[0].x)) {
+	    entry e = lo[0];
+	    lo[0] = entry{ -hi[0].x, hi[0].slot };
+	    hi[0] = entry{ -e.x, e.slot };
+	    sift_down(&lo[0], nlo, 0, -1);
+	    sift_down(&hi[0], nhi, 0, 1);
+	}
+    }
+
+    inline bool contains(int slot) const { return where[slot] != 0; }
+    inline bool empty() const { return nlo == 0; }
+
+    // Removes the sample in the given slot, if the slot is nonempty.
+    inline void remove(int slot)
+    {
+	int w = where[slot];
+
+	if (w == 0)
+	    return;
+	else if (w < 0)
+	    erase(&lo[0], nlo, -w-1, -1);
+	else
+	    erase(&hi[0], nhi, w-1, 1);
+
+	rebalance();
+    }
+
+    // Caller must check that the heap is nonempty.
+    inline float median() const
+    {
+	return (nlo > nhi) ? (-lo[0].x) : (0.5f * (hi[0].x - lo[0].x));
+    }
+
+protected:
+    struct entry {
+	float x;
+	int slot;
+    };
+
+    // Invariant: nhi <= nlo <= nhi+1, and every element of 'lo' is <= every element of 'hi'.
+    vector<entry> lo;
+    vector<entry> hi;
+    int nlo = 0;
+    int nhi = 0;
+
+    // Indexed by slot: (k+1) if the sample is hi[k], -(k+1) if the sample is lo[k], or 0 if the slot is empty.
+    vector<int> where;
+
+    // In the helper functions below, 'tag' is -1 for the 'lo' heap and +1 for the 'hi' heap.
+
+    inline void sift_up(entry *h, int k, int tag)
+    {
+	entry e = h[k];
+
+	while (k > 0) {
+	    int p = (k-1) / 2;
+	    if (h[p].x <= e.x)
+		break;
+	    h[k] = h[p];
+	    where[h[k].slot] = tag * (k+1);
+	    k = p;
+	}
+
+	h[k] = e;
+	where[e.slot] = tag * (k+1);
+    }
+
+    inline void sift_down(entry *h, int n, int k, int tag)
+    {
+	entry e = h[k];
+
+	for (;;) {
+	    int c = 2*k + 1;
+	    if (c >= n)
+		break;
+	    if ((c+1 < n) && (h[c+1].x < h[c].x))
+		c++;
+	    if (e.x <= h[c].x)
+		break;
+	    h[k] = h[c];
+	    where[h[k].slot] = tag * (k+1);
+	    k = c;
+	}
+
+	h[k] = e;
+	where[e.slot] = tag * (k+1);
+    }
+
+    inline void push(entry *h, int &n, entry e, int tag)
+    {
+	h[n] = e;
+	sift_up(h, n++, tag);
+    }
+
+    inline void erase(entry *h, int &n, int k, int tag)
+    {
+	where[h[k].slot] = 0;
+
+	if (k == --n)
+	    return;
+
+	h[k] = h[n];
+	resift(h, n, k, tag);
+    }
+
+    // Restores the heap property after the value of h[k] has changed.
+    inline void resift(entry *h, int n, int k, int tag)
+    {
+	if ((k > 0) && (h[k].x < h[(k-1)/2].x))
+	    sift_up(h, k, tag);
+	else
+	    sift_down(h, n, k, tag);
+    }
+
+    inline entry pop(entry *h, int &n, int tag)
+    {
+	entry top = h[0];
+	erase(h, n, 0, tag);
+	return top;
+    }
+
+    inline void rebalance()
+    {
+	if (nlo > nhi + 1) {
+	    entry e = pop(&lo[0], nlo, -1);
+	    push(&hi[0], nhi, entry{-e.x,e.slot}, 1);
+	}
+	else if (nhi > nlo) {
+	    entry e = pop(&hi[0], nhi, 1);
+	    push(&lo[0], nlo, entry{-e.x,e.slot}, -1);
+	}
+    }
+};
+
+
+struct running_median_detrender : public wi_transform
+{
+    const int nt_window;
+    const int Dt;
+    const int nb_window;   // window length in blocks (= nt_window / Dt)
+    const int nb_lag;      // number of blocks after block b in the window for block b
+
+    vector<median_heap> heaps;   // one per frequency channel
+    vector<float> scratch;       // length Dt (rounded up to a multiple of S), used to compute block medians
+
+    ssize_t nb_processed = 0;    // number of blocks detrended so far in the current substream
+
+    running_median_detrender(int nt_chunk_, int nt_window_, int Dt_) :
+	nt_window(nt_window_), Dt(Dt_), nb_window(nt_window_ / Dt_), nb_lag((nt_window_ / Dt_) / 2)
+    {
+	stringstream ss;
+	ss << "running_median_detrender_cpp(nt_chunk=" << nt_chunk_ << ", axis=" << int(AXIS_TIME) << ", nt_window=" << nt_window;
+	if (Dt > 1)
+	    ss << ", Dt=" << Dt;
+	ss << ")";
+
+	this->name = ss.str();
+	this->nt_chunk = nt_chunk_;
+	this->nt_prepad = 0;
+	this->nt_postpad = nb_lag * Dt;
+	this->preserves_mask = true;
+    }
+
+    virtual void set_stream(const wi_stream &stream) override
+    {
+	this->nfreq = stream.nfreq;
+	static constexpr int S = constants::single_precision_simd_length;
+
+	this->heaps.resize(nfreq);
+	this->scratch.resize(S * ((Dt + S - 1) / S));
+    }
+
+    virtual void start_substream(int isubstream, double t0) override
+    {
+	for (auto &h: heaps)
+	    h.reset(nb_window);
+
+	this->nb_processed = 0;
+    }
+
+    // Computes the median of the unmasked samples in block ib.  Returns false if all samples are masked.
+    inline bool block_median(float &med, const float *ivec, const float *wvec, int ib)
+    {
+	static constexpr int S = constants::single_precision_simd_length;
+
+	if (Dt == 1) {
+	    med = ivec[ib];
+	    return (wvec[ib] > 0.0f);
+	}
+
+	int n = 0;
+	for (int i = ib*Dt; i < (ib+1)*Dt; i++)
+	    if (wvec[i] > 0.0f)
+		scratch[n++] = ivec[i];
+
+	if (n == 0)
+	    return false;
+
+	float *v = &scratch[0];
+
+	if (n <= max_rank_select) {
+	    for (int i = n; i < S * ((n+S-1)/S); i++)
+		v[i] = numeric_limits<float>::max();
+
+	    float lo;
+	    _select_two<S> (lo, med, v, n, (n-1)/2, n/2);
+
+	    if (n % 2 == 0)
+		med = 0.5f * (med + lo);
+	    return true;
+	}
+
+	nth_element(v, v + n/2, v + n);
+	med = v[n/2];
+
+	if (n % 2 == 0)
+	    med = 0.5f * (med + *max_element(v, v + n/2));
+
+	return true;
+    }
+
+    // Inserts block 'ib' (an index into the chunk) into the heap, replacing the block which leaves the window.
+    inline void update(median_heap &h, int slot, const float *ivec, const float *wvec, int ib)
+    {
+	float med;
+	bool valid = block_median(med, ivec, wvec, ib);
+
+	if (valid && h.contains(slot))
+	    h.replace(slot, med);
+	else if (valid)
+	    h.insert(slot, med);
+	else
+	    h.remove(slot);
+    }
+
+    virtual void process_chunk(double t0, double t1, float *intensity, float *weights, ssize_t stride, float *pp_intensity, float *pp_weights, ssize_t pp_stride) override
+    {
+	// At the beginning of the substream, blocks [0, nb_lag) must be inserted before the first
+	// output block.  After that, there is one insertion (and removal) per output block.
+	int nb_chunk = nt_chunk / Dt;
+	int ib0 = (nb_processed == 0) ? 0 : nb_lag;
+
+	for (int ifreq = 0; ifreq < nfreq; ifreq++) {
+	    median_heap &h = heaps[ifreq];
+	    float *ivec = intensity + ifreq * stride;
+	    const float *wvec = weights + ifreq * stride;
+
+	    // Slot of the next block to be inserted (at index ib in the chunk).
+	    int slot = (nb_processed + ib0) % nb_window;
+
+	    for (int ib = ib0; ib < nb_lag; ib++) {
+		update(h, slot, ivec, wvec, ib);
+		slot = (slot < nb_window-1) ? (slot+1) : 0;
+	    }
+
+	    for (int ib = 0; ib < nb_chunk; ib++) {
+		update(h, slot, ivec, wvec, ib + nb_lag);
+		slot = (slot < nb_window-1) ? (slot+1) : 0;
+
+		// If the heap is empty, then every sample in block ib is masked.
+		if (!h.empty()) {
+		    float med = h.median();
+		    for (int i = ib*Dt; i < (ib+1)*Dt; i++)
+			if (wvec[i] > 0.0f)
+			    ivec[i] -= med;
+		}
+	    }
+	}
+
+	this->nb_processed += nb_chunk;
+    }
+
+    virtual void end_substream() override { }
+};
+
+
+// externally visible
+shared_ptr<wi_transform> make_running_median_detrender(int nt_chunk, axis_type axis, int nt_window, int Dt)
+{
+    if (_unlikely(axis != AXIS_TIME))
+	throw runtime_error("rf_pipelines running median detrender: axis=" + stringify(axis) + " is not supported (currently only AXIS_TIME is implemented)");
+    if (_unlikely(Dt <= 0))
+	throw runtime_error("rf_pipelines running median detrender: Dt=" + to_string(Dt) + ", positive number expected");
+    if (_unlikely((nt_chunk <= 0) || (nt_chunk % Dt)))
+	throw runtime_error("rf_pipelines running median detrender: nt_chunk=" + to_string(nt_chunk) + " must be a positive multiple of Dt=" + to_string(Dt));
+    if (_unlikely((nt_window <= 0) || (nt_window % Dt)))
+	throw runtime_error("rf_pipelines running median detrender: nt_window=" + to_string(nt_window) + " must be a positive multiple of Dt=" + to_string(Dt));
+
+    return make_shared<running_median_detrender> (nt_chunk, nt_window, Dt);
+}
+
+
+}  // namespace rf_pipelines
@@ -0,0 +1,69 @@
+// Runtime choice between the S=8 (AVX2) and S=16 (AVX-512) kernel tables.
+//
+// If the library is compiled with HAVE_AVX512 (see Makefile), then the S=16 kernel tables are
+// compiled in kernel_tables_avx512.cpp, and we use them when the CPU supports AVX-512.  Otherwise,
+// or on older CPUs, we fall back to the S=8 tables.  This means that a single binary can be
+// deployed on both old and new hardware.
+//
+// The choice can be overridden by setting the environment variable RF_PIPELINES_SIMD to either
+// "avx2" or "avx512".  This is mostly intended for testing and timing.
+
+#include <cstdlib>
+#include "rf_pipelines_internals.hpp"
+
+using namespace std;
+
+namespace rf_pipelines {
+#if 0
+};  // pacify emacs c-mode!
+#endif
+
+
+static bool cpu_has_avx512()
+{
+#if defined(HAVE_AVX512) && (defined(__x86_64__) || defined(__i386__))
+    __builtin_cpu_init();
+    return __builtin_cpu_supports("avx512f") && __builtin_cpu_supports("avx512bw")
+	&& __builtin_cpu_supports("avx512dq") && __builtin_cpu_supports("avx512vl");
+#else
+    return false;
+#endif
+}
+
+
+static int _simd_dispatch_length()
+{
+    const char *s = getenv("RF_PIPELINES_SIMD");
+
+    if (!s || !s[0])
+	return cpu_has_avx512() ? 16 : 8;
+
+    string env(s);
+
+    if (env == "avx2")
+	return 8;
+
+    if (env != "avx512")
+	throw runtime_error("rf_pipelines: environment variable RF_PIPELINES_SIMD='" + env + "' is invalid (expected 'avx2' or 'avx512')");
+
+#ifndef HAVE_AVX512
+    throw runtime_error("rf_pipelines: environment variable RF_PIPELINES_SIMD='avx512' was specified, but rf_pipelines was compiled without HAVE_AVX512");
+#endif
+
+    if (_unlikely(!cpu_has_avx512()))
+	throw runtime_error("rf_pipelines: environment variable RF_PIPELINES_SIMD='avx512' was specified, but this CPU does not support AVX-512");
+
+    return 16;
+}
+
+
+// externally visible (declared in rf_pipelines_internals.hpp)
+int simd_dispatch_length()
+{
+    // Thread-safe initialization (C++11), evaluated once.
+    static const int ret = _simd_dispatch_length();
+    return ret;
+}
+
+
+}  // namespace rf_pipelines
@@ -0,0 +1,104 @@
+#include "rf_pipelines_internals.hpp"
+#include "kernels/spline.hpp"
+
+using namespace std;
+
+namespace rf_pipelines {
+#if 0
+}; // pacify emacs c-mode
+#endif
+
+
+struct spline_detrender : public wi_transform
+{
+    const axis_type axis;
+    const int nx_knot;
+    const double epsilon;
+
+    vector<float> basis;     // shape (4, nx_knot), see _spline_basis_init() in kernels/spline.hpp
+    vector<float> scratch;   // band matrix and vector, see kernels/spline.hpp
+
+    spline_detrender(int nt_chunk_, axis_type axis_, int nx_knot_, double epsilon_) :
+	axis(axis_), nx_knot(nx_knot_), epsilon(epsilon_)
+    {
+	stringstream ss;
+	ss << "spline_detrender_cpp(nt_chunk=" << nt_chunk_ << ", axis=" << int(axis) << ", nx_knot=" << nx_knot << ", epsilon=" << epsilon << ")";
+
+	this->name = ss.str();
+	this->nt_chunk = nt_chunk_;
+	this->nt_prepad = 0;
+	this->nt_postpad = 0;
+	this->preserves_mask = true;
+    }
+
+    virtual void set_stream(const wi_stream &stream) override
+    {
+	static constexpr int S = constants::single_precision_simd_length;
+
+	this->nfreq = stream.nfreq;
+
+	if (_unlikely((axis == AXIS_FREQ) && (nfreq % nx_knot)))
+	    throw runtime_error("rf_pipelines spline detrender: nfreq=" + to_string(nfreq) + " must be a multiple of nx_knot=" + to_string(nx_knot));
+
+	int nx = (axis == AXIS_TIME) ? nt_chunk : nfreq;
+	int nbasis = nx / nx_knot + 3;
+
+	this->basis.resize(4 * nx_knot);
+	this->scratch.resize(5 * nbasis * S);
+
+	_spline_basis_init(&basis[0], nx_knot);
+    }
+
+    virtual void process_chunk(double t0, double t1, float *intensity, float *weights, ssize_t stride, float *pp_intensity, float *pp_weights, ssize_t pp_stride) override
+    {
+	static constexpr int S = constants::single_precision_simd_length;
+
+	// Fully masked rows and chunks are skipped (see 'struct chunk_mask_info').  This doesn't change
+	// the output, since every basis function is dropped from the fit if all weights are zero.
+	if (mask_info) {
+	    mask_info->update();
+	    if (mask_info->all_masked())
+		return;
+	}
+
+	if ((axis == AXIS_TIME) && mask_info && (mask_info->nrows_masked > 0)) {
+	    mask_info->foreach_block_range(1, [&](ssize_t ifreq0, ssize_t ifreq1, bool masked) {
+		if (!masked)
+		    _kernel_spline_detrend_t<float,S> (ifreq1 - ifreq0, nt_chunk, intensity + ifreq0 * stride, weights + ifreq0 * stride, stride, nx_knot, &basis[0], epsilon, &scratch[0]);
+	    });
+	}
+	else if (axis == AXIS_TIME)
+	    _kernel_spline_detrend_t<float,S> (nfreq, nt_chunk, intensity, weights, stride, nx_knot, &basis[0], epsilon, &scratch[0]);
+	else
+	    _kernel_spline_detrend_f<float,S> (nfreq, nt_chunk, intensity, weights, stride, nx_knot, &basis[0], epsilon, &scratch[0]);
+    }
+
+    virtual void start_substream(int isubstream, double t0) override { }
+    virtual void end_substream() override { }
+};
+
+
+// externally visible
+shared_ptr<wi_transform> make_spline_detrender(int nt_chunk, axis_type axis, int nx_knot, double epsilon)
+{
+    static constexpr int S = constants::single_precision_simd_length;
+
+    if (_unlikely((axis != AXIS_FREQ) && (axis != AXIS_TIME)))
+	throw runtime_error("rf_pipelines spline detrender: axis=" + stringify(axis) + " is not defined for this transform");
+    if (_unlikely((nt_chunk <= 0) || (nt_chunk % S)))
+	throw runtime_error("rf_pipelines spline detrender: nt_chunk=" + to_string(nt_chunk)
+			    + " must be a positive multiple of constants::single_precision_simd_length=" + to_string(S));
+    if (_unlikely(nx_knot <= 0))
+	throw runtime_error("rf_pipelines spline detrender: nx_knot=" + to_string(nx_knot) + ", positive number expected");
+    if (_unlikely((axis == AXIS_TIME) && ((nx_knot % S) || (nt_chunk % nx_knot))))
+	throw runtime_error("rf_pipelines spline detrender: for axis=AXIS_TIME, nx_knot=" + to_string(nx_knot)
+			    + " must be a multiple of constants::single_precision_simd_length=" + to_string(S)
+			    + ", and a divisor of nt_chunk=" + to_string(nt_chunk));
+    if (_unlikely(epsilon <= 0.0))
+	throw runtime_error("rf_pipelines spline detrender: epsilon=" + to_string(epsilon) + ", positive number expected");
+
+    return make_shared<spline_detrender> (nt_chunk, axis, nx_knot, epsilon);
+}
+
+
+}  // namespace rf_pipelines
@@ -1,6 +1,6 @@
-// FIXME: currently we need to compile a new kernel for every (Df,Dt) pair, where
-// Df,Dt are the frequency/time downsampling factors.  Eventually I'd like to 
-// improve this by having special kernels to handle the large-Df and large-Dt cases.
+// We compile a specialized kernel for every (Df,Dt) pair up to constants::max_specialized_frequency_downsampling
+// and constants::max_specialized_time_downsampling, where Df,Dt are the frequency/time downsampling factors.
+// Larger factors are handled by downsampling in stages (see 'struct staged_downsampler').
 
 #include <array>
 #include <cassert>
@@ -8,7 +8,7 @@
 #include "rf_pipelines_internals.hpp"
 
 #include "kernels/mask.hpp"
-#include "kernels/std_dev_clippers.hpp"
+#include "kernels/kernel_tables.hpp"
 
 using namespace std;
 
@@ -23,52 +23,132 @@ using mask_t = simd_helpers::smask_t<float>;
 
 // -------------------------------------------------------------------------------------------------
 //
-// Externally-linkable helper function, declared "extern" in kernels/std_dev_clippers.hpp.
-// If the arguments change here, then declaration should be changed there as well!
+// clip_1d(): this is the last step of the std_dev_clipper, which is applied to the 1D array of
+// standard deviations (one per downsampled row or column).  Entries which differ from the mean
+// by more than (sigma * rms) are masked.
+//
+// If niter > 1, then the mean/rms are computed with iterated clipping, as in the intensity_clipper:
+// each iteration after the first only uses entries within (iter_sigma * rms) of the previous mean.
+// As in _kernel_wrms_iterate_2d(), we stop early if an iteration leaves (mean, rms) unchanged.
+//
+// The sums are vectorized, with single-precision accumulators over blocks of (B*S) entries,
+// and double-precision accumulators for the block sums (see _clip_1d_accumulate() below).
 
 
-void clip_1d(int n, float *tmp_sd, mask_t *tmp_valid, double sigma)
+// Accumulates (count, sum, sum of squares) of (sd[i] - shift), over entries such that valid[i]
+// is nonzero and |sd[i] - shift| < thresh.
+template<unsigned int S, unsigned int B>
+inline void _clip_1d_accumulate(double &acc0, double &acc1, double &acc2, int n, const float *sd, const mask_t *valid, float shift, float thresh)
 {
-#if 0
-    cerr << "clip_1d: [";
-    for (int i = 0; i < n; i++) {
-	if (tmp_valid[i])
-	    cerr << " " << tmp_sd[i];
-	else
-	    cerr << " -";
+    const simd_t<float,S> zero = simd_t<float,S>::zero();
+    const simd_t<float,S> one = simd_t<float,S>(1.0);
+    const simd_t<float,S> s = simd_t<float,S>(shift);
+    const simd_t<float,S> t = simd_t<float,S>(thresh);
+
+    int nv = n - (n % S);
+
+    acc0 = acc1 = acc2 = 0.0;
+
+    for (int i0 = 0; i0 < nv; i0 += B*S) {
+	int i1 = min(i0 + int(B*S), nv);
+
+	simd_t<float,S> b0 = zero;
+	simd_t<float,S> b1 = zero;
+	simd_t<float,S> b2 = zero;
+
+	for (int i = i0; i < i1; i += S) {
+	    simd_t<float,S> x = simd_t<float,S>::loadu(sd + i) - s;
+	    smask_t<float,S> m = smask_t<float,S>::loadu(valid + i);
+
+	    m = m.bitwise_and(x.abs().compare_lt(t));
+	    x = x.apply_mask(m);
+
+	    b0 += one.apply_mask(m);
+	    b1 += x;
+	    b2 += x * x;
+	}
+
+	acc0 += b0.horizontal_sum().template extract<0> ();
+	acc1 += b1.horizontal_sum().template extract<0> ();
+	acc2 += b2.horizontal_sum().template extract<0> ();
     }
-    cerr << " ]\n";
-#endif
 
-    float acc0 = 0.0;
-    float acc1 = 0.0;
-    
-    for (int i = 0; i < n; i++) {
-	if (tmp_valid[i]) {
+    for (int i = nv; i < n; i++) {
+	double x = double(sd[i]) - double(shift);
+	if (valid[i] && (fabs(x) < thresh)) {
 	    acc0 += 1.0;
-	    acc1 += tmp_sd[i];
+	    acc1 += x;
+	    acc2 += x * x;
 	}
     }
-    
+}
+
+
+// Masks entries with |sd[i] - mean| >= thresh.
+template<unsigned int S>
+inline void _clip_1d_mask(int n, const float *sd, mask_t *valid, float mean, float thresh)
+{
+    const simd_t<float,S> m = simd_t<float,S>(mean);
+    const simd_t<float,S> t = simd_t<float,S>(thresh);
+
+    int nv = n - (n % S);
+
+    for (int i = 0; i < nv; i += S) {
+	simd_t<float,S> x = simd_t<float,S>::loadu(sd + i);
+	smask_t<float,S> v = smask_t<float,S>::loadu(valid + i);
+
+	v = v.bitwise_and((x-m).abs().compare_lt(t));
+	v.storeu(valid + i);
+    }
+
+    for (int i = nv; i < n; i++) {
+	if (fabs(sd[i] - mean) >= thresh)
+	    valid[i] = 0;
+    }
+}
+
+
+// Externally-linkable helper function, declared "extern" in kernels/std_dev_clippers.hpp.
+// If the arguments change here, then declaration should be changed there as well!
+
+void clip_1d(int n, float *tmp_sd, mask_t *tmp_valid, double sigma, int niter, double iter_sigma)
+{
+    static constexpr int S = constants::single_precision_simd_length;
+    static constexpr int B = 16;
+
+    // Initial pass: the mean is computed first, then the variance is computed about the mean.
+    double acc0, acc1, acc2;
+    _clip_1d_accumulate<S,B> (acc0, acc1, acc2, n, tmp_sd, tmp_valid, 0.0f, numeric_limits<float>::max());
+
     if (acc0 < 1.5) {
 	memset(tmp_valid, 0, n * sizeof(mask_t));
 	return;
     }
-    
+
     float mean = acc1 / acc0;
-    float acc2 = 0.0;
-    
-    for (int i = 0; i < n; i++)
-	if (tmp_valid[i])
-	    acc2 += square(tmp_sd[i] - mean);
-    
-    float stdv = sqrtf(acc2/acc0);
-    float thresh = sigma * stdv;
+    _clip_1d_accumulate<S,B> (acc0, acc1, acc2, n, tmp_sd, tmp_valid, mean, numeric_limits<float>::max());
+
+    float rms = sqrt(max(acc2/acc0 - square(acc1/acc0), 0.0));
+
+    for (int iter = 1; iter < niter; iter++) {
+	_clip_1d_accumulate<S,B> (acc0, acc1, acc2, n, tmp_sd, tmp_valid, mean, iter_sigma * rms);
+
+	if (acc0 < 1.5) {
+	    memset(tmp_valid, 0, n * sizeof(mask_t));
+	    return;
+	}
+
+	float prev_mean = mean;
+	float prev_rms = rms;
 
-    for (int i = 0; i < n; i++) {
-	if (fabs(tmp_sd[i] - mean) >= thresh)
-	    tmp_valid[i] = 0;
+	mean = prev_mean + acc1/acc0;
+	rms = sqrt(max(acc2/acc0 - square(acc1/acc0), 0.0));
+
+	if ((mean == prev_mean) && (rms == prev_rms))
+	    break;
     }
+
+    _clip_1d_mask<S> (n, tmp_sd, tmp_valid, mean, sigma * rms);
 }
 
 
@@ -96,78 +176,49 @@ inline void allocate_buffers(std_dev_clipper_buffers<T> &buf, int nfreq, int nt,
 }
 
 
-// -------------------------------------------------------------------------------------------------
-//
-// std_dev_clipper_kernel_table
-
-
-// kernel(intensity, weights, nfreq, nt, stride, sigma, tmp_sd, tmp_valid)
-using std_dev_clipper_kernel_t = void (*)(const std_dev_clipper_buffers<float> &, const float *, float *, int, int, int, double);
-
-
-// Fills shape-(NDt,2,2) array indexed by (Dt,axis,two_pass)
-template<unsigned int S, unsigned int Df, unsigned int NDt, typename enable_if<(NDt==0),int>::type = 0>
-inline void fill_3d_std_dev_clipper_kernel_table(std_dev_clipper_kernel_t *out) { }
-
-template<unsigned int S, unsigned int Df, unsigned int NDt, typename enable_if<(NDt>0),int>::type = 0>
-inline void fill_3d_std_dev_clipper_kernel_table(std_dev_clipper_kernel_t *out) 
-{ 
-    static_assert(AXIS_FREQ == 0, "expected AXIS_FREQ==0");
-    static_assert(AXIS_TIME == 1, "expected AXIS_TIME==1");
-
-    fill_3d_std_dev_clipper_kernel_table<S,Df,NDt-1> (out);
-
-    constexpr unsigned int Dt = 1 << (NDt-1);
-    out[4*(NDt-1) + 2*AXIS_FREQ] = _kernel_std_dev_clip_freq_axis<float,S,Df,Dt,false>;
-    out[4*(NDt-1) + 2*AXIS_FREQ+1] = _kernel_std_dev_clip_freq_axis<float,S,Df,Dt,true>;
-    out[4*(NDt-1) + 2*AXIS_TIME] = _kernel_std_dev_clip_time_axis<float,S,Df,Dt,false>;
-    out[4*(NDt-1) + 2*AXIS_TIME+1] = _kernel_std_dev_clip_time_axis<float,S,Df,Dt,true>;
-}
+// Same as allocate_buffers(), but the buffers are borrowed from a clipper_workspace.
+template<typename T>
+inline void borrow_buffers(std_dev_clipper_buffers<T> &buf, clipper_workspace &ws, int nfreq, int nt, axis_type axis, int Df, int Dt, bool two_pass)
+{
+    int sd_nalloc = (axis == AXIS_FREQ) ? (nt/Dt) : (nfreq/Df);
 
-// Fills shape-(NDf,NDt,2,2) array indexed by (Df,Dt,axis,two_pass)
-template<unsigned int S, unsigned int NDf, unsigned int NDt, typename enable_if<(NDf==0),int>::type = 0>
-inline void fill_4d_std_dev_clipper_kernel_table(std_dev_clipper_kernel_t *out) { }
+    buf.owns_memory = false;
+    buf.sd = ws.get<T> (WS_SD, sd_nalloc);
+    buf.sd_valid = ws.get<smask_t<T,1>> (WS_SD_VALID, sd_nalloc);
 
-template<unsigned int S, unsigned int NDf, unsigned int NDt, typename enable_if<(NDf>0),int>::type = 0>
-inline void fill_4d_std_dev_clipper_kernel_table(std_dev_clipper_kernel_t *out) 
-{ 
-    fill_4d_std_dev_clipper_kernel_table<S,NDf-1,NDt> (out);
-    fill_3d_std_dev_clipper_kernel_table<S,(1<<(NDf-1)),NDt> (out + 4*(NDf-1)*NDt);
+    if (two_pass && ((Df > 1) || (Dt > 1))) {
+	buf.ds_intensity = ws.get<T> (WS_KERNEL_INTENSITY, (nfreq*nt) / (Df*Dt));
+	buf.ds_weights = ws.get<T> (WS_KERNEL_WEIGHTS, (nfreq*nt) / (Df*Dt));
+    }
 }
 
 
-struct std_dev_clipper_kernel_table {
-    static constexpr int S = constants::single_precision_simd_length;
-    static constexpr int MaxDf = constants::max_frequency_downsampling;
-    static constexpr int MaxDt = constants::max_time_downsampling;
-    static constexpr int NDf = IntegerLog2<MaxDf>() + 1;
-    static constexpr int NDt = IntegerLog2<MaxDt>() + 1;
-
-    // Weird: for some reason using std::max() here gives a clang linker (not compiler) error.
-    static constexpr int MaxD = (MaxDf > MaxDt) ? MaxDf : MaxDt;
+// -------------------------------------------------------------------------------------------------
+//
+// Kernel dispatch (the kernel tables themselves are in kernels/kernel_tables.hpp)
 
-    vector<std_dev_clipper_kernel_t> kernels;
 
-    integer_log2_lookup_table ilog2_lookup;
+static std_dev_clipper_kernel_table<constants::single_precision_simd_length> global_std_dev_clipper_kernel_table;
 
-    std_dev_clipper_kernel_table() :
-	kernels(4*NDf*NDt), ilog2_lookup(MaxD)
-    {
-	fill_4d_std_dev_clipper_kernel_table<S,NDf,NDt> (&kernels[0]);
-    }
 
-    // Caller must call check_params()!
-    inline std_dev_clipper_kernel_t get_kernel(axis_type axis, int Df, int Dt, bool two_pass)
-    {
-	int idf = ilog2_lookup(Df);
-	int idt = ilog2_lookup(Dt);
+// Caller must call check_params()!
+//
+// If (Df,Dt) exceeds the largest specialized kernel, then the returned kernel is for the
+// factors (staged_downsampler::kernel_Df(Df), staged_downsampler::kernel_Dt(Dt)).
 
-	return kernels[4*(idf*NDt+idt) + 2*axis + (two_pass ? 1 : 0)];
-    }
-};
+static std_dev_clipper_kernel_t get_std_dev_clipper_kernel(axis_type axis, int nt, int Df, int Dt, bool two_pass)
+{
+    int Dk_f = staged_downsampler::kernel_Df(Df);
+    int Dk_t = staged_downsampler::kernel_Dt(Dt);
 
+#ifdef HAVE_AVX512
+    // The kernel runs on an array of length nt/(Dt/Dk_t), so this is equivalent to checking (nt/(Dt/Dk_t)) % (16*Dk_t).
+    if ((simd_dispatch_length() == 16) && (nt % (16*Dt) == 0))
+	return get_avx512_std_dev_clipper_kernel(axis, Dk_f, Dk_t, two_pass);
+#endif
 
-static std_dev_clipper_kernel_table global_std_dev_clipper_kernel_table;
+    return global_std_dev_clipper_kernel_table.get_kernel(axis, Dk_f, Dk_t, two_pass);
+}
 
 
 // -------------------------------------------------------------------------------------------------
@@ -182,28 +233,41 @@ struct std_dev_clipper_transform : public wi_transform
     const int nds_t;
     const axis_type axis;
     const bool two_pass;
+    const bool robust;
     
-    // Clipping threshold.
+    // Clipping threshold, and iterated clipping parameters (see clip_1d()).
     const double sigma;
+    const int niter;
+    const double iter_sigma;
 
     std_dev_clipper_kernel_t kernel;
     std_dev_clipper_buffers<float> buf;
 
+    // Only used if (Df,Dt) exceeds the largest specialized kernel.
+    staged_downsampler stage;
+
+    // Only used in robust mode.
+    clipper_workspace ws;
+
     // Noncopyable
     std_dev_clipper_transform(const std_dev_clipper_transform &) = delete;
     std_dev_clipper_transform &operator=(const std_dev_clipper_transform &) = delete;
 
-    std_dev_clipper_transform(int nds_f_, int nds_t_, axis_type axis_, int nt_chunk_, double sigma_, bool two_pass_, std_dev_clipper_kernel_t(kernel_))
-	: nds_f(nds_f_), nds_t(nds_t_), axis(axis_), two_pass(two_pass_), sigma(sigma_), kernel(kernel_)
+    std_dev_clipper_transform(int nds_f_, int nds_t_, axis_type axis_, int nt_chunk_, double sigma_, bool two_pass_, bool robust_, int niter_, double iter_sigma_, std_dev_clipper_kernel_t(kernel_))
+	: nds_f(nds_f_), nds_t(nds_t_), axis(axis_), two_pass(two_pass_), robust(robust_), sigma(sigma_), niter(niter_), iter_sigma(iter_sigma_ ? iter_sigma_ : sigma_), kernel(kernel_)
     {
 	stringstream ss;
         ss << "std_dev_clipper_transform_cpp(nt_chunk=" << nt_chunk_ << ", axis=" << axis
-           << ", sigma=" << sigma << ", Df=" << nds_f << ", Dt=" << nds_t << ", two_pass=" << two_pass << ")";
+           << ", sigma=" << sigma << ", Df=" << nds_f << ", Dt=" << nds_t << ", two_pass=" << two_pass << ", robust=" << robust;
+	if (niter > 1)
+	    ss << ", niter=" << niter << ", iter_sigma=" << iter_sigma;
+	ss << ")";
 	
         this->name = ss.str();
 	this->nt_chunk = nt_chunk_;
 	this->nt_prepad = 0;
 	this->nt_postpad = 0;
+	this->preserves_mask = true;
     }
 
     virtual void set_stream(const wi_stream &stream) override
@@ -213,13 +277,43 @@ struct std_dev_clipper_transform : public wi_transform
 				+ ") is not divisible by frequency downsampling factor Df=" + to_string(nds_f));
 
 	this->nfreq = stream.nfreq;
+	this->stage.init(nfreq, nt_chunk, nds_f, nds_t);
 	
-	allocate_buffers(this->buf, nfreq, nt_chunk, axis, nds_f, nds_t, two_pass);
+	allocate_buffers(this->buf, stage.nfreq_ds, stage.nt_ds, axis, stage.Df_kernel, stage.Dt_kernel, two_pass);
     }
 
     virtual void process_chunk(double t0, double t1, float *intensity, float *weights, ssize_t stride, float *pp_intensity, float *pp_weights, ssize_t pp_stride) override
     {
-	this->kernel(buf, intensity, weights, nfreq, nt_chunk, stride, sigma);
+	// Clipping doesn't change a fully masked chunk (see 'struct chunk_mask_info').
+	if (mask_info) {
+	    mask_info->update();
+	    if (mask_info->all_masked())
+		return;
+	}
+
+	if (robust) {
+	    robust_std_dev_clip(intensity, weights, nfreq, nt_chunk, stride, axis, sigma, nds_f, nds_t, ws);
+	    return;
+	}
+
+	if (!stage.is_active())
+	    this->kernel(buf, intensity, weights, nfreq, nt_chunk, stride, niter, sigma, iter_sigma);
+	else {
+	    stage.downsample(intensity, weights, stride, this->ds_cache, this->mask_info);
+	    this->kernel(buf, stage.intensity_ds, stage.weights_ds, stage.nfreq_ds, stage.nt_ds, stage.nt_ds, niter, sigma, iter_sigma);
+	    stage.upsample_mask(weights, stride);
+	}
+
+	// If axis=AXIS_TIME, then the kernel has masked every block of Df rows whose 'sd_valid' entry
+	// is zero.  We record these rows, so that later transforms don't need to scan them.
+	if (mask_info && (axis == AXIS_TIME)) {
+	    for (int i = 0; i < nfreq / nds_f; i++) {
+		if (buf.sd_valid[i])
+		    continue;
+		for (int ifreq = i*nds_f; ifreq < (i+1)*nds_f; ifreq++)
+		    mask_info->mask_row(ifreq);
+	    }
+	}
     }
 
     virtual void start_substream(int isubstream, double t0) override { }
@@ -230,17 +324,15 @@ struct std_dev_clipper_transform : public wi_transform
 // -------------------------------------------------------------------------------------------------
 
 
-static void check_params(int Df, int Dt, axis_type axis, int nfreq, int nt, int stride, double sigma)
+static void check_params(int Df, int Dt, axis_type axis, int nfreq, int nt, int stride, double sigma, int niter, double iter_sigma, bool two_pass, bool robust)
 {
     static constexpr int S = constants::single_precision_simd_length;
-    static constexpr int MaxDf = constants::max_frequency_downsampling;
-    static constexpr int MaxDt = constants::max_time_downsampling;
 
-    if (_unlikely((Df <= 0) || !is_power_of_two(Df)))
-	throw runtime_error("rf_pipelines std_dev clipper: Df=" + to_string(Df) + " must be a power of two");
+    if (_unlikely(Df <= 0))
+	throw runtime_error("rf_pipelines std_dev clipper: Df=" + to_string(Df) + ", positive value was expected");
 
-    if (_unlikely((Dt <= 0) || !is_power_of_two(Dt)))
-	throw runtime_error("rf_pipelines std_dev clipper: Dt=" + to_string(Dt) + " must be a power of two");
+    if (_unlikely(Dt <= 0))
+	throw runtime_error("rf_pipelines std_dev clipper: Dt=" + to_string(Dt) + ", positive value was expected");
 
     if (_unlikely((axis != AXIS_FREQ) && (axis != AXIS_TIME)))
 	throw runtime_error("rf_pipelines std_dev clipper: axis=" + stringify(axis) + " is not defined for this transform");
@@ -257,6 +349,18 @@ static void check_params(int Df, int Dt, axis_type axis, int nfreq, int nt, int
     if (_unlikely(sigma < 1.0))
 	throw runtime_error("rf_pipelines std_dev clipper: sigma=" + to_string(sigma) + " must be >= 1.0");
 
+    if (_unlikely(niter < 1))
+	throw runtime_error("rf_pipelines std_dev clipper: niter=" + to_string(niter) + " must be >= 1");
+
+    if (_unlikely(robust && (niter != 1)))
+	throw runtime_error("rf_pipelines std_dev clipper: niter=" + to_string(niter) + " was specified, but niter=1 is required in robust mode");
+
+    if (_unlikely(robust && two_pass))
+	throw runtime_error("rf_pipelines std_dev clipper: two_pass=true is not supported in robust mode");
+
+    if (_unlikely((iter_sigma < 1.0) && (iter_sigma != 0.0)))
+	throw runtime_error("rf_pipelines std_dev clipper: iter_sigma=" + to_string(iter_sigma) + " must be >= 1.0 (or zero, to use the same value as sigma)");
+
     if (_unlikely((nfreq % Df) != 0))
 	throw runtime_error("rf_pipelines std_dev clipper: nfreq=" + to_string(nfreq)
 			    + " must be a multiple of the downsampling factor Df=" + to_string(Df));
@@ -265,40 +369,256 @@ static void check_params(int Df, int Dt, axis_type axis, int nfreq, int nt, int
 	throw runtime_error("rf_pipelines std_dev clipper: nt=" + to_string(nt)
 			    + " must be a multiple of the downsampling factor Dt=" + to_string(Dt)
 			    + " multiplied by constants::single_precision_simd_length=" + to_string(S));
-
-    if (_unlikely((Df > MaxDf) || (Dt > MaxDt)))
-	throw runtime_error("rf_pipelines std_dev clipper: (Df,Dt)=(" + to_string(Df) + "," + to_string(Dt) + ")"
-			    + " exceeds compile time limits; to fix this see 'constants' in rf_pipelines.hpp");
 }
 
 
 // Externally callable
-shared_ptr<wi_transform> make_std_dev_clipper(int nt_chunk, axis_type axis, double sigma, int Df, int Dt, bool two_pass)
+shared_ptr<wi_transform> make_std_dev_clipper(int nt_chunk, axis_type axis, double sigma, int Df, int Dt, bool two_pass, bool robust, int niter, double iter_sigma)
 {
     int dummy_nfreq = Df;         // arbitrary
     int dummy_stride = nt_chunk;  // arbitrary
-    check_params(Df, Dt, axis, dummy_nfreq, nt_chunk, dummy_stride, sigma);
+    check_params(Df, Dt, axis, dummy_nfreq, nt_chunk, dummy_stride, sigma, niter, iter_sigma, two_pass, robust);
 
-    auto kernel = global_std_dev_clipper_kernel_table.get_kernel(axis, Df, Dt, two_pass);
-    return make_shared<std_dev_clipper_transform> (Df, Dt, axis, nt_chunk, sigma, two_pass, kernel);
+    auto kernel = get_std_dev_clipper_kernel(axis, nt_chunk, Df, Dt, two_pass);
+    return make_shared<std_dev_clipper_transform> (Df, Dt, axis, nt_chunk, sigma, two_pass, robust, niter, iter_sigma, kernel);
 }
 
 
 // Externally callable
-void apply_std_dev_clipper(const float *intensity, float *weights, int nfreq, int nt, int stride, axis_type axis, double sigma, int Df, int Dt, bool two_pass)
+void apply_std_dev_clipper(const float *intensity, float *weights, int nfreq, int nt, int stride, axis_type axis, double sigma, int Df, int Dt, bool two_pass, bool robust, int niter, double iter_sigma, clipper_workspace *ws)
 {
-    check_params(Df, Dt, axis, nfreq, nt, stride, sigma);
+    check_params(Df, Dt, axis, nfreq, nt, stride, sigma, niter, iter_sigma, two_pass, robust);
 
     if (_unlikely(!intensity))
 	throw runtime_error("rf_pipelines: apply_std_dev_clipper(): NULL intensity pointer");
     if (_unlikely(!weights))
 	throw runtime_error("rf_pipelines: apply_std_dev_clipper(): NULL weights pointer");
 
+    clipper_workspace &w = ws ? (*ws) : clipper_workspace::thread_local_default();
+
+    if (robust) {
+	robust_std_dev_clip(intensity, weights, nfreq, nt, stride, axis, sigma, Df, Dt, w);
+	return;
+    }
+
+    // Same convention as make_std_dev_clipper(): iter_sigma=0 means "same as sigma".
+    if (iter_sigma == 0.0)
+	iter_sigma = sigma;
+
+    staged_downsampler stage;
+    stage.init(nfreq, nt, Df, Dt, &w);
+
+    std_dev_clipper_buffers<float> buf;
+    borrow_buffers(buf, w, stage.nfreq_ds, stage.nt_ds, axis, stage.Df_kernel, stage.Dt_kernel, two_pass);
+
+    auto kernel = get_std_dev_clipper_kernel(axis, nt, Df, Dt, two_pass);
+
+    if (stage.is_active()) {
+	stage.downsample(intensity, weights, stride);
+	kernel(buf, stage.intensity_ds, stage.weights_ds, stage.nfreq_ds, stage.nt_ds, stage.nt_ds, niter, sigma, iter_sigma);
+	stage.upsample_mask(weights, stride);
+    }
+    else
+	kernel(buf, intensity, weights, nfreq, nt, stride, niter, sigma, iter_sigma);
+}
+
+
+// -------------------------------------------------------------------------------------------------
+//
+// blocked_std_dev_clipper (see rf_pipelines_internals.hpp)
+
+
+// static member function
+bool blocked_std_dev_clipper::is_blockable(int Df, int Dt, bool robust)
+{
+    return !robust && (staged_downsampler::kernel_Df(Df) == Df) && (staged_downsampler::kernel_Dt(Dt) == Dt);
+}
+
+
+blocked_std_dev_clipper::blocked_std_dev_clipper(int nfreq_, int nt_, axis_type axis_, double sigma_, int Df_, int Dt_, bool two_pass_, int niter_, double iter_sigma_) :
+    nfreq(nfreq_), nt(nt_), axis(axis_), sigma(sigma_), Df(Df_), Dt(Dt_), two_pass(two_pass_), niter(niter_),
+    iter_sigma(iter_sigma_ ? iter_sigma_ : sigma_), nsd((axis_ == AXIS_FREQ) ? (nt_/Dt_) : (nfreq_/Df_))
+{
+    rf_assert(is_blockable(Df, Dt, false));
+
+    // Same kernel as get_std_dev_clipper_kernel(), so that the variances are bitwise identical.
+#ifdef HAVE_AVX512
+    if (uses_avx512())
+	this->kernel = get_avx512_std_dev_kernel(axis, Df, Dt, two_pass);
+    else
+#endif
+	this->kernel = global_std_dev_clipper_kernel_table.get_sd_kernel(axis, Df, Dt, two_pass);
+
+    // The 'ds_intensity' and 'ds_weights' buffers are sized for the whole chunk, which is more than
+    // the kernel needs when it runs on a block.
+    this->buf = new std_dev_clipper_buffers<float> ();
+    allocate_buffers(*buf, nfreq, nt, axis, Df, Dt, two_pass);
+}
+
+
+blocked_std_dev_clipper::~blocked_std_dev_clipper()
+{
+    delete buf;
+    buf = nullptr;
+}
+
+
+bool blocked_std_dev_clipper::uses_avx512() const
+{
+#ifdef HAVE_AVX512
+    return (simd_dispatch_length() == 16) && (nt % (16*Dt) == 0);
+#else
+    return false;
+#endif
+}
+
+
+void blocked_std_dev_clipper::compute_sd(const float *intensity, const float *weights, int stride, int i0, int n)
+{
+    std_dev_clipper_buffers<float> b;
+    b.owns_memory = false;
+    b.ds_intensity = buf->ds_intensity;
+    b.ds_weights = buf->ds_weights;
+
+    if (axis == AXIS_TIME) {
+	b.sd = buf->sd + i0/Df;
+	b.sd_valid = buf->sd_valid + i0/Df;
+	kernel(b, intensity + i0*stride, weights + i0*stride, n, nt, stride);
+    }
+    else {
+	b.sd = buf->sd + i0/Dt;
+	b.sd_valid = buf->sd_valid + i0/Dt;
+	kernel(b, intensity + i0, weights + i0, nfreq, n, stride);
+    }
+}
+
+
+// A fully masked row (or column) has zero variance, and is always invalid.
+void blocked_std_dev_clipper::skip_sd(int i0, int n)
+{
+    int D = (axis == AXIS_TIME) ? Df : Dt;
+
+    for (int i = i0/D; i < (i0+n)/D; i++) {
+	buf->sd[i] = 0.0;
+	buf->sd_valid[i] = 0;
+    }
+}
+
+
+void blocked_std_dev_clipper::clip()
+{
+    clip_1d(nsd, buf->sd, buf->sd_valid, sigma, niter, iter_sigma);
+}
+
+
+void blocked_std_dev_clipper::apply_mask(float *weights, int stride, int f0, int nf, int t0, int nt_) const
+{
+    for (int ifreq = f0; ifreq < f0+nf; ifreq++) {
+	float *wrow = weights + ifreq*stride;
+
+	if (axis == AXIS_TIME) {
+	    if (!buf->sd_valid[ifreq/Df])
+		memset(wrow + t0, 0, nt_ * sizeof(float));
+	    continue;
+	}
+
+	for (int i = t0/Dt; i < (t0+nt_)/Dt; i++)
+	    if (!buf->sd_valid[i])
+		memset(wrow + i*Dt, 0, Dt * sizeof(float));
+    }
+}
+
+
+bool blocked_std_dev_clipper::is_row_masked(int ifreq) const
+{
+    return (axis == AXIS_TIME) && !buf->sd_valid[ifreq/Df];
+}
+
+
+// -------------------------------------------------------------------------------------------------
+//
+// Multithreaded std_dev clipper.
+//
+// The std_dev clipper isn't local in either axis, since the outlier threshold depends on the
+// variances of all rows (or columns).  The array is downsampled first (in parallel), then the
+// variances are computed in parallel over blocks of rows (or columns), using the same kernels
+// as the single-threaded clipper with (Df,Dt)=(1,1).  Then clip_1d() runs in the calling thread
+// (it only sees one value per row or column), and the mask is applied in parallel.
+
+
+template<bool TwoPass>
+static void parallel_std_dev_clip(int nthreads, const float *intensity, float *weights, int nfreq, int nt, int stride, axis_type axis, double sigma, int Df, int Dt, int niter, double iter_sigma)
+{
+    static constexpr int S = constants::single_precision_simd_length;
+
+    parallel_downsampler ds(nthreads, intensity, weights, nfreq, nt, stride, Df, Dt);
+
+    int nsd = (axis == AXIS_FREQ) ? ds.nt_ds : ds.nfreq_ds;
+
     std_dev_clipper_buffers<float> buf;
-    allocate_buffers(buf, nfreq, nt, axis, Df, Dt, two_pass);
+    buf.sd = aligned_alloc<float> (nsd);
+    buf.sd_valid = aligned_alloc<mask_t> (nsd);
+
+    if (axis == AXIS_TIME) {
+	parallel_for(nthreads, ds.nfreq_ds, 1, [&](int ithread, int f0, int f1) {
+	    std_dev_clipper_buffers<float> b;
+	    b.owns_memory = false;
+	    b.sd = buf.sd + f0;
+	    b.sd_valid = buf.sd_valid + f0;
+
+	    _kernel_std_dev_t<float,S,1,1,TwoPass> (b, ds.intensity + f0*ds.stride, ds.weights + f0*ds.stride, f1-f0, ds.nt_ds, ds.stride);
+	});
+
+	clip_1d(nsd, buf.sd, buf.sd_valid, sigma, niter, iter_sigma);
+
+	parallel_for(nthreads, nfreq, Df, [&](int ithread, int f0, int f1) {
+	    for (int ifreq = f0; ifreq < f1; ifreq++)
+		if (!buf.sd_valid[ifreq/Df])
+		    memset(weights + ifreq*stride, 0, nt * sizeof(float));
+	});
+
+	return;
+    }
+
+    parallel_for(nthreads, ds.nt_ds, S, [&](int ithread, int t0, int t1) {
+	std_dev_clipper_buffers<float> b;
+	b.owns_memory = false;
+	b.sd = buf.sd + t0;
+	b.sd_valid = buf.sd_valid + t0;
 
-    auto kernel = global_std_dev_clipper_kernel_table.get_kernel(axis, Df, Dt, two_pass);
-    kernel(buf, intensity, weights, nfreq, nt, stride, sigma);
+	_kernel_std_dev_f<float,S,1,1,TwoPass> (b, ds.intensity + t0, ds.weights + t0, ds.nfreq_ds, t1-t0, ds.stride);
+    });
+
+    clip_1d(nsd, buf.sd, buf.sd_valid, sigma, niter, iter_sigma);
+
+    parallel_for(nthreads, ds.nfreq_ds, 1, [&](int ithread, int f0, int f1) {
+	_kernel_mask_columns<float,S,1> (ds.weights + f0*ds.stride, buf.sd_valid, f1-f0, ds.nt_ds, ds.stride);
+    });
+
+    ds.upsample_mask(weights, stride);
+}
+
+
+// Externally callable
+void apply_std_dev_clipper_parallel(int nthreads, const float *intensity, float *weights, int nfreq, int nt, int stride, axis_type axis, double sigma, int Df, int Dt, bool two_pass, bool robust, int niter, double iter_sigma)
+{
+    check_params(Df, Dt, axis, nfreq, nt, stride, sigma, niter, iter_sigma, two_pass, robust);
+
+    if (_unlikely(!intensity))
+	throw runtime_error("rf_pipelines: apply_std_dev_clipper_parallel(): NULL intensity pointer");
+    if (_unlikely(!weights))
+	throw runtime_error("rf_pipelines: apply_std_dev_clipper_parallel(): NULL weights pointer");
+
+    if (iter_sigma == 0.0)
+	iter_sigma = sigma;
+
+    // The robust clipper needs the median of all variances, and isn't parallelized.
+    if (robust)
+	apply_std_dev_clipper(intensity, weights, nfreq, nt, stride, axis, sigma, Df, Dt, two_pass, robust);
+    else if (two_pass)
+	parallel_std_dev_clip<true> (nthreads, intensity, weights, nfreq, nt, stride, axis, sigma, Df, Dt, niter, iter_sigma);
+    else
+	parallel_std_dev_clip<false> (nthreads, intensity, weights, nfreq, nt, stride, axis, sigma, Df, Dt, niter, iter_sigma);
 }
 
 
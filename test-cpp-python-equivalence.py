@@ -90,8 +90,9 @@ def random_divisor(n):
 
 def test_utils():
     for iter in xrange(1000):
-        Df = 2**rand.randint(0,6)
-        Dt = 2**rand.randint(0,6)
+        # Downsampling factors include some non-powers of two (3 * 2^n)
+        Df = rand.randint(1,4) * 2**rand.randint(0,5)
+        Dt = rand.randint(1,4) * 2**rand.randint(0,5)
         nfreq = Df * rand.randint(8,16)
         nt = Dt * 8 * rand.randint(1,8)
         two_pass = rand.randint(0,2)
@@ -134,7 +135,9 @@ def test_utils():
         # array, but takes a 'mean_hint' which is arbitrary (but numerical precision is higher if the
         # mean_hint is close to the true weighted mean intensity).
 
-        mean_hint = rand.standard_normal() * np.ones(8)  # FIXME hardcoded simd length
+        # The length of the mean_hint is the simd length of the dispatched kernel (see test 4 below).
+        simd_length = rf_pipelines_c._wrms_hack_for_testing1(copy_array(intensity), copy_array(weights)).size
+        mean_hint = rand.standard_normal() * np.ones(simd_length)
         (mean3, rms3) = rf_pipelines_c._wrms_hack_for_testing2(copy_array(intensity), copy_array(weights), mean_hint)
 
         epsilon_m = np.abs(mean1-mean3)
@@ -321,8 +324,8 @@ def test_clippers():
         sys.stderr.write('.')
 
         axis = rand.randint(0,2) if (rand.uniform() < 0.66) else None
-        Df = 2**rand.randint(0,6)
-        Dt = 2**rand.randint(0,6)
+        Df = rand.randint(1,4) * 2**rand.randint(0,5)
+        Dt = rand.randint(1,4) * 2**rand.randint(0,5)
         nfreq = Df * rand.randint(8,16)
         nt = Dt * 8 * rand.randint(1,8)
         thresh = rand.uniform(1.1, 1.3)
@@ -496,13 +499,14 @@ def test_iterated_intensity_clippers():
         # mean_hint.  We actually use _wrms_hack_for_testing2() instead of weighted_mean_rms(1)
         # in (*).
         #
-        # One more complication.  In the kernel, the mean_hint is a simd_t<float,8>, not a
-        # scalar float!  The 8 elements of the mean_hint will be nearly equal to the mean
-        # reported by weighted_mean_and_rms(niter), but not strictly equal, due to roundoffs.
+        # One more complication.  In the kernel, the mean_hint is a simd_t<float,S>, not a
+        # scalar float!  (Here S=8, or S=16 if the AVX-512 kernels are dispatched.)  The S
+        # elements of the mean_hint will be nearly equal to the mean reported by
+        # weighted_mean_and_rms(niter), but not strictly equal, due to roundoffs.
         #
         # Therefore we also introduce _wrms_hack_for_testing1(), which follows the exact
         # code paths of weighted_mean_and_rms(niter), but returns the mean_hint (represented
-        # in python as a shape-(8,) numpy array), rather than the scalar mean/rms.
+        # in python as a shape-(S,) numpy array), rather than the scalar mean/rms.
         #
         # So, in conclusion, what we actually compare in test 4 is:
         #    _wrms_hack_for_testing1(niter) -> _wrms_hack_for_testing2()   (*)
@@ -598,8 +602,8 @@ def make_random_transform():
     elif transform_type == 1:
         # intensity_clipper
         axis = rand.randint(0,2) if (rand.uniform() < 0.66) else None
-        Df = 2**rand.randint(0,6)
-        Dt = 2**rand.randint(0,6)
+        Df = rand.randint(1,4) * 2**rand.randint(0,5)
+        Dt = rand.randint(1,4) * 2**rand.randint(0,5)
         sigma = rand.uniform(1.1, 1.3)
         niter = rand.randint(1,5)
         iter_sigma = rand.uniform(1.8, 2.0)
@@ -696,7 +700,7 @@ def test_transforms():
             tf = test_finalizer(ti)
             transform_chain += [ ti, t, tf ]
 
-        nfreq = 32 * rand.randint(1, 8)
+        nfreq = 96 * rand.randint(1, 8)   # divisible by all frequency downsampling factors (up to 3*2^4)
         nt_tot = rand.randint(1000, 5000)
         freq_lo_MHz = 400.   # arbitrary
         freq_hi_MHz = 800.
@@ -13,6 +13,7 @@
 #include "rf_pipelines_internals.hpp"
 
 #include "kernels/polyfit.hpp"
+#include "kernels/spline.hpp"
 #include "kernels/intensity_clippers.hpp"
 
 using namespace std;
@@ -525,6 +526,392 @@ static void test_detrend_transpose(std::mt19937 &rng, int n1, int n2, int stride
 }
 
 
+// -------------------------------------------------------------------------------------------------
+//
+// Test the float, double, and mixed-precision detrending kernels against a reference polynomial
+// fit, which is done in double precision (with no check for poor conditioning, so the weights
+// should be well-conditioned).
+
+
+// Detrends a length-n strided array, writing the result to 'out' (also strided).
+static void reference_detrend_1d(double *out, int npl, int n, const float *ivec, const float *wvec, int stride)
+{
+    vector<double> zvec(n);
+    for (int i = 0; i < n; i++)
+	zvec[i] = 2 * (i+0.5) / double(n) - 1;
+
+    vector<double> pl = reference_legpoly_eval(npl, zvec);
+    vector<double> a(npl * npl, 0.0);
+    vector<double> b(npl, 0.0);
+
+    for (int l = 0; l < npl; l++) {
+	for (int l2 = 0; l2 < npl; l2++)
+	    for (int i = 0; i < n; i++)
+		a[l*npl+l2] += double(wvec[i*stride]) * pl[l*n+i] * pl[l2*n+i];
+	for (int i = 0; i < n; i++)
+	    b[l] += double(wvec[i*stride]) * pl[l*n+i] * double(ivec[i*stride]);
+    }
+
+    // Gaussian elimination (the matrix is positive definite, so no pivoting is needed).
+    for (int l = 0; l < npl; l++) {
+	for (int l2 = l+1; l2 < npl; l2++) {
+	    double t = a[l2*npl+l] / a[l*npl+l];
+	    for (int l3 = l; l3 < npl; l3++)
+		a[l2*npl+l3] -= t * a[l*npl+l3];
+	    b[l2] -= t * b[l];
+	}
+    }
+
+    for (int l = npl-1; l >= 0; l--) {
+	for (int l2 = l+1; l2 < npl; l2++)
+	    b[l] -= a[l*npl+l2] * b[l2];
+	b[l] /= a[l*npl+l];
+    }
+
+    for (int i = 0; i < n; i++) {
+	out[i*stride] = ivec[i*stride];
+	for (int l = 0; l < npl; l++)
+	    out[i*stride] -= b[l] * pl[l*n+i];
+    }
+}
+
+
+template<unsigned int S, unsigned int N>
+static void test_detrend_precision(std::mt19937 &rng, int nfreq, int nt, int stride)
+{
+    random_chunk c(rng, nfreq, nt, stride);
+
+    vector<double> ref_t(nfreq * stride, 0.0);
+    vector<double> ref_f(nfreq * stride, 0.0);
+
+    for (int ifreq = 0; ifreq < nfreq; ifreq++)
+	reference_detrend_1d(&ref_t[ifreq*stride], N, nt, c.intensity + ifreq*stride, c.weights + ifreq*stride, 1);
+
+    for (int it = 0; it < nt; it++)
+	reference_detrend_1d(&ref_f[it], N, nfreq, c.intensity + it, c.weights + it, stride);
+
+    // Tolerances for (float, double, mixed).  In the mixed case, the accumulation is done in single precision.
+    static const double tol[3] = { 1.0e-4, 1.0e-6, 1.0e-4 };
+
+    for (int axis = 0; axis < 2; axis++) {
+	for (int precision = 0; precision < 3; precision++) {
+	    vector<float> intensity(c.intensity, c.intensity + nfreq * stride);
+	    vector<float> weights(c.weights, c.weights + nfreq * stride);
+	    const vector<double> &ref = axis ? ref_f : ref_t;
+
+	    if (axis == 0) {
+		if (precision == 0)
+		    _kernel_detrend_t<float,S,N> (nfreq, nt, &intensity[0], &weights[0], stride);
+		else if (precision == 1)
+		    _kernel_detrend_t<double,S/2,N> (nfreq, nt, &intensity[0], &weights[0], stride);
+		else
+		    _kernel_detrend_t_mixed<S,N> (nfreq, nt, &intensity[0], &weights[0], stride);
+	    }
+	    else {
+		if (precision == 0)
+		    _kernel_detrend_f<float,S,N> (nfreq, nt, &intensity[0], &weights[0], stride);
+		else if (precision == 1)
+		    _kernel_detrend_f<double,S/2,N> (nfreq, nt, &intensity[0], &weights[0], stride);
+		else
+		    _kernel_detrend_f_mixed<S,N> (nfreq, nt, &intensity[0], &weights[0], stride);
+	    }
+
+	    double epsilon = 0.0;
+
+	    for (int ifreq = 0; ifreq < nfreq; ifreq++) {
+		for (int it = 0; it < nt; it++) {
+		    int i = ifreq*stride + it;
+		    assert(weights[i] == c.weights[i]);
+		    epsilon = max(epsilon, fabs(intensity[i] - ref[i]));
+		}
+	    }
+
+	    if (epsilon > tol[precision]) {
+		cerr << "test_detrend_precision failed (N=" << N << ", axis=" << axis 
+		     << ", precision=" << precision << "): epsilon=" << epsilon << endl;
+		exit(1);
+	    }
+	}
+    }
+}
+
+
+// -------------------------------------------------------------------------------------------------
+//
+// Test that _kernel_detrend_t() and _kernel_detrend_t_mixed(), which solve S rows per Cholesky
+// factorization, are bitwise identical to the one-row-at-a-time versions below.
+
+
+template<typename T, unsigned int S, unsigned int N>
+static void unbatched_detrend_t(int nfreq, int nt, float *intensity, float *weights, int stride, double epsilon=1.0e-2)
+{
+    for (int ifreq = 0; ifreq < nfreq; ifreq++) {
+	float *ivec = intensity + ifreq * stride;
+
+	simd_trimatrix<T,S,N> xmat;
+	simd_ntuple<T,S,N> xvec;
+
+	_kernel_detrend_t_pass1(xmat, xvec, nt, ivec, weights + ifreq*stride);
+
+	smask_t<T,S> flags = xmat.cholesky_in_place_checked(epsilon);
+
+	if (!flags.is_all_ones()) {
+	    memset(weights + ifreq*stride, 0, nt * sizeof(float));
+	    continue;
+	}
+
+	xmat.solve_lower_in_place(xvec);
+	xmat.solve_upper_in_place(xvec);
+
+	_kernel_detrend_t_pass2(ivec, nt, xvec);
+    }
+}
+
+
+template<unsigned int S, unsigned int N>
+static void unbatched_detrend_t_mixed(int nfreq, int nt, float *intensity, float *weights, int stride, double epsilon=1.0e-2)
+{
+    for (int ifreq = 0; ifreq < nfreq; ifreq++) {
+	float *ivec = intensity + ifreq * stride;
+
+	simd_trimatrix<float,S,N> xmat;
+	simd_ntuple<float,S,N> xvec;
+
+	_kernel_detrend_t_pass1(xmat, xvec, nt, ivec, weights + ifreq*stride);
+
+	simd_trimatrix<double,S/2,N> dmat;
+	simd_ntuple<double,S/2,N> dvec;
+
+	_kernel_split_lanes<S> (dmat, xmat, 0);
+	_kernel_split_lanes<S> (dvec, xvec, 0);
+
+	smask_t<double,S/2> flags = dmat.cholesky_in_place_checked(epsilon);
+
+	if (!flags.is_all_ones()) {
+	    memset(weights + ifreq*stride, 0, nt * sizeof(float));
+	    continue;
+	}
+
+	dmat.solve_lower_in_place(dvec);
+	dmat.solve_upper_in_place(dvec);
+
+	_kernel_merge_lanes<S> (xvec, dvec, 0);
+	_kernel_merge_lanes<S> (xvec, dvec, 1);
+
+	_kernel_detrend_t_pass2(ivec, nt, xvec);
+    }
+}
+
+
+template<unsigned int S, unsigned int N>
+static void test_detrend_t_batched(std::mt19937 &rng, int nfreq, int nt, int stride)
+{
+    random_chunk c(rng, nfreq, nt, stride);
+
+    // Some rows are badly conditioned, and some are fully masked.
+    for (int ifreq = 0; ifreq < nfreq; ifreq++) {
+	double u = std::uniform_real_distribution<>()(rng);
+	if (u < 0.2)
+	    make_weights_badly_conditioned(c.weights + ifreq*stride, rng, N-1, nt, 1);
+	else if (u < 0.3)
+	    memset(c.weights + ifreq*stride, 0, nt * sizeof(float));
+    }
+
+    int n = nfreq * stride;
+
+    for (int precision = 0; precision < 3; precision++) {
+	vector<float> intensity1(c.intensity, c.intensity + n), weights1(c.weights, c.weights + n);
+	vector<float> intensity2(c.intensity, c.intensity + n), weights2(c.weights, c.weights + n);
+
+	if (precision == 0) {
+	    _kernel_detrend_t<float,S,N> (nfreq, nt, &intensity1[0], &weights1[0], stride);
+	    unbatched_detrend_t<float,S,N> (nfreq, nt, &intensity2[0], &weights2[0], stride);
+	}
+	else if (precision == 1) {
+	    _kernel_detrend_t<double,S/2,N> (nfreq, nt, &intensity1[0], &weights1[0], stride);
+	    unbatched_detrend_t<double,S/2,N> (nfreq, nt, &intensity2[0], &weights2[0], stride);
+	}
+	else {
+	    _kernel_detrend_t_mixed<S,N> (nfreq, nt, &intensity1[0], &weights1[0], stride);
+	    unbatched_detrend_t_mixed<S,N> (nfreq, nt, &intensity2[0], &weights2[0], stride);
+	}
+
+	if (memcmp(&intensity1[0], &intensity2[0], n * sizeof(float)) || memcmp(&weights1[0], &weights2[0], n * sizeof(float))) {
+	    cerr << "test_detrend_t_batched failed (N=" << N << ", precision=" << precision << ", nfreq=" << nfreq << ")\n";
+	    exit(1);
+	}
+    }
+}
+
+
+// -------------------------------------------------------------------------------------------------
+//
+// Test that _kernel_detrend_f(), which processes tiles of several S-wide column groups per sweep,
+// is bitwise identical to the one-column-group-at-a-time version below.
+
+
+template<typename T, unsigned int S, unsigned int N, bool Mixed>
+static void untiled_detrend_f(int nfreq, int nt, float *intensity, float *weights, int stride, double epsilon=1.0e-2)
+{
+    for (int it = 0; it < nt; it += S) {
+	float *ivec = intensity + it;
+	float *wvec = weights + it;
+
+	simd_trimatrix<T,S,N> xmat;
+	simd_ntuple<T,S,N> xvec;
+
+	_kernel_detrend_f_pass1(xmat, xvec, nfreq, ivec, wvec, stride);
+
+	smask_t<T,S> flags = _kernel_detrend_f_solve<T,S,N,Mixed> (xmat, xvec, epsilon);
+
+	if (flags.is_all_zeros()) {
+	    _kernel_colzero_full<T,S> (wvec, nfreq, stride);
+	    continue;
+	}
+
+	_kernel_detrend_f_pass2(ivec, nfreq, xvec, stride);
+
+	if (!flags.is_all_ones())
+	    _kernel_colzero_partial<T,S> (wvec, nfreq, stride, flags);
+    }
+}
+
+
+template<unsigned int S, unsigned int N>
+static void test_detrend_f_tiled(std::mt19937 &rng, int nfreq, int nt, int stride)
+{
+    random_chunk c(rng, nfreq, nt, stride);
+
+    // Some S-wide column groups are fully masked, some are fully badly conditioned, and
+    // some are partially badly conditioned.
+    for (int it = 0; it < nt; it += S) {
+	double u = std::uniform_real_distribution<>()(rng);
+
+	for (int jt = it; jt < it + int(S); jt++) {
+	    if (u < 0.1)
+		make_weights_badly_conditioned(c.weights + jt, rng, 0, nfreq, stride);
+	    else if ((u < 0.2) || ((u < 0.4) && (std::uniform_real_distribution<>()(rng) < 0.5)))
+		make_weights_badly_conditioned(c.weights + jt, rng, N-1, nfreq, stride);
+	}
+    }
+
+    int n = nfreq * stride;
+
+    for (int precision = 0; precision < 3; precision++) {
+	vector<float> intensity1(c.intensity, c.intensity + n), weights1(c.weights, c.weights + n);
+	vector<float> intensity2(c.intensity, c.intensity + n), weights2(c.weights, c.weights + n);
+
+	if (precision == 0) {
+	    _kernel_detrend_f<float,S,N> (nfreq, nt, &intensity1[0], &weights1[0], stride);
+	    untiled_detrend_f<float,S,N,false> (nfreq, nt, &intensity2[0], &weights2[0], stride);
+	}
+	else if (precision == 1) {
+	    _kernel_detrend_f<double,S/2,N> (nfreq, nt, &intensity1[0], &weights1[0], stride);
+	    untiled_detrend_f<double,S/2,N,false> (nfreq, nt, &intensity2[0], &weights2[0], stride);
+	}
+	else {
+	    _kernel_detrend_f_mixed<S,N> (nfreq, nt, &intensity1[0], &weights1[0], stride);
+	    untiled_detrend_f<float,S,N,true> (nfreq, nt, &intensity2[0], &weights2[0], stride);
+	}
+
+	if (memcmp(&intensity1[0], &intensity2[0], n * sizeof(float)) || memcmp(&weights1[0], &weights2[0], n * sizeof(float))) {
+	    cerr << "test_detrend_f_tiled failed (N=" << N << ", precision=" << precision << ", nt=" << nt << ")\n";
+	    exit(1);
+	}
+    }
+}
+
+
+// -------------------------------------------------------------------------------------------------
+//
+// Test _kernel_detrend_t_sliding(), which updates the window moments incrementally, and refits from
+// scratch every 'nresync' steps.  In each step, the output is compared with a one-step call to the
+// kernel (which always fits from scratch), and with reference_detrend_1d() applied to the window.
+// On the steps where the kernel refits from scratch, the output should be bitwise identical to the
+// one-step call.
+
+
+template<unsigned int S, unsigned int N>
+static void test_detrend_t_sliding(std::mt19937 &rng, int nfreq)
+{
+    // The window contains at least 4*N samples, so that fits are well-conditioned unless most of the
+    // window is masked.
+    const int nt_step = S * std::uniform_int_distribution<>(1,2)(rng);
+    const int mmin = (4*int(N) + nt_step - 1) / (2*nt_step);
+    const int m = std::uniform_int_distribution<>(mmin,mmin+4)(rng);
+    const int nsteps = std::uniform_int_distribution<>(1,12)(rng);
+    const int nt_window = (2*m+1) * nt_step;
+    const int nt_pad = m * nt_step;
+    const int nt = nsteps * nt_step;
+    const int nt_tot = nt + 2*nt_pad;
+    const int nresync = std::max((2*m+1) / int((N+1)/2), 1);
+
+    // The undetrended data, including padding on both sides.  Some rows are fully masked, and in
+    // other rows, some samples are masked.
+    random_chunk c(rng, nfreq, nt_tot);
+    vector<bool> row_masked(nfreq, false);
+
+    for (int ifreq = 0; ifreq < nfreq; ifreq++) {
+	row_masked[ifreq] = (std::uniform_real_distribution<>()(rng) < 0.1);
+	for (int it = 0; it < nt_tot; it++)
+	    if (row_masked[ifreq] || (std::uniform_real_distribution<>()(rng) < 0.1))
+		c.weights[ifreq*c.stride + it] = 0.0f;
+    }
+
+    vector<float> scratch(2 * S * nt_tot);
+    vector<float> intensity(c.intensity, c.intensity + nfreq * c.stride);
+    vector<float> weights(c.weights, c.weights + nfreq * c.stride);
+
+    _kernel_detrend_t_sliding<double,S/2,N> (nfreq, nt, &intensity[nt_pad], &weights[nt_pad], c.stride,
+					     c.intensity, c.weights, c.stride, nt_step, nt_window, 1.0e-2, &scratch[0]);
+
+    vector<double> ref(nt_window);
+
+    for (int istep = 0; istep < nsteps; istep++) {
+	int it0 = istep * nt_step;
+
+	vector<float> intensity1(c.intensity, c.intensity + nfreq * c.stride);
+	vector<float> weights1(c.weights, c.weights + nfreq * c.stride);
+
+	_kernel_detrend_t_sliding<double,S/2,N> (nfreq, nt_step, &intensity1[it0+nt_pad], &weights1[it0+nt_pad], c.stride,
+						 c.intensity + it0, c.weights + it0, c.stride, nt_step, nt_window, 1.0e-2, &scratch[0]);
+
+	for (int ifreq = 0; ifreq < nfreq; ifreq++) {
+	    int i0 = ifreq*c.stride + it0 + nt_pad;
+	    bool exact = (istep % nresync) == 0;
+
+	    int count = 0;
+	    for (int i = i0 - nt_pad; i < i0 - nt_pad + nt_window; i++)
+		count += (c.weights[i] > 0.0f) ? 1 : 0;
+
+	    // If the window has fewer than N unmasked samples, then the step should be masked, and
+	    // its intensity should be unmodified.
+	    bool masked = (count < int(N));
+
+	    if (masked)
+		std::copy(c.intensity + i0 - nt_pad, c.intensity + i0 - nt_pad + nt_window, ref.begin());
+	    else
+		reference_detrend_1d(&ref[0], N, nt_window, c.intensity + i0 - nt_pad, c.weights + i0 - nt_pad, 1);
+
+	    for (int i = i0; i < i0 + nt_step; i++) {
+		assert(weights[i] == weights1[i]);
+		assert(weights[i] == (masked ? 0.0f : c.weights[i]));
+
+		double x = intensity[i];
+		double y = intensity1[i];
+		double z = ref[i - i0 + nt_pad];
+
+		if ((exact && (x != y)) || (fabs(x-y) > 1.0e-4) || (fabs(x-z) > 1.0e-4)) {
+		    cerr << "test_detrend_t_sliding failed (N=" << N << ", nt_step=" << nt_step << ", m=" << m
+			 << ", istep=" << istep << ", exact=" << exact << "): " << x << " " << y << " " << z << endl;
+		    exit(1);
+		}
+	    }
+	}
+    }
+}
+
+
 // -------------------------------------------------------------------------------------------------
 
 
@@ -559,6 +946,166 @@ static void run_all_polynomial_detrender_tests(std::mt19937 &rng)
 	int n2 = S * std::uniform_int_distribution<>((10*Nmax)/S,(20*Nmax)/S)(rng);
 	int stride2 = n2 + S * std::uniform_int_distribution<>(0,4)(rng);
 	test_detrend_transpose<T,S,Nmax> (rng, nt, n2, stride, stride2);
+
+	test_detrend_precision<S,Nmax> (rng, nfreq, nt, stride);
+	test_detrend_t_batched<S,Nmax> (rng, nfreq, nt, stride);
+	test_detrend_f_tiled<S,Nmax> (rng, nfreq, nt, stride);
+	test_detrend_t_sliding<S,Nmax> (rng, nfreq);
+    }
+}
+
+
+// -------------------------------------------------------------------------------------------------
+//
+// Test the cubic B-spline detrending kernels against a reference least-squares fit, which is done
+// in double precision with a dense normal matrix.  The reference evaluates the B-splines directly
+// (as shifted copies of the cardinal cubic B-spline), rather than using _spline_basis_init().
+
+
+// Cardinal cubic B-spline, supported on [0,4].
+static double reference_cubic_bspline(double t)
+{
+    if ((t <= 0.0) || (t >= 4.0))
+	return 0.0;
+    if (t < 1.0)
+	return t*t*t / 6.0;
+    if (t < 2.0)
+	return (-3*t*t*t + 12*t*t - 12*t + 4) / 6.0;
+    if (t < 3.0)
+	return (3*t*t*t - 24*t*t + 60*t - 44) / 6.0;
+    return (4-t) * (4-t) * (4-t) / 6.0;
+}
+
+
+// Detrends a length-n strided array, writing the result to 'out' (also strided).  Basis functions
+// whose support has zero total weight are dropped from the fit (this is the only case where the
+// kernels drop a basis function, if the weights are otherwise well-conditioned).
+static void reference_spline_detrend_1d(double *out, int n, int nx_knot, const float *ivec, const float *wvec, int stride)
+{
+    int nbasis = n / nx_knot + 3;
+
+    vector<double> bval(nbasis * n);
+    for (int k = 0; k < nbasis; k++)
+	for (int i = 0; i < n; i++)
+	    bval[k*n+i] = reference_cubic_bspline((i+0.5) / double(nx_knot) - k + 3);
+
+    // Indices of basis functions which are not dropped.
+    vector<int> kept;
+    for (int k = 0; k < nbasis; k++) {
+	double wsum = 0.0;
+	for (int i = 0; i < n; i++)
+	    wsum += (bval[k*n+i] > 0.0) ? double(wvec[i*stride]) : 0.0;
+	if (wsum > 0.0)
+	    kept.push_back(k);
+    }
+
+    int nk = kept.size();
+    vector<double> a(nk * nk, 0.0);
+    vector<double> b(nk, 0.0);
+
+    for (int k = 0; k < nk; k++) {
+	for (int k2 = 0; k2 < nk; k2++)
+	    for (int i = 0; i < n; i++)
+		a[k*nk+k2] += double(wvec[i*stride]) * bval[kept[k]*n+i] * bval[kept[k2]*n+i];
+	for (int i = 0; i < n; i++)
+	    b[k] += double(wvec[i*stride]) * bval[kept[k]*n+i] * double(ivec[i*stride]);
+    }
+
+    for (int k = 0; k < nk; k++) {
+	for (int k2 = k+1; k2 < nk; k2++) {
+	    double t = a[k2*nk+k] / a[k*nk+k];
+	    for (int k3 = k; k3 < nk; k3++)
+		a[k2*nk+k3] -= t * a[k*nk+k3];
+	    b[k2] -= t * b[k];
+	}
+    }
+
+    for (int k = nk-1; k >= 0; k--) {
+	for (int k2 = k+1; k2 < nk; k2++)
+	    b[k] -= a[k*nk+k2] * b[k2];
+	b[k] /= a[k*nk+k];
+    }
+
+    for (int i = 0; i < n; i++) {
+	out[i*stride] = ivec[i*stride];
+	for (int k = 0; k < nk; k++)
+	    out[i*stride] -= b[k] * bval[kept[k]*n+i];
+    }
+}
+
+
+template<typename T, unsigned int S>
+static void test_spline_detrend(std::mt19937 &rng, int axis)
+{
+    // Each basis function is supported on at least 2*S samples, so that the fit is well-conditioned
+    // (apart from dropped basis functions, see below).
+    int nx_knot = S * std::uniform_int_distribution<>(2,4)(rng);
+    int nb = std::uniform_int_distribution<>(2,6)(rng);
+    int nfreq = (axis == 0) ? std::uniform_int_distribution<>(1,3*S)(rng) : (nb * nx_knot);
+    int nt = (axis == 0) ? (nb * nx_knot) : (S * std::uniform_int_distribution<>(1,4)(rng));
+
+    random_chunk c(rng, nfreq, nt);
+
+    // Some samples are masked.  In some rows (or columns) the first bin is fully masked, so that
+    // the first basis function is dropped, and some rows (or columns) are fully masked.  (In rows
+    // where the first bin is masked, no other samples are masked, since the second basis function
+    // could then be dropped by the kernel, depending on epsilon.)
+    int nfit = (axis == 0) ? nfreq : nt;
+    int nx = (axis == 0) ? nt : nfreq;
+    int xstride = (axis == 0) ? 1 : c.stride;
+    int fstride = (axis == 0) ? c.stride : 1;
+
+    for (int i = 0; i < nfit; i++) {
+	double u = std::uniform_real_distribution<>()(rng);
+	for (int x = 0; x < nx; x++)
+	    if ((u < 0.1) || ((u < 0.3) && (x < nx_knot)) || ((u >= 0.3) && (std::uniform_real_distribution<>()(rng) < 0.1)))
+		c.weights[i*fstride + x*xstride] = 0.0f;
+    }
+
+    vector<float> basis(4 * nx_knot);
+    _spline_basis_init(&basis[0], nx_knot);
+
+    vector<T> scratch(5 * (nb+3) * S);
+    vector<float> intensity(c.intensity, c.intensity + nfreq * c.stride);
+    vector<double> ref(nfreq * c.stride, 0.0);
+
+    if (axis == 0)
+	_kernel_spline_detrend_t<T,S> (nfreq, nt, &intensity[0], c.weights, c.stride, nx_knot, &basis[0], 1.0e-2, &scratch[0]);
+    else
+	_kernel_spline_detrend_f<T,S> (nfreq, nt, &intensity[0], c.weights, c.stride, nx_knot, &basis[0], 1.0e-2, &scratch[0]);
+
+    for (int i = 0; i < nfit; i++)
+	reference_spline_detrend_1d(&ref[i*fstride], nx, nx_knot, c.intensity + i*fstride, c.weights + i*fstride, xstride);
+
+    for (int ifreq = 0; ifreq < nfreq; ifreq++) {
+	for (int it = 0; it < nt; it++) {
+	    int i = ifreq*c.stride + it;
+	    // If the first bin is masked, the fit is poorly conditioned near the edge, so the tolerance is
+	    // fairly large in single precision.  In masked samples, the fit is an extrapolation, which
+	    // amplifies roundoff error, so the tolerance is larger.  In fully masked rows (or columns),
+	    // every basis function is dropped, so the intensity should be unmodified.
+	    double tol = std::is_same<T,float>::value ? 1.0e-3 : 1.0e-5;
+	    tol *= (c.weights[i] > 0.0f) ? 1.0 : 100.0;
+	    bool unmodified = (ref[i] == c.intensity[i]);
+
+	    if ((unmodified && (intensity[i] != c.intensity[i])) || (fabs(intensity[i] - ref[i]) > tol * (1.0 + fabs(ref[i])))) {
+		cerr << "test_spline_detrend failed (T=" << simd_helpers::type_name<T>() << ", axis=" << axis << ", nx_knot=" << nx_knot
+		     << ", nb=" << nb << ", ifreq=" << ifreq << ", it=" << it << "): " << intensity[i] << " " << ref[i] << endl;
+		exit(1);
+	    }
+	}
+    }
+}
+
+
+template<unsigned int S>
+static void run_all_spline_detrender_tests(std::mt19937 &rng)
+{
+    for (int iter = 0; iter < 10; iter++) {
+	for (int axis = 0; axis < 2; axis++) {
+	    test_spline_detrend<float,S> (rng, axis);
+	    test_spline_detrend<double,S/2> (rng, axis);
+	}
     }
 }
 
@@ -1108,6 +1655,369 @@ inline void run_all_clipper_tests(std::mt19937 &rng)
 }
 
 
+// -------------------------------------------------------------------------------------------------
+//
+// Test _kernel_downsample_generic(), for downsampling factors (Df,Dt) which are not powers of two,
+// or which exceed the largest specialized kernel.  For powers of two up to the specialized limit,
+// the generic kernel is also compared with _kernel_downsample_2d().
+
+
+template<typename T>
+static void reference_downsample(T *out_intensity, T *out_weights, int out_stride, const T *in_intensity, const T *in_weights, int in_nfreq, int in_nt, int in_stride, int Df, int Dt)
+{
+    for (int ifreq = 0; ifreq < in_nfreq/Df; ifreq++) {
+	for (int it = 0; it < in_nt/Dt; it++) {
+	    double wisum = 0.0;
+	    double wsum = 0.0;
+
+	    for (int i = ifreq*Df; i < (ifreq+1)*Df; i++) {
+		for (int j = it*Dt; j < (it+1)*Dt; j++) {
+		    wisum += double(in_weights[i*in_stride+j]) * double(in_intensity[i*in_stride+j]);
+		    wsum += double(in_weights[i*in_stride+j]);
+		}
+	    }
+
+	    out_intensity[ifreq*out_stride + it] = (wsum > 0.0) ? (wisum / wsum) : wisum;
+	    out_weights[ifreq*out_stride + it] = wsum;
+	}
+    }
+}
+
+
+template<typename T, unsigned int S>
+static void test_downsample_generic(std::mt19937 &rng, int Df, int Dt)
+{
+    int nfreq = Df * std::uniform_int_distribution<>(1,3)(rng);
+    int nt = Dt * S * std::uniform_int_distribution<>(1,3)(rng);
+    int stride = nt + std::uniform_int_distribution<>(0,4)(rng);
+    int out_nfreq = nfreq / Df;
+    int out_nt = nt / Dt;
+    int out_stride = out_nt + std::uniform_int_distribution<>(0,4)(rng);
+
+    vector<T> intensity = simd_helpers::uniform_randvec<T> (rng, nfreq * stride, -1.0, 1.0);
+    vector<T> weights = simd_helpers::uniform_randvec<T> (rng, nfreq * stride, 0.0, 1.0);
+
+    // Mask some samples, and an entire (Df,Dt) block (to test the zero-weight convention).
+    for (int i = 0; i < nfreq * stride; i++)
+	if (std::uniform_real_distribution<>()(rng) < 0.2)
+	    weights[i] = 0;
+
+    for (int i = 0; i < Df; i++)
+	memset(&weights[i*stride], 0, Dt * sizeof(T));
+
+    vector<T> out_intensity(out_nfreq * out_stride, 0);
+    vector<T> out_weights(out_nfreq * out_stride, 0);
+    vector<T> ref_intensity(out_nfreq * out_stride, 0);
+    vector<T> ref_weights(out_nfreq * out_stride, 0);
+
+    _kernel_downsample_generic<T,S> (&out_intensity[0], &out_weights[0], out_stride, &intensity[0], &weights[0], nfreq, nt, stride, Df, Dt);
+    reference_downsample(&ref_intensity[0], &ref_weights[0], out_stride, &intensity[0], &weights[0], nfreq, nt, stride, Df, Dt);
+
+    for (int ifreq = 0; ifreq < out_nfreq; ifreq++) {
+	for (int it = 0; it < out_nt; it++) {
+	    int i = ifreq*out_stride + it;
+	    assert(fabs(out_intensity[i] - ref_intensity[i]) < 1.0e-5);
+	    assert(fabs(out_weights[i] - ref_weights[i]) < 1.0e-5 * Df * Dt);
+	}
+    }
+}
+
+
+template<typename T, unsigned int S, unsigned int Df, unsigned int Dt>
+static void test_downsample_generic_vs_2d(std::mt19937 &rng)
+{
+    int nfreq = Df * std::uniform_int_distribution<>(1,3)(rng);
+    int nt = Dt * S * std::uniform_int_distribution<>(1,3)(rng);
+    int stride = nt + std::uniform_int_distribution<>(0,4)(rng);
+    int out_nt = nt / Dt;
+    int nout = (nfreq/Df) * out_nt;
+
+    vector<T> intensity = simd_helpers::uniform_randvec<T> (rng, nfreq * stride, -1.0, 1.0);
+    vector<T> weights = simd_helpers::uniform_randvec<T> (rng, nfreq * stride, 0.0, 1.0);
+
+    vector<T> out_intensity1(nout), out_weights1(nout);
+    vector<T> out_intensity2(nout), out_weights2(nout);
+
+    _kernel_downsample_generic<T,S> (&out_intensity1[0], &out_weights1[0], out_nt, &intensity[0], &weights[0], nfreq, nt, stride, Df, Dt);
+    _kernel_downsample_2d<T,S,Df,Dt> (&out_intensity2[0], &out_weights2[0], out_nt, &intensity[0], &weights[0], nfreq, nt, stride);
+
+    for (int i = 0; i < nout; i++) {
+	assert(fabs(out_intensity1[i] - out_intensity2[i]) < 1.0e-5);
+	assert(fabs(out_weights1[i] - out_weights2[i]) < 1.0e-5 * Df * Dt);
+    }
+}
+
+
+template<typename T, unsigned int S>
+static void run_all_downsample_tests(std::mt19937 &rng)
+{
+    // Not powers of two, including Dt < S, Dt > S, and Dt a multiple of S.
+    static const int df_list[] = { 1, 2, 3, 5, 6, 12, 48 };
+    static const int dt_list[] = { 1, 3, 5, 6, 7, 12, 2*S, 3*S, 40 };
+
+    for (int Df: df_list)
+	for (int Dt: dt_list)
+	    test_downsample_generic<T,S> (rng, Df, Dt);
+
+    // Powers of two above the largest specialized kernel.
+    test_downsample_generic<T,S> (rng, 2 * constants::max_specialized_frequency_downsampling, 1);
+    test_downsample_generic<T,S> (rng, 1, 2 * constants::max_specialized_time_downsampling);
+    test_downsample_generic<T,S> (rng, constants::max_frequency_downsampling, constants::max_time_downsampling);
+
+    test_downsample_generic_vs_2d<T,S,1,1> (rng);
+    test_downsample_generic_vs_2d<T,S,2,4> (rng);
+    test_downsample_generic_vs_2d<T,S,4,S> (rng);
+    test_downsample_generic_vs_2d<T,S,16,16> (rng);
+}
+
+
+// -------------------------------------------------------------------------------------------------
+//
+// Test the Shifted=true one-pass mean/variance kernels on data with a large DC offset, where the
+// unshifted one-pass kernels lose all precision.  The merge() of partial sums with different
+// pilots (as in the multithreaded clippers) is also tested.  The reference is computed in double
+// precision, from the (reference) downsampled arrays.
+
+
+template<typename T>
+static void reference_mean_variance(double &mean, double &var, const T *intensity, const T *weights, int n, int stride, int nrows)
+{
+    double acc0 = 0.0, acc1 = 0.0, acc2 = 0.0;
+
+    for (int i = 0; i < nrows; i++) {
+	for (int j = 0; j < n; j++) {
+	    acc0 += double(weights[i*stride+j]);
+	    acc1 += double(weights[i*stride+j]) * double(intensity[i*stride+j]);
+	}
+    }
+
+    mean = acc1 / acc0;
+
+    for (int i = 0; i < nrows; i++)
+	for (int j = 0; j < n; j++)
+	    acc2 += double(weights[i*stride+j]) * square(double(intensity[i*stride+j]) - mean);
+
+    var = acc2 / acc0;
+}
+
+
+template<typename T>
+static void make_offset_data(std::mt19937 &rng, vector<T> &intensity, vector<T> &weights, int n, double offset)
+{
+    std::normal_distribution<> gauss(offset, 1.0);
+
+    intensity.resize(n);
+    weights = simd_helpers::uniform_randvec<T> (rng, n, 0.0, 1.0);
+
+    for (int i = 0; i < n; i++) {
+	intensity[i] = gauss(rng);
+	if (std::uniform_real_distribution<>()(rng) < 0.2)
+	    weights[i] = 0;
+    }
+}
+
+
+inline void check_mean_variance(double mean, double var, double ref_mean, double ref_var)
+{
+    assert(ref_var > 0.0);
+    assert(fabs(mean - ref_mean) < 1.0e-6 * fabs(ref_mean) + 1.0e-3 * sqrt(ref_var));
+    assert(fabs(var - ref_var) < 1.0e-2 * ref_var);
+}
+
+
+template<typename T, unsigned int S, unsigned int Df, unsigned int Dt>
+static void test_shifted_mean_variance_2d(std::mt19937 &rng, double offset)
+{
+    int nfreq = Df * std::uniform_int_distribution<>(8,32)(rng);
+    int nt = Dt * S * std::uniform_int_distribution<>(8,32)(rng);
+    int stride = nt + std::uniform_int_distribution<>(0,4)(rng);
+    int ds_nt = nt / Dt;
+
+    vector<T> intensity, weights;
+    make_offset_data(rng, intensity, weights, nfreq * stride, offset);
+
+    vector<T> ds_intensity((nfreq/Df) * ds_nt);
+    vector<T> ds_weights((nfreq/Df) * ds_nt);
+    reference_downsample(&ds_intensity[0], &ds_weights[0], ds_nt, &intensity[0], &weights[0], nfreq, nt, stride, Df, Dt);
+
+    double ref_mean, ref_var;
+    reference_mean_variance(ref_mean, ref_var, &ds_intensity[0], &ds_weights[0], ds_nt, ds_nt, nfreq/Df);
+
+    simd_t<T,S> mean, var;
+    _kernel_mean_variance_2d<T,S,Df,Dt,false,false,false,true> (mean, var, &intensity[0], &weights[0], nfreq, nt, stride, NULL, NULL);
+
+    for (unsigned int s = 0; s < S; s++)
+	check_mean_variance(vectorize(mean)[s], vectorize(var)[s], ref_mean, ref_var);
+
+    // Partial sums over row ranges, combined with merge() in the same order as parallel_visit_2d().
+    // Note that the pilot in each partial sum is different.
+    int nparts = std::uniform_int_distribution<>(2,5)(rng);
+    vector<_mean_variance_visitor<T,S,false,false,true>> parts(nparts, _mean_variance_visitor<T,S,false,false,true> (nullptr, nullptr));
+
+    for (int i = 0; i < nparts; i++) {
+	int f0 = ((i * (nfreq/Df)) / nparts) * Df;
+	int f1 = (((i+1) * (nfreq/Df)) / nparts) * Df;
+	_kernel_visit_2d<Df,Dt> (parts[i], &intensity[f0*stride], &weights[f0*stride], f1-f0, nt, stride);
+    }
+
+    for (int d = 1; d < nparts; d *= 2)
+	for (int i = 0; i+d < nparts; i += 2*d)
+	    parts[i].merge(parts[i+d]);
+
+    parts[0].get_mean_variance(mean, var);
+
+    for (unsigned int s = 0; s < S; s++)
+	check_mean_variance(vectorize(mean)[s], vectorize(var)[s], ref_mean, ref_var);
+}
+
+
+template<typename T, unsigned int S, unsigned int Df, unsigned int Dt>
+static void test_shifted_mean_variance_1d_f(std::mt19937 &rng, double offset)
+{
+    int nfreq = Df * std::uniform_int_distribution<>(64,256)(rng);
+    int nt = Dt * S;
+    int stride = nt + std::uniform_int_distribution<>(0,4)(rng);
+
+    vector<T> intensity, weights;
+    make_offset_data(rng, intensity, weights, nfreq * stride, offset);
+
+    vector<T> ds_intensity((nfreq/Df) * S);
+    vector<T> ds_weights((nfreq/Df) * S);
+    reference_downsample(&ds_intensity[0], &ds_weights[0], S, &intensity[0], &weights[0], nfreq, nt, stride, Df, Dt);
+
+    simd_t<T,S> mean, var;
+    _kernel_mean_variance_1d_f<T,S,Df,Dt,false,false,false,true> (mean, var, &intensity[0], &weights[0], nfreq, stride, NULL, NULL);
+
+    for (unsigned int s = 0; s < S; s++) {
+	double ref_mean, ref_var;
+	reference_mean_variance(ref_mean, ref_var, &ds_intensity[s], &ds_weights[s], 1, S, nfreq/Df);
+	check_mean_variance(vectorize(mean)[s], vectorize(var)[s], ref_mean, ref_var);
+    }
+}
+
+
+template<typename T, unsigned int S>
+static void run_all_shifted_mean_variance_tests(std::mt19937 &rng)
+{
+    for (double offset: { 0.0, 1.0e4, -1.0e4 }) {
+	test_shifted_mean_variance_2d<T,S,1,1> (rng, offset);
+	test_shifted_mean_variance_2d<T,S,2,4> (rng, offset);
+	test_shifted_mean_variance_2d<T,S,4,16> (rng, offset);
+	test_shifted_mean_variance_1d_f<T,S,1,1> (rng, offset);
+	test_shifted_mean_variance_1d_f<T,S,2,2> (rng, offset);
+    }
+}
+
+
+// -------------------------------------------------------------------------------------------------
+//
+// Test early termination in _kernel_wrms_iterate_*().  The reference runs every iteration, by
+// calling the kernel repeatedly with niter=2 (i.e. one iteration per call), so that the final
+// (mean, rms) should be bitwise identical.  The reference also determines the iteration where
+// (mean, rms) first reaches a fixed point, which should equal the kernel's return value.
+
+
+template<typename T, unsigned int S>
+static void check_early_stop(const char *kernel_name, const simd_t<T,S> &mean, const simd_t<T,S> &rms, int n, const simd_t<T,S> &ref_mean, const simd_t<T,S> &ref_rms, int ref_n, int niter)
+{
+    vector<T> m = vectorize(mean);
+    vector<T> r = vectorize(rms);
+    vector<T> ref_m = vectorize(ref_mean);
+    vector<T> ref_r = vectorize(ref_rms);
+
+    if (memcmp(&m[0], &ref_m[0], S * sizeof(T)) || memcmp(&r[0], &ref_r[0], S * sizeof(T)) || (n != ref_n)) {
+	cerr << "test_wrms_iterate_early_stop(): " << kernel_name << " failed: T=" << simd_helpers::type_name<T>() << ", S=" << S << ", niter=" << niter << "\n"
+	     << "  mean: " << simd_helpers::vecstr(ref_m) << ", " << simd_helpers::vecstr(m) << "\n"
+	     << "  rms: " << simd_helpers::vecstr(ref_r) << ", " << simd_helpers::vecstr(r) << "\n"
+	     << "  iterations: " << ref_n << ", " << n << "\n";
+	exit(1);
+    }
+}
+
+
+// Runs all (niter-1) iterations, and returns the number of iterations which the kernel should report.
+template<typename T, unsigned int S, typename F>
+static int reference_wrms_iterate(simd_t<T,S> &mean, simd_t<T,S> &rms, int niter, const F &iterate_once)
+{
+    int ret = niter;
+
+    for (int iter = 1; iter < niter; iter++) {
+	simd_t<T,S> prev_mean = mean;
+	simd_t<T,S> prev_rms = rms;
+	iterate_once(mean, rms);
+
+	bool converged = (vectorize(prev_mean) == vectorize(mean)) && (vectorize(prev_rms) == vectorize(rms));
+	if (converged && (ret == niter))
+	    ret = iter + 1;
+    }
+
+    return ret;
+}
+
+
+template<typename T, unsigned int S>
+static void test_wrms_iterate_early_stop(std::mt19937 &rng)
+{
+    int nfreq = std::uniform_int_distribution<>(50,100)(rng);
+    int nt = S * std::uniform_int_distribution<>(10,20)(rng);
+    int stride = nt + std::uniform_int_distribution<>(0,4)(rng);
+    int niter = std::uniform_int_distribution<>(2,12)(rng);
+    double iter_sigma = std::uniform_real_distribution<>(1.5,3.0)(rng);
+
+    // A few strong outliers, so that the first iterations mask something.
+    random_chunk rc(rng, nfreq, nt, stride);
+    for (int i = 0; i < nfreq * stride; i++)
+	if (std::uniform_int_distribution<>(0,49)(rng) == 0)
+	    rc.intensity[i] += std::uniform_real_distribution<>(-20.,20.)(rng);
+
+    simd_t<T,S> mean0, rms0, mean, rms, ref_mean, ref_rms;
+    int n, ref_n;
+
+    // 2d
+    _kernel_noniterative_wrms_2d<T,S,1,1,false,false,false> (mean0, rms0, rc.intensity, rc.weights, nfreq, nt, stride, NULL, NULL);
+
+    mean = ref_mean = mean0;
+    rms = ref_rms = rms0;
+    n = _kernel_wrms_iterate_2d<T,S> (mean, rms, rc.intensity, rc.weights, nfreq, nt, stride, niter, iter_sigma);
+    ref_n = reference_wrms_iterate<T,S> (ref_mean, ref_rms, niter, [&](simd_t<T,S> &m, simd_t<T,S> &r) {
+	_kernel_wrms_iterate_2d<T,S> (m, r, rc.intensity, rc.weights, nfreq, nt, stride, 2, iter_sigma);
+    });
+    check_early_stop("_kernel_wrms_iterate_2d", mean, rms, n, ref_mean, ref_rms, ref_n, niter);
+
+    // 1d_t (each row is an independent clipping group)
+    for (int ifreq = 0; ifreq < nfreq; ifreq++) {
+	const T *irow = rc.intensity + ifreq * stride;
+	const T *wrow = rc.weights + ifreq * stride;
+
+	_kernel_noniterative_wrms_1d_t<T,S,1,1,false,false,false> (mean0, rms0, irow, wrow, nt, stride, NULL, NULL);
+
+	mean = ref_mean = mean0;
+	rms = ref_rms = rms0;
+	n = _kernel_wrms_iterate_1d_t<T,S> (mean, rms, irow, wrow, nt, niter, iter_sigma);
+	ref_n = reference_wrms_iterate<T,S> (ref_mean, ref_rms, niter, [&](simd_t<T,S> &m, simd_t<T,S> &r) {
+	    _kernel_wrms_iterate_1d_t<T,S> (m, r, irow, wrow, nt, 2, iter_sigma);
+	});
+	check_early_stop("_kernel_wrms_iterate_1d_t", mean, rms, n, ref_mean, ref_rms, ref_n, niter);
+    }
+
+    // 1d_f (each column block of length S stops when all of its lanes have converged)
+    for (int it = 0; it < nt; it += S) {
+	const T *icol = rc.intensity + it;
+	const T *wcol = rc.weights + it;
+
+	_kernel_noniterative_wrms_1d_f<T,S,1,1,false,false,false> (mean0, rms0, icol, wcol, nfreq, stride, NULL, NULL);
+
+	mean = ref_mean = mean0;
+	rms = ref_rms = rms0;
+	n = _kernel_wrms_iterate_1d_f<T,S> (mean, rms, icol, wcol, nfreq, stride, niter, iter_sigma);
+	ref_n = reference_wrms_iterate<T,S> (ref_mean, ref_rms, niter, [&](simd_t<T,S> &m, simd_t<T,S> &r) {
+	    _kernel_wrms_iterate_1d_f<T,S> (m, r, icol, wcol, nfreq, stride, 2, iter_sigma);
+	});
+	check_early_stop("_kernel_wrms_iterate_1d_f", mean, rms, n, ref_mean, ref_rms, ref_n, niter);
+    }
+}
+
+
 // -------------------------------------------------------------------------------------------------
 
 
@@ -1130,10 +2040,19 @@ int main(int argc, char **argv)
 
 	run_all_polynomial_detrender_tests<float,8,9> (rng);   // max degree 8
 
+	run_all_spline_detrender_tests<8> (rng);
+
 	// Run clipper tests to max (Df,Dt)=(16,16).
 	// I wanted to use (32,32) but that ended up being pretty slow!
 
 	run_all_clipper_tests<float,8,16,16> (rng);
+
+	run_all_downsample_tests<float,8> (rng);
+
+	run_all_shifted_mean_variance_tests<float,8> (rng);
+
+	for (int i = 0; i < 10; i++)
+	    test_wrms_iterate_early_stop<float,8> (rng);
     }
 
     cout << "test-kernels: all tests passed\n";
@@ -92,11 +92,58 @@ inline std::thread make_detrender_timing_thread(const shared_ptr<timing_thread_p
 }
 
 
-int main(int argc, char **argv)
+static void time_polynomial_detrenders(int nfreq, int nt_chunk, int stride, int polydeg, int nthreads)
 {
     // (max polynomial degree) + 1
     static const int Nmax = 17;
 
+    assert(polydeg >= 0 && polydeg < Nmax);
+
+    auto pool = make_shared<timing_thread_pool> (nthreads);
+
+    vector<std::thread> threads(nthreads);
+    for (int i = 0; i < nthreads; i++)
+        threads[i] = make_detrender_timing_thread<float,8,Nmax> (pool, polydeg, nfreq, nt_chunk, stride);
+    for (int i = 0; i < nthreads; i++)
+        threads[i].join();
+}
+
+
+// -------------------------------------------------------------------------------------------------
+//
+// The running median and spline detrenders don't depend on polydeg, so they are timed by a separate
+// (non-templated) timing thread.
+
+
+struct median_spline_timing_thread : public transform_timing_thread
+{
+    median_spline_timing_thread(const shared_ptr<timing_thread_pool> &pool_, int nfreq_, int nt_chunk_, int stride_) :
+	transform_timing_thread(pool_, nfreq_, nt_chunk_, stride_,
+				{ make_running_median_detrender(nt_chunk_, AXIS_TIME, nt_chunk_, 1),
+				  make_running_median_detrender(nt_chunk_, AXIS_TIME, nt_chunk_, 16),
+				  make_spline_detrender(nt_chunk_, AXIS_TIME, 64),
+				  make_spline_detrender(nt_chunk_, AXIS_FREQ, 64) })
+    { }
+};
+
+
+static void time_median_and_spline_detrenders(int nfreq, int nt_chunk, int stride, int nthreads)
+{
+    auto pool = make_shared<timing_thread_pool> (nthreads);
+
+    vector<std::thread> threads(nthreads);
+    for (int i = 0; i < nthreads; i++)
+        threads[i] = spawn_timing_thread<median_spline_timing_thread> (pool, nfreq, nt_chunk, stride);
+    for (int i = 0; i < nthreads; i++)
+        threads[i].join();
+}
+
+
+// -------------------------------------------------------------------------------------------------
+
+
+int main(int argc, char **argv)
+{
     if (argc != 6) {
 	cerr << "usage: time-detrenders <nfreq> <nt_chunk> <stride> <polydeg> <nthreads>\n";
 	exit(2);
@@ -111,17 +158,12 @@ int main(int argc, char **argv)
     assert(nfreq > 0);
     assert((nt_chunk > 0) && (nt_chunk % 8 == 0));
     assert(stride >= nt_chunk);
-    assert(polydeg >= 0 && polydeg < Nmax);
     assert(nthreads > 0 && nthreads <= 20);
     
     cout << "nthreads = " << nthreads << endl;
-    auto pool = make_shared<timing_thread_pool> (nthreads);
 
-    vector<std::thread> threads(nthreads);
-    for (int i = 0; i < nthreads; i++)
-        threads[i] = make_detrender_timing_thread<float,8,Nmax> (pool, polydeg, nfreq, nt_chunk, stride);
-    for (int i = 0; i < nthreads; i++)
-        threads[i].join();
+    time_polynomial_detrenders(nfreq, nt_chunk, stride, polydeg, nthreads);
+    time_median_and_spline_detrenders(nfreq, nt_chunk, stride, nthreads);
 
     return 0;
 }
@@ -194,8 +194,16 @@ transform_timing_thread::transform_timing_thread(const shared_ptr<timing_thread_
     rf_assert(stride >= nt_chunk);
     rf_assert(ntransforms > 0);
     
-    intensity = aligned_alloc<float> (nfreq * stride);
-    weights = aligned_alloc<float> (nfreq * stride);
+    // Postpadded transforms read past the end of each row.  Rather than requiring a larger
+    // stride, we just extend the allocation, so that the postpad of the last row is valid memory.
+    // (In other rows, the postpad overlaps the next row, which is fine for timing purposes.)
+    ssize_t nt_postpad = 0;
+    for (const auto &t: transform_list)
+	nt_postpad = max(nt_postpad, t->nt_postpad);
+
+    intensity = aligned_alloc<float> (nfreq * stride + nt_postpad);
+    weights = aligned_alloc<float> (nfreq * stride + nt_postpad);
+    nt_alloc = nfreq * stride + nt_postpad;
 }
 
 
@@ -241,8 +249,8 @@ void transform_timing_thread::thread_body()
 	    throw runtime_error("rf_pipelines::transform_timing_thread: nfreq mismatch");
 	if (transform_list[itr]->nt_chunk != nt_chunk)
 	    throw runtime_error("rf_pipelines::transform_timing_thread: nt_chunk mismatch");
-	if ((transform_list[itr]->nt_prepad != 0) || (transform_list[itr]->nt_postpad != 0))
-	    throw runtime_error("rf_pipelines::transform_timing_thread expects nt_prepad=nt_prepad=0 (this would be easy to fix if needed)");
+	if (transform_list[itr]->nt_prepad != 0)
+	    throw runtime_error("rf_pipelines::transform_timing_thread expects nt_prepad=0 (this would be easy to fix if needed)");
 	
 	for (int ichunk = 0; ichunk < num_chunks; ichunk++) {
 
@@ -250,7 +258,7 @@ void transform_timing_thread::thread_body()
 	    // This is to avoid unexpected situations, such as a clipper which eventually
 	    // clips the entire buffer if it is iterated many times.
 
-	    for (int i = 0; i < nfreq * stride; i++) {
+	    for (ssize_t i = 0; i < nt_alloc; i++) {
 		intensity[i] = uniform_real_distribution<>()(rng);
 		weights[i] = 1.0;
 	    }
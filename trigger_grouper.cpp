@@ -0,0 +1,380 @@
+#include <fstream>
+#include <iomanip>
+#include <mutex>
+#include <algorithm>
+#include <tuple>
+#include "rf_pipelines_internals.hpp"
+
+using namespace std;
+
+namespace rf_pipelines {
+#if 0
+}; // pacify emacs c-mode
+#endif
+
+
+// -------------------------------------------------------------------------------------------------
+//
+// Streaming friends-of-friends clustering.
+//
+// Two above-threshold triggers are linked if they are within 'dm_link' in DM and 't_link' in time,
+// and each L1 event is a connected component of the resulting graph (single-linkage clustering),
+// so the result doesn't depend on the order in which triggers arrive.
+//
+// Each "cluster" is an L1 event under construction.  We keep its bounding box in (dm, time), the
+// trigger with the largest S/N, and the (dm, time) of its "recent" triggers, i.e. the triggers which
+// can still be linked to future triggers.  A new trigger is compared with the recent triggers of
+// every open cluster, and all clusters it links to are merged.  Since trigger times are nondecreasing
+// from one call to process_triggers() to the next, a trigger stops being recent as soon as it falls
+// more than t_link behind the start of the current chunk, and a cluster with no recent triggers
+// can be finalized.
+
+
+struct trigger_grouper_cpp : public trigger_grouper
+{
+    struct cluster {
+	l1_event event;
+	vector<pair<double,double>> recent;   // (dm, time) of triggers which can still be linked
+    };
+
+    const double threshold;
+    const double dm_link;
+    const double t_link;
+    const vector<double> tree_max_dm;
+    const string fname;
+    const int max_events;
+
+    vector<cluster> open_clusters;
+    vector<float> tmax;         // scratch array of shape (ndm, nt): max over (sm, beta) indices
+    vector<int> targmax;        // scratch array of shape (ndm, nt): argmax (ism * nbeta + ibeta)
+
+    // Ring buffer of finalized events (protected by lock, since get_events() may be called from another thread)
+    std::mutex lock;
+    vector<l1_event> ring;
+    ssize_t ring_pos = 0;       // total number of events ever written to ring buffer
+    ssize_t ring_nread = 0;     // total number of events ever read by get_events()
+
+    // Per-substream state
+    ssize_t nevents = 0;
+    ssize_t nevents_dropped = 0;
+    ssize_t ntriggers = 0;
+    string basename;
+    ofstream outfile;
+
+
+    trigger_grouper_cpp(double threshold_, double dm_link_, double t_link_, const vector<double> &tree_max_dm_, const string &fname_, int max_events_, int nt_chunk_) :
+	threshold(threshold_), dm_link(dm_link_), t_link(t_link_), tree_max_dm(tree_max_dm_), fname(fname_), max_events(max_events_)
+    {
+	stringstream ss;
+	ss << "trigger_grouper_cpp(threshold=" << threshold << ", dm_link=" << dm_link << ", t_link=" << t_link << ", max_events=" << max_events << ")";
+
+	this->name = ss.str();
+	this->nt_chunk = nt_chunk_;
+	this->nt_prepad = 0;
+	this->nt_postpad = 0;
+	this->is_read_only = true;
+
+	// No need to make these asserts "verbose", since they should have been checked in make_trigger_grouper().
+	rf_assert(dm_link >= 0.0);
+	rf_assert(t_link >= 0.0);
+	rf_assert(max_events > 0);
+
+	this->ring.resize(max_events);
+    }
+
+    virtual void set_stream(const wi_stream &stream) override
+    {
+	this->nfreq = stream.nfreq;
+    }
+
+    virtual void start_substream(int isubstream, double t0) override
+    {
+	this->open_clusters.clear();
+	this->nevents = 0;
+	this->nevents_dropped = 0;
+	this->ntriggers = 0;
+
+	if (fname.size() == 0)
+	    return;
+
+	this->basename = fname;
+	if (isubstream > 0)
+	    basename += "_" + to_string(isubstream);
+	basename += ".txt";
+
+	string filename = this->add_file(basename);
+
+	outfile.open(filename, ios::out | ios::trunc);
+	if (!outfile)
+	    throw runtime_error("rf_pipelines trigger_grouper: couldn't open file " + filename);
+
+	outfile << "# dm time snr dm_lo dm_hi t_lo t_hi itree ism ibeta ntriggers\n"
+		<< setprecision(10);
+    }
+
+    // The grouper doesn't look at the intensity data.  Triggers are supplied separately, by calling process_triggers().
+    virtual void process_chunk(double t0, double t1, float *intensity, float *weights, ssize_t stride, float *pp_intensity, float *pp_weights, ssize_t pp_stride) override { }
+
+    virtual void end_substream() override
+    {
+	std::sort(open_clusters.begin(), open_clusters.end(), [](const cluster &a, const cluster &b) { return a.event.t_hi < b.event.t_hi; });
+
+	for (const cluster &c: open_clusters)
+	    _emit(c.event);
+
+	this->open_clusters.clear();
+
+	this->json_per_substream["nevents"] = Json::Int64(nevents);
+	this->json_per_substream["nevents_dropped"] = Json::Int64(nevents_dropped);
+	this->json_per_substream["ntriggers_above_threshold"] = Json::Int64(ntriggers);
+
+	if (!outfile.is_open())
+	    return;
+
+	outfile.close();
+
+	if (!outfile)
+	    throw runtime_error("rf_pipelines trigger_grouper: write to " + basename + " failed");
+
+	this->json_per_substream["filename"] = basename;
+    }
+
+    virtual void process_triggers(int itree, const float *triggers, int ndm, int nsm, int nbeta, int nt, double t0, double t1) override
+    {
+	if (_unlikely(itree < 0 || (tree_max_dm.size() > 0 && itree >= (int)tree_max_dm.size())))
+	    throw runtime_error("rf_pipelines: trigger_grouper::process_triggers(): itree=" + to_string(itree) + " is out of range");
+	if (_unlikely(ndm <= 0 || nsm <= 0 || nbeta <= 0 || nt <= 0))
+	    throw runtime_error("rf_pipelines: trigger_grouper::process_triggers(): expected all trigger array dimensions to be positive");
+	if (_unlikely(!triggers))
+	    throw runtime_error("rf_pipelines: trigger_grouper::process_triggers(): null pointer");
+	if (_unlikely(t1 <= t0))
+	    throw runtime_error("rf_pipelines: trigger_grouper::process_triggers(): expected t0 < t1");
+
+	// Finalize clusters which can no longer be linked to new triggers.
+	_flush(t0);
+
+	// Flatten the (sm, beta) axes by taking the max, as in the python bonsai_dedisperser.
+	const int nsb = nsm * nbeta;
+	tmax.assign(ndm * nt, -1.0e30);
+	targmax.assign(ndm * nt, 0);
+
+	for (int idm = 0; idm < ndm; idm++) {
+	    for (int isb = 0; isb < nsb; isb++) {
+		const float *src = triggers + (ssize_t(idm) * nsb + isb) * nt;
+		float *dst = &tmax[idm * nt];
+		int *adst = &targmax[idm * nt];
+
+		for (int it = 0; it < nt; it++) {
+		    if (src[it] > dst[it]) {
+			dst[it] = src[it];
+			adst[it] = isb;
+		    }
+		}
+	    }
+	}
+
+	// If 'tree_max_dm' was not specified, DM's are reported in units of coarse-grained trigger
+	// indices in tree 0, following the convention in grouper.py.
+	const double dm_per_index = (tree_max_dm.size() > 0) ? (tree_max_dm[itree] / ndm) : double(1 << itree);
+	const double dt = (t1 - t0) / nt;
+
+	for (int it = 0; it < nt; it++) {
+	    for (int idm = 0; idm < ndm; idm++) {
+		float snr = tmax[idm*nt + it];
+		if (snr < threshold)
+		    continue;
+
+		l1_event e;
+		e.dm = e.dm_lo = e.dm_hi = (tree_max_dm.size() > 0) ? ((idm + 0.5) * dm_per_index) : (idm * dm_per_index);
+		e.time = e.t_lo = e.t_hi = t0 + (it + 0.5) * dt;
+		e.snr = snr;
+		e.itree = itree;
+		e.ism = targmax[idm*nt + it] / nbeta;
+		e.ibeta = targmax[idm*nt + it] % nbeta;
+		e.ntriggers = 1;
+
+		_link(e);
+		this->ntriggers++;
+	    }
+	}
+
+	// Bounded memory: if there are too many clusters in progress, finalize the oldest ones.
+	if ((int)open_clusters.size() > max_events) {
+	    std::sort(open_clusters.begin(), open_clusters.end(), [](const cluster &a, const cluster &b) { return a.event.t_hi < b.event.t_hi; });
+	    int n = open_clusters.size() - max_events;
+
+	    for (int i = 0; i < n; i++)
+		_emit(open_clusters[i].event);
+
+	    open_clusters.erase(open_clusters.begin(), open_clusters.begin() + n);
+	}
+    }
+
+    virtual void get_events(vector<l1_event> &out) override
+    {
+	lock_guard<std::mutex> lg(lock);
+
+	out.clear();
+	for (ssize_t i = ring_nread; i < ring_pos; i++)
+	    out.push_back(ring[i % max_events]);
+
+	this->ring_nread = ring_pos;
+    }
+
+
+    // Ties in S/N are broken by (time, dm, itree), so that the result doesn't depend on the merge order.
+    static inline void _merge(l1_event &dst, const l1_event &src)
+    {
+	if (std::tie(src.snr, dst.time, dst.dm, dst.itree) > std::tie(dst.snr, src.time, src.dm, src.itree)) {
+	    dst.dm = src.dm;
+	    dst.time = src.time;
+	    dst.snr = src.snr;
+	    dst.itree = src.itree;
+	    dst.ism = src.ism;
+	    dst.ibeta = src.ibeta;
+	}
+
+	dst.dm_lo = min(dst.dm_lo, src.dm_lo);
+	dst.dm_hi = max(dst.dm_hi, src.dm_hi);
+	dst.t_lo = min(dst.t_lo, src.t_lo);
+	dst.t_hi = max(dst.t_hi, src.t_hi);
+	dst.ntriggers += src.ntriggers;
+    }
+
+    // Linking conditions are written in terms of differences, so that they're exactly symmetric
+    // under roundoff, and consistent with the finalization condition in _flush().
+    inline bool _is_linked(const cluster &c, const l1_event &e) const
+    {
+	// Quick rejection using the bounding box.
+	if ((e.dm - c.event.dm_hi > dm_link) || (c.event.dm_lo - e.dm > dm_link) || (e.time - c.event.t_hi > t_link))
+	    return false;
+
+	for (const auto &p: c.recent)
+	    if ((fabs(e.dm - p.first) <= dm_link) && (fabs(e.time - p.second) <= t_link))
+		return true;
+
+	return false;
+    }
+
+    void _link(const l1_event &e)
+    {
+	int ifirst = -1;
+
+	for (int i = 0; i < (int)open_clusters.size(); ) {
+	    if (!_is_linked(open_clusters[i], e)) {
+		i++;
+		continue;
+	    }
+
+	    if (ifirst < 0) {
+		_merge(open_clusters[i].event, e);
+		open_clusters[i].recent.push_back({ e.dm, e.time });
+		ifirst = i++;
+		continue;
+	    }
+
+	    // Trigger links two clusters: merge cluster i into cluster 'ifirst' (note ifirst < i).
+	    cluster &dst = open_clusters[ifirst];
+	    _merge(dst.event, open_clusters[i].event);
+	    dst.recent.insert(dst.recent.end(), open_clusters[i].recent.begin(), open_clusters[i].recent.end());
+
+	    open_clusters[i] = std::move(open_clusters.back());
+	    open_clusters.pop_back();
+	}
+
+	if (ifirst < 0) {
+	    cluster c;
+	    c.event = e;
+	    c.recent.push_back({ e.dm, e.time });
+	    open_clusters.push_back(std::move(c));
+	}
+    }
+
+    // Drops triggers which can't be linked to any trigger with time >= t0, and finalizes clusters with no remaining triggers.
+    void _flush(double t0)
+    {
+	for (int i = 0; i < (int)open_clusters.size(); ) {
+	    vector<pair<double,double>> &r = open_clusters[i].recent;
+	    r.erase(std::remove_if(r.begin(), r.end(), [this,t0](const pair<double,double> &p) { return t0 - p.second > t_link; }), r.end());
+
+	    if (r.size() > 0) {
+		i++;
+		continue;
+	    }
+
+	    _emit(open_clusters[i].event);
+	    open_clusters[i] = std::move(open_clusters.back());
+	    open_clusters.pop_back();
+	}
+    }
+
+    void _emit(const l1_event &e)
+    {
+	{
+	    lock_guard<std::mutex> lg(lock);
+
+	    if (ring_pos - ring_nread >= max_events) {
+		this->ring_nread++;    // overwrite oldest unread event
+		this->nevents_dropped++;
+	    }
+
+	    ring[ring_pos % max_events] = e;
+	    this->ring_pos++;
+	}
+
+	this->nevents++;
+
+	if (outfile.is_open()) {
+	    outfile << e.dm << " " << e.time << " " << e.snr << " " << e.dm_lo << " " << e.dm_hi << " " << e.t_lo << " " << e.t_hi
+		    << " " << e.itree << " " << e.ism << " " << e.ibeta << " " << e.ntriggers << "\n";
+	}
+    }
+};
+
+
+// -------------------------------------------------------------------------------------------------
+
+
+// Note: std::isfinite() can't be used here, since the library is compiled with -ffast-math,
+// which allows the compiler to assume that it always returns true.
+static inline bool _is_finite(double x)
+{
+    uint64_t u;
+    memcpy(&u, &x, sizeof(u));
+    return (u & 0x7ff0000000000000ULL) != 0x7ff0000000000000ULL;
+}
+
+
+static void check_params(double threshold, double dm_link, double t_link, const vector<double> &tree_max_dm, int max_events, int nt_chunk)
+{
+    if (_unlikely(!_is_finite(threshold) || (threshold < 0.0)))
+	throw runtime_error("rf_pipelines: make_trigger_grouper(): threshold=" + to_string(threshold) + ", finite nonnegative value was expected");
+
+    if (_unlikely(dm_link < 0.0))
+	throw runtime_error("rf_pipelines: make_trigger_grouper(): dm_link=" + to_string(dm_link) + ", nonnegative value was expected");
+
+    if (_unlikely(t_link < 0.0))
+	throw runtime_error("rf_pipelines: make_trigger_grouper(): t_link=" + to_string(t_link) + ", nonnegative value was expected");
+
+    if (_unlikely(max_events <= 0))
+	throw runtime_error("rf_pipelines: make_trigger_grouper(): max_events=" + to_string(max_events) + ", positive value was expected");
+
+    if (_unlikely(nt_chunk <= 0))
+	throw runtime_error("rf_pipelines: make_trigger_grouper(): nt_chunk=" + to_string(nt_chunk) + ", positive value was expected");
+
+    for (double max_dm: tree_max_dm) {
+	if (_unlikely(max_dm <= 0.0))
+	    throw runtime_error("rf_pipelines: make_trigger_grouper(): expected all elements of 'tree_max_dm' to be positive");
+    }
+}
+
+
+// externally visible
+shared_ptr<trigger_grouper> make_trigger_grouper(double threshold, double dm_link, double t_link, const vector<double> &tree_max_dm, const string &fname, int max_events, int nt_chunk)
+{
+    check_params(threshold, dm_link, t_link, tree_max_dm, max_events, nt_chunk);
+    return make_shared<trigger_grouper_cpp> (threshold, dm_link, t_link, tree_max_dm, fname, max_events, nt_chunk);
+}
+
+
+}  // namespace rf_pipelines
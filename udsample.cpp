@@ -1,15 +1,16 @@
 // Fast downsampling kernels.  Maybe I'll write fast upsampling kernels some day too!
 //
-// FIXME: currently we need to compile a new kernel for every (Df,Dt) pair, where
-// Df,Dt are the frequency/time downsampling factors.  Eventually I'd like to 
-// improve this by having special kernels to handle the large-Df and large-Dt cases.
+// We compile a specialized kernel for every power-of-two (Df,Dt) pair up to
+// constants::max_specialized_frequency_downsampling and constants::max_specialized_time_downsampling.
+// Larger downsampling factors are handled in stages (e.g. Df=1024 is done as 16 x 16 x 4).
+// Factors which are not powers of two (e.g. Df=3) are handled by _kernel_downsample_generic().
 
 #include <array>
 #include <cassert>
 
 #include "rf_pipelines_internals.hpp"
 
-#include "kernels/downsample.hpp"
+#include "kernels/kernel_tables.hpp"
 
 using namespace std;
 
@@ -19,147 +20,379 @@ namespace rf_pipelines {
 #endif
 
 
-// Note: kernels/downsample.hpp defines
-//   _kernel_downsample_2d<T,S,Df,Dt> (out_intensity, out_weights, out_stride, in_intensity, in_nfreq, in_nt, in_stride)
+// The kernel tables are in kernels/kernel_tables.hpp.
+static downsampling_kernel_table<constants::single_precision_simd_length> global_downsampling_kernel_table;
 
-using downsampling_kernel_t = void (*) (float *, float *, int, const float *, const float *, int, int, int);
 
+// Caller must argument-check!
+static downsampling_kernel_t get_downsampling_kernel(int in_nt, int Df, int Dt)
+{
+#ifdef HAVE_AVX512
+    if ((simd_dispatch_length() == 16) && (in_nt % (16*Dt) == 0))
+	return get_avx512_downsampling_kernel(Df, Dt);
+#endif
 
-// -------------------------------------------------------------------------------------------------
-//
-// fill_2d_downsampling_kernel_table<S,MaxDf,MaxDt>()
+    return global_downsampling_kernel_table.get_kernel(Df, Dt);
+}
 
 
-template<unsigned int S, unsigned int Df, unsigned int MaxDt, typename std::enable_if<(MaxDt==0),int>::type = 0>
-inline void fill_1d_downsampling_kernel_table(downsampling_kernel_t *out) { }
+// Externally visible downsampling routine declared in rf_pipelines.hpp
+//
+// Note that the normalization of the downsampled weights array differs (by a factor of Df*Dt) 
+// from the python version of wi_downsample().  This is actually nontrivial to change, since
+// the unit tests currently assume strict equivalence with the downsampling logic in the
+// intensity_clipper, which we don't want to slow down by including an extra multiplication.
+//
+void wi_downsample(float *out_intensity, float *out_weights, int out_stride, const float *in_intensity, const float *in_weights, int in_nfreq, int in_nt, int in_stride, int Df, int Dt)
+{
+    wi_downsample(out_intensity, out_weights, out_stride, in_intensity, in_weights, in_nfreq, in_nt, in_stride, Df, Dt, clipper_workspace::thread_local_default());
+}
+
 
-template<unsigned int S, unsigned int Df, unsigned int MaxDt, typename std::enable_if<(MaxDt>0),int>::type = 0>
-inline void fill_1d_downsampling_kernel_table(downsampling_kernel_t *out)
+// Declared in rf_pipelines_internals.hpp.
+//
+// If (Df,Dt) are done in stages, then the first stage has the largest output, of size n1 = (in_nfreq/Df2) * (in_nt/Dt2).
+// Subsequent stages alternate between two halves of the workspace buffer: stages 1,3,5... use the first half
+// (intensity and weights, each of size n1), and stages 2,4... use the second half (each of size n1/2, since
+// each stage after the first downsamples by at least a factor two).
+ssize_t wi_downsample_scratch_size(int in_nfreq, int in_nt, int Df, int Dt)
 {
-    constexpr int NDt = IntegerLog2<MaxDt>() + 1;
+    static constexpr int MaxDf = constants::max_specialized_frequency_downsampling;
+    static constexpr int MaxDt = constants::max_specialized_time_downsampling;
+
+    if (!is_power_of_two(Df) || !is_power_of_two(Dt) || ((Df <= MaxDf) && (Dt <= MaxDt)))
+	return 0;
 
-    fill_1d_downsampling_kernel_table<S,Df,(MaxDt/2)> (out);
-    out[NDt-1] = _kernel_downsample_2d<float,S,Df,MaxDt>;
+    ssize_t n1 = ssize_t(in_nfreq / min(Df,MaxDf)) * ssize_t(in_nt / min(Dt,MaxDt));
+    return 3 * n1;
 }
 
 
-template<unsigned int S, unsigned int MaxDf, unsigned int MaxDt, typename std::enable_if<(MaxDf==0),int>::type = 0>
-inline void fill_2d_downsampling_kernel_table(downsampling_kernel_t *out) { }
+// Declared in rf_pipelines_internals.hpp.
+void wi_downsample(float *out_intensity, float *out_weights, int out_stride, const float *in_intensity, const float *in_weights, 
+		   int in_nfreq, int in_nt, int in_stride, int Df, int Dt, clipper_workspace &ws)
+{
+    static constexpr int S = constants::single_precision_simd_length;
+    static constexpr int MaxDf = constants::max_specialized_frequency_downsampling;
+    static constexpr int MaxDt = constants::max_specialized_time_downsampling;
 
-template<unsigned int S, unsigned int MaxDf, unsigned int MaxDt, typename std::enable_if<(MaxDf>0),int>::type = 0>
-inline void fill_2d_downsampling_kernel_table(downsampling_kernel_t *out) 
-{ 
-    constexpr int NDf = IntegerLog2<MaxDf>() + 1;
-    constexpr int NDt = IntegerLog2<MaxDt>() + 1;
+    // Part 1: Argument megacheck
+
+    if (_unlikely((in_nfreq <= 0) || (in_nt <= 0)))
+	throw runtime_error("wi_downsample(): (in_nfreq,in_nt)=(" + to_string(in_nfreq) + "," + to_string(in_nt) + ") is invalid");
+
+    if (_unlikely((Df <= 0) || (Dt <= 0)))
+	throw runtime_error("wi_downsample(): (Df,Dt)=(" + to_string(Df) + "," + to_string(Dt) + ") is invalid");
 
-    fill_2d_downsampling_kernel_table<S,(MaxDf/2),MaxDt> (out);
-    fill_1d_downsampling_kernel_table<S,MaxDf,MaxDt> (out + (NDf-1)*NDt);
+    if (_unlikely(in_nfreq % Df))
+	throw runtime_error("wi_downsample(): in_nfreq=" + to_string(in_nfreq) + " is not divisible by Df=" + to_string(Df));
+
+    if (_unlikely(in_nt % (Dt*S)))
+	throw runtime_error("wi_downsample(): in_nt=" + to_string(in_nt) + " is not divisible by Dt*S, where Dt=" + to_string(Dt)
+			    + " is the time downsampling factor and S=" + to_string(S) + " is the single-precision simd length on this machine");
+
+    if (_unlikely(out_stride < in_nt/Dt))
+	throw runtime_error("wi_downsample(): out_stride=" + to_string(out_stride) + " is < (in_nt/Dt) =" + to_string(in_nt/Dt));
+    
+    if (_unlikely(in_stride < in_nt))
+	throw runtime_error("wi_downsample(): in_stride=" + to_string(in_stride) + " is < in_nt=" + to_string(in_nt));	
+
+    if (_unlikely(!out_intensity))
+	throw runtime_error("wi_downsample(): 'out_intensity' argument is a NULL pointer");
+
+    if (_unlikely(!out_weights))
+	throw runtime_error("wi_downsample(): 'out_weights' argument is a NULL pointer");
+
+    if (_unlikely(!in_intensity))
+	throw runtime_error("wi_downsample(): 'in_intensity' argument is a NULL pointer");
+
+    if (_unlikely(!in_weights))
+	throw runtime_error("wi_downsample(): 'in_weights' argument is a NULL pointer");
+
+    // Part 2: Get and apply downsampling kernel.
+    //
+    // Downsampling factors which are not powers of two are handled in a single pass by the generic kernel.
+
+    if (!is_power_of_two(Df) || !is_power_of_two(Dt)) {
+	_kernel_downsample_generic<float,S> (out_intensity, out_weights, out_stride, in_intensity, in_weights, in_nfreq, in_nt, in_stride, Df, Dt);
+	return;
+    }
+
+    //
+    // If (Df,Dt) exceeds the largest specialized kernel, we downsample by the largest specialized
+    // factors in each stage, storing the intermediate arrays in the workspace (see wi_downsample_scratch_size()).
+
+    ssize_t n1 = wi_downsample_scratch_size(in_nfreq, in_nt, Df, Dt) / 3;
+    float *scratch = (n1 > 0) ? ws.get<float> (WS_DOWNSAMPLE, 3*n1) : nullptr;
+    float *half[2][2] = { { scratch, scratch + n1 }, { scratch + 2*n1, scratch + 2*n1 + n1/2 } };
+
+    const float *src_intensity = in_intensity;
+    const float *src_weights = in_weights;
+    int src_nfreq = in_nfreq;
+    int src_nt = in_nt;
+    int src_stride = in_stride;
+
+    for (int istage = 0; ; istage++) {
+	int Df2 = min(Df, MaxDf);
+	int Dt2 = min(Dt, MaxDt);
+	auto kernel = get_downsampling_kernel(src_nt, Df2, Dt2);
+
+	if ((Df2 == Df) && (Dt2 == Dt)) {
+	    kernel(out_intensity, out_weights, out_stride, src_intensity, src_weights, src_nfreq, src_nt, src_stride);
+	    return;
+	}
+
+	float *dst_intensity = half[istage % 2][0];
+	float *dst_weights = half[istage % 2][1];
+	kernel(dst_intensity, dst_weights, src_nt / Dt2, src_intensity, src_weights, src_nfreq, src_nt, src_stride);
+
+	src_intensity = dst_intensity;
+	src_weights = dst_weights;
+	src_nfreq /= Df2;
+	src_nt /= Dt2;
+	src_stride = src_nt;
+	Df /= Df2;
+	Dt /= Dt2;
+    }
 }
 
 
 // -------------------------------------------------------------------------------------------------
+//
+// staged_downsampler (declared in rf_pipelines_internals.hpp)
 
 
-struct downsampling_kernel_table {
-    static constexpr int S = constants::single_precision_simd_length;
-    static constexpr int MaxDf = constants::max_frequency_downsampling;
-    static constexpr int MaxDt = constants::max_time_downsampling;
-    static constexpr int NDf = IntegerLog2<MaxDf>() + 1;
-    static constexpr int NDt = IntegerLog2<MaxDt>() + 1;
+staged_downsampler::~staged_downsampler()
+{
+    if (owns_buffers) {
+	free(intensity_ds);
+	free(weights_ds);
+    }
+
+    intensity_ds = weights_ds = nullptr;
+}
+
+
+void staged_downsampler::init(int nfreq, int nt, int Df, int Dt, clipper_workspace *ws)
+{
+    rf_assert((Df >= 1) && (Dt >= 1));
+    rf_assert((nfreq % Df == 0) && (nt % Dt == 0));
+
+    if (owns_buffers) {
+	free(intensity_ds);
+	free(weights_ds);
+    }
+
+    intensity_ds = weights_ds = nullptr;
+    owns_buffers = (ws == nullptr);
+    this->ws = ws;
+
+    this->Df_kernel = kernel_Df(Df);
+    this->Dt_kernel = kernel_Dt(Dt);
+    this->Df1 = Df / Df_kernel;
+    this->Dt1 = Dt / Dt_kernel;
+    this->nfreq_ds = nfreq / Df1;
+    this->nt_ds = nt / Dt1;
+
+    if (is_active() && ws) {
+	intensity_ds = ws->get<float> (WS_STAGE_INTENSITY, nfreq_ds * nt_ds);
+	weights_ds = ws->get<float> (WS_STAGE_WEIGHTS, nfreq_ds * nt_ds);
+    }
+    else if (is_active()) {
+	intensity_ds = aligned_alloc<float> (nfreq_ds * nt_ds);
+	weights_ds = aligned_alloc<float> (nfreq_ds * nt_ds);
+    }
+}
 
-    // Weird: for some reason using std::max() here gives a clang linker (not compiler) error.
-    static constexpr int MaxD = (MaxDf > MaxDt) ? MaxDf : MaxDt;
 
-    std::vector<downsampling_kernel_t> entries;
+void staged_downsampler::downsample(const float *intensity, const float *weights, int stride, const downsample_cache *cache, const chunk_mask_info *mask)
+{
+    rf_assert(is_active());
 
-    integer_log2_lookup_table ilog2_lookup;
+    const float *cached_intensity = nullptr;
+    const float *cached_weights = nullptr;
 
+    bool hit = (cache != nullptr)
+	&& (cache->intensity == intensity) && (cache->weights == weights) && (cache->stride == stride)
+	&& (cache->nfreq == nfreq_ds * Df1) && (cache->nt == nt_ds * Dt1)
+	&& cache->lookup(Df1, Dt1, cached_intensity, cached_weights);
 
-    downsampling_kernel_table() : entries(NDf*NDt), ilog2_lookup(MaxD)
-    {
-	fill_2d_downsampling_kernel_table<S,MaxDf,MaxDt> (&entries[0]);
+    if (hit) {
+	memcpy(intensity_ds, cached_intensity, nfreq_ds * nt_ds * sizeof(float));
+	memcpy(weights_ds, cached_weights, nfreq_ds * nt_ds * sizeof(float));
+	return;
     }
 
-    // Before calling get_kernel(), caller must check:
-    //    1 <= Df <= MaxDf 
-    //    1 <= Dt <= MaxDt
-    //    both Df,Dt are powers of two
+    bool skip = (mask != nullptr) && (mask->nrows_masked > 0) && (mask->weights == weights)
+	&& (mask->nfreq == nfreq_ds * Df1) && (mask->nt == nt_ds * Dt1);
+
+    if (!skip) {
+	wi_downsample(intensity_ds, weights_ds, nt_ds, intensity, weights, nfreq_ds * Df1, nt_ds * Dt1, stride, Df1, Dt1, get_workspace());
+	return;
+    }
+
+    // Blocks of Df1 rows which are fully masked are downsampled to zeros.
+    mask->foreach_block_range(Df1, [&](ssize_t ifreq0, ssize_t ifreq1, bool masked) {
+	float *dst_intensity = intensity_ds + (ifreq0 / Df1) * nt_ds;
+	float *dst_weights = weights_ds + (ifreq0 / Df1) * nt_ds;
+	ssize_t nds = ((ifreq1 - ifreq0) / Df1) * nt_ds;
+
+	if (masked) {
+	    memset(dst_intensity, 0, nds * sizeof(float));
+	    memset(dst_weights, 0, nds * sizeof(float));
+	}
+	else
+	    wi_downsample(dst_intensity, dst_weights, nt_ds, intensity + ifreq0 * stride, weights + ifreq0 * stride, ifreq1 - ifreq0, nt_ds * Dt1, stride, Df1, Dt1, get_workspace());
+    });
+}
+
 
-    inline downsampling_kernel_t get_kernel(int Df, int Dt)
-    {
-	int idf = ilog2_lookup(Df);
-	int idt = ilog2_lookup(Dt);
+void staged_downsampler::upsample_mask(float *weights, int stride) const
+{
+    rf_assert(is_active());
+
+    for (int ifreq = 0; ifreq < nfreq_ds * Df1; ifreq++) {
+	const float *wds_row = weights_ds + (ifreq / Df1) * nt_ds;
+	float *w_row = weights + ifreq * stride;
 
-	return entries[idf*NDt + idt];
+	for (int it = 0; it < nt_ds; it++) {
+	    if (wds_row[it] == 0.0f)
+		memset(w_row + it*Dt1, 0, Dt1 * sizeof(float));
+	}
     }
-};
+}
 
 
 // -------------------------------------------------------------------------------------------------
+//
+// parallel_downsampler (declared in rf_pipelines_internals.hpp)
 
 
-static downsampling_kernel_table global_downsampling_kernel_table;
+parallel_downsampler::parallel_downsampler(int nthreads_, const float *intensity_, float *weights_, int nfreq, int nt, int stride_, int Df_, int Dt_) :
+    nthreads(nthreads_), Df(Df_), Dt(Dt_), nfreq_ds(nfreq/Df_), nt_ds(nt/Dt_)
+{
+    rf_assert((Df >= 1) && (Dt >= 1));
+    rf_assert((nfreq % Df == 0) && (nt % Dt == 0));
+
+    if (!is_active()) {
+	this->intensity = intensity_;
+	this->weights = weights_;
+	this->stride = stride_;
+	return;
+    }
 
+    this->intensity_ds = aligned_alloc<float> (nfreq_ds * nt_ds);
+    this->weights_ds = aligned_alloc<float> (nfreq_ds * nt_ds);
+    this->intensity = intensity_ds;
+    this->weights = weights_ds;
+    this->stride = nt_ds;
 
-// Externally visible downsampling routine declared in rf_pipelines.hpp
-//
-// Note that the normalization of the downsampled weights array differs (by a factor of Df*Dt) 
-// from the python version of wi_downsample().  This is actually nontrivial to change, since
-// the unit tests currently assume strict equivalence with the downsampling logic in the
-// intensity_clipper, which we don't want to slow down by including an extra multiplication.
-//
-void wi_downsample(float *out_intensity, float *out_weights, int out_stride, const float *in_intensity, const float *in_weights, int in_nfreq, int in_nt, int in_stride, int Df, int Dt)
+    parallel_for(nthreads, nfreq, Df, [&](int ithread, int f0, int f1) {
+	wi_downsample(intensity_ds + (f0/Df) * nt_ds, weights_ds + (f0/Df) * nt_ds, nt_ds, 
+		      intensity_ + f0 * stride_, weights_ + f0 * stride_, f1-f0, nt, stride_, Df, Dt);
+    });
+}
+
+
+parallel_downsampler::~parallel_downsampler()
 {
-    static constexpr int S = constants::single_precision_simd_length;
-    static constexpr int MaxDf = constants::max_frequency_downsampling;
-    static constexpr int MaxDt = constants::max_time_downsampling;
+    free(intensity_ds);
+    free(weights_ds);
+    intensity_ds = weights_ds = nullptr;
+}
 
-    // Part 1: Argument megacheck
 
-    if (_unlikely((in_nfreq <= 0) || (in_nt <= 0)))
-	throw runtime_error("wi_downsample(): (in_nfreq,in_nt)=(" + to_string(in_nfreq) + "," + to_string(in_nt) + ") is invalid");
+void parallel_downsampler::upsample_mask(float *weights_hires, int stride_hires) const
+{
+    if (!is_active())
+	return;
+
+    parallel_for(nthreads, nfreq_ds * Df, Df, [&](int ithread, int f0, int f1) {
+	for (int ifreq = f0; ifreq < f1; ifreq++) {
+	    const float *wds_row = weights_ds + (ifreq / Df) * nt_ds;
+	    float *w_row = weights_hires + ifreq * stride_hires;
+
+	    for (int it = 0; it < nt_ds; it++) {
+		if (wds_row[it] == 0.0f)
+		    memset(w_row + it*Dt, 0, Dt * sizeof(float));
+	    }
+	}
+    });
+}
 
-    if (_unlikely((Df <= 0) || (Dt <= 0)))
-	throw runtime_error("wi_downsample(): (Df,Dt)=(" + to_string(Df) + "," + to_string(Dt) + ") is invalid");
 
-    if (_unlikely(!is_power_of_two(Df) || !is_power_of_two(Dt)))
-	throw runtime_error("wi_downsample(): (Df,Dt)=(" + to_string(Df) + "," + to_string(Dt) + ") must be powers of two");
+// -------------------------------------------------------------------------------------------------
+//
+// downsample_cache
 
-    if (_unlikely(in_nfreq % Df))
-	throw runtime_error("wi_downsample(): in_nfreq=" + to_string(in_nfreq) + " is not divisible by Df=" + to_string(Df));
 
-    if (_unlikely(in_nt % (Dt*S)))
-	throw runtime_error("wi_downsample(): in_nt=" + to_string(in_nfreq) + " is not divisible by Dt*S, where Dt=" + to_string(Dt)
-			    + " is the time downsampling factor and S=" + to_string(S) + " is the single-precision simd length on this machine");
+downsample_cache::entry::~entry()
+{
+    free(intensity);
+    free(weights);
+    intensity = weights = nullptr;
+}
+
+
+void downsample_cache::set_chunk(ssize_t nfreq_, ssize_t it0_, ssize_t nt_, const float *intensity_, const float *weights_, ssize_t stride_)
+{
+    this->nfreq = nfreq_;
+    this->it0 = it0_;
+    this->nt = nt_;
+    this->intensity = intensity_;
+    this->weights = weights_;
+    this->stride = stride_;
+}
 
-    if (_unlikely(out_stride < in_nt/Dt))
-	throw runtime_error("wi_downsample(): out_stride=" + to_string(out_stride) + " is < (in_nt/Dt) =" + to_string(in_nt/Dt));
-    
-    if (_unlikely(in_stride < in_nt))
-	throw runtime_error("wi_downsample(): in_stride=" + to_string(in_stride) + " is < in_nt=" + to_string(in_nt));	
 
-    if (_unlikely((Df > MaxDf) || (Dt > MaxDt))) {
-	throw runtime_error("wi_downsample(): (Df,Dt)=(" + to_string(Df) + "," + to_string(Dt) + ")"
-			    + " exceeds compile time limits; to fix this see 'constants' in rf_pipelines.hpp");
+bool downsample_cache::lookup(int Df, int Dt, const float* &ds_intensity, const float* &ds_weights) const
+{
+    for (const auto &e: entries) {
+	if ((e->version == version) && (e->it0 == it0) && (e->nt == nt) && (e->Df == Df) && (e->Dt == Dt)) {
+	    ds_intensity = e->intensity;
+	    ds_weights = e->weights;
+	    return true;
+	}
     }
 
-    if (_unlikely(!out_intensity))
-	throw runtime_error("wi_downsample(): 'out_intensity' argument is a NULL pointer");
+    return false;
+}
 
-    if (_unlikely(!out_weights))
-	throw runtime_error("wi_downsample(): 'out_weights' argument is a NULL pointer");
 
-    if (_unlikely(!in_intensity))
-	throw runtime_error("wi_downsample(): 'in_intensity' argument is a NULL pointer");
+void downsample_cache::get(int Df, int Dt, const float* &ds_intensity, const float* &ds_weights)
+{
+    if (_unlikely(!intensity || !weights))
+	throw runtime_error("rf_pipelines: downsample_cache::get() was called before set_chunk()");
 
-    if (_unlikely(!in_weights))
-	throw runtime_error("wi_downsample(): 'in_weights' argument is a NULL pointer");
+    if (lookup(Df, Dt, ds_intensity, ds_weights))
+	return;
 
-    // Part 2: Get and apply downsampling kernel
+    // Reuse a stale entry with the same shape if possible, to avoid reallocating.
+    entry *e = nullptr;
 
-    auto kernel = global_downsampling_kernel_table.get_kernel(Df, Dt);
-    
-    kernel(out_intensity, out_weights, out_stride, in_intensity, in_weights, in_nfreq, in_nt, in_stride);
+    for (const auto &p: entries) {
+	if ((p->nt == nt) && (p->Df == Df) && (p->Dt == Dt)) {
+	    e = p.get();
+	    break;
+	}
+    }
+
+    if (!e) {
+	entries.push_back(unique_ptr<entry> (new entry));
+	e = entries.back().get();
+	e->nt = nt;
+	e->Df = Df;
+	e->Dt = Dt;
+	e->intensity = aligned_alloc<float> ((nfreq/Df) * (nt/Dt));
+	e->weights = aligned_alloc<float> ((nfreq/Df) * (nt/Dt));
+    }
+
+    wi_downsample(e->intensity, e->weights, nt/Dt, intensity, weights, nfreq, nt, stride, Df, Dt);
+
+    e->it0 = it0;
+    e->version = version;
+    ds_intensity = e->intensity;
+    ds_weights = e->weights;
 }
 
 
@@ -0,0 +1,249 @@
+#include <algorithm>
+#include <fstream>
+#include "rf_pipelines_internals.hpp"
+#include "kernels/variance_estimator.hpp"
+
+using namespace std;
+
+namespace rf_pipelines {
+#if 0
+}; // pacify emacs c-mode
+#endif
+
+
+// -------------------------------------------------------------------------------------------------
+//
+// The variance estimates are written as a .npy file, so that they can be read with np.load(),
+// as in the python variance_estimator.  The array has logical shape (nfreq, nv2), but is written
+// in Fortran order, so that each "column" of v2 estimates can be appended as soon as it is computed.
+// The header is padded to a fixed size, so that it can be rewritten with the final shape at the
+// end of the substream.
+
+
+static constexpr int npy_header_size = 128;
+
+
+static void write_npy_header(ostream &os, ssize_t nfreq, ssize_t nv2)
+{
+    stringstream ss;
+    ss << "{'descr': '<f4', 'fortran_order': True, 'shape': (" << nfreq << ", " << nv2 << "), }";
+
+    // Total header size is (magic string + version + header_len + dict), where the dict is padded with spaces and ends in '\n'.
+    string dict = ss.str();
+    int header_len = npy_header_size - 10;
+
+    if (dict.size() + 1 > (size_t)header_len)
+	throw runtime_error("rf_pipelines: internal error: npy header too long in variance_estimator");
+
+    dict.append(header_len - dict.size() - 1, ' ');
+    dict.append(1, '\n');
+
+    const char hlen[2] = { (char)(header_len & 0xff), (char)(header_len >> 8) };
+
+    os.write("\x93NUMPY\x01\x00", 8);
+    os.write(hlen, 2);
+    os.write(dict.data(), dict.size());
+}
+
+
+// Returns the median of the nonzero elements of 'buf' (using the np.median() convention for
+// even-length arrays), or zero if there are fewer than 'min_count' nonzero elements.
+// Note that 'buf' is modified.
+
+static float nonzero_median(float *buf, int n, double min_count)
+{
+    int m = std::remove(buf, buf+n, 0.0f) - buf;
+
+    if ((m == 0) || (m < min_count))
+	return 0.0;
+
+    std::nth_element(buf, buf + m/2, buf + m);
+    float hi = buf[m/2];
+
+    if (m % 2)
+	return hi;
+
+    float lo = *std::max_element(buf, buf + m/2);
+    return 0.5 * (lo + hi);
+}
+
+
+// -------------------------------------------------------------------------------------------------
+
+
+struct variance_estimator : public wi_transform
+{
+    static constexpr int S = constants::single_precision_simd_length;
+
+    const int v1_chunk;
+    const int v2_chunk;
+    const string fname;
+    const shared_ptr<variance_estimate> handle;
+
+    // Initialized in set_stream()
+    int nv1_per_chunk = 0;
+    vector<float> v1_tmp;       // shape (nfreq, nv1_per_chunk), filled in each call to process_chunk()
+    vector<float> v1_buf;       // shape (nfreq, v2_chunk), accumulates v1 estimates until the median is taken
+    vector<float> v2_col;       // shape (nfreq,), most recent v2 estimates in each channel
+
+    // Per-substream state
+    int iv1 = 0;                // number of v1 estimates currently in v1_buf (same for all channels)
+    ssize_t nv2 = 0;            // number of v2 estimates so far
+    string basename;
+    ofstream outfile;
+
+
+    variance_estimator(int v1_chunk_, int v2_chunk_, int nt_chunk_, const string &fname_, const shared_ptr<variance_estimate> &handle_)
+	: v1_chunk(v1_chunk_), v2_chunk(v2_chunk_), fname(fname_), handle(handle_)
+    {
+	stringstream ss;
+	ss << "variance_estimator_cpp(v1_chunk=" << v1_chunk << ", v2_chunk=" << v2_chunk << ", nt_chunk=" << nt_chunk_ << ")";
+
+	this->name = ss.str();
+	this->nt_chunk = nt_chunk_;
+	this->nt_prepad = 0;
+	this->nt_postpad = 0;
+	this->is_read_only = true;
+
+	// No need to make these asserts "verbose", since they should have been checked in make_variance_estimator().
+	rf_assert(v1_chunk > 0);
+	rf_assert(v2_chunk > 0);
+	rf_assert(nt_chunk % v1_chunk == 0);
+    }
+
+    virtual void set_stream(const wi_stream &stream) override
+    {
+	this->nfreq = stream.nfreq;
+	this->nv1_per_chunk = nt_chunk / v1_chunk;
+
+	this->v1_tmp.resize(nfreq * nv1_per_chunk, 0.0);
+	this->v1_buf.resize(nfreq * v2_chunk, 0.0);
+	this->v2_col.resize(nfreq, 0.0);
+
+	if (handle) {
+	    handle->nfreq = nfreq;
+	    handle->nt_per_v2 = ssize_t(v1_chunk) * ssize_t(v2_chunk);
+	}
+    }
+
+    virtual void start_substream(int isubstream, double t0) override
+    {
+	this->iv1 = 0;
+	this->nv2 = 0;
+
+	if (handle) {
+	    handle->nv2 = 0;
+	    handle->t1 = t0;
+	    handle->variance.assign(nfreq, 0.0);
+	    handle->last_valid_variance.assign(nfreq, 0.0);
+	}
+
+	if (fname.size() == 0)
+	    return;
+
+	this->basename = fname;
+	if (isubstream > 0)
+	    basename += "_" + to_string(isubstream);
+	basename += ".npy";
+
+	string filename = this->add_file(basename);
+
+	outfile.open(filename, ios::out | ios::binary | ios::trunc);
+	if (!outfile)
+	    throw runtime_error("rf_pipelines variance_estimator: couldn't open file " + filename);
+
+	write_npy_header(outfile, nfreq, 0);
+    }
+
+    virtual void process_chunk(double t0, double t1, float *intensity, float *weights, ssize_t stride, float *pp_intensity, float *pp_weights, ssize_t pp_stride) override
+    {
+	const float v1_min_count = 0.25 * v1_chunk;
+	const double v2_min_count = 0.25 * v2_chunk;
+	const double dt_v1 = (t1 - t0) / nv1_per_chunk;
+
+	_kernel_v1_t<float,S> (&v1_tmp[0], nv1_per_chunk, intensity, weights, nfreq, nt_chunk, stride, v1_chunk, v1_min_count);
+
+	for (int j = 0; j < nv1_per_chunk; j++) {
+	    for (int ifreq = 0; ifreq < nfreq; ifreq++)
+		v1_buf[ifreq*v2_chunk + iv1] = v1_tmp[ifreq*nv1_per_chunk + j];
+
+	    if (++iv1 < v2_chunk)
+		continue;
+
+	    for (int ifreq = 0; ifreq < nfreq; ifreq++)
+		v2_col[ifreq] = nonzero_median(&v1_buf[ifreq*v2_chunk], v2_chunk, v2_min_count);
+
+	    if (outfile.is_open())
+		outfile.write(reinterpret_cast<const char *> (&v2_col[0]), nfreq * sizeof(float));
+
+	    if (handle) {
+		for (int ifreq = 0; ifreq < nfreq; ifreq++) {
+		    handle->variance[ifreq] = v2_col[ifreq];
+		    if (v2_col[ifreq] > 0.0)
+			handle->last_valid_variance[ifreq] = v2_col[ifreq];
+		}
+
+		handle->nv2 = nv2 + 1;
+		handle->t1 = t0 + (j+1) * dt_v1;
+	    }
+
+	    this->iv1 = 0;
+	    this->nv2++;
+	}
+    }
+
+    virtual void end_substream() override
+    {
+	// Note: a partially filled v1_buf is discarded, as in the python variance_estimator.
+	this->json_per_substream["nv2"] = Json::Int64(nv2);
+
+	if (!outfile.is_open())
+	    return;
+
+	outfile.seekp(0);
+	write_npy_header(outfile, nfreq, nv2);
+	outfile.close();
+
+	if (!outfile)
+	    throw runtime_error("rf_pipelines variance_estimator: write to " + basename + " failed");
+
+	this->json_per_substream["filename"] = basename;
+    }
+};
+
+
+// -------------------------------------------------------------------------------------------------
+
+
+static void check_params(int v1_chunk, int v2_chunk, int nt_chunk)
+{
+    static constexpr int S = constants::single_precision_simd_length;
+
+    if (_unlikely(v1_chunk <= 0))
+	throw runtime_error("rf_pipelines: make_variance_estimator(): v1_chunk=" + to_string(v1_chunk) + ", positive value was expected");
+
+    if (_unlikely(v2_chunk <= 0))
+	throw runtime_error("rf_pipelines: make_variance_estimator(): v2_chunk=" + to_string(v2_chunk) + ", positive value was expected");
+
+    if (_unlikely(nt_chunk <= 0))
+	throw runtime_error("rf_pipelines: make_variance_estimator(): nt_chunk=" + to_string(nt_chunk) + ", positive value was expected");
+
+    if (_unlikely(v1_chunk % S))
+	throw runtime_error("rf_pipelines: make_variance_estimator(): v1_chunk=" + to_string(v1_chunk)
+			    + " must be a multiple of constants::single_precision_simd_length=" + to_string(S));
+
+    if (_unlikely(nt_chunk % v1_chunk))
+	throw runtime_error("rf_pipelines: make_variance_estimator(): nt_chunk=" + to_string(nt_chunk)
+			    + " must be a multiple of v1_chunk=" + to_string(v1_chunk));
+}
+
+
+// externally visible
+shared_ptr<wi_transform> make_variance_estimator(int v1_chunk, int v2_chunk, int nt_chunk, const string &fname, const shared_ptr<variance_estimate> &handle)
+{
+    check_params(v1_chunk, v2_chunk, nt_chunk);
+    return make_shared<variance_estimator> (v1_chunk, v2_chunk, nt_chunk, fname, handle);
+}
+
+
+}  // namespace rf_pipelines
@@ -43,7 +43,9 @@ wi_run_state::wi_run_state(const wi_stream &stream, const vector<shared_ptr<wi_t
     isubstream(0),
     nt_pending(0),
     verbosity(verbosity_),
-    prepad_buffers(transforms_.size())
+    prepad_buffers(transforms_.size()),
+    ds_cache(make_shared<downsample_cache> ()),
+    mask_info(make_shared<chunk_mask_info> ())
 {
     if (!nfreq)
 	throw runtime_error("wi_run_state constructor called on uninitialized stream");
@@ -66,6 +68,8 @@ void wi_run_state::start_substream(double t0)
 	throw runtime_error("rf_transforms: logic error in stream: double call to start_substream() (maybe a call to end_substream() is missing somewhere?)");
 
     this->clear_per_substream_data();
+    this->ds_cache->invalidate();   // sample indices restart from zero in the new substream
+    this->mask_info->invalidate();
     this->substream_start_time = t0;
     this->stream_curr_time = t0;
 
@@ -226,10 +230,27 @@ void wi_run_state::finalize_write(ssize_t nt)
 	    if (verbosity >= 3)
 		cerr << "rf_pipelines: calling transform->process_chunk() [" << transforms[it]->name << "]" << endl;
 
+	    ds_cache->set_chunk(nfreq, transform_ipos[it], n1, intensity, weights, stride);
+	    transforms[it]->ds_cache = ds_cache.get();
+
+	    mask_info->set_chunk(nfreq, transform_ipos[it], n1, weights, stride);
+	    transforms[it]->mask_info = mask_info.get();
+
 	    struct timeval tv0 = get_time();
 	    transforms[it]->process_chunk(t0, t1, intensity, weights, stride, pp_intensity, pp_weights, pp_stride);
 	    transforms[it]->time_spent_in_transform += time_diff(tv0, get_time());
 
+	    transforms[it]->ds_cache = nullptr;
+	    transforms[it]->mask_info = nullptr;
+
+	    if (!transforms[it]->is_read_only)
+		ds_cache->invalidate();
+
+	    if (!transforms[it]->is_read_only && !transforms[it]->preserves_mask)
+		mask_info->invalidate();
+	    else if (!transforms[it]->is_read_only)
+		mask_info->weights_changed();
+
 	    if (verbosity >= 3)
 		cerr << "rf_pipelines: calling transform->process_chunk() returned" << endl;
 
@@ -275,6 +296,9 @@ void wi_run_state::end_substream()
 	target_ipos = transform_ipos[it] + n1 + n2;
     }
 
+    // Chunks which only contain padding are fully masked, and kernels can skip them.
+    this->mask_info->it_padding = save_ipos;
+
     while (stream_ipos < target_ipos) {
 	float *dummy_intensity;
 	float *dummy_weights;
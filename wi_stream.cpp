@@ -14,7 +14,7 @@ namespace rf_pipelines {
 #endif
 
 //
-// A helper class which resets wi_transform::outdir_manager pointers in its destructor.
+// A helper class which resets wi_transform::outdir_manager (and ds_cache, mask_info) pointers in its destructor.
 // This is convenient for ensuring that the pointer always gets reset, e.g. in the case where an
 // exception is thrown.  We also use this class to detect transform reuse (currently treated as an error).
 //
@@ -33,8 +33,11 @@ struct outdir_janitor {
 
     ~outdir_janitor() 
     { 
-	for (unsigned int i = 0; i < transform_list.size(); i++)
+	for (unsigned int i = 0; i < transform_list.size(); i++) {
 	    transform_list[i]->outdir_manager.reset(); 
+	    transform_list[i]->ds_cache = nullptr;   // only non-null if process_chunk() threw an exception
+	    transform_list[i]->mask_info = nullptr;
+	}
 	transform_list.clear();
     }
 